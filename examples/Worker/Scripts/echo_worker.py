@@ -0,0 +1,77 @@
+# Reference worker for rules using WorkerCommandLine.
+#
+# Protocol (all integers are little-endian):
+# - Request:  uint32 size, followed by the formatted CommandLine of the command.
+# - Response: int32 exit code, uint32 size, followed by the output of the command.
+# The worker exits when its stdin is closed. Nothing should be written to stderr.
+#
+# Each request contains two quoted paths: the input file and the output file.
+# The input is copied to the output, prefixed with the number of requests handled by this process.
+# Run with --once <input> <output> to handle a single command without the protocol (spawn-per-command).
+
+import os
+import shlex
+import struct
+import sys
+
+
+def cook(args, request_count):
+    if len(args) != 2:
+        return 1, "Expected 2 arguments (input and output paths), got %d.\n" % len(args)
+
+    input_path, output_path = args
+    try:
+        with open(input_path, "r") as input_file:
+            content = input_file.read()
+
+        os.makedirs(os.path.dirname(output_path), exist_ok=True)
+        with open(output_path, "w") as output_file:
+            output_file.write("Request %d: %s" % (request_count, content))
+    except OSError as error:
+        return 1, "%s\n" % error
+
+    return 0, "Echoed %s to %s (request %d of this process).\n" % (input_path, output_path, request_count)
+
+
+def read_exact(stream, size):
+    data = b""
+    while len(data) < size:
+        chunk = stream.read(size - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def main():
+    if len(sys.argv) > 1 and sys.argv[1] == "--once":
+        exit_code, output = cook(sys.argv[2:], 1)
+        sys.stdout.write(output)
+        return exit_code
+
+    stdin = sys.stdin.buffer
+    stdout = sys.stdout.buffer
+    request_count = 0
+
+    while True:
+        header = read_exact(stdin, 4)
+        if header is None:
+            return 0 # stdin was closed, time to exit.
+
+        (size,) = struct.unpack("<I", header)
+        request = read_exact(stdin, size)
+        if request is None:
+            return 1
+
+        request_count += 1
+        args = [arg.strip('"') for arg in shlex.split(request.decode("utf-8"), posix=False)]
+        exit_code, output = cook(args, request_count)
+
+        output = output.encode("utf-8")
+        stdout.write(struct.pack("<iI", exit_code, len(output)))
+        stdout.write(output)
+        stdout.flush()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
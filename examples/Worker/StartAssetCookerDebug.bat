@@ -0,0 +1,5 @@
+@echo off
+
+:: Change current directory just to have an excuse for using -working_dir
+cd ..\..
+start bin\x64\Debug\AssetCookerDebug.exe -working_dir examples\Worker
@@ -0,0 +1,536 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#include "ActionCache.h"
+#include "App.h"
+#include "CookingSystem.h"
+#include "DepFile.h"
+#include "BinaryReadWriter.h"
+#include <Bedrock/Test.h>
+#include <Bedrock/StringFormat.h>
+
+#include "win32/file.h"
+#include "win32/misc.h"
+
+#include "xxHash/xxh3.h"
+
+#include <algorithm> // for std::sort
+
+
+// Version of the action files. Increment when the format changes.
+static constexpr uint32 cActionFileVersion = 1;
+
+
+static TempString sHashToString(Hash128 inHash)
+{
+	return gTempFormat("%016llX%016llX", inHash.mData[0], inHash.mData[1]);
+}
+
+
+// Parse a hash written by sHashToString. Return false if the string isn't one.
+static bool sStringToHash(StringView inStr, Hash128& outHash)
+{
+	if (inStr.Size() != 32)
+		return false;
+
+	outHash = {};
+	for (int i = 0; i < inStr.Size(); ++i)
+	{
+		char   c = inStr[i];
+		uint64 digit;
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else
+			return false;
+
+		uint64& data = outHash.mData[i / 16];
+		data = (data << 4) | digit;
+	}
+
+	return true;
+}
+
+
+// Hash the content of a file, and get its size.
+static bool sHashFile(const TempString& inPath, Hash128& outHash, int64& outSize)
+{
+	OwnedHandle handle = CreateFileA(inPath.AsCStr(), FILE_GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (!handle.IsValid())
+		return false;
+
+	LARGE_INTEGER file_size = {};
+	if (GetFileSizeEx(handle, &file_size) == FALSE)
+		return false;
+
+	XXH3_state_t state;
+	XXH3_128bits_reset(&state);
+
+	uint8 buffer[16 * 1024];
+	while (true)
+	{
+		DWORD bytes_read = 0;
+		if (ReadFile(handle, buffer, sizeof(buffer), &bytes_read, nullptr) == FALSE)
+			return false;
+
+		if (bytes_read == 0)
+			break;
+
+		XXH3_128bits_update(&state, buffer, bytes_read);
+	}
+
+	XXH128_hash_t hash = XXH3_128bits_digest(&state);
+	outHash = { hash.low64, hash.high64 };
+	outSize = file_size.QuadPart;
+	return true;
+}
+
+
+void ActionCache::Start(int64 inMaxSize)
+{
+	mMaxSize = inMaxSize;
+	if (!IsEnabled())
+		return;
+
+	TempString root_directory = gConcat(gApp.mCacheDirectory, R"(\ActionCache)");
+	mActionsDirectory         = gConcat(root_directory, R"(\Actions)");
+	mBlobsDirectory           = gConcat(root_directory, R"(\Blobs)");
+
+	CreateDirectoryA(gApp.mCacheDirectory.AsCStr(), nullptr);
+	CreateDirectoryA(root_directory.AsCStr(), nullptr);
+	CreateDirectoryA(mActionsDirectory.AsCStr(), nullptr);
+	CreateDirectoryA(mBlobsDirectory.AsCStr(), nullptr);
+
+	// List the blobs stored by the previous runs.
+	{
+		LockGuard lock(mMutex);
+		mBlobs.Clear();
+		mStats = {};
+
+		WIN32_FIND_DATAA find_file_data;
+		HANDLE find_handle = FindFirstFileA(gTempFormat(R"(%s\*)", mBlobsDirectory.AsCStr()).AsCStr(), &find_file_data);
+		if (find_handle != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				// Ignore directories.
+				if (find_file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+					continue;
+
+				// Anything that isn't named like a blob is a leftover from an interrupted store, delete it.
+				Hash128 blob;
+				if (!sStringToHash(find_file_data.cFileName, blob))
+				{
+					DeleteFileA(gTempFormat(R"(%s\%s)", mBlobsDirectory.AsCStr(), find_file_data.cFileName).AsCStr());
+					continue;
+				}
+
+				BlobInfo blob_info;
+				blob_info.mSize     = ((int64)find_file_data.nFileSizeHigh << 32) | find_file_data.nFileSizeLow;
+				blob_info.mLastUsed = find_file_data.ftLastWriteTime;
+				mBlobs.Insert(blob, blob_info);
+
+				mStats.mTotalSize += blob_info.mSize;
+
+			} while (FindNextFileA(find_handle, &find_file_data) != 0);
+		}
+		FindClose(find_handle);
+
+		mStats.mBlobCount = mBlobs.Size();
+	}
+
+	// The max size might have been reduced since the last run.
+	EvictBlobs();
+
+	mStopRequested = false;
+	mThread.Create({
+		.mName        = "Action Cache Thread",
+		.mTempMemSize = 1_MiB, // Dep files are read in temp memory.
+	}, [this](Thread&) { ThreadFunction(); });
+}
+
+
+void ActionCache::Stop()
+{
+	if (!IsEnabled())
+		return;
+
+	{
+		LockGuard lock(mMutex);
+		mStopRequested = true;
+	}
+	mRequestAdded.NotifyAll();
+
+	mThread.Join();
+
+	// Forget about the stores that didn't happen, these commands will just miss the cache next time.
+	LockGuard lock(mMutex);
+	mRequests.Clear();
+	mPendingCount = 0;
+}
+
+
+bool ActionCache::Restore(Hash128 inKey)
+{
+	TempString action_path = GetActionPath(inKey);
+
+	BinaryReader bin;
+	bool         success = false;
+	if (FILE* action_file = fopen(action_path.AsCStr(), "rb"))
+	{
+		success = bin.ReadFile(action_file);
+		fclose(action_file);
+	}
+
+	// The action was never stored (or the file is being replaced, which is just as good as a miss).
+	if (!success)
+	{
+		LockGuard lock(mMutex);
+		mStats.mMissCount++;
+		return false;
+	}
+
+	uint32 version      = 0;
+	uint32 output_count = 0;
+	bin.ExpectLabel("ACTN");
+	bin.Read(version);
+	bin.Read(output_count);
+	success = !bin.mError && version == cActionFileVersion;
+
+	for (uint32 i = 0; success && i < output_count; ++i)
+	{
+		TempString path;
+		Hash128    blob;
+		bin.Read(path);
+		bin.Read(blob);
+
+		if (bin.mError)
+		{
+			success = false;
+			break;
+		}
+
+		// Only restore files that are in a repo, otherwise the cook would never be considered finished.
+		FileID file_id = gFileSystem.FindFileIDByPath(path);
+		if (!file_id.IsValid() || !gFileSystem.CreateDirectory(file_id))
+		{
+			success = false;
+			break;
+		}
+
+		{
+			LockGuard lock(mMutex);
+			if (mBlobs.Find(blob) == mBlobs.End())
+			{
+				// The blob was evicted.
+				success = false;
+				break;
+			}
+		}
+
+		MarkBlobUsed(blob);
+
+		// Copy rather than hardlink: the commands might modify their outputs in place next time, which would corrupt the blob.
+		if (CopyFileA(GetBlobPath(blob).AsCStr(), path.AsCStr(), FALSE) == FALSE)
+		{
+			success = false;
+			break;
+		}
+	}
+
+	// Don't keep an action that can't be restored, it will be stored again after the cook.
+	if (!success)
+		DeleteFileA(action_path.AsCStr());
+
+	LockGuard lock(mMutex);
+	if (success)
+		mStats.mHitCount++;
+	else
+		mStats.mMissCount++;
+
+	return success;
+}
+
+
+void ActionCache::Store(Hash128 inKey, CookingCommandID inCommandID, CookingLogEntryID inLogEntryID, Span<const FileID> inDepFileInputs)
+{
+	{
+		LockGuard lock(mMutex);
+		StoreRequest request;
+		request.mKey           = inKey;
+		request.mCommandID     = inCommandID;
+		request.mLogEntryID    = inLogEntryID;
+		request.mDepFileInputs = inDepFileInputs;
+		mRequests.PushBack(request);
+		mPendingCount++;
+	}
+	mRequestAdded.NotifyOne();
+}
+
+
+int ActionCache::GetPendingCount() const
+{
+	LockGuard lock(mMutex);
+	return mPendingCount;
+}
+
+
+ActionCache::Stats ActionCache::GetStats() const
+{
+	LockGuard lock(mMutex);
+	return mStats;
+}
+
+
+void ActionCache::ThreadFunction()
+{
+	while (true)
+	{
+		StoreRequest request;
+		{
+			LockGuard lock(mMutex);
+			while (!mStopRequested && mRequests.IsEmpty())
+				mRequestAdded.Wait(lock);
+
+			if (mStopRequested)
+				return;
+
+			request = gMove(mRequests.Front());
+			mRequests.PopFront();
+		}
+
+		StoreAction(request);
+
+		LockGuard lock(mMutex);
+		mPendingCount--;
+	}
+}
+
+
+void ActionCache::StoreAction(const StoreRequest& inRequest)
+{
+	const CookingCommand& command = gCookingSystem.GetCommand(inRequest.mCommandID);
+	const CookingRule&    rule    = command.GetRule();
+
+	// If the command started cooking again, its outputs might not be the ones of that cook anymore.
+	// Note: mLastCookingLog is written by the cooking threads without synchronization, use the atomic ID instead.
+	auto is_same_cook = [&]() {
+		return command.mLastCookingLogID.Load() == inRequest.mLogEntryID;
+	};
+
+	if (!is_same_cook())
+		return;
+
+	Vector<FileID> outputs = command.mOutputs;
+
+	if (rule.UseDepFile())
+	{
+		Vector<FileID> dep_file_inputs;
+		Vector<FileID> dep_file_outputs;
+		if (!gReadDepFile(rule.mDepFileFormat, command.GetDepFile(), dep_file_inputs, dep_file_outputs))
+			return;
+
+		// The key was computed with the dep file inputs of the previous cook. If this cook read different files, the key
+		// doesn't describe it. It will be stored next time (the dep file inputs are updated by then).
+		if (dep_file_inputs.Size() != inRequest.mDepFileInputs.Size())
+			return;
+
+		HashSet<FileID> expected_inputs;
+		for (FileID file_id : inRequest.mDepFileInputs)
+			expected_inputs.Insert(file_id);
+
+		for (FileID file_id : dep_file_inputs)
+			if (expected_inputs.Find(file_id) == expected_inputs.End())
+				return;
+
+		for (FileID file_id : dep_file_outputs)
+			outputs.PushBack(file_id);
+	}
+
+	BinaryWriter bin;
+	bin.WriteLabel("ACTN");
+	bin.Write(cActionFileVersion);
+	bin.Write((uint32)outputs.Size());
+
+	for (FileID file_id : outputs)
+	{
+		Hash128 blob;
+		if (!StoreBlob(file_id, blob))
+			return;
+
+		bin.Write(StringView(gConcat(file_id.GetRepo().mRootPath, file_id.GetFile().mPath)));
+		bin.Write(blob);
+	}
+
+	// Check again, the outputs could have been written again while they were copied.
+	if (!is_same_cook())
+		return;
+
+	// Write to a temp file then rename it, to never let Restore read a partial file.
+	TempString action_path      = GetActionPath(inRequest.mKey);
+	TempString temp_action_path = gConcat(action_path, ".tmp");
+
+	FILE* action_file = fopen(temp_action_path.AsCStr(), "wb");
+	if (action_file == nullptr)
+		return;
+
+	bool success = bin.WriteFile(action_file);
+	fclose(action_file);
+
+	if (!success || !MoveFileExA(temp_action_path.AsCStr(), action_path.AsCStr(), MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileA(temp_action_path.AsCStr());
+		return;
+	}
+
+	{
+		LockGuard lock(mMutex);
+		mStats.mStoreCount++;
+	}
+
+	EvictBlobs();
+}
+
+
+bool ActionCache::StoreBlob(FileID inFileID, Hash128& outBlob)
+{
+	// Copy the file first and hash the copy, the original could be written again in the meantime.
+	// Note: only this thread writes blobs, so a single temp file is enough.
+	TempString file_path = gConcat(inFileID.GetRepo().mRootPath, inFileID.GetFile().mPath);
+	TempString temp_path = gConcat(mBlobsDirectory, R"(\Store.tmp)");
+
+	if (CopyFileA(file_path.AsCStr(), temp_path.AsCStr(), FALSE) == FALSE)
+		return false;
+
+	int64 size = 0;
+	if (!sHashFile(temp_path, outBlob, size))
+	{
+		DeleteFileA(temp_path.AsCStr());
+		return false;
+	}
+
+	bool blob_exists;
+	{
+		LockGuard lock(mMutex);
+		blob_exists = mBlobs.Find(outBlob) != mBlobs.End();
+	}
+
+	// Outputs with the same content share the same blob.
+	if (blob_exists)
+	{
+		DeleteFileA(temp_path.AsCStr());
+		MarkBlobUsed(outBlob);
+		return true;
+	}
+
+	if (!MoveFileExA(temp_path.AsCStr(), GetBlobPath(outBlob).AsCStr(), MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileA(temp_path.AsCStr());
+		return false;
+	}
+
+	{
+		LockGuard lock(mMutex);
+		mBlobs.Insert(outBlob, BlobInfo{ .mSize = size, .mLastUsed = gGetSystemTimeAsFileTime() });
+
+		mStats.mTotalSize += size;
+		mStats.mBlobCount = mBlobs.Size();
+	}
+
+	return true;
+}
+
+
+void ActionCache::MarkBlobUsed(Hash128 inBlob)
+{
+	FileTime now = gGetSystemTimeAsFileTime();
+
+	{
+		LockGuard lock(mMutex);
+		auto it = mBlobs.Find(inBlob);
+		if (it == mBlobs.End())
+			return;
+
+		it->mValue.mLastUsed = now;
+	}
+
+	// Also update the last write time of the file, it's what's used to sort the blobs on the next run.
+	OwnedHandle handle = CreateFileA(GetBlobPath(inBlob).AsCStr(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (handle.IsValid())
+	{
+		FILETIME last_write_time = now.ToWin32();
+		SetFileTime(handle, nullptr, nullptr, &last_write_time);
+	}
+}
+
+
+void ActionCache::EvictBlobs()
+{
+	LockGuard lock(mMutex);
+
+	if (mStats.mTotalSize <= mMaxSize)
+		return;
+
+	struct BlobToSort
+	{
+		Hash128  mBlob;
+		FileTime mLastUsed;
+	};
+
+	Vector<BlobToSort> blobs;
+	blobs.Reserve(mBlobs.Size());
+	for (const auto& blob : mBlobs)
+		blobs.PushBack({ blob.mKey, blob.mValue.mLastUsed });
+
+	// Least recently used first.
+	std::sort(blobs.begin(), blobs.end(), [](const BlobToSort& inA, const BlobToSort& inB) { return inA.mLastUsed.mDateTime < inB.mLastUsed.mDateTime; });
+
+	// Go a bit under the max size, to not have to evict again for every new blob.
+	int64 target_size = mMaxSize - mMaxSize / 10;
+
+	for (const BlobToSort& blob : blobs)
+	{
+		if (mStats.mTotalSize <= target_size)
+			break;
+
+		// If the blob can't be deleted (eg. it's being restored), keep it for now.
+		TempString blob_path = GetBlobPath(blob.mBlob);
+		if (DeleteFileA(blob_path.AsCStr()) == FALSE && GetLastError() != ERROR_FILE_NOT_FOUND)
+			continue;
+
+		mStats.mTotalSize -= mBlobs.Find(blob.mBlob)->mValue.mSize;
+		mStats.mEvictedCount++;
+		mBlobs.Erase(blob.mBlob);
+	}
+
+	mStats.mBlobCount = mBlobs.Size();
+}
+
+
+TempString ActionCache::GetActionPath(Hash128 inKey) const
+{
+	return gConcat(mActionsDirectory, "\\", sHashToString(inKey));
+}
+
+
+TempString ActionCache::GetBlobPath(Hash128 inBlob) const
+{
+	return gConcat(mBlobsDirectory, "\\", sHashToString(inBlob));
+}
+
+
+REGISTER_TEST("ActionCacheHashString")
+{
+	Hash128 hash = { 0x0123456789ABCDEFull, 0xFEDCBA9876543210ull };
+	TEST_TRUE(sHashToString(hash) == "0123456789ABCDEFFEDCBA9876543210");
+
+	Hash128 parsed;
+	TEST_TRUE(sStringToHash(sHashToString(hash), parsed));
+	TEST_TRUE(parsed == hash);
+
+	TEST_FALSE(sStringToHash("Store.tmp", parsed));
+	TEST_FALSE(sStringToHash("0123456789ABCDEFFEDCBA987654321G", parsed));
+};
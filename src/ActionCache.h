@@ -0,0 +1,88 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include "Core.h"
+#include "FileSystem.h"
+#include "CookingSystemIDs.h"
+#include "FileTime.h"
+#include "Queue.h"
+
+#include <Bedrock/String.h>
+#include <Bedrock/Vector.h>
+#include <Bedrock/HashMap.h>
+#include <Bedrock/Thread.h>
+#include <Bedrock/Mutex.h>
+#include <Bedrock/ConditionVariable.h>
+
+
+// Local cache of the outputs of the commands, to restore them instead of cooking again when the same inputs come back (eg. when switching branches).
+// An action is identified by a key (see sComputeActionKey in CookingSystem.cpp) and lists the outputs of the command.
+// Each output is stored once as a blob named after the hash of its content. When the blobs take more than the max size,
+// the least recently used ones are deleted. Actions referencing deleted blobs are deleted the next time they're used.
+// Storing happens on a separate thread, to not delay the cooking threads (or the process executor).
+struct ActionCache : NoCopy
+{
+	void Start(int64 inMaxSize); // Zero disables the cache.
+	void Stop();
+	bool IsEnabled() const { return mMaxSize > 0; }
+
+	// Copy the outputs of this action to their paths. Return false if the action isn't in the cache, or if its outputs couldn't be restored.
+	bool Restore(Hash128 inKey);
+
+	// Queue storing the outputs of that cook. Nothing is stored if the command cooks again in the meantime, or if its
+	// dep file lists different inputs than inDepFileInputs (the ones used to compute the key).
+	void Store(Hash128 inKey, CookingCommandID inCommandID, CookingLogEntryID inLogEntryID, Span<const FileID> inDepFileInputs);
+
+	int  GetPendingCount() const; // Number of cooks waiting to be stored.
+
+	struct Stats
+	{
+		int   mHitCount     = 0;
+		int   mMissCount    = 0;
+		int   mStoreCount   = 0;
+		int   mEvictedCount = 0; // Number of blobs deleted to stay under the max size.
+		int   mBlobCount    = 0;
+		int64 mTotalSize    = 0; // Size of all the blobs, in bytes.
+	};
+	Stats GetStats() const;
+
+private:
+	struct StoreRequest
+	{
+		Hash128           mKey;
+		CookingCommandID  mCommandID;
+		CookingLogEntryID mLogEntryID;
+		Vector<FileID>    mDepFileInputs;
+	};
+
+	struct BlobInfo
+	{
+		int64    mSize     = 0;
+		FileTime mLastUsed;    // Also stored as the last write time of the blob file, to survive restarts.
+	};
+
+	void                 ThreadFunction();
+	void                 StoreAction(const StoreRequest& inRequest);
+	bool                 StoreBlob(FileID inFileID, Hash128& outBlob); // Copy the file into the blobs, return false if it failed.
+	void                 MarkBlobUsed(Hash128 inBlob);
+	void                 EvictBlobs();
+	TempString           GetActionPath(Hash128 inKey) const;
+	TempString           GetBlobPath(Hash128 inBlob) const;
+
+	String               mActionsDirectory;
+	String               mBlobsDirectory;
+	int64                mMaxSize = 0;
+	Thread               mThread;
+
+	mutable Mutex        mMutex;
+	ConditionVariable    mRequestAdded;
+	Queue<StoreRequest>  mRequests;
+	int                  mPendingCount  = 0;
+	bool                 mStopRequested = false;
+	HashMap<Hash128, BlobInfo> mBlobs;
+	Stats                mStats;
+};
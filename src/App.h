@@ -80,6 +80,7 @@ struct App
 	String							mLogFilePath;
 	String							mLogDirectory	= "Logs";
 	String							mCacheDirectory = "Cache";
+	int64							mActionCacheMaxSize = 0; // Max size of the action cache, in bytes. Zero disables it (see ActionCache).
 	String							mInitError;
 
 	bool                            mHideWindowOnMinimize       = true; // Hide the window when minimizing it.
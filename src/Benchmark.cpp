@@ -0,0 +1,67 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#include "Benchmark.h"
+#include "App.h"
+#include "Debug.h"
+#include "FileUtils.h"
+
+#include <Bedrock/Ticks.h>
+#include <Bedrock/Vector.h>
+#include <Bedrock/StringFormat.h>
+
+#include "win32/file.h"
+
+
+struct Benchmark
+{
+	const char*       mName;
+	BenchmarkFunction mFunction;
+};
+
+
+// Function static to not depend on the initialization order of the registrations.
+static Vector<Benchmark>& sGetBenchmarks()
+{
+	static Vector<Benchmark> benchmarks;
+	return benchmarks;
+}
+
+
+BenchmarkRegistration::BenchmarkRegistration(const char* inName, BenchmarkFunction inFunction)
+{
+	sGetBenchmarks().PushBack({ inName, inFunction });
+}
+
+
+void gRunBenchmarks(StringView inFilter/* = {}*/)
+{
+	for (const Benchmark& benchmark : sGetBenchmarks())
+	{
+		if (!inFilter.Empty() && StringView(benchmark.mName).Find(inFilter) == -1)
+			continue;
+
+		gAppLog("[Benchmark] %s", benchmark.mName);
+
+		Timer timer;
+		benchmark.mFunction();
+
+		gAppLog("[Benchmark] %s done in %.2f seconds.", benchmark.mName, gTicksToSeconds(timer.GetTicks()));
+	}
+}
+
+
+TempString gCreateBenchmarkDirectory(StringView inName)
+{
+	char temp_path[MAX_PATH + 1];
+	if (GetTempPathA(sizeof(temp_path), temp_path) == 0)
+		gAppFatalError("Failed to get the temp directory - %s", GetLastErrorString().AsCStr());
+
+	TempString path = gTempFormat(R"(%sAssetCookerBenchmark\%s\)", temp_path, inName.AsCStr());
+	if (!gCreateDirectoryRecursive(path))
+		gAppFatalError("Failed to create %s - %s", path.AsCStr(), GetLastErrorString().AsCStr());
+
+	return path;
+}
@@ -0,0 +1,31 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include "Core.h"
+#include <Bedrock/String.h>
+
+
+// Benchmarks are registered like tests but are not part of the tests, they only run with the -benchmark argument.
+// They log their timings with gAppLog and report wrong results with gAppLogError.
+using BenchmarkFunction = void (*)();
+
+struct BenchmarkRegistration : NoCopy
+{
+	BenchmarkRegistration(const char* inName, BenchmarkFunction inFunction);
+};
+
+void gRunBenchmarks(StringView inFilter = {}); // Only run the benchmarks whose name contains inFilter (if not empty).
+TempString gCreateBenchmarkDirectory(StringView inName); // Make an empty directory in the temp directory for a benchmark to create files in. Return its path, with a trailing slash.
+
+
+#define BENCHMARK_CONCAT_IMPL(inA, inB) inA##inB
+#define BENCHMARK_CONCAT(inA, inB) BENCHMARK_CONCAT_IMPL(inA, inB)
+
+#define REGISTER_BENCHMARK(inName)                                                                                         \
+	static void BENCHMARK_CONCAT(sBenchmark, __LINE__)();                                                                  \
+	static BenchmarkRegistration BENCHMARK_CONCAT(sBenchmarkRegistration, __LINE__)(inName, &BENCHMARK_CONCAT(sBenchmark, __LINE__)); \
+	static void BENCHMARK_CONCAT(sBenchmark, __LINE__)()
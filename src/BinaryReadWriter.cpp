@@ -4,31 +4,266 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 #include "BinaryReadWriter.h"
+#include "Benchmark.h"
 #include "lz4.h"
+#include <Bedrock/Thread.h>
+#include <Bedrock/Mutex.h>
+#include <Bedrock/ConditionVariable.h>
+#include <Bedrock/Ticks.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+
+// The data is split into chunks that are compressed independently, so that they can be compressed/decompressed
+// on several threads, while the previous/next chunks are written/read.
+constexpr uint32 cChunkedFileMagic     = 0x43345A4C; // "LZ4C"
+constexpr int    cChunkSize            = 1024 * 1024;
+constexpr int    cMaxChunkThreadCount  = 16;
+constexpr int    cMaxChunkSlotCount    = cMaxChunkThreadCount * 2;
+
+struct ChunkedFileHeader
+{
+	uint32 mMagic            = cChunkedFileMagic;
+	uint32 mChunkSize        = cChunkSize;
+	uint64 mUncompressedSize = 0;
+};
+static_assert(sizeof(ChunkedFileHeader) == 16);
+
+struct ChunkHeader
+{
+	uint32 mUncompressedSize = 0;
+	uint32 mCompressedSize   = 0;
+};
+static_assert(sizeof(ChunkHeader) == 8);
+
+
+// Number of chunks that can be in flight at the same time. Each needs a buffer, so this also bounds the memory used.
+static int sGetChunkSlotCount(int inChunkCount)
+{
+	int thread_count = gMin(gThreadHardwareConcurrency(), cMaxChunkThreadCount);
+	return gMax(1, gMin(thread_count * 2, inChunkCount));
+}
+
+
+// Process chunks on worker threads, while the calling thread does the I/O in order:
+// - inBeforeProcess(chunk, slot) is called in order on the calling thread (eg. to read the chunk).
+// - inProcess(chunk, slot) is called on any worker thread (eg. to compress or decompress the chunk).
+// - inAfterProcess(chunk, slot) is called in order on the calling thread (eg. to write the chunk).
+// A slot is only re-used for another chunk once inAfterProcess was called for the previous one.
+// Return false as soon as one of the callbacks returns false.
+template <typename taBeforeProcess, typename taProcess, typename taAfterProcess>
+static bool sProcessChunks(int inChunkCount, int inSlotCount, taBeforeProcess&& inBeforeProcess, taProcess&& inProcess, taAfterProcess&& inAfterProcess)
+{
+	gAssert(inSlotCount > 0 && inSlotCount <= cMaxChunkSlotCount);
+
+	Mutex             mutex;
+	ConditionVariable chunk_ready_signal;
+	ConditionVariable chunk_processed_signal;
+	int               ready_count       = 0;     // Number of chunks that can be processed.
+	int               next_to_process   = 0;     // Next chunk to give to a worker thread.
+	int               processed_chunk[cMaxChunkSlotCount];
+	bool              process_failed    = false;
+	bool              stop              = false;
+
+	// Index of the last chunk processed in each slot.
+	for (int& chunk : processed_chunk)
+		chunk = -1;
+
+	const int thread_count = gMin((inSlotCount + 1) / 2, inChunkCount);
+	Thread    threads[cMaxChunkThreadCount];
+	for (int thread_index = 0; thread_index < thread_count; ++thread_index)
+	{
+		threads[thread_index].Create({ .mName = "Chunk Thread" }, [&](Thread&) 
+		{
+			while (true)
+			{
+				int chunk = 0;
+				{
+					LockGuard lock(mutex);
+					while (!stop && next_to_process == ready_count)
+						chunk_ready_signal.Wait(lock);
+
+					if (next_to_process == ready_count)
+						return; // Stopped and nothing left to process.
+
+					chunk = next_to_process++;
+				}
+
+				bool success = inProcess(chunk, chunk % inSlotCount);
+
+				{
+					LockGuard lock(mutex);
+					processed_chunk[chunk % inSlotCount] = chunk;
+					process_failed |= !success;
+				}
+
+				// Only the calling thread waits on this signal.
+				chunk_processed_signal.NotifyOne();
+			}
+		});
+	}
+
+	bool success        = true;
+	int  finished_count = 0; // Number of chunks done with inAfterProcess (or skipped because of a failure).
+
+	// Wait for the oldest chunk in flight to be processed, and finish it.
+	auto finish_chunk = [&]()
+	{
+		int chunk = finished_count++;
+		{
+			LockGuard lock(mutex);
+			while (processed_chunk[chunk % inSlotCount] != chunk)
+				chunk_processed_signal.Wait(lock);
+
+			if (process_failed)
+				success = false;
+		}
+
+		if (success)
+			success = inAfterProcess(chunk, chunk % inSlotCount);
+	};
+
+	for (int chunk = 0; chunk < inChunkCount && success; ++chunk)
+	{
+		// If all the slots are in use, wait until the oldest one is free.
+		if (chunk - finished_count == inSlotCount)
+		{
+			finish_chunk();
+			if (!success)
+				break;
+		}
+
+		if (!inBeforeProcess(chunk, chunk % inSlotCount))
+		{
+			success = false;
+			break;
+		}
+
+		{
+			LockGuard lock(mutex);
+			ready_count++;
+		}
+		chunk_ready_signal.NotifyOne();
+	}
+
+	// Wait for the chunks still in flight (even on failure, they're using the slots).
+	while (finished_count < ready_count)
+		finish_chunk();
+
+	// Stop the worker threads.
+	{
+		LockGuard lock(mutex);
+		stop = true;
+	}
+	chunk_ready_signal.NotifyAll();
+
+	for (int thread_index = 0; thread_index < thread_count; ++thread_index)
+		threads[thread_index].Join();
+
+	return success;
+}
+
 
 bool BinaryWriter::WriteFile(FILE* ioFile)
 {
 	// Compress the data with LZ4.
 	// LZ4HC gives a slightly better ratio but is 10 times as slow, so not worth it here.
-	int    uncompressed_size   = mBuffer.Size();
-	int    compressed_size_max = LZ4_compressBound(uncompressed_size);
-	char*  compressed_buffer   = (char*)malloc(compressed_size_max);
-	int    compressed_size     = LZ4_compress_default((const char*)mBuffer.Begin(), compressed_buffer, uncompressed_size, compressed_size_max);
-
-	defer { free(compressed_buffer); };
+	ChunkedFileHeader file_header;
+	file_header.mUncompressedSize = (uint64)mBuffer.Size();
 
-	// Write the uncompressed size first, we'll need it to decompress.
-	if (fwrite(&uncompressed_size, sizeof(uncompressed_size), 1, ioFile) != 1)
+	if (fwrite(&file_header, sizeof(file_header), 1, ioFile) != 1)
 		return false;
 
-	// Write the compressed data.
-	int written_size = fwrite(compressed_buffer, 1, compressed_size, ioFile);
-	return written_size == compressed_size;
+	const int chunk_count         = (mBuffer.Size() + cChunkSize - 1) / cChunkSize;
+	const int slot_count          = sGetChunkSlotCount(chunk_count);
+	const int compressed_size_max = LZ4_compressBound(cChunkSize);
+
+	// Only allocate enough memory for the chunks in flight.
+	char*       compressed_buffers = (char*)malloc((size_t)slot_count * compressed_size_max);
+	ChunkHeader chunk_headers[cMaxChunkSlotCount];
+	defer { free(compressed_buffers); };
+
+	return sProcessChunks(chunk_count, slot_count,
+		[](int, int) { return true; }, // Nothing to do before compressing, the data is already in memory.
+		[&](int inChunk, int inSlot) 
+		{
+			int   offset            = inChunk * cChunkSize;
+			int   uncompressed_size = gMin(cChunkSize, mBuffer.Size() - offset);
+			char* compressed_buffer = compressed_buffers + (size_t)inSlot * compressed_size_max;
+			int   compressed_size   = LZ4_compress_default((const char*)mBuffer.Begin() + offset, compressed_buffer, uncompressed_size, compressed_size_max);
+
+			chunk_headers[inSlot] = { (uint32)uncompressed_size, (uint32)compressed_size };
+			return compressed_size > 0;
+		},
+		[&](int, int inSlot) 
+		{
+			const ChunkHeader& chunk_header      = chunk_headers[inSlot];
+			const char*        compressed_buffer = compressed_buffers + (size_t)inSlot * compressed_size_max;
+
+			return fwrite(&chunk_header, sizeof(chunk_header), 1, ioFile) == 1 &&
+				   fwrite(compressed_buffer, 1, chunk_header.mCompressedSize, ioFile) == chunk_header.mCompressedSize;
+		});
 }
 
 
 bool BinaryReader::ReadFile(FILE* inFile)
+{
+	ChunkedFileHeader file_header;
+	if (fread(&file_header, sizeof(file_header), 1, inFile) != 1)
+		return false;
+
+	// Check that the file has the expected format (and that the sizes are sane).
+	if (file_header.mMagic != cChunkedFileMagic || 
+		file_header.mChunkSize == 0 || file_header.mChunkSize > 64 * 1024 * 1024 ||
+		file_header.mUncompressedSize > INT_MAX)
+		return false;
+
+	const int uncompressed_size   = (int)file_header.mUncompressedSize;
+	const int chunk_size          = (int)file_header.mChunkSize;
+	const int chunk_count         = (int)(((int64)uncompressed_size + chunk_size - 1) / chunk_size);
+	const int slot_count          = sGetChunkSlotCount(chunk_count);
+	const int compressed_size_max = LZ4_compressBound(chunk_size);
+
+	// Resize the buffer.
+	mBuffer.Resize(uncompressed_size, EResizeInit::NoZeroInit);
+
+	// Only allocate enough memory for the chunks in flight.
+	char*       compressed_buffers = (char*)malloc((size_t)slot_count * compressed_size_max);
+	ChunkHeader chunk_headers[cMaxChunkSlotCount];
+	defer { free(compressed_buffers); };
+
+	return sProcessChunks(chunk_count, slot_count,
+		[&](int inChunk, int inSlot) 
+		{
+			ChunkHeader& chunk_header      = chunk_headers[inSlot];
+			char*        compressed_buffer = compressed_buffers + (size_t)inSlot * compressed_size_max;
+
+			if (fread(&chunk_header, sizeof(chunk_header), 1, inFile) != 1)
+				return false;
+
+			// All chunks are full size, except the last one.
+			int expected_size = gMin(chunk_size, uncompressed_size - inChunk * chunk_size);
+			if (chunk_header.mUncompressedSize != (uint32)expected_size || chunk_header.mCompressedSize > (uint32)compressed_size_max)
+				return false;
+
+			return fread(compressed_buffer, 1, chunk_header.mCompressedSize, inFile) == chunk_header.mCompressedSize;
+		},
+		[&](int inChunk, int inSlot) 
+		{
+			const ChunkHeader& chunk_header      = chunk_headers[inSlot];
+			const char*        compressed_buffer = compressed_buffers + (size_t)inSlot * compressed_size_max;
+			char*              destination       = (char*)mBuffer.Data() + inChunk * chunk_size;
+
+			int decompressed_size = LZ4_decompress_safe(compressed_buffer, destination, (int)chunk_header.mCompressedSize, (int)chunk_header.mUncompressedSize);
+			return decompressed_size == (int)chunk_header.mUncompressedSize;
+		},
+		[](int, int) { return true; }); // Nothing to do after decompressing, the data is already in the buffer.
+}
+
+
+bool BinaryReader::ReadFileUncompressed(FILE* inFile)
 {
 	if (fseek(inFile, 0, SEEK_END) != 0)
 		return false;
@@ -40,25 +275,65 @@ bool BinaryReader::ReadFile(FILE* inFile)
 	if (fseek(inFile, 0, SEEK_SET) != 0)
 		return false;
 
-	// First read the uncompressed size.
-	int uncompressed_size = 0;
-	if (fread(&uncompressed_size, sizeof(uncompressed_size), 1, inFile) != 1)
-		return false;
+	mBuffer.Resize(file_size, EResizeInit::NoZeroInit);
 
-	// Then read the compressed data.
-	int   compressed_size   = file_size - (int)sizeof(uncompressed_size);
-	char* compressed_buffer = (char*)malloc(compressed_size);
-	defer { free(compressed_buffer); };
+	return fread(mBuffer.Data(), 1, file_size, inFile) == (size_t)file_size;
+}
 
-	if (fread(compressed_buffer, 1, compressed_size, inFile) != compressed_size)
-		return false;
 
-	// Resize the buffer.
-	mBuffer.Resize(uncompressed_size, EResizeInit::NoZeroInit);
+REGISTER_BENCHMARK("BinaryReadWriter")
+{
+	// About 65 MB of records looking like the cache (paths, hashes, indices), so that the compression ratio is realistic.
+	BinaryWriter writer;
+	for (int i = 0; i < 800'000; ++i)
+	{
+		char path[128];
+		int  path_size = snprintf(path, sizeof(path), "textures\\environment\\props_%04d\\medium_house_brick_wall_%06d_albedo.png", i / 1000, i);
+		writer.Write(StringView(path, path_size));
+		writer.Write((uint64)i * 0x9E3779B97F4A7C15ull);
+		writer.Write((uint32)i);
+	}
 
-	// Decompress the data into the buffer.
-	int actual_uncompressed_size = LZ4_decompress_safe(compressed_buffer, (char*)mBuffer.Data(), compressed_size, mBuffer.Size());
-	gAssert(actual_uncompressed_size == uncompressed_size);
+	FILE* file = tmpfile();
+	if (file == nullptr)
+	{
+		gAppLogError("Failed to create a temporary file - %s", strerror(errno));
+		return;
+	}
+	defer { fclose(file); };
 
-	return true;
-}
\ No newline at end of file
+	Timer  write_timer;
+	bool   written  = writer.WriteFile(file);
+	double write_ms = gTicksToSeconds(write_timer.GetTicks()) * 1000.0;
+
+	int file_size = (int)ftell(file);
+	rewind(file);
+
+	BinaryReader reader;
+	Timer        read_timer;
+	bool         read    = reader.ReadFile(file);
+	double       read_ms = gTicksToSeconds(read_timer.GetTicks()) * 1000.0;
+
+	if (!written || !read || reader.mBuffer.Size() != writer.mBuffer.Size() || gMemCmp(reader.mBuffer.Data(), writer.mBuffer.Data(), writer.mBuffer.Size()) != 0)
+	{
+		gAppLogError("The data read back is different from the data written.");
+		return;
+	}
+
+	// Baseline: the whole buffer as a single LZ4 block on this thread, like the cache file was written before the chunked format.
+	int   compressed_size_max = LZ4_compressBound(writer.mBuffer.Size());
+	char* compressed_buffer   = (char*)malloc(compressed_size_max);
+	defer { free(compressed_buffer); };
+
+	Timer  baseline_compress_timer;
+	int    compressed_size        = LZ4_compress_default((const char*)writer.mBuffer.Data(), compressed_buffer, writer.mBuffer.Size(), compressed_size_max);
+	double baseline_compress_ms   = gTicksToSeconds(baseline_compress_timer.GetTicks()) * 1000.0;
+
+	Timer  baseline_decompress_timer;
+	(void)LZ4_decompress_safe(compressed_buffer, (char*)reader.mBuffer.Data(), compressed_size, reader.mBuffer.Size());
+	double baseline_decompress_ms = gTicksToSeconds(baseline_decompress_timer.GetTicks()) * 1000.0;
+
+	gAppLog("Cache file of %s (%s on disk).", gFormatSizeInBytes(writer.mBuffer.Size()).AsCStr(), gFormatSizeInBytes(file_size).AsCStr());
+	gAppLog("Chunked:      write %7.1f ms, read %7.1f ms (including the file I/O).", write_ms, read_ms);
+	gAppLog("Single block: write %7.1f ms, read %7.1f ms (compression only).", baseline_compress_ms, baseline_decompress_ms);
+}
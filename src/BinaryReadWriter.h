@@ -59,6 +59,9 @@ struct BinaryReader : NoCopy
 	// Read the entire file into the internal buffer.
 	bool ReadFile(FILE* inFile);
 
+	// Read the entire file into the internal buffer, for files that were not written by BinaryWriter::WriteFile.
+	bool ReadFileUncompressed(FILE* inFile);
+
 	template <typename taType>
 	void Read(Span<taType> outSpan)
 	{
@@ -117,18 +117,8 @@ REGISTER_TEST("ParseInt")
 	TEST_TRUE(i == 0);
 };
 
-namespace
-{
-
-struct Slice
-{
-	int mStart = 0;
-	int mEnd   = cMaxInt;
-
-	bool operator==(const Slice&) const = default;
-};
+using Slice = CommandVariableSlice;
 
-}
 
 // Parse a python-like slice, ie. "[start:end]".
 // Both start and end are optional. The column is optional too if only start is provided.
@@ -310,12 +300,14 @@ REGISTER_TEST("ParseCommandVariableArgument")
 
 namespace FxHash
 {
-	inline constexpr uint32_t Fnv1a32(const char* str, size_t len)
+	constexpr uint32_t FNV1A32_OFFSET_BASIS = 0x811c9dc5;
+
+	// Pass the previous hash as inHash to continue hashing.
+	inline constexpr uint32_t Fnv1a32(const char* str, size_t len, uint32_t inHash = FNV1A32_OFFSET_BASIS)
 	{
 		constexpr uint32_t PRIME		= 0x01000193;
-		constexpr uint32_t OFFSET_BASIS = 0x811c9dc5;
 
-		uint32_t		   hash			= OFFSET_BASIS;
+		uint32_t		   hash			= inHash;
 
 		for (size_t i = 0; i < len; ++i)
 		{
@@ -327,205 +319,6 @@ namespace FxHash
 	}
 }
 
-// Format inFormatStr into outString by calling inFormatter any time a CommandVariable is encountered.
-// Return true on success. Output is always an empty string on failure.
-// FIXME should use a FunctionRef instead of template
-template<class taFormatter>
-static bool sParseCommandVariables(StringView inFormatStr, taFormatter&& inFormatter, TempString& outString)
-{
-	// Make sure the output is cleared, the function should return empty string on failure.
-	outString.Clear();
-
-	TempString out_string;
-	while (true)
-	{
-		int open_brace_pos = inFormatStr.FindFirstOf("{");
-		if (open_brace_pos == -1)
-		{
-			// No more arguments.
-			out_string.Append(inFormatStr);
-
-			// Move the result to the actual output.
-			outString = gMove(out_string);
-			return true;
-		}
-
-		out_string.Append(inFormatStr.SubStr(0, open_brace_pos));
-		inFormatStr.RemovePrefix(open_brace_pos);
-
-		StringView arg;
-		Slice      slice;
-		if (!sParseArgument(inFormatStr, arg, slice)) [[unlikely]]
-		{
-			// Failed to parse argument.
-			return false;
-		}
-
-		if (arg.StartsWith(gToStringView(CommandVariables::Repo)))
-		{
-			arg.RemovePrefix(gToStringView(CommandVariables::Repo).Size());
-
-			if (arg.Size() < 2 || arg[0] != ':') [[unlikely]]
-				return false; // Failed to get the repo name part.
-		
-			StringView repo_name = arg.SubStr(1);
-
-			if (!inFormatter(CommandVariables::Repo, repo_name, slice, inFormatStr, out_string)) [[unlikely]]
-				return false; // Formatter says error.
-		}
-		else if (arg.StartsWith(gToStringView(CommandVariables::Fnv1a32)))
-		{
-			arg.RemovePrefix(gToStringView(CommandVariables::Fnv1a32).Size());
-
-			if (arg.Size() < 2 || arg[0] != ':') [[unlikely]]
-				return false; // Failed to get the repo name part.
-
-			StringView var_name = arg.SubStr(1);
-			bool matched = false;
-
-			for (int i = 0; i < (int)CommandVariables::_Count; ++i)
-			{
-				CommandVariables var = (CommandVariables)i;
-
-				if (var == CommandVariables::Repo)
-					continue; // Probably NA in this situation...
-
-				if (var_name == gToStringView(var))
-				{
-					char hash_string[32];
-					size_t hash_string_length = 0;
-
-					{
-						// Extra scope to ensure the actual command output "var_result" is destructed before trying
-						// to modify "out_string" (in order to resize which it needs to be the last allocation)
-
-						TempString var_result;
-						if (!inFormatter(var, "", slice, inFormatStr, var_result)) [[unlikely]]
-							return false; // Formatter says error.
-
-						const uint32_t hash = FxHash::Fnv1a32(var_result.AsCStr(), var_result.Size());
-						hash_string_length = snprintf(hash_string, sizeof(hash_string), "%x", hash);
-					}
-
-					out_string.Append(hash_string, hash_string_length);
-
-					matched = true;
-					break;
-				}
-			}
-
-			if (!matched) [[unlikely]]
-			{
-				return false;  // Invalid variable name.
-			}
-		}
-		else
-		{
-			bool matched = false;
-			for (int i = 0; i < (int)CommandVariables::_Count; ++i)
-			{
-				CommandVariables var = (CommandVariables)i;
-
-				if (var == CommandVariables::Repo)
-					continue; // Treated separately.
-
-				if (arg == gToStringView(var))
-				{
-					matched = true;
-					if (!inFormatter(var, "", slice, inFormatStr, out_string)) [[unlikely]]
-						return false; // Formatter says error.
-
-					break;
-				}
-			}
-
-			if (!matched) [[unlikely]]
-				return false; // Invalid variable name.
-		}
-	}
-}
-
-
-REGISTER_TEST("ParseCommandVariables")
-{
-	// Make sure temp memory is initialized or the tests will fail.
-	TEST_INIT_TEMP_MEMORY(1_KiB);
-
-	auto test_formatter = [](CommandVariables inVar, StringView inRepoName, Slice inSlice, StringView inRemainingFormatStr, TempString& outStr)
-	{
-		outStr.Append(gToStringView(inVar));
-
-		if (inVar == CommandVariables::Repo)
-			outStr.Append(inRepoName);
-
-		if (inSlice != Slice())
-		{
-			outStr.Append("[");
-
-			if (inSlice.mStart != 0)
-				gAppendFormat(outStr, "%d", inSlice.mStart);
-
-			if (inSlice.mEnd != cMaxInt)
-				gAppendFormat(outStr, ":%d", inSlice.mEnd);
-
-			outStr.Append("]");
-		}
-
-		return true;
-	};
-
-	{
-		TempString result;
-		bool success = sParseCommandVariables("OH! { Repo:Test} AH!", test_formatter, result);
-		TEST_TRUE(success);
-		TEST_TRUE(result == "OH! RepoTest AH!");
-	}
-
-	{
-		TempString result;
-		bool success = sParseCommandVariables("{   File    }{Ext}{\tExt\t}{Dir } ", test_formatter, result);
-		TEST_TRUE(success);
-		TEST_TRUE(result == "FileExtExtDir ");
-	}
-
-	{
-		TempString result;
-		bool success = sParseCommandVariables("{ Repo:! }\n\n{Dir_NoTrailingSlash}\t{Path}", test_formatter, result);
-		TEST_TRUE(success);
-		TEST_TRUE(result == "Repo!\n\nDir_NoTrailingSlash\tPath");
-	}
-
-	{
-		TempString result;
-		bool success = sParseCommandVariables("{   File[4:5] }{Ext[ : -1 ]}{\tExt[-2]\t}{Dir[100000:100001 ]}{Repo:A[10:70] } ", test_formatter, result);
-		TEST_TRUE(success);
-		TEST_TRUE(result == "File[4:5]Ext[:-1]Ext[-2]Dir[100000:100001]RepoA[10:70] ");
-	}
-
-	{
-		TempString result;
-		bool success = sParseCommandVariables("JustText", test_formatter, result);
-		TEST_TRUE(success);
-		TEST_TRUE(result == "JustText");
-	}
-
-	{
-		TempString result = "previous text";
-		bool success = sParseCommandVariables("", test_formatter, result);
-		TEST_TRUE(success);
-		TEST_TRUE(result == "");
-	}
-
-	TempString result;
-	TEST_FALSE(sParseCommandVariables("{ Repo: }", test_formatter, result));
-	TEST_FALSE(sParseCommandVariables("{ Repo }", test_formatter, result));
-	TEST_FALSE(sParseCommandVariables("{ Repo Test }", test_formatter, result));
-	TEST_FALSE(sParseCommandVariables("{ File and more things", test_formatter, result));
-	TEST_FALSE(sParseCommandVariables("{}", test_formatter, result));
-	TEST_FALSE(sParseCommandVariables("{        }", test_formatter, result));
-	TEST_FALSE(sParseCommandVariables("{ file }", test_formatter, result));
-};
-
 
 static [[nodiscard]] StringView sApplySlice(StringView inStr, Slice inSlice)
 {
@@ -593,6 +386,7 @@ static StringView sGetCommandVarString(CommandVariables inVar, const FileInfo& i
 
 	case CommandVariables::Repo:
 	case CommandVariables::Fnv1a32:
+	case CommandVariables::ResponseFile:
 		return {}; // Needs to be handled separately.
 
 	default:
@@ -602,107 +396,365 @@ static StringView sGetCommandVarString(CommandVariables inVar, const FileInfo& i
 }
 
 
-// TODO add an output error string to help understand why it fails
-bool gFormatCommandString(StringView inFormatStr, const FileInfo& inFile, TempString& outString)
+// If the string ends with a backslash and the following character is a quote, the backslash will escape it and the command line won't work.
+// In this case another backslash needs to be added to escape the first one (unless it's already there).
+static bool sNeedsEscapedBackslash(StringView inStr, bool inQuoteFollows)
+{
+	return inQuoteFollows && inStr.EndsWith(R"(\)") && !inStr.EndsWith(R"(\\)");
+}
+
+
+// Get the string corresponding to a CommandVariable (before slicing). Return false if the variable can't be used here.
+static bool sGetVarString(CommandVariables inVar, const FileInfo& inFile, StringView inResponseFilePath, bool inIsFilePath, StringView& outStr)
 {
+	if (inVar == CommandVariables::ResponseFile)
+	{
+		// Only valid in the command lines of batched rules.
+		if (inIsFilePath || inResponseFilePath.Empty())
+			return false;
+
+		outStr = inResponseFilePath;
+		return true;
+	}
+
+	outStr = sGetCommandVarString(inVar, inFile);
+	return true;
+}
+
+
+bool CommandTemplate::Compile(StringView inFormatStr)
+{
+	mLiterals.Clear();
+	mOps.Clear();
+
+	auto fail = [this]()
+	{
+		mLiterals.Clear();
+		mOps.Clear();
+		return false;
+	};
+
+	auto add_literal = [this](StringView inLiteral)
+	{
+		if (inLiteral.Empty())
+			return;
+
+		mOps.PushBack({ .mType = OpType::Literal, .mLiteralBegin = mLiterals.Size(), .mLiteralSize = inLiteral.Size() });
+		mLiterals.Append(inLiteral);
+	};
+
 	if (inFormatStr.Empty())
 		return false; // Consider empty format string is an error.
 
-	return sParseCommandVariables(inFormatStr, [&inFile](CommandVariables inVar, StringView inRepoName, Slice inSlice, StringView inRemainingFormatStr, TempString& outStr) 
+	while (true)
 	{
-		StringView var_str;
+		int open_brace_pos = inFormatStr.FindFirstOf("{");
+		if (open_brace_pos == -1)
+		{
+			// No more arguments.
+			add_literal(inFormatStr);
+			return true;
+		}
+
+		add_literal(inFormatStr.SubStr(0, open_brace_pos));
+		inFormatStr.RemovePrefix(open_brace_pos);
+
+		StringView arg;
+		Op         op;
+		if (!sParseArgument(inFormatStr, arg, op.mSlice)) [[unlikely]]
+			return fail(); // Failed to parse argument.
 
-		// Repo need to be treated separately, string is based on inRepoName rather than inFile.
-		if (inVar == CommandVariables::Repo)
+		op.mQuoteFollows = inFormatStr.StartsWith(R"(")");
+
+		if (arg.StartsWith(gToStringView(CommandVariables::Repo)))
 		{
-			if (FileRepo* repo = gFileSystem.FindRepo(inRepoName))
-				var_str = repo->mRootPath;
-			else
-				// Invalid repo name.
-				return false;
+			arg.RemovePrefix(gToStringView(CommandVariables::Repo).Size());
+
+			if (arg.Size() < 2 || arg[0] != ':') [[unlikely]]
+				return fail(); // Failed to get the repo name part.
+
+			op.mType = OpType::Repo;
+			op.mVar  = CommandVariables::Repo;
+			op.mRepo = gFileSystem.FindRepo(arg.SubStr(1));
+
+			if (op.mRepo == nullptr) [[unlikely]]
+				return fail(); // Invalid repo name.
 		}
 		else
 		{
-			// Get the string corresponding to this CommandVariable.
-			var_str = sGetCommandVarString(inVar, inFile);
-		}
+			op.mType = OpType::Variable;
 
-		// Apply the slice to it.
-		var_str = sApplySlice(var_str, inSlice);
+			if (arg.StartsWith(gToStringView(CommandVariables::Fnv1a32)))
+			{
+				arg.RemovePrefix(gToStringView(CommandVariables::Fnv1a32).Size());
 
-		// Append to the output.
-		outStr.Append(var_str);
+				if (arg.Size() < 2 || arg[0] != ':') [[unlikely]]
+					return fail(); // Failed to get the variable name part.
 
-		// If the string ends with a backslash and the following character is a quote, the backslash will escape it and the command line won't work.
-		// In this case, add another backslash to escape the first one.
-		if (outStr.EndsWith(R"(\)") &&
-			inRemainingFormatStr.StartsWith(R"(")") &&
-			!outStr.EndsWith(R"(\\)")) // Already added the double backslash
-		{
-			outStr.Append(R"(\)");
+				arg      = arg.SubStr(1);
+				op.mType = OpType::Fnv1a32;
+			}
+
+			for (int i = 0; i < (int)CommandVariables::_Count; ++i)
+			{
+				CommandVariables var = (CommandVariables)i;
+
+				if (var == CommandVariables::Repo)
+					continue; // Treated separately.
+
+				if (arg == gToStringView(var))
+				{
+					op.mVar = var;
+					break;
+				}
+			}
+
+			if (op.mVar == CommandVariables::_Count) [[unlikely]]
+				return fail(); // Invalid variable name.
 		}
 
-		return true;
-	}, outString);
+		mOps.PushBack(op);
+	}
 }
 
 
-bool gFormatFilePath(StringView inFormatStr, const FileInfo& inFile, FileRepo*& outRepo, TempString& outPath)
+bool CommandTemplate::FormatInternal(const FileInfo& inFile, StringView inResponseFilePath, FileRepo** outRepo, TempString& outString) const
 {
-	FileRepo*  repo = nullptr;
-	TempString out_path;
-
-	bool       success = sParseCommandVariables(
-        inFormatStr,
-        [&inFile, &repo](CommandVariables inVar, StringView inRepoName, Slice inSlice, StringView inRemainingFormatStr, TempString& outStr) {
-            // Repo need to be treated separately, string is based on inRepoName rather than inFile.
-            if (inVar == CommandVariables::Repo)
-            {
-                // There can only be 1 Repo arg and it should be at the very beginning of the path.
-                if (repo != nullptr || !outStr.Empty())
-                    return false;
-
-                // Repo cannot be sliced.
-                if (inSlice != Slice())
-                    return false;
-
-                repo = gFileSystem.FindRepo(inRepoName);
-
-                // Invalid repo name.
-                if (repo == nullptr)
-                    return false;
-            }
-            else
-            {
-                // Get the string corresponding to this CommandVariable.
-                StringView var_str = sGetCommandVarString(inVar, inFile);
-
-                // Apply the slice to it.
-                var_str = sApplySlice(var_str, inSlice);
-
-                // Append to the output.
-                outStr.Append(var_str);
-            }
-
-            return true;
-        },
-        out_path);
-
-	if (!success)
+	// Make sure the output is cleared, the function should return empty string on failure.
+	outString.Clear();
+
+	if (mOps.Empty()) [[unlikely]]
+		return false; // Not compiled.
+
+	auto fail = [&outString]()
+	{
+		outString.Clear();
 		return false;
+	};
+
+	bool      is_file_path = outRepo != nullptr;
+	FileRepo* repo         = nullptr;
+	StringView literals    = mLiterals;
+
+	// Compute an upper bound of the size of the result first, to allocate only once.
+	int size = mLiterals.Size();
+	for (const Op& op : mOps)
+	{
+		switch (op.mType)
+		{
+		case OpType::Literal:
+			break; // Already counted.
+		case OpType::Repo:
+			size += op.mRepo->mRootPath.Size() + 1; // +1 for a potential escaping backslash.
+			break;
+		case OpType::Variable:
+			size += (op.mVar == CommandVariables::ResponseFile ? inResponseFilePath.Size() : sGetCommandVarString(op.mVar, inFile).Size()) + 1;
+			break;
+		case OpType::Fnv1a32:
+			size += 8;
+			break;
+		}
+	}
+	outString.Reserve(size);
+
+	for (const Op& op : mOps)
+	{
+		switch (op.mType)
+		{
+		case OpType::Literal:
+			{
+				outString.Append(literals.SubStr(op.mLiteralBegin, op.mLiteralSize));
+				break;
+			}
+		case OpType::Repo:
+			{
+				if (is_file_path)
+				{
+					// There can only be 1 Repo arg and it should be at the very beginning of the path.
+					if (repo != nullptr || !outString.Empty())
+						return fail();
+
+					// Repo cannot be sliced.
+					if (op.mSlice != Slice())
+						return fail();
+
+					repo = op.mRepo;
+				}
+				else
+				{
+					outString.Append(sApplySlice(op.mRepo->mRootPath, op.mSlice));
+
+					if (sNeedsEscapedBackslash(outString, op.mQuoteFollows))
+						outString.Append(R"(\)");
+				}
+				break;
+			}
+		case OpType::Variable:
+			{
+				StringView var_str;
+				if (!sGetVarString(op.mVar, inFile, inResponseFilePath, is_file_path, var_str))
+					return fail();
+
+				outString.Append(sApplySlice(var_str, op.mSlice));
+
+				if (!is_file_path && sNeedsEscapedBackslash(outString, op.mQuoteFollows))
+					outString.Append(R"(\)");
+				break;
+			}
+		case OpType::Fnv1a32:
+			{
+				StringView var_str;
+				if (!sGetVarString(op.mVar, inFile, inResponseFilePath, is_file_path, var_str))
+					return fail();
+
+				var_str = sApplySlice(var_str, op.mSlice);
+
+				// The escaping backslash is part of the hashed string (as it would be in the formatted variable).
+				uint32 hash = FxHash::Fnv1a32(var_str.Data(), var_str.Size());
+				if (!is_file_path && sNeedsEscapedBackslash(var_str, op.mQuoteFollows))
+					hash = FxHash::Fnv1a32(R"(\)", 1, hash);
+
+				char   hash_string[32];
+				size_t hash_string_length = snprintf(hash_string, sizeof(hash_string), "%x", hash);
+				outString.Append(hash_string, hash_string_length);
+				break;
+			}
+		}
+	}
+
+	if (is_file_path)
+		*outRepo = repo;
 
-	outRepo = repo;
-	outPath = gMove(out_path);
 	return true;
 }
 
 
-FileID gGetOrAddFileFromFormat(StringView inFormatStr, const FileInfo& inFile)
+bool CommandTemplate::Format(const FileInfo& inFile, TempString& outString, StringView inResponseFilePath/* = {}*/) const
+{
+	return FormatInternal(inFile, inResponseFilePath, nullptr, outString);
+}
+
+
+bool CommandTemplate::FormatFilePath(const FileInfo& inFile, FileRepo*& outRepo, TempString& outPath) const
+{
+	return FormatInternal(inFile, {}, &outRepo, outPath);
+}
+
+
+REGISTER_TEST("CommandTemplate")
+{
+	// Make sure temp memory is initialized or the tests will fail.
+	TEST_INIT_TEMP_MEMORY(10_KiB);
+
+	// Note: Repo variables are not tested since they need actual FileRepos.
+	FileInfo file(FileID{ 0, 0 }, "dir\\sub\\file.txt", Hash128{ 0, 0 }, FileType::File, {}, FileID::cInvalid());
+
+	struct TestCase
+	{
+		StringView  mFormatStr;
+		const char* mCommandLine;			// Expected result of Format, nullptr if it should fail.
+		const char* mBatchCommandLine;		// Expected result of Format with a response file.
+		const char* mFilePath;				// Expected result of FormatFilePath.
+	};
+
+	constexpr TestCase cTestCases[] =
+	{
+		{ "JustText",
+			"JustText",
+			"JustText",
+			"JustText" },
+		{ "{File}{Ext}",
+			"file.txt",
+			"file.txt",
+			"file.txt" },
+		{ "{   File    }{Ext}{\tExt\t}{Dir } ",
+			"file.txt.txtdir\\sub\\ ",
+			"file.txt.txtdir\\sub\\ ",
+			"file.txt.txtdir\\sub\\ " },
+		// The trailing backslash of Dir is escaped when followed by a quote, but only in command lines.
+		{ "tool.exe -i {Path} -o \"{Dir}\" -v",
+			"tool.exe -i dir\\sub\\file.txt -o \"dir\\sub\\\\\" -v",
+			"tool.exe -i dir\\sub\\file.txt -o \"dir\\sub\\\\\" -v",
+			"tool.exe -i dir\\sub\\file.txt -o \"dir\\sub\\\" -v" },
+		{ "{ Dir_NoTrailingSlash }\\out\\{ File[1:-1] }{Ext[-2]}",
+			"dir\\sub\\out\\ilxt",
+			"dir\\sub\\out\\ilxt",
+			"dir\\sub\\out\\ilxt" },
+		{ "tool.exe {Path[100:]}\"{Dir}\"",
+			"tool.exe \"dir\\sub\\\\\"",
+			"tool.exe \"dir\\sub\\\\\"",
+			"tool.exe \"dir\\sub\\\"" },
+		{ "{Fnv1a32:Path}_{Fnv1a32:File[0:2]}",
+			"607efd52_5c22ded0",
+			"607efd52_5c22ded0",
+			"607efd52_5c22ded0" },
+		// The escaping backslash is part of the hashed string.
+		{ "\"{Fnv1a32:Dir}\"",
+			"\"e2dcb5ba\"",
+			"\"e2dcb5ba\"",
+			"\"3b3f6fc2\"" },
+		{ "tool.exe @{ResponseFile}",
+			nullptr,
+			"tool.exe @batch.rsp",
+			nullptr },
+		{ "tool.exe @{Fnv1a32:ResponseFile}",
+			nullptr,
+			"tool.exe @c9c94984",
+			nullptr },
+		{ "",						nullptr, nullptr, nullptr },
+		{ "{}",						nullptr, nullptr, nullptr },
+		{ "{        }",				nullptr, nullptr, nullptr },
+		{ "{ file }",				nullptr, nullptr, nullptr },
+		{ "{ File and more things",	nullptr, nullptr, nullptr },
+		{ "{ File[1:x] }",			nullptr, nullptr, nullptr },
+		{ "{ Fnv1a32 }",			nullptr, nullptr, nullptr },
+		{ "{ Fnv1a32:Nope }",		nullptr, nullptr, nullptr },
+		{ "{ Repo }",				nullptr, nullptr, nullptr },
+		{ "{ Repo: }",				nullptr, nullptr, nullptr },
+		{ "{ Repo Test }",			nullptr, nullptr, nullptr },
+	};
+
+	for (const TestCase& test_case : cTestCases)
+	{
+		CommandTemplate command_template;
+		bool            compiled = command_template.Compile(test_case.mFormatStr);
+
+		{
+			TempString result;
+			bool       success = compiled && command_template.Format(file, result);
+			TEST_TRUE(success == (test_case.mCommandLine != nullptr));
+			TEST_TRUE(result == (success ? test_case.mCommandLine : ""));
+		}
+
+		{
+			TempString result;
+			bool       success = compiled && command_template.Format(file, result, "batch.rsp");
+			TEST_TRUE(success == (test_case.mBatchCommandLine != nullptr));
+			TEST_TRUE(result == (success ? test_case.mBatchCommandLine : ""));
+		}
+
+		{
+			FileRepo*  repo = nullptr;
+			TempString result;
+			bool       success = compiled && command_template.FormatFilePath(file, repo, result);
+			TEST_TRUE(success == (test_case.mFilePath != nullptr));
+			TEST_TRUE(result == (success ? test_case.mFilePath : ""));
+			TEST_TRUE(repo == nullptr);
+		}
+	}
+};
+
+
+FileID gGetOrAddFileFromFormat(const CommandTemplate& inTemplate, const FileInfo& inFile)
 {
 	FileRepo*  repo = nullptr;
 	TempString path;
 
-	if (!gFormatFilePath(inFormatStr, inFile, repo, path))
+	if (!inTemplate.FormatFilePath(inFile, repo, path))
+		return FileID::cInvalid();
+
+	// Without a Repo variable, there's no way to know where the file is.
+	if (repo == nullptr)
 		return FileID::cInvalid();
 
 	return repo->GetOrAddFile(path, FileType::File, {}).mID;
@@ -7,6 +7,7 @@
 
 #include "Core.h"
 #include <Bedrock/String.h>
+#include <Bedrock/Vector.h>
 
 struct FileInfo;
 struct FileRepo;
@@ -22,6 +23,7 @@ enum class CommandVariables : uint8
 	Path,
 	Repo,
 	Fnv1a32,
+	ResponseFile,
 	_Count
 };
 
@@ -35,7 +37,8 @@ constexpr StringView gToStringView(CommandVariables inVar)
 		"Dir_NoTrailingSlash",
 		"Path",
 		"Repo",
-		"Fnv1a32"
+		"Fnv1a32",
+		"ResponseFile",
 	};
 	static_assert(gElemCount(cNames) == (size_t)CommandVariables::_Count);
 
@@ -43,15 +46,57 @@ constexpr StringView gToStringView(CommandVariables inVar)
 };
 
 
-// Check for CommandVariables and replace them by the corresponding part of inFile.
+// Python-like slice that can follow a CommandVariable, eg. "{File[0:-2]}".
+struct CommandVariableSlice
+{
+	int mStart = 0;
+	int mEnd   = cMaxInt;
+
+	bool operator==(const CommandVariableSlice&) const = default;
+};
+
+
+// Format string containing CommandVariables, parsed once to be formatted many times (eg. the command lines and paths of a rule).
 // Eg. "copy.exe {Repo:Source}{Path} {Repo:Bin}" will turn into "copy.exe D:/src/file.txt D:/bin/"
-bool gFormatCommandString(StringView inFormatStr, const FileInfo& inFile, TempString& outString);
+// The CommandVariables, slices and repo names are resolved by Compile, formatting is then only a matter of appending strings.
+struct CommandTemplate
+{
+	bool Compile(StringView inFormatStr); // Return false if the format string is invalid (empty, syntax error, unknown variable or repo).
 
+	// Replace the CommandVariables by the corresponding part of inFile.
+	// The ResponseFile CommandVariable is only valid if inResponseFilePath is provided (ie. for the BatchCommandLine of batched rules).
+	bool Format(const FileInfo& inFile, TempString& outString, StringView inResponseFilePath = {}) const;
 
-// Check for CommandVariables and replace them by the corresponding part of inFile but expects the string to be a single file path.
-// One Repo var is needed at the start and of the path and the corresponding FileRepo will be returned instead of be replaced by its path.
-bool gFormatFilePath(StringView inFormatStr, const FileInfo& inFile, FileRepo*& outRepo, TempString& outPath);
+	// Same as Format but expects the string to be a single file path.
+	// One Repo var is needed at the start of the path and the corresponding FileRepo will be returned instead of be replaced by its path.
+	bool FormatFilePath(const FileInfo& inFile, FileRepo*& outRepo, TempString& outPath) const;
+
+private:
+	enum class OpType : uint8
+	{
+		Literal,
+		Variable,
+		Repo,
+		Fnv1a32,
+	};
+
+	struct Op
+	{
+		OpType               mType          = OpType::Literal;
+		CommandVariables     mVar           = CommandVariables::_Count;
+		bool                 mQuoteFollows  = false;   // True if the format string continues with a quote (a trailing backslash would need to be escaped).
+		int                  mLiteralBegin  = 0;       // Position in mLiterals.
+		int                  mLiteralSize   = 0;
+		CommandVariableSlice mSlice;
+		FileRepo*            mRepo          = nullptr;
+	};
+
+	bool FormatInternal(const FileInfo& inFile, StringView inResponseFilePath, FileRepo** outRepo, TempString& outString) const; // outRepo is only set when formatting a file path.
+
+	String                   mLiterals;	// Text between the CommandVariables.
+	Vector<Op>               mOps;
+};
 
 
 // Format the file path and get (or add) the corresponding file. Return an invalid FileID if the format is invalid.
-FileID gGetOrAddFileFromFormat(StringView inFormatStr, const FileInfo& inFile);
+FileID gGetOrAddFileFromFormat(const CommandTemplate& inTemplate, const FileInfo& inFile);
@@ -95,6 +95,13 @@ void gReadConfigFile(StringView inPath)
 		}
 	}
 
+	// Action cache max size
+	{
+		int64 max_size_mb = 0;
+		if (reader.TryRead("ActionCacheMaxSizeMB", max_size_mb))
+			gApp.mActionCacheMaxSize = gMax(max_size_mb, (int64)0) * 1_MiB;
+	}
+
 	// Read the window title.
 	reader.TryRead("WindowTitle", gApp.mMainWindowTitle);
 }
@@ -10,16 +10,24 @@
 #include "Notifications.h"
 #include "CommandVariables.h"
 #include "UI.h"
+#include "Benchmark.h"
 #include <Bedrock/Test.h>
 #include <Bedrock/Algorithm.h>
 #include <Bedrock/Ticks.h>
 #include <Bedrock/Random.h>
 #include <Bedrock/StringFormat.h>
 
+#include <algorithm> // for std::sort
+
 #include "subprocess/subprocess.h"
 #include "win32/file.h"
 #include "win32/misc.h"
 #include "win32/process.h"
+#include "win32/threads.h"
+
+#include "xxHash/xxh3.h"
+
+extern "C" __declspec(dllimport) BOOL WINAPI PeekNamedPipe(HANDLE hNamedPipe, LPVOID lpBuffer, DWORD nBufferSize, LPDWORD lpBytesRead, LPDWORD lpTotalBytesAvailMessage, LPDWORD lpBytesLeftThisMessage);
 
 
 // Debug toggle to fake cooking failures, to test error handling.
@@ -38,144 +46,164 @@ constexpr bool gPushBackUnique(taContainer& ioContainer, const taValue& inElem)
 }
 
 
-// Test a path against a pattern. Return true if the path matches the pattern (case-insensitive).
-// Pattern supports wild cards '*' (any number of characters) and '?' (single character).
-bool gMatchPath(StringView inPath, StringView inPattern)
+bool InputFilter::Pass(const FileInfo& inFile) const
 {
-	gAssert(!inPattern.Empty());
-	gAssert(gIsNormalized(inPath) && gIsNormalized(inPattern));
+	if (mRepoIndex != inFile.mID.mRepoIndex)
+		return false;
 
-	// Convert the path and pattern to lowercase to make sure the search is case-insensitive.
-	TempString path_lowercase = inPath;
-	gToLowercase(path_lowercase);
-	TempString pattern_lowercase = inPattern;
-	gToLowercase(pattern_lowercase);
+	return mCompiledPathPattern.Match(inFile.mPath);
+}
 
-	StringView str          = path_lowercase;
-	StringView pattern      = pattern_lowercase;
-	bool       pending_star = false;
 
-	while (true)
+// Get the extension of the file names matched by this pattern (including the '.'), if it's fixed.
+// Return false if the extension contains wild cards (or non-ASCII characters, because the bucket keys are only case-insensitive for ASCII).
+static bool sGetPatternFixedExtension(StringView inPattern, StringView& outExtension)
+{
+	for (int i = inPattern.Size() - 1; i >= 0; --i)
 	{
-		// Find the next wild card in the pattern.
-		int next_wildcard_index = pattern.FindFirstOf("?*");
+		char c = inPattern[i];
+		if (c == '*' || c == '?' || c == '\\' || c == '/' || (uint8)c >= 0x80)
+			return false;
 
-		// If the next char isn't a wild card and we have a pending '*', process it now.
-		// This case happens when we encounter '*?'. More explanations where pending_star is set to true below.
-		if (next_wildcard_index != 0 && pending_star)
+		if (c == '.')
 		{
-			pending_star = false;
+			outExtension = inPattern.SubStr(i);
+			return true;
+		}
+	}
 
-			// If the pattern ends with '*', it's an automatic match.
-			if (pattern.Empty())
-				return true;
+	return false;
+}
 
-			// Find where the string starts matching the pattern again.
-			StringView pattern_until_next_wildcard = pattern.SubStr(0, pattern.FindFirstOf("?*"));
-			int next_match = str.Find(pattern_until_next_wildcard);
 
-			// Never? Then it's a fail.
-			if (next_match == -1)
-				return false;
+// Hash the repo index and the lowercase extension.
+// Note: the extension "*" is used for the bucket of filters without fixed extension (it can't be a real extension).
+static uint64 sGetRuleBucketKey(uint32 inRepoIndex, StringView inExtension)
+{
+	// FNV-1a
+	uint64 hash = 0xCBF29CE484222325ull ^ inRepoIndex;
+	for (char c : inExtension)
+	{
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
 
-			// Skip to where it matches again.
-			str.RemovePrefix(next_match);
-		}
+		hash = (hash ^ (uint8)c) * 0x100000001B3ull;
+	}
+	return hash;
+}
 
-		// Strings should be equal until there (or until end of the string).
-		if (str.SubStr(0, next_wildcard_index) != pattern.SubStr(0, next_wildcard_index))
-			return false;
 
-		// If there was no wild card, we're done! Strings match.
-		if (next_wildcard_index == -1)
-			return true;
+void RuleIndex::Build(Span<const CookingRule> inRules)
+{
+	struct BucketRule
+	{
+		uint64        mKey;
+		CookingRuleID mRuleID;
+	};
+
+	Vector<BucketRule> bucket_rules;
+	for (const CookingRule& rule : inRules)
+	{
+		for (const InputFilter& filter : rule.mInputFilters)
+		{
+			StringView extension;
+			if (!sGetPatternFixedExtension(filter.mPathPattern, extension))
+				extension = "*";
 
-		// Skip the parts that match.
-		str.RemovePrefix(next_wildcard_index);
-		pattern.RemovePrefix(next_wildcard_index);
+			bucket_rules.PushBack({ sGetRuleBucketKey(filter.mRepoIndex, extension), rule.mID });
+		}
+	}
 
-		// Also skip the wild card, but keep a copy.
-		char wild_card = pattern[0];
-		pattern.RemovePrefix(1);
+	// Group by bucket, keeping the declaration order in each bucket.
+	std::sort(bucket_rules.begin(), bucket_rules.end(), [](const BucketRule& inA, const BucketRule& inB) {
+		if (inA.mKey != inB.mKey)
+			return inA.mKey < inB.mKey;
+		return inA.mRuleID.mIndex < inB.mRuleID.mIndex;
+	});
 
-		if (wild_card == '?')
-		{
-			// If there is no character left, it's a fail.
-			if (str.Size() < 1)
-				return false;
+	mBuckets.Clear();
+	mRuleIDs.Clear();
 
-			// Skip one character.
-			str.RemovePrefix(1);
+	for (int i = 0; i < bucket_rules.Size(); ++i)
+	{
+		const BucketRule& bucket_rule = bucket_rules[i];
+
+		if (i == 0 || bucket_rule.mKey != bucket_rules[i - 1].mKey)
+		{
+			// First rule of a new bucket.
+			mBuckets.Insert(bucket_rule.mKey, Range{ mRuleIDs.Size(), mRuleIDs.Size() });
 		}
-		else
+		else if (bucket_rule.mRuleID == bucket_rules[i - 1].mRuleID)
 		{
-			gAssert(wild_card == '*');
-
-			// If the pattern ends with '*', it's an automatic match.
-			if (pattern.Empty())
-				return true;
+			// Same rule with several filters in the same bucket, only add it once.
+			continue;
+		}
 
-			// If the * is followed by another '*', continue to process the next wild card directly, '**' is equivalent to '*'.
-			if (pattern[0] == '*')
-				continue;
+		mRuleIDs.PushBack(bucket_rule.mRuleID);
+		mBuckets.Find(bucket_rule.mKey)->mValue.mEnd = mRuleIDs.Size();
+	}
+}
 
-			// If the '*' is followed by '?', it is THE annoying case.
-			// '*?' is equivalent to '?*', so continue to process the '?', but remember we have a pending '*'.
-			// This way both '*???' and '*?*?*?' will just be interpreted as '???*'.
-			if (pattern[0] == '?')
-			{
-				pending_star = true;
-				continue;
-			}
 
-			// Clear the pending '*' if we encounter another one.
-			pending_star = false;
+Span<const CookingRuleID> RuleIndex::GetBucket(uint64 inKey) const
+{
+	auto it = mBuckets.Find(inKey);
+	if (it == mBuckets.End())
+		return {};
 
-			// Find where the string starts matching the pattern again.
-			StringView pattern_until_next_wildcard = pattern.SubStr(0, pattern.FindFirstOf("?*"));
-			int next_match = str.Find(pattern_until_next_wildcard);
+	return Span<const CookingRuleID>(mRuleIDs).SubSpan(it->mValue.mBegin, it->mValue.mEnd - it->mValue.mBegin);
+}
 
-			// Never? Then it's a fail.
-			if (next_match == -1)
-				return false;
 
-			// Skip to where it matches again.
-			str.RemovePrefix(next_match);
+void RuleIndex::GetCandidateRules(const FileInfo& inFile, TempVector<CookingRuleID>& outRules) const
+{
+	// Note: if two buckets get the same key, they are merged. That only adds candidates, it doesn't change the result.
+	Span<const CookingRuleID> extension_rules = GetBucket(sGetRuleBucketKey(inFile.mID.mRepoIndex, inFile.GetExtension()));
+	Span<const CookingRuleID> other_rules     = GetBucket(sGetRuleBucketKey(inFile.mID.mRepoIndex, "*"));
+
+	// Merge both buckets to keep the declaration order (needed for MatchMoreRules).
+	int extension_index = 0;
+	int other_index     = 0;
+	while (extension_index < extension_rules.Size() || other_index < other_rules.Size())
+	{
+		if (other_index == other_rules.Size() 
+			|| (extension_index < extension_rules.Size() && extension_rules[extension_index].mIndex < other_rules[other_index].mIndex))
+		{
+			outRules.PushBack(extension_rules[extension_index++]);
+		}
+		else if (extension_index == extension_rules.Size() 
+			|| other_rules[other_index].mIndex < extension_rules[extension_index].mIndex)
+		{
+			outRules.PushBack(other_rules[other_index++]);
+		}
+		else
+		{
+			// Same rule in both buckets.
+			outRules.PushBack(extension_rules[extension_index++]);
+			other_index++;
 		}
 	}
 }
 
 
-REGISTER_TEST("MatchPath")
+REGISTER_TEST("PatternFixedExtension")
 {
-	TEST_TRUE(gMatchPath ("YOYO.txt", "yoyo.txt"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "*.txt"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "y?yo.txt"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "????????"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "*"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "?*"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "**"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "*?"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "*?oyo.txt"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "*????.txt"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "y*?*?*?.txt"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "y*y*.txt"));
-	TEST_TRUE(gMatchPath ("YOYO.txt", "y*?.*"));
-	TEST_FALSE(gMatchPath("Y.txt", "y*?.*"));
-	TEST_FALSE(gMatchPath("YOYO.txt", "yoyo.txt*?"));
-	TEST_TRUE(gMatchPath("medium_house\\texture_albedo.png", "*_albedo.*"));
+	StringView extension;
+	TEST_TRUE(sGetPatternFixedExtension("*.png", extension));
+	TEST_TRUE(extension == ".png");
+	TEST_TRUE(sGetPatternFixedExtension("textures\\*_albedo.tar.gz", extension));
+	TEST_TRUE(extension == ".gz");
+	TEST_TRUE(sGetPatternFixedExtension("file.", extension));
+	TEST_TRUE(extension == ".");
+	TEST_FALSE(sGetPatternFixedExtension("*_albedo.*", extension));
+	TEST_FALSE(sGetPatternFixedExtension("*.pn?", extension));
+	TEST_FALSE(sGetPatternFixedExtension("*png", extension));
+	TEST_FALSE(sGetPatternFixedExtension("dir.d\\*", extension));
+	TEST_TRUE(sGetRuleBucketKey(0, ".PNG") == sGetRuleBucketKey(0, ".png"));
+	TEST_TRUE(sGetRuleBucketKey(0, ".png") != sGetRuleBucketKey(1, ".png"));
 };
 
 
-bool InputFilter::Pass(const FileInfo& inFile) const
-{
-	if (mRepoIndex != inFile.mID.mRepoIndex)
-		return false;
-
-	return gMatchPath(inFile.mPath, mPathPattern);
-}
-
-
 FileID CookingCommand::GetDepFile() const
 {
 	const CookingRule& rule = gCookingSystem.GetRule(mRuleID);
@@ -193,28 +221,105 @@ void CookingCommand::UpdateDirtyState()
 	// Dirty state should not be updated while still cooking!
 	gAssert(!mLastCookingLog || mLastCookingLog->mCookingState.Load() > CookingState::Cooking);
 
-	DirtyState dirty_state = NotDirty;
+	DirtyState dirty_state         = ReadDepFileIfNeeded();
+	bool       all_outputs_written = false;
+	dirty_state |= ComputeDirtyState(all_outputs_written);
 
-	FileID dep_file = GetDepFile();
+	SetDirtyState(dirty_state, all_outputs_written);
+}
+
+
+CookingCommand::DirtyState CookingCommand::ReadDepFileIfNeeded()
+{
 	// If the dep file is out of date, read it. The dirty state depends on its content.
 	// Note: This is updating the InputOf/OutputOf lists in FileInfos, which isn't thread safe, so it can't be done on the Cooking Threads.
-	if (dep_file.IsValid() && dep_file.GetFile().mLastChangeUSN != mLastDepFileRead)
+	if (!NeedsDepFileRead())
+		return NotDirty;
+
+	const FileInfo& dep_file = GetDepFile().GetFile();
+	USN             dep_file_usn = dep_file.mLastChangeUSN;
+	Vector<FileID>  inputs, outputs;
+
+	// If the file is deleted, don't actually try to read it.
+	bool success = dep_file.IsDeleted() || gReadDepFile(GetRule().mDepFileFormat, GetDepFile(), inputs, outputs);
+
+	return ApplyDepFile(dep_file_usn, success, inputs, outputs);
+}
+
+
+bool CookingCommand::NeedsDepFileRead() const
+{
+	FileID dep_file = GetDepFile();
+	return dep_file.IsValid() && dep_file.GetFile().mLastChangeUSN != mLastDepFileRead;
+}
+
+
+CookingCommand::DirtyState CookingCommand::ApplyDepFile(USN inDepFileUSN, bool inReadSuccess, Span<FileID> inInputs, Span<FileID> inOutputs)
+{
+	// Update the USN of the last time we read the dep file.
+	mLastDepFileRead = inDepFileUSN;
+
+	if (!inReadSuccess)
 	{
-		if (ReadDepFile())
-		{
-			// Update the last cook USN again now that we know all the inputs.
-			// TODO this does not work if multiple drives are involved, we can only compare USNs from the same journal
-			USN max_input_usn = 0;
-			for (FileID input_id : GetAllInputs())
-				max_input_usn = gMax(max_input_usn, input_id.GetFile().mLastChangeUSN);
-			mLastCookUSN = gMax(mLastCookUSN, max_input_usn);
-		}
-		else
-		{
-			dirty_state |= Error;
-		}
+		// If the command was cooking, set its state to error.
+		if (mLastCookingLog && mLastCookingLog->mCookingState.Load() == CookingState::Waiting)
+			mLastCookingLog->mCookingState.Store(CookingState::Error);
+
+		return Error;
+	}
+
+	// Update this command with the new list of input/output.
+	gApplyDepFileContent(*this, inInputs, inOutputs);
+
+	// Update the last cook USN again now that we know all the inputs.
+	// TODO this does not work if multiple drives are involved, we can only compare USNs from the same journal
+	USN max_input_usn = 0;
+	for (FileID input_id : GetAllInputs())
+		max_input_usn = gMax(max_input_usn, input_id.GetFile().mLastChangeUSN);
+	mLastCookUSN = gMax(mLastCookUSN, max_input_usn);
+
+	// Same for the cached state, if the cook is already finished (otherwise it's copied when it is).
+	if (!HasUnfinishedCook())
+		mCacheState.mLastCookUSN = gMax(mCacheState.mLastCookUSN, max_input_usn);
+
+	return NotDirty;
+}
+
+
+bool CookingCommand::NeedsInputHash(const FileInfo& inInput) const
+{
+	return !inInput.IsDeleted() && !inInput.IsContentHashValid() && inInput.mLastChangeUSN > mLastCookUSN;
+}
+
+
+bool CookingCommand::NeedsInputHashes() const
+{
+	for (const InputHash& input_hash : mInputHashes)
+	{
+		if (NeedsInputHash(input_hash.mFileID.GetFile()))
+			return true;
+	}
+
+	return false;
+}
+
+
+bool CookingCommand::IsInputContentUnchanged(const FileInfo& inInput) const
+{
+	for (const InputHash& input_hash : mInputHashes)
+	{
+		if (input_hash.mFileID == inInput.mID)
+			return inInput.IsContentHashValid() && inInput.mContentHash == input_hash.mHash;
 	}
 
+	return false;
+}
+
+
+CookingCommand::DirtyState CookingCommand::ComputeDirtyState(bool& outAllOutputsWritten) const
+{
+	DirtyState dirty_state = NotDirty;
+
 	// If the rule version changed since the last time this command was cooked, it needs to cook again.
 	if (mLastCookRuleVersion != GetRule().mVersion)
 		dirty_state |= VersionMismatch;
@@ -229,7 +334,8 @@ void CookingCommand::UpdateDirtyState()
 		}
 		else
 		{
-			if (file.mLastChangeUSN > mLastCookUSN)
+			// Note: if the input was written again with the same content (see CookingRule::mHashOutputs and mHashInputs), it didn't change.
+			if (file.GetLastContentChangeUSN() > mLastCookUSN && !IsInputContentUnchanged(file))
 				dirty_state |= InputChanged;
 		}
 	}
@@ -263,32 +369,39 @@ void CookingCommand::UpdateDirtyState()
 	if (all_output_missing)
 		dirty_state |= AllOutputsMissing;
 
-	bool last_cook_is_waiting = mLastCookingLog && mLastCookingLog->mCookingState.Load() == CookingState::Waiting;
-	bool last_cook_is_cleanup = mLastCookingLog && mLastCookingLog->mIsCleanup;
-	bool last_cook_is_error   = mLastCookingLog && mLastCookingLog->mCookingState.Load() == CookingState::Error;
-
-	if (last_cook_is_error)
+	if (mLastCookingLog && mLastCookingLog->mCookingState.Load() == CookingState::Error)
 		dirty_state |= Error;
 
+	outAllOutputsWritten = all_output_written;
+	return dirty_state;
+}
+
+
+void CookingCommand::SetDirtyState(DirtyState inDirtyState, bool inAllOutputsWritten)
+{
+	bool all_output_missing     = (inDirtyState & AllOutputsMissing) != 0;
+	bool last_cook_is_waiting   = mLastCookingLog && mLastCookingLog->mCookingState.Load() == CookingState::Waiting;
+	bool last_cook_is_cleanup   = mLastCookingLog && mLastCookingLog->mIsCleanup;
+	bool last_cook_is_cancelled = mLastCookingLog && mLastCookingLog->mCookingState.Load() == CookingState::Cancelled;
+
 	// If the command is waiting for results and all outputs were written (or deleted in case of cleanup), change its state to success.
 	if (last_cook_is_waiting)
 	{
-		if ((!last_cook_is_cleanup && all_output_written) ||
+		if ((!last_cook_is_cleanup && inAllOutputsWritten) ||
 			(last_cook_is_cleanup && all_output_missing))
 		{
 			CookingLogEntry& log_entry = *mLastCookingLog;
 
-			// TODO: setting the state to Success/Error should probably be grouped with mCommandsToCook.FinishedCooking into a function
 			log_entry.mCookingState.Store(CookingState::Success);
 
 			// Notify the system that this command has officially finished cooking.
-			gCookingSystem.mCommandsToCook.FinishedCooking(log_entry);
+			gCookingSystem.FinishedCooking(*this);
 
 			last_cook_is_waiting = false;
 		}
 	}
 
-	mDirtyState = dirty_state;
+	mDirtyState = inDirtyState;
 
 	// Wait until the last cook is finished before re-adding to the queue (or removing it from the queue).
 	if (last_cook_is_waiting)
@@ -310,11 +423,9 @@ void CookingCommand::UpdateDirtyState()
 	{
 		mIsQueued = false;
 
-		// TODO these removes are slow! fix it!
-		// Keep the order because it makes the UI much nicer.
-		gCookingSystem.mCommandsDirty.Remove(mID, RemoveOption::KeepOrder | RemoveOption::ExpectFound);
+		gCookingSystem.mCommandsDirty.Remove(mID, RemoveOption::ExpectFound);
 
-		// Don't care about the order in the cooking queue as much since it's not displayed (and might not be found if a worker already grabbed it).
+		// Might not be found if a worker already grabbed it.
 		gCookingSystem.mCommandsToCook.Remove(mID);
 	}
 	// Special last case: the command is already dirty, had an error, and its inputs changed again since.
@@ -325,42 +436,83 @@ void CookingCommand::UpdateDirtyState()
 		if (!gCookingSystem.IsCookingPaused())
 			gCookingSystem.mCommandsToCook.Push(mID);
 	}
+	// Same if the last cook was cancelled because an input changed.
+	else if (last_cook_is_cancelled && IsDirty())
+	{
+		gAssert(mIsQueued);
+		if (!gCookingSystem.IsCookingPaused())
+			gCookingSystem.mCommandsToCook.Push(mID);
+	}
 }
 
 
 
-bool CookingCommand::ReadDepFile()
+uint32 CookingRule::GetAverageCookDurationMs() const
 {
-	const FileInfo& dep_file = GetDepFile().GetFile();
-	gAssert(mLastDepFileRead != dep_file.mLastChangeUSN); // Don't read the dep file if it's not necessary.
+	int count = mCookDurationCount.Load();
+	if (count <= 0)
+		return 0;
 
-	// Update the USN of the last time we read the dep file.
-	mLastDepFileRead = dep_file.mLastChangeUSN;
+	return (uint32)(mTotalCookDurationMs.Load() / count);
+}
 
-	Vector<FileID> inputs, outputs;
 
-	// If the file is deleted, don't actually try to read it.
-	if (!dep_file.IsDeleted())
+void CookingCommand::SetLastCookDuration(uint32 inDurationMs)
+{
+	const CookingRule& rule = GetRule();
+
+	// Replace the previous duration in the rule total.
+	if (mLastCookDurationMs != 0)
 	{
-		// Read the dep file.
-		if (!gReadDepFile(GetRule().mDepFileFormat, GetDepFile(), inputs, outputs))
-		{
-			// If the command was cooking, set its state to error.
-			if (mLastCookingLog && mLastCookingLog->mCookingState.Load() == CookingState::Waiting)
-				mLastCookingLog->mCookingState.Store(CookingState::Error);
+		rule.mTotalCookDurationMs.Add(-(int64)mLastCookDurationMs);
+		rule.mCookDurationCount.Add(-1);
+	}
 
-			// Return failure.
-			return false;
-		}
+	if (inDurationMs != 0)
+	{
+		rule.mTotalCookDurationMs.Add(inDurationMs);
+		rule.mCookDurationCount.Add(1);
 	}
 
-	// Update this command with the new list of input/output.
-	gApplyDepFileContent(*this, inputs, outputs);
+	mLastCookDurationMs = inDurationMs;
+}
 
-	return true;
+
+uint32 CookingCommand::GetCookDurationEstimateMs() const
+{
+	if (mLastCookDurationMs != 0)
+		return mLastCookDurationMs;
+
+	return GetRule().GetAverageCookDurationMs();
+}
+
+
+bool CookingCommand::NeedsJournaling() const
+{
+	// Don't write anything until the last cook is finished, the state isn't final yet (eg. the dep file and the input hashes
+	// are updated while Waiting). The command is updated again once it's finished, which adds it back to the commands to journal.
+	if (HasUnfinishedCook())
+		return false;
+
+	// Same as SaveCache, these commands are not saved.
+	if (IsCleanedUp() || mCacheState.mLastCookRuleVersion != GetRule().mVersion)
+		return false;
+
+	return mCacheState.mLastCookingLog != mJournaledCookingLog || mLastDepFileRead != mJournaledDepFileRead;
+}
+
+
+void CookingCommand::UpdateCacheState()
+{
+	mCacheState.mLastCookingLog      = mLastCookingLog;
+	mCacheState.mLastCookRuleVersion = mLastCookRuleVersion;
+	mCacheState.mLastCookUSN         = mLastCookUSN;
+	mCacheState.mLastCookTime        = mLastCookTime;
+	mCacheState.mLastCookDurationMs  = mLastCookDurationMs;
 }
 
 
+
 void CookingQueue::Push(CookingCommandID inCommandID, PushPosition inPosition/* = PushPosition::Back*/)
 {
 	const CookingCommand& command = gCookingSystem.GetCommand(inCommandID);
@@ -378,16 +530,152 @@ void CookingQueue::PushInternal(MutexLockGuard& ioLock, int inPriority, CookingC
 	// Find or add the bucket for that cooking priority.
 	PrioBucket& bucket = *gEmplaceSorted(mPrioBuckets, inPriority);
 
+	// Make sure there's a link for this command.
+	if ((int)inCommandID.mIndex >= mLinks.Size())
+		mLinks.Resize(gMax((int)inCommandID.mIndex + 1, mLinks.Size() * 2));
+
+	Link& link = mLinks[inCommandID.mIndex];
+
+	// If the command is already in the queue, only move it if it needs to go to the front.
+	if (link.mIsInQueue)
+	{
+		if (inPosition == PushPosition::Back || bucket.mFirst == inCommandID)
+			return;
+
+		Unlink(bucket, inCommandID);
+	}
+
 	// Add the command.
+	link.mIsInQueue = true;
 	if (inPosition == PushPosition::Back)
-		bucket.mCommands.PushBack(inCommandID);
+	{
+		link.mPrev  = bucket.mLast;
+		link.mNext  = CookingCommandID::cInvalid();
+		link.mOrder = bucket.mNextBackOrder++;
+
+		if (bucket.mLast.IsValid())
+			mLinks[bucket.mLast.mIndex].mNext = inCommandID;
+		else
+			bucket.mFirst = inCommandID;
+
+		bucket.mLast = inCommandID;
+	}
 	else
-		bucket.mCommands.Insert(0, inCommandID);
+	{
+		link.mPrev  = CookingCommandID::cInvalid();
+		link.mNext  = bucket.mFirst;
+		link.mOrder = bucket.mNextFrontOrder--;
 
+		if (bucket.mFirst.IsValid())
+			mLinks[bucket.mFirst.mIndex].mPrev = inCommandID;
+		else
+			bucket.mLast = inCommandID;
+
+		bucket.mFirst = inCommandID;
+
+		// Everything after it moved by one.
+		if (bucket.mCursor.IsValid())
+			bucket.mCursorIndex++;
+	}
+
+	if (!bucket.mCursor.IsValid())
+	{
+		bucket.mCursor      = inCommandID;
+		bucket.mCursorIndex = 0;
+	}
+
+	bucket.mSize++;
 	mTotalSize++;
 }
 
 
+void CookingQueue::Unlink(PrioBucket& ioBucket, CookingCommandID inCommandID)
+{
+	Link& link = mLinks[inCommandID.mIndex];
+	gAssert(link.mIsInQueue);
+
+	// Keep the cursor on a command that stays in the bucket, and keep its position up to date.
+	if (ioBucket.mCursor == inCommandID)
+	{
+		if (link.mNext.IsValid())
+		{
+			ioBucket.mCursor = link.mNext; // Takes the same position.
+		}
+		else
+		{
+			ioBucket.mCursor      = link.mPrev; // Invalid if the bucket becomes empty.
+			ioBucket.mCursorIndex = gMax(0, ioBucket.mCursorIndex - 1);
+		}
+	}
+	else if (link.mOrder < mLinks[ioBucket.mCursor.mIndex].mOrder)
+	{
+		ioBucket.mCursorIndex--;
+	}
+
+	if (link.mPrev.IsValid())
+		mLinks[link.mPrev.mIndex].mNext = link.mNext;
+	else
+		ioBucket.mFirst = link.mNext;
+
+	if (link.mNext.IsValid())
+		mLinks[link.mNext.mIndex].mPrev = link.mPrev;
+	else
+		ioBucket.mLast = link.mPrev;
+
+	link = {};
+
+	ioBucket.mSize--;
+	mTotalSize--;
+}
+
+
+CookingCommandID CookingQueue::Seek(PrioBucket& ioBucket, int inIndex)
+{
+	if (inIndex < 0 || inIndex >= ioBucket.mSize)
+		return CookingCommandID::cInvalid();
+
+	auto distance = [inIndex](int inOtherIndex) { return inOtherIndex > inIndex ? inOtherIndex - inIndex : inIndex - inOtherIndex; };
+
+	// Start from the closest known position.
+	CookingCommandID command_id = ioBucket.mFirst;
+	int              index      = 0;
+
+	if (distance(ioBucket.mSize - 1) < distance(index))
+	{
+		command_id = ioBucket.mLast;
+		index      = ioBucket.mSize - 1;
+	}
+
+	if (distance(ioBucket.mCursorIndex) < distance(index))
+	{
+		command_id = ioBucket.mCursor;
+		index      = ioBucket.mCursorIndex;
+	}
+
+	if (index == inIndex)
+		return command_id; // Don't move the cursor when the first or last command is asked for (eg. when ImGui measures the first item).
+
+	for (; index < inIndex; ++index)
+		command_id = mLinks[command_id.mIndex].mNext;
+
+	for (; index > inIndex; --index)
+		command_id = mLinks[command_id.mIndex].mPrev;
+
+	ioBucket.mCursor      = command_id;
+	ioBucket.mCursorIndex = inIndex;
+
+	return command_id;
+}
+
+
+CookingCommandID CookingQueue::PopBack(PrioBucket& ioBucket)
+{
+	CookingCommandID id = ioBucket.mLast;
+	Unlink(ioBucket, id);
+	return id;
+}
+
+
 CookingCommandID CookingQueue::Pop()
 {
 	LockGuard lock(mMutex);
@@ -395,14 +683,10 @@ CookingCommandID CookingQueue::Pop()
 	// Find the first non-empty bucket.
 	for (PrioBucket& bucket : mPrioBuckets)
 	{
-		if (!bucket.mCommands.Empty())
+		if (!bucket.IsEmpty())
 		{
 			// Pop a command.
-			CookingCommandID id = bucket.mCommands.Back();
-			bucket.mCommands.PopBack();
-			mTotalSize--;
-
-			return id;
+			return PopBack(bucket);
 		}
 	}
 
@@ -416,34 +700,28 @@ bool CookingQueue::Remove(CookingCommandID inCommandID, RemoveOption inOption/*
 	int priority = gCookingSystem.GetRule(command.mRuleID).mPriority;
 
 	LockGuard lock(mMutex);
+	return RemoveInternal(lock, priority, inCommandID, inOption);
+}
 
-	// Find the bucket.
-	auto bucket_it = gFindSorted(mPrioBuckets, priority);
-	if (bucket_it == mPrioBuckets.end())
-	{
-		gAssert((inOption & RemoveOption::ExpectFound) == false);
-		return false;
-	}
 
-	// Find the command in the bucket.
-	auto it = gFind(bucket_it->mCommands, inCommandID);
-	if (it == bucket_it->mCommands.end())
+bool CookingQueue::RemoveInternal(MutexLockGuard& ioLock, int inPriority, CookingCommandID inCommandID, RemoveOption inOption)
+{
+	gAssert(ioLock.GetMutex() == &mMutex);
+
+	// Check if the command is in the queue.
+	if ((int)inCommandID.mIndex >= mLinks.Size() || !mLinks[inCommandID.mIndex].mIsInQueue)
 	{
 		gAssert((inOption & RemoveOption::ExpectFound) == false);
 		return false;
 	}
 
-	// Remove it.
-	if (inOption & RemoveOption::KeepOrder)
-	{
-		bucket_it->mCommands.Erase(bucket_it->mCommands.GetIndex(*it));
-	}
-	else
-	{
-		gSwapErase(bucket_it->mCommands, it);
-	}
+	// Find the bucket.
+	auto bucket_it = gFindSorted(mPrioBuckets, inPriority);
+	gAssert(bucket_it != mPrioBuckets.end());
+
+	// Remove it. This always keeps the order.
+	Unlink(*bucket_it, inCommandID);
 
-	mTotalSize--;
 	return true;
 }
 
@@ -453,9 +731,12 @@ void CookingQueue::Clear()
 	LockGuard lock(mMutex);
 
 	for (PrioBucket& bucket : mPrioBuckets)
-		bucket.mCommands.Clear();
+	{
+		while (!bucket.IsEmpty())
+			PopBack(bucket);
+	}
 
-	mTotalSize = 0;
+	gAssert(mTotalSize == 0);
 }
 
 
@@ -466,30 +747,370 @@ int CookingQueue::GetSize() const
 }
 
 
-void CookingThreadsQueue::Push(CookingCommandID inCommandID, PushPosition inPosition/* = PushPosition::Back*/)
+REGISTER_TEST("CookingQueue")
 {
-	const CookingCommand& command = gCookingSystem.GetCommand(inCommandID);
-	int priority = gCookingSystem.GetRule(command.mRuleID).mPriority;
+	CookingQueue queue;
+	LockGuard    lock(queue.mMutex);
+
+	for (uint32 i = 0; i < 10; ++i)
+		queue.PushInternal(lock, 0, { i }, PushPosition::Back);
+
+	// Pushing again to the back doesn't add a duplicate, pushing to the front moves it.
+	queue.PushInternal(lock, 0, { 3 }, PushPosition::Back);
+	TEST_TRUE(queue.mTotalSize == 10);
+	queue.PushInternal(lock, 0, { 9 }, PushPosition::Front);
+	TEST_TRUE(queue.mTotalSize == 10);
+
+	// Order is now 9 0 1 2 3 4 5 6 7 8.
+	CookingQueue::PrioBucket& bucket = queue.mPrioBuckets[0];
+	TEST_TRUE(queue.Seek(bucket, 0) == CookingCommandID{ 9 });
+	TEST_TRUE(queue.Seek(bucket, 5) == CookingCommandID{ 4 });
+	TEST_TRUE(queue.Seek(bucket, 9) == CookingCommandID{ 8 });
+	TEST_TRUE(queue.Seek(bucket, 10) == CookingCommandID::cInvalid());
+
+	// Move the cursor to the middle, then add and remove commands around it.
+	TEST_TRUE(queue.Seek(bucket, 4) == CookingCommandID{ 3 });
+	TEST_TRUE(queue.RemoveInternal(lock, 0, { 1 }, RemoveOption::ExpectFound));	// Before the cursor.
+	TEST_TRUE(queue.RemoveInternal(lock, 0, { 6 }, RemoveOption::ExpectFound));	// After the cursor.
+	TEST_TRUE(queue.RemoveInternal(lock, 0, { 3 }, RemoveOption::ExpectFound));	// The cursor itself.
+	queue.PushInternal(lock, 0, { 10 }, PushPosition::Front);
+	queue.PushInternal(lock, 0, { 11 }, PushPosition::Back);
+	TEST_FALSE(queue.RemoveInternal(lock, 0, { 3 }, RemoveOption::None));
+
+	// Order is now 10 9 0 2 4 5 7 8 11, check every position from the cursor.
+	const uint32 expected[] = { 10, 9, 0, 2, 4, 5, 7, 8, 11 };
+	TEST_TRUE(bucket.mSize == (int)gElemCount(expected));
+	for (int i = 0; i < (int)gElemCount(expected); ++i)
+		TEST_TRUE(queue.Seek(bucket, i) == CookingCommandID{ expected[i] });
+	for (int i = (int)gElemCount(expected) - 1; i >= 0; --i)
+		TEST_TRUE(queue.Seek(bucket, i) == CookingCommandID{ expected[i] });
+
+	// Pop takes from the back.
+	TEST_TRUE(queue.Pop() == CookingCommandID{ 11 });
+	queue.Clear();
+	TEST_TRUE(queue.mTotalSize == 0);
+	TEST_TRUE(queue.Seek(bucket, 0) == CookingCommandID::cInvalid());
+};
 
-	{
-		LockGuard lock(mMutex);
-		PushInternal(lock, priority, inCommandID, inPosition);
 
-		// Make sure the data array stays in sync (makes pop simpler).
-		gEmplaceSorted(mPrioData, priority);
-	}
+REGISTER_BENCHMARK("CookingQueue")
+{
+	// A cook wave: many commands get dirty, then they get clean in a different order than they were queued.
+	constexpr int cCommandCount  = 500'000;
+	constexpr int cPriorityCount = 4;
+
+	CookingQueue queue;
+	LockGuard    lock(queue.mMutex);
+
+	Timer dirty_timer;
+	for (int i = 0; i < cCommandCount; ++i)
+		queue.PushInternal(lock, i % cPriorityCount, { (uint32)i }, PushPosition::Back);
+	double dirty_ms = gTicksToSeconds(dirty_timer.GetTicks()) * 1000.0;
+
+	// Every other command first, then the rest from the end.
+	int   removed_count = 0;
+	Timer clean_timer;
+	for (int i = 0; i < cCommandCount; i += 2)
+		removed_count += queue.RemoveInternal(lock, i % cPriorityCount, { (uint32)i }, RemoveOption::ExpectFound);
+	for (int i = cCommandCount - 1; i > 0; i -= 2)
+		removed_count += queue.RemoveInternal(lock, i % cPriorityCount, { (uint32)i }, RemoveOption::ExpectFound);
+	double clean_ms = gTicksToSeconds(clean_timer.GetTicks()) * 1000.0;
+
+	if (removed_count != cCommandCount || queue.mTotalSize != 0)
+		gAppLogError("Removed %d commands out of %d.", removed_count, cCommandCount);
+
+	gAppLog("%d commands dirtied in %.1f ms, cleaned in %.1f ms.", cCommandCount, dirty_ms, clean_ms);
+}
+
+
+CookingThreadsQueue::CommandData& CookingThreadsQueue::GetCommandData(CookingCommandID inCommandID)
+{
+	if ((int)inCommandID.mIndex >= mCommandData.Size())
+		mCommandData.Resize(gMax((int)inCommandID.mIndex + 1, mCommandData.Size() * 2));
+
+	return mCommandData[inCommandID.mIndex];
+}
+
+
+void CookingThreadsQueue::AddWaiter(CookingCommandID inProducerID, CookingCommandID inWaiterID)
+{
+	// Make sure both exist first, getting one can resize the array.
+	GetCommandData(inProducerID);
+	CommandData& waiter_data = GetCommandData(inWaiterID);
+	waiter_data.mPendingProducerCount++;
+
+	mCommandData[inProducerID.mIndex].mWaiters.PushBack({ inWaiterID, waiter_data.mGeneration });
+}
+
+
+bool CookingThreadsQueue::ReleaseWaiters(CookingCommandID inProducerID)
+{
+	Vector<Waiter> waiters;
+	gSwap(waiters, GetCommandData(inProducerID).mWaiters);
+
+	bool any_ready = false;
+
+	for (const Waiter& waiter : waiters)
+	{
+		CommandData& waiter_data = GetCommandData(waiter.mCommandID);
+
+		// Ignore the waiter if it left the queue since it started waiting.
+		if (waiter_data.mGeneration != waiter.mGeneration)
+			continue;
+
+		gAssert(waiter_data.mStatus == CommandStatus::Blocked);
+		gAssert(waiter_data.mPendingProducerCount > 0);
+
+		if (--waiter_data.mPendingProducerCount > 0)
+			continue;
+
+		// All its producers are done, it can run.
+		waiter_data.mStatus = CommandStatus::Ready;
+		HeapPush(waiter.mCommandID);
+		any_ready = true;
+	}
+
+	return any_ready;
+}
+
+
+void CookingThreadsQueue::HeapPush(CookingCommandID inCommandID)
+{
+	int index = mReadyHeap.Size();
+	mReadyHeap.PushBack(inCommandID);
+	mCommandData[inCommandID.mIndex].mHeapIndex = index;
+
+	HeapUpdate(index);
+}
+
+
+void CookingThreadsQueue::HeapRemove(CookingCommandID inCommandID)
+{
+	CommandData& data  = mCommandData[inCommandID.mIndex];
+	int          index = data.mHeapIndex;
+	int          last  = mReadyHeap.Size() - 1;
+	gAssert(index >= 0 && mReadyHeap[index] == inCommandID);
+
+	HeapSwap(index, last);
+	mReadyHeap.PopBack();
+	data.mHeapIndex = -1;
+
+	// Put the command that took its place back in order.
+	if (index != last)
+		HeapUpdate(index);
+}
+
+
+void CookingThreadsQueue::HeapUpdate(int inIndex)
+{
+	// Move up.
+	while (inIndex > 0)
+	{
+		int parent = (inIndex - 1) / 2;
+		if (!HeapIsBefore(inIndex, parent))
+			break;
+
+		HeapSwap(inIndex, parent);
+		inIndex = parent;
+	}
+
+	// Move down.
+	while (true)
+	{
+		int first = inIndex;
+		int left  = inIndex * 2 + 1;
+		int right = inIndex * 2 + 2;
+
+		if (left < mReadyHeap.Size() && HeapIsBefore(left, first))
+			first = left;
+		if (right < mReadyHeap.Size() && HeapIsBefore(right, first))
+			first = right;
+
+		if (first == inIndex)
+			break;
+
+		HeapSwap(inIndex, first);
+		inIndex = first;
+	}
+}
+
+
+bool CookingThreadsQueue::HeapIsBefore(int inIndexA, int inIndexB) const
+{
+	return mCommandData[mReadyHeap[inIndexA].mIndex].mSortKey > mCommandData[mReadyHeap[inIndexB].mIndex].mSortKey;
+}
+
+
+void CookingThreadsQueue::HeapSwap(int inIndexA, int inIndexB)
+{
+	gSwap(mReadyHeap[inIndexA], mReadyHeap[inIndexB]);
+	mCommandData[mReadyHeap[inIndexA].mIndex].mHeapIndex = inIndexA;
+	mCommandData[mReadyHeap[inIndexB].mIndex].mHeapIndex = inIndexB;
+}
+
+
+bool CookingThreadsQueue::IsWaitingFor(CookingCommandID inWaiterID, CookingCommandID inProducerID)
+{
+	// Go through the waiters of the producer, then their own waiters, etc. until finding inWaiterID.
+	uint32                       visit_mark = ++mVisitCounter;
+	TempVector<CookingCommandID> to_visit;
+	to_visit.PushBack(inProducerID);
+
+	while (!to_visit.Empty())
+	{
+		CookingCommandID command_id = to_visit.Back();
+		to_visit.PopBack();
+
+		for (const Waiter& waiter : mCommandData[command_id.mIndex].mWaiters)
+		{
+			CommandData& waiter_data = mCommandData[waiter.mCommandID.mIndex];
+
+			// Ignore outdated waiters, and the ones already visited.
+			if (waiter_data.mGeneration != waiter.mGeneration || waiter_data.mVisitMark == visit_mark)
+				continue;
+
+			if (waiter.mCommandID == inWaiterID)
+				return true;
+
+			waiter_data.mVisitMark = visit_mark;
+			to_visit.PushBack(waiter.mCommandID);
+		}
+	}
+
+	return false;
+}
+
+
+void CookingThreadsQueue::Push(CookingCommandID inCommandID, PushPosition inPosition/* = PushPosition::Back*/)
+{
+	CookingCommand&       command  = gCookingSystem.GetCommand(inCommandID);
+	int                   priority = gCookingSystem.GetRule(command.mRuleID).mPriority;
+
+	// If the critical path wasn't estimated yet (eg. new command), at least use the duration of this command.
+	uint32 critical_path_ms = command.mCriticalPathMs != 0 ? command.mCriticalPathMs : command.GetCookDurationEstimateMs();
+
+	// The commands producing our inputs, and the ones using our outputs. PushInternal only keeps the ones that are in the queue.
+	TempVector<CookingCommandID> producers;
+	for (FileID file_id : command.GetAllInputs())
+		for (CookingCommandID producer_id : file_id.GetFile().mOutputOf)
+			producers.PushBack(producer_id);
+
+	TempVector<CookingCommandID> consumers;
+	for (FileID file_id : command.GetAllOutputs())
+		for (CookingCommandID consumer_id : file_id.GetFile().mInputOf)
+			consumers.PushBack(consumer_id);
+
+	bool notify = false;
+
+	{
+		LockGuard lock(mMutex);
+
+		// Copy the dep file inputs/outputs for the cooking threads. If the command isn't in the queue (nor cooking), nothing reads the copies,
+		// and it can't be popped before the lock is released.
+		if (GetCommandData(inCommandID).mStatus == CommandStatus::None)
+		{
+			command.mCookDepFileInputs  = command.mDepFileInputs;
+			command.mCookDepFileOutputs = command.mDepFileOutputs;
+		}
+
+		notify = PushInternal(lock, inCommandID, priority, critical_path_ms, producers, consumers, inPosition);
+	}
 
 	// Wake up one thread to work on this.
-	mBarrier.NotifyOne();
+	if (notify)
+		mBarrier.NotifyOne();
+}
+
+
+bool CookingThreadsQueue::PushInternal(MutexLockGuard& ioLock, CookingCommandID inCommandID, int inPriority, uint32 inCriticalPathMs, 
+                                       Span<const CookingCommandID> inProducers, Span<const CookingCommandID> inConsumers, PushPosition inPosition)
+{
+	gAssert(ioLock.GetMutex() == &mMutex);
+
+	// Note: don't keep a reference to the CommandData, getting the data of other commands can resize the array.
+	switch (GetCommandData(inCommandID).mStatus)
+	{
+	case CommandStatus::Ready:
+	case CommandStatus::Blocked:
+	{
+		// Already in the queue, this only moves it if it needs to go to the front.
+		if (inPosition == PushPosition::Front)
+		{
+			CommandData& data = mCommandData[inCommandID.mIndex];
+			data.mSortKey.mFrontOrder = ++mPushCounter;
+
+			if (data.mStatus == CommandStatus::Ready)
+				HeapUpdate(data.mHeapIndex);
+		}
+		return false;
+	}
+	case CommandStatus::Cooking:
+		// Its dirty state will be updated once it's finished, which will push it again if necessary.
+		return false;
+	case CommandStatus::None:
+		break;
+	}
+
+	gAssert(mCommandData[inCommandID.mIndex].mPendingProducerCount == 0);
+
+	// Wait for the commands producing our inputs, if they are queued or cooking, whatever their priority.
+	// Note: The command has no waiters yet, so this can't make a cycle.
+	for (CookingCommandID producer_id : inProducers)
+	{
+		if (producer_id == inCommandID || GetCommandData(producer_id).mStatus == CommandStatus::None)
+			continue;
+
+		AddWaiter(producer_id, inCommandID);
+	}
+
+	// Make the commands using our outputs wait for us, if they haven't started cooking yet.
+	for (CookingCommandID consumer_id : inConsumers)
+	{
+		if (consumer_id == inCommandID)
+			continue;
+
+		CommandData& consumer_data = GetCommandData(consumer_id);
+		if (consumer_data.mStatus != CommandStatus::Ready && consumer_data.mStatus != CommandStatus::Blocked)
+			continue;
+
+		// If we're (indirectly) waiting for that command, it can't wait for us too. This only happens if the inputs/outputs make a cycle.
+		// Note: Only possible if we're waiting for anything at all, which is rare enough to not worry about the cost of the search.
+		if (mCommandData[inCommandID.mIndex].mPendingProducerCount > 0 && IsWaitingFor(inCommandID, consumer_id))
+			continue;
+
+		// Take it out of the ready heap if it was ready.
+		if (consumer_data.mStatus == CommandStatus::Ready)
+		{
+			HeapRemove(consumer_id);
+			consumer_data.mStatus = CommandStatus::Blocked;
+		}
+
+		AddWaiter(inCommandID, consumer_id);
+	}
+
+	CommandData& data = mCommandData[inCommandID.mIndex];
+	data.mSortKey.mFrontOrder     = inPosition == PushPosition::Front ? ++mPushCounter : 0;
+	data.mSortKey.mCriticalPathMs = inCriticalPathMs;
+	data.mSortKey.mPriority       = -inPriority;
+	data.mSortKey.mPushOrder      = ++mPushCounter;
+
+	mTotalSize++;
+
+	if (data.mPendingProducerCount > 0)
+	{
+		data.mStatus = CommandStatus::Blocked;
+		return false;
+	}
+
+	data.mStatus = CommandStatus::Ready;
+	HeapPush(inCommandID);
+	return true;
 }
 
 
 CookingCommandID CookingThreadsQueue::Pop()
 {
 	LockGuard lock(mMutex);
-	gAssert(mPrioData.Size() == mPrioBuckets.Size());
-
-	int  non_empty_bucket_index = -1;
 
 	while (true)
 	{
@@ -498,52 +1119,132 @@ CookingCommandID CookingThreadsQueue::Pop()
 		if (mStopRequested)
 			break;
 
+		if (!mReadyHeap.Empty())
+		{
+			// Pop the command with the longest critical path.
+			CookingCommandID id = mReadyHeap[0];
+			HeapRemove(id);
+			mTotalSize--;
+
+			// Commands waiting for it will stay blocked until it's finished.
+			mCommandData[id.mIndex].mStatus = CommandStatus::Cooking;
+
+			return id;
+		}
+
 		// Wait for work.
 		mBarrier.Wait(lock);
+	}
 
-		// Find the first bucket containing command that can run.
-		for (int prio_index = 0; prio_index < mPrioBuckets.Size(); ++prio_index)
-		{
-			PrioBucket& bucket = mPrioBuckets[prio_index];
-			PrioData&   data   = mPrioData[prio_index];
+	return CookingCommandID::cInvalid();
+}
 
-			// If this bucket is empty but some commands are still being cooked, wait until they're finished before checking the next buckets.
-			if (bucket.mCommands.Empty() && data.mCommandsBeingCooked > 0)
-			{
-				// Go back to waiting and start over if more work is added or these commands are finished.
-				break;
-			}
 
-			if (!bucket.mCommands.Empty())
-			{
-				// Found one!
-				non_empty_bucket_index = (int)(&bucket - &mPrioBuckets.Front());
-				break;
-			}
+void CookingThreadsQueue::PopBatch(CookingRuleID inRuleID, int inMaxCount, Vector<CookingCommandID>& ioCommands)
+{
+	LockGuard lock(mMutex);
+
+	// Pop in order until the batch is full, the commands of other rules are put back in the heap afterwards.
+	// Give up after skipping a few times the batch size, a smaller batch is better than keeping the lock for long.
+	const int                    max_skipped_count = inMaxCount * 8;
+	TempVector<CookingCommandID> skipped_commands;
+	int                          batch_count       = 0;
+
+	while (batch_count < inMaxCount && !mReadyHeap.Empty() && skipped_commands.Size() < max_skipped_count)
+	{
+		CookingCommandID command_id = mReadyHeap[0];
+		HeapRemove(command_id);
+
+		const CookingCommand& command = gCookingSystem.GetCommand(command_id);
+		if (command.mRuleID != inRuleID || (command.mDirtyState & CookingCommand::AllStaticInputsMissing) != 0)
+		{
+			skipped_commands.PushBack(command_id);
+			continue;
 		}
 
-		// If we've found a bucket with commands that can run, exit the outer loop.
-		if (non_empty_bucket_index != -1)
-			break;
+		mTotalSize--;
+
+		// Commands waiting for it will stay blocked until it's finished.
+		mCommandData[command_id.mIndex].mStatus = CommandStatus::Cooking;
+
+		ioCommands.PushBack(command_id);
+		batch_count++;
 	}
-	
-	if (non_empty_bucket_index != -1)
+
+	// Their sort keys didn't change, they go back to the same place.
+	for (CookingCommandID command_id : skipped_commands)
+		HeapPush(command_id);
+}
+
+
+bool CookingThreadsQueue::Remove(CookingCommandID inCommandID, RemoveOption inOption/* = RemoveOption::None*/)
+{
+	bool notify = false;
+
 	{
-		PrioBucket&      bucket = mPrioBuckets[non_empty_bucket_index];
-		PrioData&        data   = mPrioData[non_empty_bucket_index];
+		LockGuard    lock(mMutex);
+		CommandData& data = GetCommandData(inCommandID);
 
-		// Pop a command.
-		CookingCommandID id     = bucket.mCommands.Back();
-		bucket.mCommands.PopBack();
+		if (data.mStatus != CommandStatus::Ready && data.mStatus != CommandStatus::Blocked)
+		{
+			// Not in the queue, or a worker already grabbed it.
+			gAssert((inOption & RemoveOption::ExpectFound) == false);
+			return false;
+		}
+
+		if (data.mStatus == CommandStatus::Ready)
+			HeapRemove(inCommandID);
+
+		data.mStatus               = CommandStatus::None;
+		data.mPendingProducerCount = 0;
+		data.mGeneration++;
 		mTotalSize--;
 
-		// Remember there's now one command ongoing.
-		data.mCommandsBeingCooked++;
+		// It won't cook, so the commands waiting for it don't need to wait anymore.
+		notify = ReleaseWaiters(inCommandID);
+	}
+
+	// Wake up the threads if some commands became ready.
+	if (notify)
+		mBarrier.NotifyAll();
+
+	return true;
+}
+
+
+void CookingThreadsQueue::Clear()
+{
+	LockGuard lock(mMutex);
 
-		return id;
+	for (CookingCommandID command_id : mReadyHeap)
+		mCommandData[command_id.mIndex].mHeapIndex = -1;
+
+	mReadyHeap.Clear();
+
+	// Reset everything that isn't currently cooking. The Waiters of the cooking commands become outdated and will be ignored.
+	for (CommandData& data : mCommandData)
+	{
+		if (data.mStatus == CommandStatus::Cooking)
+			continue;
+
+		if (data.mStatus != CommandStatus::None)
+		{
+			data.mStatus               = CommandStatus::None;
+			data.mPendingProducerCount = 0;
+			data.mGeneration++;
+		}
+
+		data.mWaiters.Clear();
 	}
 
-	return CookingCommandID::cInvalid();
+	mTotalSize = 0;
+}
+
+
+int CookingThreadsQueue::GetSize() const
+{
+	LockGuard lock(mMutex);
+	return mTotalSize;
 }
 
 
@@ -551,14 +1252,13 @@ void CookingThreadsQueue::FinishedCooking(const CookingLogEntry& inLogEntry)
 {
 #ifdef ASSERTS_ENABLED
 	{
-		// At this poing the command should have finished cooking and be in either Success/Error.
+		// At this poing the command should have finished cooking and be in either Success/Error/Cancelled.
 		CookingState cooking_state = inLogEntry.mCookingState.Load();
-		gAssert(cooking_state == CookingState::Success || cooking_state == CookingState::Error);
+		gAssert(cooking_state == CookingState::Success || cooking_state == CookingState::Error || cooking_state == CookingState::Cancelled);
 	}
 #endif
 
 	const CookingCommand& command  = gCookingSystem.GetCommand(inLogEntry.mCommandID);
-	int                   priority = gCookingSystem.GetRule(command.mRuleID).mPriority;
 	bool                  notify   = false;
 
 	// When running without UI, print a line for each cooked command.
@@ -570,23 +1270,7 @@ void CookingThreadsQueue::FinishedCooking(const CookingLogEntry& inLogEntry)
 
 	{
 		LockGuard lock(mMutex);
-
-		// Find the bucket.
-		auto bucket_it = gFindSorted(mPrioBuckets, priority);
-		if (bucket_it == mPrioBuckets.end())
-		{
-			gAssert(false);
-			return;
-		}
-
-		// Update the number of commands still cooking.
-		int index = mPrioBuckets.GetIndex(*bucket_it);
-		PrioData& data  = mPrioData[index];
-		data.mCommandsBeingCooked--;
-
-		// If this was the last command being cooked for this prio, notify any waiting thread.
-		if (data.mCommandsBeingCooked == 0)
-			notify = true;
+		notify = FinishedCookingInternal(lock, inLogEntry.mCommandID);
 	}
 
 	// Notify outside of the lock, no reason to wake threads to immediately make them wait for the lock.
@@ -595,6 +1279,21 @@ void CookingThreadsQueue::FinishedCooking(const CookingLogEntry& inLogEntry)
 }
 
 
+bool CookingThreadsQueue::FinishedCookingInternal(MutexLockGuard& ioLock, CookingCommandID inCommandID)
+{
+	gAssert(ioLock.GetMutex() == &mMutex);
+
+	CommandData& data = GetCommandData(inCommandID);
+	gAssert(data.mStatus == CommandStatus::Cooking);
+
+	data.mStatus = CommandStatus::None;
+	data.mGeneration++;
+
+	// Unblock the commands that were waiting for this one.
+	return ReleaseWaiters(inCommandID);
+}
+
+
 void CookingThreadsQueue::RequestStop()
 {
 	{
@@ -605,6 +1304,107 @@ void CookingThreadsQueue::RequestStop()
 }
 
 
+REGISTER_BENCHMARK("CookingThreadsQueue")
+{
+	// A cook wave of commands with random priorities, each using the outputs of up to two of the previous commands (whatever their priority).
+	// Everything is pushed first, then the threads pop and finish the commands, checking that their producers were finished before.
+	constexpr int cCommandCount     = 50'000;
+	constexpr int cPriorityCount    = 4;
+	constexpr int cMaxProducerCount = 2;
+	const int     thread_count      = gClamp(gThreadHardwareConcurrency() - 1, 1, 64);
+
+	struct SyntheticCommand
+	{
+		int                      mPriority       = 0;
+		uint32                   mCriticalPathMs = 0;
+		Vector<CookingCommandID> mProducers;
+		Vector<CookingCommandID> mConsumers;
+	};
+
+	Vector<SyntheticCommand> commands;
+	commands.Resize(cCommandCount);
+	for (int i = 0; i < cCommandCount; ++i)
+	{
+		commands[i].mPriority       = (int)(gRand32() % cPriorityCount);
+		commands[i].mCriticalPathMs = gRand32() % 1000;
+
+		int producer_count = i == 0 ? 0 : (int)(gRand32() % (cMaxProducerCount + 1));
+		for (int p = 0; p < producer_count; ++p)
+		{
+			int producer = i - 1 - (int)(gRand32() % (uint32)gMin(i, 64));
+			commands[i].mProducers.PushBack({ (uint32)producer });
+			commands[producer].mConsumers.PushBack({ (uint32)i });
+		}
+	}
+
+	// Push in a random order, so that waiters get added both when pushing producers and when pushing consumers.
+	Vector<int> push_order;
+	for (int i = 0; i < cCommandCount; ++i)
+		push_order.PushBack(i);
+	for (int i = cCommandCount - 1; i > 0; --i)
+		gSwap(push_order[i], push_order[gRand32() % (uint32)(i + 1)]);
+
+	CookingThreadsQueue queue;
+
+	Timer push_timer;
+	{
+		LockGuard lock(queue.mMutex);
+		for (int index : push_order)
+		{
+			const SyntheticCommand& command = commands[index];
+			queue.PushInternal(lock, { (uint32)index }, command.mPriority, command.mCriticalPathMs, command.mProducers, command.mConsumers, PushPosition::Back);
+		}
+	}
+	double push_ms = gTicksToSeconds(push_timer.GetTicks()) * 1000.0;
+
+	Vector<uint8> finished;              // Protected by the queue mutex.
+	finished.Resize(cCommandCount);
+	AtomicInt32   finished_count    = 0;
+	AtomicInt32   wrong_order_count = 0;
+
+	Timer  cook_timer;
+	Thread threads[64];
+	for (int thread_index = 0; thread_index < thread_count; ++thread_index)
+	{
+		threads[thread_index].Create({ .mName = "Cooking Thread" }, [&](Thread&)
+		{
+			CookingCommandID command_id;
+			while ((command_id = queue.Pop()).IsValid())
+			{
+				bool notify = false;
+				{
+					LockGuard lock(queue.mMutex);
+
+					for (CookingCommandID producer_id : commands[command_id.mIndex].mProducers)
+						if (!finished[producer_id.mIndex])
+							wrong_order_count.Add(1);
+
+					finished[command_id.mIndex] = 1;
+					notify = queue.FinishedCookingInternal(lock, command_id);
+				}
+
+				if (notify)
+					queue.mBarrier.NotifyAll();
+
+				if (finished_count.Add(1) + 1 == cCommandCount)
+					queue.RequestStop();
+			}
+		});
+	}
+
+	for (Thread& thread : Span(threads, thread_count))
+		thread.Join();
+
+	double cook_ms = gTicksToSeconds(cook_timer.GetTicks()) * 1000.0;
+
+	if (finished_count.Load() != cCommandCount || wrong_order_count.Load() != 0)
+		gAppLogError("CookingThreadsQueue: %d commands out of %d finished, %d popped before one of their producers finished.", 
+			finished_count.Load(), cCommandCount, wrong_order_count.Load());
+
+	gAppLog("CookingThreadsQueue: %d commands pushed in %.1f ms, popped and finished by %d threads in %.1f ms.", cCommandCount, push_ms, thread_count, cook_ms);
+}
+
+
 void CookingSystem::CreateCommandsForFile(FileInfo& ioFile)
 {
 	// Directories can't have commands.
@@ -617,12 +1417,27 @@ void CookingSystem::CreateCommandsForFile(FileInfo& ioFile)
 
 	ioFile.mCommandsCreated = true;
 
-	for (const CookingRule& rule : mRules)
+	Vector<NewCommand> new_commands;
+	MatchRules(ioFile, new_commands);
+
+	for (NewCommand& new_command : new_commands)
+		AddCommand(new_command);
+}
+
+
+void CookingSystem::MatchRules(const FileInfo& inFile, Vector<NewCommand>& outCommands)
+{
+	TempVector<CookingRuleID> candidate_rules;
+	mRuleIndex.GetCandidateRules(inFile, candidate_rules);
+
+	for (CookingRuleID rule_id : candidate_rules)
 	{
+		const CookingRule& rule = GetRule(rule_id);
+
 		bool pass = false;
 		for (auto& filter : rule.mInputFilters)
 		{
-			if (filter.Pass(ioFile))
+			if (filter.Pass(inFile))
 			{
 				pass = true;
 				break;
@@ -632,106 +1447,301 @@ void CookingSystem::CreateCommandsForFile(FileInfo& ioFile)
 		if (!pass)
 			continue;
 
-		CookingCommandID command_id;
+		bool                success = true;
+		Vector<FileID>      inputs;
+		Vector<FileID>      outputs;
+		Vector<MissingFile> missing_files;
 
-		// Create the command.
+		// Find the file of a path template and add it to ioFiles (if it's not already there).
+		// If the file isn't known yet, only remember its path. Adding it here would give it a FileID that depends on thread scheduling.
+		auto find_file = [&](const CommandTemplate& inTemplate, Vector<FileID>& ioFiles, bool inIsOutput)
 		{
-			bool   success = true;
-			FileID dep_file;
+			FileRepo*  repo = nullptr;
+			TempString path;
+			if (!inTemplate.FormatFilePath(inFile, repo, path) || repo == nullptr) // Without a Repo variable, there's no way to know where the file is.
+			{
+				success = false;
+				return;
+			}
 
-			// Get the dep file (if needed).
-			if (rule.UseDepFile())
+			gNormalizePath(path);
+			PathHash path_hash = gHashPath(repo->mRootPathHash, path);
+
+			if (FileID file_id = gFileSystem.FindFileIDByPathHash(path_hash); file_id.IsValid())
 			{
-				dep_file = gGetOrAddFileFromFormat(rule.mDepFilePath, ioFile);
-				if (dep_file.IsValid())
-					dep_file.GetFile().mIsDepFile = true;
-				else
-					success = false;
+				gPushBackUnique(ioFiles, file_id);
+				return;
 			}
 
-			// Add the main input file.
-			// Note: order is important, the main input file is always the first input.
-			Vector<FileID> inputs;
-			inputs.PushBack(ioFile.mID);
+			for (const MissingFile& missing_file : missing_files)
+				if (missing_file.mIsOutput == inIsOutput && missing_file.mPathHash == path_hash)
+					return;
+
+			missing_files.PushBack({ repo, String(path), path_hash, inIsOutput, ioFiles.Size() });
+			ioFiles.PushBack(FileID::cInvalid());
+		};
+
+		// If there is an output dep file, add it to the outputs.
+		// Note: order is important, the dep file is always the first output.
+		if (rule.UseDepFile())
+			find_file(rule.mDepFilePathTemplate, outputs, true);
+
+		// Add the main input file.
+		// Note: order is important, the main input file is always the first input.
+		inputs.PushBack(inFile.mID);
+
+		// Get the additional input files.
+		for (const CommandTemplate& path : rule.mInputPathTemplates)
+			find_file(path, inputs, false);
+
+		// Add the ouput files.
+		for (const CommandTemplate& path : rule.mOutputPathTemplates)
+			find_file(path, outputs, true);
 
-			// Get the additional input files.
-			for (StringView path : rule.mInputPaths)
+		// Most problems should be caught during ValidateRules,
+		// but if something goes wrong anyway, log an error and ignore this rule.
+		if (!success)
+		{
+			gAppLogError("Failed to create Rule %s command for %s", rule.mName.AsCStr(), inFile.ToString().AsCStr());
+			continue;
+		}
+
+		outCommands.PushBack({ rule.mID, gMove(inputs), gMove(outputs), gMove(missing_files) });
+
+		// TODO: add validation
+		// - a file cannot be the input/output of the same command
+		// - all the inputs of a command can only be outputs of commands with lower prio (ie. that build before)
+
+		// Check if we need to continue to try more rules for this file.
+		if (!rule.mMatchMoreRules)
+			break;
+	}
+}
+
+
+void CookingSystem::AddCommand(NewCommand& ioNewCommand)
+{
+	const CookingRule& rule = GetRule(ioNewCommand.mRuleID);
+
+	// Add the files that didn't exist when the rules were matched.
+	// Note: Another command added before this one might have added them already, GetOrAddFile finds them in that case.
+	for (const MissingFile& missing_file : ioNewCommand.mMissingFiles)
+	{
+		FileID file_id = missing_file.mRepo->GetOrAddFile(missing_file.mPath, FileType::File, {}).mID;
+		(missing_file.mIsOutput ? ioNewCommand.mOutputs : ioNewCommand.mInputs)[missing_file.mIndex] = file_id;
+	}
+
+	// The dep file is always the first output.
+	if (rule.UseDepFile())
+		gFileSystem.GetFile(ioNewCommand.mOutputs[0]).mIsDepFile = true;
+
+	// Add the command to the global list.
+	CookingCommandID command_id;
+	{
+		auto lock = mCommands.Lock();
+
+		// Build the ID now that we have the mutex.
+		command_id              = CookingCommandID{ (uint32)mCommands.SizeRelaxed() };
+
+		// Create the command.
+		CookingCommand& command = mCommands.Emplace(lock);
+		command.mID             = command_id;
+		command.mRuleID         = rule.mID;
+		command.mInputs         = gMove(ioNewCommand.mInputs);
+		command.mOutputs        = gMove(ioNewCommand.mOutputs);
+	}
+
+	// Update stats.
+	rule.mCommandCount.Add(1);
+
+	// Let all the input and ouputs know that they are referenced by this command.
+	const CookingCommand& command = GetCommand(command_id);
+
+	for (FileID file_id : command.mInputs)
+		gFileSystem.GetFile(file_id).mInputOf.PushBack(command.mID);
+
+	for (FileID file_id : command.mOutputs)
+		gFileSystem.GetFile(file_id).mOutputOf.PushBack(command.mID);
+}
+
+
+// Call inFunction(index) for every index in [0, inCount), on temporary worker threads. Return once they're all done.
+// The indices are handed out in order, but the calls can finish in any order.
+template <typename taFunction>
+static void sParallelFor(const char* inThreadName, int inCount, taFunction&& inFunction)
+{
+	constexpr int cMaxThreadCount = 64;
+	const int     thread_count    = gMin(gMin(gThreadHardwareConcurrency(), cMaxThreadCount), inCount);
+
+	// Not worth starting threads.
+	if (thread_count <= 1)
+	{
+		for (int index = 0; index < inCount; ++index)
+			inFunction(index);
+		return;
+	}
+
+	Mutex  mutex;
+	int    next_index = 0;
+	Thread threads[cMaxThreadCount];
+	for (int thread_index = 0; thread_index < thread_count; ++thread_index)
+	{
+		threads[thread_index].Create({ .mName = inThreadName, .mTempMemSize = 1_MiB }, [&](Thread&) 
+		{
+			while (true)
 			{
-				FileID file = gGetOrAddFileFromFormat(path, ioFile);
-				if (!file.IsValid())
+				int index;
 				{
-					success = false;
-					continue;
+					LockGuard lock(mutex);
+					if (next_index == inCount)
+						return;
+
+					index = next_index++;
 				}
 
-				gPushBackUnique(inputs, file);
+				inFunction(index);
 			}
+		});
+	}
+
+	for (auto& thread : Span(threads, thread_count))
+		thread.Join();
+}
+
+
+void CookingSystem::CreateCommandsForAllFiles()
+{
+	// Split the files into ranges processed on worker threads.
+	constexpr int cFilesPerRange = 4096;
 
-			// If there is an output dep file, add it to the outputs.
-			// Note: order is important, the dep file is always the first output.
-			Vector<FileID> outputs;
-			if (dep_file.IsValid())
-				outputs.PushBack(dep_file);
+	struct FileRange
+	{
+		uint32 mRepoIndex = 0;
+		uint32 mBegin     = 0;
+		uint32 mEnd       = 0;
+	};
+
+	Vector<uint32> processed_file_count; // Per repo.
+	processed_file_count.Resize(gFileSystem.GetRepoCount());
 
-			// Add the ouput files.
-			for (StringView path : rule.mOutputPaths)
+	// Matching rules can add files (eg. outputs that don't exist yet, which can be the inputs of other rules).
+	// Do more passes until there are no new files.
+	while (true)
+	{
+		Vector<FileRange> ranges;
+		for (const FileRepo& repo : gFileSystem.GetRepos())
+		{
+			uint32 file_count = (uint32)repo.mFiles.SizeRelaxed();
+			for (uint32 begin = processed_file_count[repo.mIndex]; begin < file_count; begin += cFilesPerRange)
+				ranges.PushBack({ repo.mIndex, begin, gMin(begin + cFilesPerRange, file_count) });
+
+			processed_file_count[repo.mIndex] = file_count;
+		}
+
+		if (ranges.Empty())
+			break;
+
+		// Match the rules and get (or add) the input/output files on the worker threads.
+		// This only reads the FileInfos (adding files is thread safe), the commands are not added yet.
+		Vector<Vector<NewCommand>> new_commands_per_range;
+		new_commands_per_range.Resize(ranges.Size());
+
+		sParallelFor("Create Commands Thread", ranges.Size(), [&](int inRangeIndex)
+		{
+			const FileRange& range = ranges[inRangeIndex];
+			const FileRepo&  repo  = gFileSystem.GetRepo(FileID{ range.mRepoIndex, 0 });
+
+			for (uint32 file_index = range.mBegin; file_index < range.mEnd; ++file_index)
 			{
-				FileID file = gGetOrAddFileFromFormat(path, ioFile);
-				if (!file.IsValid())
-				{
-					success = false;
+				const FileInfo& file = repo.mFiles[file_index];
+
+				if (file.IsDirectory() || file.mCommandsCreated)
 					continue;
-				}
 
-				gPushBackUnique(outputs, file);
+				MatchRules(file, new_commands_per_range[inRangeIndex]);
 			}
+		});
 
-			// Most problems should be caught during ValidateRules,
-			// but if something goes wrong anyway, log an error and ignore this rule.
-			if (!success)
+		// Add the commands in file order, so that the command IDs and the order of the InputOf/OutputOf lists
+		// don't depend on how the threads were scheduled.
+		for (int range_index = 0; range_index < ranges.Size(); ++range_index)
+		{
+			const FileRange& range = ranges[range_index];
+			FileRepo&        repo  = gFileSystem.GetRepo(FileID{ range.mRepoIndex, 0 });
+
+			for (uint32 file_index = range.mBegin; file_index < range.mEnd; ++file_index)
 			{
-				gAppLogError("Failed to create Rule %s command for %s", rule.mName.AsCStr(), ioFile.ToString().AsCStr());
-				continue;
+				FileInfo& file = repo.mFiles[file_index];
+				if (!file.IsDirectory())
+					file.mCommandsCreated = true;
 			}
 
-			// Add the command to the global list.
-			{
-				auto lock = mCommands.Lock();
+			for (NewCommand& new_command : new_commands_per_range[range_index])
+				AddCommand(new_command);
+		}
+	}
+}
 
-				// Build the ID now that we have the mutex.
-				command_id              = CookingCommandID{ (uint32)mCommands.SizeRelaxed() };
 
-				// Create the command.
-				CookingCommand& command = mCommands.Emplace(lock);
-				command.mID             = command_id;
-				command.mRuleID         = rule.mID;
-				command.mInputs         = gMove(inputs);
-				command.mOutputs        = gMove(outputs);
-			}
+REGISTER_BENCHMARK("CreateCommands")
+{
+	// One rule making a .dds for every .png of a repo that only exists in memory. The outputs don't exist yet, so every command adds a file.
+	// Note: CreateCommandsForAllFiles goes through the files of all the repos, run this benchmark alone to not count the ones of the other benchmarks.
+	constexpr int cDirCount         = 200;
+	constexpr int cFilesPerDirCount = 500;
 
-			// Update stats.
-			rule.mCommandCount.Add(1);
-		}
+	FileRepo& repo = gFileSystem.AddRepo("CreateCommands", gCreateBenchmarkDirectory("CreateCommands"));
 
-		// Let all the input and ouputs know that they are referenced by this command.
-		{
-			const CookingCommand& command = GetCommand(command_id);
+	for (int dir_index = 0; dir_index < cDirCount; ++dir_index)
+	{
+		FileID dir_id = repo.GetOrAddFile(repo.mRootDirID, gTempFormat("dir_%03d", dir_index), FileType::Directory, {}).mID;
+		for (int file_index = 0; file_index < cFilesPerDirCount; ++file_index)
+			repo.GetOrAddFile(dir_id, gTempFormat("file_%04d.png", file_index), FileType::File, {});
+	}
 
-			for (FileID file_id : command.mInputs)
-				gFileSystem.GetFile(file_id).mInputOf.PushBack(command.mID);
+	int source_file_count = repo.mFiles.Size();
 
-			for (FileID file_id : command.mOutputs)
-				gFileSystem.GetFile(file_id).mOutputOf.PushBack(command.mID);
+	CookingRule& rule = gCookingSystem.AddRule();
+	rule.mName        = "CreateCommands";
+
+	InputFilter& filter = rule.mInputFilters.EmplaceBack();
+	filter.mRepoIndex   = repo.mIndex;
+	filter.mPathPattern = "*.png";
+	filter.mCompiledPathPattern.Compile(filter.mPathPattern);
+
+	if (!rule.mOutputPathTemplates.EmplaceBack().Compile(R"({Repo:CreateCommands}out\{Dir}{File}.dds)"))
+	{
+		gAppLogError("CreateCommands: failed to compile the output path.");
+		return;
+	}
+
+	gCookingSystem.BuildRuleIndex();
+
+	Timer timer;
+	gCookingSystem.CreateCommandsForAllFiles();
+	double create_ms = gTicksToSeconds(timer.GetTicks()) * 1000.0;
+
+	// The outputs are added in the order of their input files, whatever the thread that matched the rules.
+	constexpr int cExpectedCommandCount = cDirCount * cFilesPerDirCount;
+	int           command_count         = 0;
+	uint32        previous_output_index = 0;
+	bool          in_order              = true;
+	for (int file_index = 0; file_index < source_file_count; ++file_index)
+	{
+		for (CookingCommandID command_id : repo.mFiles[file_index].mInputOf)
+		{
+			FileID output_id = gCookingSystem.GetCommand(command_id).mOutputs[0];
+			in_order         = in_order && output_id.mFileIndex > previous_output_index;
+
+			previous_output_index = output_id.mFileIndex;
+			command_count++;
 		}
+	}
 
-		// TODO: add validation
-		// - a file cannot be the input/output of the same command
-		// - all the inputs of a command can only be outputs of commands with lower prio (ie. that build before)
+	if (command_count != cExpectedCommandCount || !in_order)
+		gAppLogError("CreateCommands: %d commands created instead of %d, outputs %s.", command_count, cExpectedCommandCount, in_order ? "in order" : "not in order");
 
-		// Check if we need to continue to try more rules for this file.
-		if (!rule.mMatchMoreRules)
-			break;
-	}	
+	gAppLog("CreateCommands: %d commands (and as many new output files) in %.1f ms.", command_count, create_ms);
 }
 
 
@@ -760,6 +1770,14 @@ CookingCommand* CookingSystem::FindCommandByMainInput(CookingRuleID inRule, File
 }
 
 
+// Compile the template and check that it can be formatted (with a dummy file). Return false if the format string is invalid.
+static bool sCompileCommandTemplate(StringView inFormatStr, const FileInfo& inDummyFile, CommandTemplate& outTemplate, StringView inResponseFilePath = {})
+{
+	TempString dummy_result;
+	return outTemplate.Compile(inFormatStr) && outTemplate.Format(inDummyFile, dummy_result, inResponseFilePath);
+}
+
+
 bool CookingSystem::ValidateRules()
 {
 	TempHashSet<StringView> all_names;
@@ -775,7 +1793,7 @@ bool CookingSystem::ValidateRules()
 		errors++;
 	}
 
-	for (const CookingRule& rule : rules)
+	for (CookingRule& rule : mRules)
 	{
 		// Validate the name.
 		if (!rule.mName.Empty())
@@ -813,28 +1831,61 @@ bool CookingSystem::ValidateRules()
 			}
 		}
 
-		// Dummy file info and string use to test path formatting.
-		FileInfo   dummy_file(FileID{ 0, 0 }, "dir\\dummy.txt", Hash128{ 0, 0 }, FileType::File, {});
-		TempString dummy_result;
+		// Dummy file info use to test path formatting.
+		FileInfo   dummy_file(FileID{ 0, 0 }, "dir\\dummy.txt", Hash128{ 0, 0 }, FileType::File, {}, FileID::cInvalid());
 
 		// Validate the command line.
-		if (rule.mCommandType == CommandType::CommandLine && !gFormatCommandString(rule.mCommandLine, dummy_file, dummy_result))
+		if (rule.mCommandType == CommandType::CommandLine && !sCompileCommandTemplate(rule.mCommandLine, dummy_file, rule.mCommandLineTemplate))
 		{
 			errors++;
 			gAppLogError(R"(Rule %s: Failed to parse CommandLine "%s")", rule.mName.AsCStr(), rule.mCommandLine.AsCStr());
 		}
 
+		// Validate the batch size and command line.
+		if (rule.mBatchSize < 1)
+		{
+			errors++;
+			gAppLogError(R"(Rule %s: BatchSize must be at least 1.)", rule.mName.AsCStr());
+		}
+		else if (rule.IsBatched() && !sCompileCommandTemplate(rule.mBatchCommandLine, dummy_file, rule.mBatchCommandLineTemplate, "dummy.rsp"))
+		{
+			errors++;
+			gAppLogError(R"(Rule %s: Failed to parse BatchCommandLine "%s")", rule.mName.AsCStr(), rule.mBatchCommandLine.AsCStr());
+		}
+
+		// Validate the time out.
+		if (rule.mTimeout < 0)
+		{
+			errors++;
+			gAppLogError(R"(Rule %s: Timeout can't be negative.)", rule.mName.AsCStr());
+		}
+
+		// Validate the worker command line.
+		if (rule.UseWorkers() && !sCompileCommandTemplate(rule.mWorkerCommandLine, dummy_file, rule.mWorkerCommandLineTemplate))
+		{
+			errors++;
+			gAppLogError(R"(Rule %s: Failed to parse WorkerCommandLine "%s")", rule.mName.AsCStr(), rule.mWorkerCommandLine.AsCStr());
+		}
+
 		// Validate the dep file path.
-		if (rule.UseDepFile() && !gFormatCommandString(rule.mDepFilePath, dummy_file, dummy_result))
+		if (rule.UseDepFile() && !sCompileCommandTemplate(rule.mDepFilePath, dummy_file, rule.mDepFilePathTemplate))
 		{
 			errors++;
 			gAppLogError(R"(Rule %s: Failed to parse DepFilePath "%s")", rule.mName.AsCStr(), rule.mDepFilePath.AsCStr());
 		}
 
+		// Validate the dep file command line.
+		if (!rule.mDepFileCommandLine.Empty() && !sCompileCommandTemplate(rule.mDepFileCommandLine, dummy_file, rule.mDepFileCommandLineTemplate))
+		{
+			errors++;
+			gAppLogError(R"(Rule %s: Failed to parse DepFileCommandLine "%s")", rule.mName.AsCStr(), rule.mDepFileCommandLine.AsCStr());
+		}
+
 		// Validate the input paths.
+		rule.mInputPathTemplates.Clear();
 		for (int i = 0; i < rule.mInputPaths.Size(); ++i)
 		{
-			if (!gFormatCommandString(rule.mInputPaths[i], dummy_file, dummy_result))
+			if (!sCompileCommandTemplate(rule.mInputPaths[i], dummy_file, rule.mInputPathTemplates.EmplaceBack()))
 			{
 				errors++;
 				gAppLogError(R"(Rule %s: Failed to parse InputPaths[%d] "%s")", rule.mName.AsCStr(), i, rule.mInputPaths[i].AsCStr());
@@ -842,9 +1893,10 @@ bool CookingSystem::ValidateRules()
 		}
 
 		// Validate the output paths.
+		rule.mOutputPathTemplates.Clear();
 		for (int i = 0; i < rule.mOutputPaths.Size(); ++i)
 		{
-			if (!gFormatCommandString(rule.mOutputPaths[i], dummy_file, dummy_result))
+			if (!sCompileCommandTemplate(rule.mOutputPaths[i], dummy_file, rule.mOutputPathTemplates.EmplaceBack()))
 			{
 				errors++;
 				gAppLogError(R"(Rule %s: Failed to parse OutputPaths[%d] "%s")", rule.mName.AsCStr(), i, rule.mOutputPaths[i].AsCStr());
@@ -897,6 +1949,15 @@ void CookingSystem::StartCooking()
 
 	gAppLog("Starting %d Cooking Threads.", thread_count);
 
+	// Start the process executor. By default, allow as many processes in flight as there are cooking threads.
+	int max_in_flight = (mWantedMaxCommandsInFlight <= 0) ? thread_count : mWantedMaxCommandsInFlight;
+	mProcessExecutor.Start(max_in_flight, mJobObject);
+
+	// Start the threads reading the dep files. Reading is mostly waiting for the disk, a few threads are enough.
+	mDepFileReader.Start(gThreadHardwareConcurrency() / 2);
+
+	mActionCache.Start(gApp.mActionCacheMaxSize);
+
 	mCookingThreads.Reserve(thread_count);
 
 	// Start the cooking threads.
@@ -930,10 +1991,17 @@ void CookingSystem::StopCooking()
 
 	mCommandsToCook.RequestStop();
 
+	// Stop the process executor first, cooking threads might be waiting for it.
+	mProcessExecutor.Stop();
+	mDepFileReader.Stop();
+
 	for (auto& thread : mCookingThreads)
 		thread.mThread.Join();
 	mCookingThreads.Clear();
 
+	// Stop the action cache after the cooking threads, they might still be queuing outputs to store.
+	mActionCache.Stop();
+
 	mJobObject = {};
 
 	mTimeOutUpdateThread.RequestStop();
@@ -969,50 +2037,313 @@ void CookingSystem::SetCookingPaused(bool inPaused)
 		mCookingPaused = false;
 
 		// Queue all the dirty commands that need to cook.
-		QueueDirtyCommands();
+		// Note: this is called from the UI thread, let the monitor thread do it (see ProcessUIRequests).
+		{
+			LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
+			mQueueDirtyCommandsRequested = true;
+		}
+		gFileSystem.KickMonitorDirectoryThread();
+	}
+}
+
+
+// Compute the critical path of every command: its own duration estimate plus the longest critical path of the commands using its outputs.
+// The consumers need to be done first, so this is a depth first search that finishes a command once all its consumers are finished
+// (ie. a reverse topological order), in a single pass over the commands and their consumers.
+// If the commands form a cycle, the consumer closing it is ignored (the cooking queue doesn't make the commands of a cycle wait for each other either).
+// inForEachConsumer(index, callback) calls callback(consumer_index) for each command using the outputs of the command at index.
+template <typename taGetDurationMs, typename taForEachConsumer>
+static void sComputeCriticalPaths(Span<uint32> outCriticalPathsMs, taGetDurationMs&& inGetDurationMs, taForEachConsumer&& inForEachConsumer)
+{
+	enum VisitState : uint8
+	{
+		NotVisited,
+		InProgress,
+		Finished,
+	};
+
+	TempVector<uint8> states;
+	states.Resize(outCriticalPathsMs.Size()); // Zero initialized, ie. NotVisited.
+
+	TempVector<int> stack;
+	for (int root = 0; root < outCriticalPathsMs.Size(); ++root)
+	{
+		if (states[root] != NotVisited)
+			continue;
+
+		stack.PushBack(root);
+		while (!stack.Empty())
+		{
+			int index = stack.Back();
+
+			if (states[index] == Finished)
+			{
+				// Pushed by several commands, already finished through another one.
+				stack.PopBack();
+				continue;
+			}
+
+			if (states[index] == NotVisited)
+			{
+				// First visit, push the consumers to finish them before this command.
+				// If there are none, the next iteration will finish it right away.
+				states[index] = InProgress;
+				inForEachConsumer(index, [&](int inConsumerIndex)
+				{
+					if (states[inConsumerIndex] == NotVisited)
+						stack.PushBack(inConsumerIndex);
+				});
+				continue;
+			}
+
+			// Second visit, all the consumers are finished, except the ones still in progress which are part of a cycle.
+			uint32 longest_consumer_path_ms = 0;
+			inForEachConsumer(index, [&](int inConsumerIndex)
+			{
+				if (states[inConsumerIndex] == Finished)
+					longest_consumer_path_ms = gMax(longest_consumer_path_ms, outCriticalPathsMs[inConsumerIndex]);
+			});
+
+			outCriticalPathsMs[index] = (uint32)gMin((uint64)inGetDurationMs(index) + longest_consumer_path_ms, (uint64)UINT32_MAX);
+			states[index]             = Finished;
+			stack.PopBack();
+		}
+	}
+}
+
+
+void CookingSystem::UpdateCriticalPathEstimates()
+{
+	// Note: this is only called by QueueDirtyCommands, on the monitor thread. It's the only thread updating the InputOf lists,
+	// and the cooking queue reads mCriticalPathMs when commands are pushed, which also only happens on that thread.
+
+	// The cooking queue makes commands wait for all their producers whatever their priority, so every consumer counts,
+	// including the ones with the same or a lower priority value.
+	TempVector<uint32> critical_paths_ms;
+	critical_paths_ms.Resize(mCommands.Size());
+
+	sComputeCriticalPaths(critical_paths_ms,
+		[this](int inIndex) { return mCommands[inIndex].GetCookDurationEstimateMs(); },
+		[this](int inIndex, const auto& inCallback)
+		{
+			for (FileID output_id : mCommands[inIndex].GetAllOutputs())
+				for (CookingCommandID consumer_id : output_id.GetFile().mInputOf)
+					inCallback((int)consumer_id.mIndex);
+		});
+
+	for (CookingCommand& command : mCommands)
+		command.mCriticalPathMs = critical_paths_ms[command.mID.mIndex];
+}
+
+
+REGISTER_BENCHMARK("CriticalPath")
+{
+	// Commands of random rules, each using the outputs of up to two previous commands with a lower priority value,
+	// so that the previous algorithm (one pass over all the commands per rule, only following consumers with a higher priority value)
+	// finds the same critical paths and can be compared.
+	constexpr int cCommandCount     = 200'000;
+	constexpr int cRuleCount        = 32;
+	constexpr int cPriorityCount    = 8;
+	constexpr int cMaxProducerCount = 2;
+
+	Vector<int>         priorities;
+	Vector<uint32>      durations_ms;
+	Vector<Vector<int>> consumers;
+	priorities.Resize(cCommandCount);
+	durations_ms.Resize(cCommandCount);
+	consumers.Resize(cCommandCount);
+	for (int i = 0; i < cCommandCount; ++i)
+	{
+		priorities[i]   = (int)((gRand32() % cRuleCount) % cPriorityCount);
+		durations_ms[i] = gRand32() % 1000;
+
+		int producer_count = i == 0 ? 0 : (int)(gRand32() % (cMaxProducerCount + 1));
+		for (int p = 0; p < producer_count; ++p)
+		{
+			int producer = i - 1 - (int)(gRand32() % (uint32)gMin(i, 64));
+			if (priorities[producer] < priorities[i])
+				consumers[producer].PushBack(i);
+		}
+	}
+
+	auto get_duration_ms = [&](int inIndex) { return durations_ms[inIndex]; };
+
+	Vector<uint32> critical_paths_ms;
+	critical_paths_ms.Resize(cCommandCount);
+
+	Timer timer;
+	sComputeCriticalPaths(critical_paths_ms, get_duration_ms, [&](int inIndex, const auto& inCallback)
+	{
+		for (int consumer : consumers[inIndex])
+			inCallback(consumer);
+	});
+	double time_ms = gTicksToSeconds(timer.GetTicks()) * 1000.0;
+
+	// The previous algorithm, the priorities of all the rules sorted (with duplicates), processed from highest to lowest.
+	Vector<uint32> baseline_paths_ms;
+	baseline_paths_ms.Resize(cCommandCount);
+
+	Timer baseline_timer;
+	{
+		TempVector<int> rule_priorities;
+		for (int rule = 0; rule < cRuleCount; ++rule)
+			gEmplaceSorted(rule_priorities, rule % cPriorityCount);
+
+		for (int priority_index = rule_priorities.Size() - 1; priority_index >= 0; --priority_index)
+		{
+			int priority = rule_priorities[priority_index];
+			for (int i = 0; i < cCommandCount; ++i)
+			{
+				if (priorities[i] != priority)
+					continue;
+
+				uint32 longest_consumer_path_ms = 0;
+				for (int consumer : consumers[i])
+					if (priorities[consumer] > priority)
+						longest_consumer_path_ms = gMax(longest_consumer_path_ms, baseline_paths_ms[consumer]);
+
+				baseline_paths_ms[i] = durations_ms[i] + longest_consumer_path_ms;
+			}
+		}
+	}
+	double baseline_ms = gTicksToSeconds(baseline_timer.GetTicks()) * 1000.0;
+
+	for (int i = 0; i < cCommandCount; ++i)
+	{
+		if (critical_paths_ms[i] != baseline_paths_ms[i])
+		{
+			gAppLogError("CriticalPath: command %d has a critical path of %u ms, expected %u ms.", i, critical_paths_ms[i], baseline_paths_ms[i]);
+			break;
+		}
+	}
+
+	gAppLog("CriticalPath: %d commands in %.2f ms, %.2f ms with one pass per rule (%d rules).", cCommandCount, time_ms, baseline_ms, cRuleCount);
+}
+
+
+void CookingSystem::QueueDirtyCommands()
+{
+	// Refresh the estimates with the latest cook durations before queueing everything.
+	UpdateCriticalPathEstimates();
+
+	LockGuard lock(mCommandsDirty.mMutex);
+
+	for (auto& bucket : mCommandsDirty.mPrioBuckets)
+	{
+		for (CookingCommandID command_id = bucket.mFirst; command_id.IsValid(); command_id = mCommandsDirty.GetNext(command_id))
+		{
+			const CookingCommand& command = GetCommand(command_id);
+			CookingState          cooking_state = command.GetCookingState();
+
+			if (cooking_state == CookingState::Cooking || cooking_state == CookingState::Waiting)
+				continue; // Skip commands already cooking.
+
+			if (cooking_state == CookingState::Error && (command.mDirtyState & (CookingCommand::InputChanged | CookingCommand::VersionMismatch)) == 0)
+				continue; // Skip commands that errored if their input hasn't changed since last time (unless the rule version changed).
+
+			mCommandsToCook.Push(command_id);
+		}
+	}
+}
+
+
+void CookingSystem::QueueErroredCommands()
+{
+	{
+		LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
+		mQueueErroredCommandsRequested = true;
 	}
+	gFileSystem.KickMonitorDirectoryThread();
 }
 
 
-void CookingSystem::QueueDirtyCommands()
+void CookingSystem::ProcessUIRequests()
 {
-	LockGuard lock(mCommandsDirty.mMutex);
+	Vector<CookingCommandID> force_cook_requests;
+	bool                     queue_dirty_commands   = false;
+	bool                     queue_errored_commands = false;
+	{
+		LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
 
-	for (auto& bucket : mCommandsDirty.mPrioBuckets)
+		gSwap(force_cook_requests, mForceCookRequests);
+		queue_dirty_commands           = mQueueDirtyCommandsRequested;
+		queue_errored_commands         = mQueueErroredCommandsRequested;
+		mQueueDirtyCommandsRequested   = false;
+		mQueueErroredCommandsRequested = false;
+	}
+
+	// Cooking might have been paused again since the request.
+	if (queue_dirty_commands && !IsCookingPaused())
+		QueueDirtyCommands();
+
+	if (queue_errored_commands)
 	{
-		for (CookingCommandID command_id : bucket.mCommands)
+		LockGuard lock(mCommandsDirty.mMutex);
+
+		for (auto& bucket : mCommandsDirty.mPrioBuckets)
 		{
-			const CookingCommand& command = GetCommand(command_id);
-			CookingState          cooking_state = command.GetCookingState();
+			for (CookingCommandID command_id = bucket.mFirst; command_id.IsValid(); command_id = mCommandsDirty.GetNext(command_id))
+			{
+				const CookingCommand& command = GetCommand(command_id);
+				CookingState          cooking_state = command.GetCookingState();
 
-			if (cooking_state == CookingState::Cooking || cooking_state == CookingState::Waiting)
-				continue; // Skip commands already cooking.
+				// If the command is in error state, queue it again.
+				if (cooking_state == CookingState::Error)
+					mCommandsToCook.Push(command_id);
+			}
+		}
+	}
 
-			if (cooking_state == CookingState::Error && (command.mDirtyState & (CookingCommand::InputChanged | CookingCommand::VersionMismatch)) == 0)
-				continue; // Skip commands that errored if their input hasn't changed since last time (unless the rule version changed).
+	for (CookingCommandID command_id : force_cook_requests)
+	{
+		auto& command       = GetCommand(command_id);
+		auto  cooking_state = command.GetCookingState();
 
-			mCommandsToCook.Push(command_id);
-		}
+		if (cooking_state == CookingState::Cooking || cooking_state == CookingState::Waiting)
+			continue; // Already cooking, don't do anything.
+
+		// Remove it from the queue (if present) and add it at the front.
+		mCommandsToCook.Remove(command_id);
+		mCommandsToCook.Push(command_id, PushPosition::Front);
 	}
 }
 
 
-void CookingSystem::QueueErroredCommands()
+// Check on disk that the outputs were written, right after the process exited.
+// Return false (with an error in the output) if some were definitely not written. That makes the cook an error immediately,
+// instead of waiting for the USN journal to be processed and for the time out.
+// Note: outputs that were written are still confirmed by the USN journal (the FileInfos need to be updated before anything can use them),
+// and outputs that can't be opened are left for the USN journal to decide.
+// If the rule has HashOutputs, the outputs are also hashed (while they're likely still in the file cache), see CookingSystem::ApplyOutputHashes.
+template <typename taString>
+static bool sCheckOutputsWritten(CookingCommand& ioCommand, taString& ioOutput)
 {
-	LockGuard lock(mCommandsDirty.mMutex);
+	bool hash_outputs = ioCommand.GetRule().mHashOutputs;
+	gAssert(!hash_outputs || ioCommand.mOutputHashes.Size() == ioCommand.mOutputs.Size());
 
-	for (auto& bucket : mCommandsDirty.mPrioBuckets)
+	bool all_written = true;
+	for (int i = 0; i < ioCommand.mOutputs.Size(); ++i)
 	{
-		for (CookingCommandID command_id : bucket.mCommands)
+		FileID        output_id = ioCommand.mOutputs[i];
+		bool          hash      = hash_outputs && !output_id.GetFile().mIsDepFile;
+		USN           usn       = 0;
+		uint64        content   = 0;
+		OpenFileError error     = hash ? gFileSystem.ReadCurrentUSNAndHash(output_id, usn, content) : gFileSystem.ReadCurrentUSN(output_id, usn);
+
+		// Compare with the USN snapshot taken before cooking (see PrepareCook).
+		if (error == OpenFileError::FileNotFound || (error == OpenFileError::NoError && usn <= ioCommand.mLastCookUSN))
 		{
-			const CookingCommand& command = GetCommand(command_id);
-			CookingState          cooking_state = command.GetCookingState();
-
-			// If the command is in error state, queue it again.
-			if (cooking_state == CookingState::Error)
-				mCommandsToCook.Push(command_id);
+			gAppendFormat(ioOutput, "[error] Output not written: %s\n", output_id.GetFile().ToString().AsCStr());
+			all_written = false;
+		}
+		else if (hash && error == OpenFileError::NoError)
+		{
+			ioCommand.mOutputHashes[i].mUSN  = usn;
+			ioCommand.mOutputHashes[i].mHash = content;
 		}
 	}
+
+	return all_written;
 }
 
 
@@ -1084,6 +2415,232 @@ static bool sRunCommandLine(StringView inCommandLine, StringPool::ResizableStrin
 }
 
 
+REGISTER_BENCHMARK("BatchedCommandLine")
+{
+	// What batching saves when the tool itself starts instantly: only the cost of creating the processes.
+	// Same number of empty commands, run with one process each, then all in one process.
+	constexpr int cCommandCount = 16;
+	OwnedHandle   job_object    = sCreateJobObject();
+	StringPool    string_pool;
+
+	StringPool::ResizableStringView output_str = string_pool.CreateResizableString();
+
+	int   failed_count = 0;
+	Timer one_process_each_timer;
+	for (int i = 0; i < cCommandCount; ++i)
+		failed_count += !sRunCommandLine("cmd.exe /c rem", output_str, job_object);
+	double one_process_each_ms = gTicksToSeconds(one_process_each_timer.GetTicks()) * 1000.0;
+
+	TempString batch_command_line = "cmd.exe /c rem";
+	for (int i = 1; i < cCommandCount; ++i)
+		batch_command_line.Append(" & rem");
+
+	Timer  batch_timer;
+	failed_count += !sRunCommandLine(batch_command_line, output_str, job_object);
+	double batch_ms = gTicksToSeconds(batch_timer.GetTicks()) * 1000.0;
+
+	if (failed_count != 0)
+		gAppLogError("%d command lines failed:\n%s", failed_count, output_str.AsStringView().AsCStr());
+
+	gAppLog("%d empty commands: %.1f ms with one process each, %.1f ms in a single process.", cCommandCount, one_process_each_ms, batch_ms);
+}
+
+
+// Long-lived process cooking the commands of a rule, one at a time.
+// Protocol (all integers are little-endian):
+// - Request:  uint32 size, followed by the formatted CommandLine of the command (not null-terminated).
+// - Response: int32 exit code, uint32 size, followed by the output of the command.
+// The worker should exit when its stdin is closed. It should not write to stderr, nothing reads it.
+struct CookingWorker
+{
+	CookingRuleID mRuleID;
+	subprocess_s  mProcess = {};
+};
+
+
+static CookingWorker* sStartWorker(const CookingRule& inRule, const FileInfo& inMainInput, StringPool::ResizableStringView& ioOutput, HANDLE inJobObject)
+{
+	// Command Variables refer to the file the worker is started for, only the Repo ones are really useful here.
+	TempString command_line;
+	if (!inRule.mWorkerCommandLineTemplate.Format(inMainInput, command_line))
+	{
+		ioOutput.Append("[error] Failed to format worker command line.\n");
+		return nullptr;
+	}
+
+	gAppendFormat(ioOutput, "Starting Worker: %s\n\n", command_line.AsCStr());
+
+	CookingWorker* worker = new CookingWorker;
+	worker->mRuleID       = inRule.mID;
+
+	// Note: not async, stdin/stdout are used as blocking streams.
+	int options = subprocess_option_no_window | subprocess_option_single_string_command_line | subprocess_option_inherit_environment;
+
+	const char* command_line_array[] = { command_line.AsCStr(), nullptr };
+	if (subprocess_create(command_line_array, options, &worker->mProcess))
+	{
+		gAppendFormat(ioOutput, "[error] Failed to create worker process - %s\n", GetLastErrorString().AsCStr());
+		delete worker;
+		return nullptr;
+	}
+
+	// Assign the job object to the process, to make sure it is killed if the Asset Cooker process ends.
+	if (AssignProcessToJobObject(inJobObject, worker->mProcess.hProcess) == FALSE)
+		gAppFatalError("AssignProcessToJobObject failed - %s", GetLastErrorString().AsCStr());
+
+	return worker;
+}
+
+
+static void sStopWorker(CookingWorker* ioWorker)
+{
+	// Closing stdin tells the worker to exit. Give it a bit of time, then kill it.
+	fclose(ioWorker->mProcess.stdin_file);
+	ioWorker->mProcess.stdin_file = nullptr;
+
+	if (WaitForSingleObject(ioWorker->mProcess.hProcess, 1000) != WAIT_OBJECT_0)
+		subprocess_terminate(&ioWorker->mProcess);
+
+	subprocess_destroy(&ioWorker->mProcess);
+	delete ioWorker;
+}
+
+
+enum class WorkerResult : uint8
+{
+	Success,
+	Failed,		// The worker exited or sent an incomplete response.
+	TimedOut,
+	Stopped,	// Cooking is stopping.
+};
+
+
+// Read exactly inSize bytes from the worker's stdout.
+// The pipe is polled instead of doing a blocking read, to be able to give up if the worker hangs or if cooking is stopping.
+static WorkerResult sReadFromWorker(CookingWorker& ioWorker, void* outBuffer, uint32 inSize, int64 inStartTicks, int inTimeoutSeconds, const Thread& inThread)
+{
+	HANDLE worker_stdout = (HANDLE)_get_osfhandle(_fileno(subprocess_stdout(&ioWorker.mProcess)));
+	uint8* buffer        = (uint8*)outBuffer;
+
+	while (inSize > 0)
+	{
+		DWORD bytes_available = 0;
+		if (PeekNamedPipe(worker_stdout, nullptr, 0, nullptr, &bytes_available, nullptr) == FALSE)
+			return WorkerResult::Failed; // The worker exited and its end of the pipe is closed.
+
+		if (bytes_available > 0)
+		{
+			DWORD bytes_read = 0;
+			if (ReadFile(worker_stdout, buffer, gMin((DWORD)inSize, bytes_available), &bytes_read, nullptr) == FALSE || bytes_read == 0)
+				return WorkerResult::Failed;
+
+			buffer += bytes_read;
+			inSize -= bytes_read;
+			continue;
+		}
+
+		if (inThread.IsStopRequested())
+			return WorkerResult::Stopped;
+
+		if (inTimeoutSeconds > 0 && gTicksToSeconds(gGetTickCount() - inStartTicks) >= (double)inTimeoutSeconds)
+			return WorkerResult::TimedOut;
+
+		// Nothing to read yet. Wait a bit, but wake up right away if the worker exits.
+		(void)WaitForSingleObject(ioWorker.mProcess.hProcess, 1);
+	}
+
+	return WorkerResult::Success;
+}
+
+
+// Send a request to the worker and read its response.
+// Anything but Success means the worker needs to be stopped.
+static WorkerResult sSendWorkerRequest(CookingWorker& ioWorker, StringView inRequest, int inTimeoutSeconds, const Thread& inThread, StringPool::ResizableStringView& ioOutput, int& outExitCode)
+{
+	int64 start_ticks   = gGetTickCount();
+	FILE* worker_stdin  = subprocess_stdin(&ioWorker.mProcess);
+
+	uint32 request_size = (uint32)inRequest.Size();
+	if (fwrite(&request_size, sizeof(request_size), 1, worker_stdin) != 1 ||
+		fwrite(inRequest.Data(), 1, request_size, worker_stdin) != request_size ||
+		fflush(worker_stdin) != 0)
+		return WorkerResult::Failed;
+
+	int32  exit_code     = 0;
+	uint32 output_size   = 0;
+	if (WorkerResult result = sReadFromWorker(ioWorker, &exit_code, sizeof(exit_code), start_ticks, inTimeoutSeconds, inThread); result != WorkerResult::Success)
+		return result;
+	if (WorkerResult result = sReadFromWorker(ioWorker, &output_size, sizeof(output_size), start_ticks, inTimeoutSeconds, inThread); result != WorkerResult::Success)
+		return result;
+
+	char buffer[1024];
+	while (output_size > 0)
+	{
+		uint32 bytes_to_read = gMin(output_size, (uint32)sizeof(buffer));
+		if (WorkerResult result = sReadFromWorker(ioWorker, buffer, bytes_to_read, start_ticks, inTimeoutSeconds, inThread); result != WorkerResult::Success)
+			return result;
+
+		ioOutput.Append({ buffer, (int)bytes_to_read });
+		output_size -= bytes_to_read;
+	}
+
+	outExitCode = exit_code;
+	return WorkerResult::Success;
+}
+
+
+bool CookingSystem::RunOnWorker(CookingThread& ioThread, const CookingRule& inRule, const FileInfo& inMainInput, StringView inRequest, StringPool::ResizableStringView& ioOutput)
+{
+	// Find the worker for this rule, or start one.
+	int worker_index = -1;
+	for (int i = 0; i < ioThread.mWorkers.Size(); ++i)
+	{
+		if (ioThread.mWorkers[i]->mRuleID == inRule.mID)
+			worker_index = i;
+	}
+
+	if (worker_index == -1)
+	{
+		CookingWorker* new_worker = sStartWorker(inRule, inMainInput, ioOutput, mJobObject);
+		if (new_worker == nullptr)
+			return false;
+
+		worker_index = ioThread.mWorkers.Size();
+		ioThread.mWorkers.PushBack(new_worker);
+	}
+
+	CookingWorker* worker = ioThread.mWorkers[worker_index];
+
+	gAppendFormat(ioOutput, "Worker Request: %s\n\n", inRequest.AsCStr());
+
+	int          exit_code = 0;
+	WorkerResult result    = sSendWorkerRequest(*worker, inRequest, inRule.mTimeout, ioThread.mThread, ioOutput, exit_code);
+	if (result != WorkerResult::Success)
+	{
+		switch (result)
+		{
+		case WorkerResult::TimedOut: gAppendFormat(ioOutput, "\n[error] Timed out after %d seconds.\n", inRule.mTimeout); break;
+		case WorkerResult::Stopped:  ioOutput.Append("\n[error] Cooking is stopping.\n"); break;
+		default:                     ioOutput.Append("\n[error] Worker process stopped responding.\n"); break;
+		}
+
+		// The worker is still busy with the request if it timed out or cooking is stopping, don't wait for it to exit.
+		if (result != WorkerResult::Failed)
+			subprocess_terminate(&worker->mProcess);
+
+		// Stop it, a new one will be started for the next command.
+		ioThread.mWorkers.Erase(worker_index);
+		sStopWorker(worker);
+		return false;
+	}
+
+	gAppendFormat(ioOutput, "\nExit code: %d (0x%X)\n", exit_code, (uint32)exit_code);
+
+	// Non-zero exit code is considered an error.
+	return exit_code == 0;
+}
+
+
 bool sRunCopyFile(const CookingCommand& inCommand, StringPool::ResizableStringView& ioOutput)
 {
 	// Incompatible with DepFile, otherwise mOutputs[0] is the DepFile. This is checked by the RuleReader.
@@ -1098,14 +2655,56 @@ bool sRunCopyFile(const CookingCommand& inCommand, StringPool::ResizableStringVi
 }
 
 
-void CookingSystem::CookCommand(CookingCommand& ioCommand, CookingThread& ioThread)
+// Compute the key of this cook in the action cache, from everything that can change its outputs.
+// Return false if some inputs couldn't be hashed, then the outputs can't be cached.
+static bool sComputeActionKey(const CookingCommand& inCommand, StringView inCommandLine, StringView inDepFileCommandLine, Hash128& outKey)
 {
-	CookingLogEntry& log_entry = *ioCommand.mLastCookingLog;
+	if ((size_t)inCommand.mCookInputHashes.Size() != inCommand.GetCookInputs().Size())
+		return false;
 
-	// Allocate a resizable string for the output.
-	StringPool::ResizableStringView output_str = ioThread.mStringPool.CreateResizableString();
+	const CookingRule& rule = inCommand.GetRule();
 
-	const CookingRule& rule    = ioCommand.GetRule();
+	XXH3_state_t state;
+	XXH3_128bits_reset(&state);
+
+	// Hash the size of the strings as well, to not mix up where one ends and the next starts.
+	auto add_string = [&state](StringView inStr)
+	{
+		uint32 size = (uint32)inStr.Size();
+		XXH3_128bits_update(&state, &size, sizeof(size));
+		XXH3_128bits_update(&state, inStr.Data(), inStr.Size());
+	};
+
+	add_string(rule.mName);
+	XXH3_128bits_update(&state, &rule.mVersion, sizeof(rule.mVersion));
+	add_string(inCommandLine);
+	add_string(inDepFileCommandLine);
+	add_string(rule.mWorkerCommandLine);
+
+	// The input hashes are in the same order as GetCookInputs (see PrepareCook).
+	for (const CookingCommand::InputHash& input_hash : inCommand.mCookInputHashes)
+	{
+		add_string(input_hash.mFileID.GetRepo().mRootPath);
+		add_string(input_hash.mFileID.GetFile().mPath);
+		XXH3_128bits_update(&state, &input_hash.mHash, sizeof(input_hash.mHash));
+	}
+
+	for (FileID output_id : inCommand.mOutputs)
+	{
+		add_string(output_id.GetRepo().mRootPath);
+		add_string(output_id.GetFile().mPath);
+	}
+
+	XXH128_hash_t hash = XXH3_128bits_digest(&state);
+	outKey = { hash.low64, hash.high64 };
+	return true;
+}
+
+
+bool CookingSystem::PrepareCook(CookingCommand& ioCommand, StringPool::ResizableStringView& ioOutput)
+{
+	CookingLogEntry&   log_entry = *ioCommand.mLastCookingLog;
+	const CookingRule& rule      = ioCommand.GetRule();
 
 	// Update the last cook USN (used later know if this command needs to cook again).
 	// Note: when there's a DepFile, we don't know the full list of inputs before reading it, so it will be done again later, after reading it.
@@ -1113,18 +2712,47 @@ void CookingSystem::CookCommand(CookingCommand& ioCommand, CookingThread& ioThre
 		// Get the max USN of all inputs.
 		// TODO this does not work if multiple drives are involved, we can only compare USNs from the same journal
 		USN max_input_usn = 0;
-		for (FileID input_id : ioCommand.GetAllInputs())
+		for (FileID input_id : ioCommand.GetCookInputs())
 			max_input_usn = gMax(max_input_usn, input_id.GetFile().mLastChangeUSN);
 
 		// Get the max of all the (previous) outputs.
 		// Note: We include the previous outputs to detect that all outputs are written again this time,
 		// even if the command runs because of a ForceCook or a rule version change (in which case inputs have not changed).
 		USN max_outputs_usn = 0;
-		for (FileID output_id : ioCommand.GetAllOutputs())
+		for (FileID output_id : ioCommand.GetCookOutputs())
 			max_outputs_usn = gMax(max_outputs_usn, output_id.GetFile().mLastChangeUSN);
 		
 		// Last cook USN is the max of both.
 		ioCommand.mLastCookUSN = gMax(max_outputs_usn, max_input_usn);
+
+		// The monitor thread can't read mLastCookUSN while it's being written, it reads this copy instead.
+		// Note: this is stored before the cook is started on the executor, so a cancel can't miss a change made after it.
+		ioCommand.mCookStartUSN.Store(ioCommand.mLastCookUSN);
+	}
+
+	// Hash the inputs, to know later if they really changed when they're written again (see IsInputContentUnchanged).
+	// Only keep the hashes of the inputs that didn't change since mLastCookUSN was computed, otherwise they might not be what the command reads.
+	// Note: the monitor thread reads mInputHashes at any time, these replace them once the cook is Waiting (see TakeCookInputHashes).
+	ioCommand.mCookInputHashes.Clear();
+	if (rule.UseInputHashes())
+	{
+		for (FileID input_id : ioCommand.GetCookInputs())
+		{
+			USN    usn  = 0;
+			uint64 hash = 0;
+			if (gFileSystem.ReadCurrentUSNAndHash(input_id, usn, hash) == OpenFileError::NoError && usn <= ioCommand.mLastCookUSN)
+				ioCommand.mCookInputHashes.PushBack({ input_id, hash });
+		}
+	}
+	ioCommand.mHasCookInputHashes = true;
+
+	// Remember the USN of the outputs, to know later if their previous hash was still valid (see ApplyOutputHashes).
+	// The hashes themselves are computed once the outputs are written (see sCheckOutputsWritten).
+	ioCommand.mOutputHashes.Clear();
+	if (rule.mHashOutputs)
+	{
+		for (FileID output_id : ioCommand.mOutputs)
+			ioCommand.mOutputHashes.PushBack({ .mPreviousUSN = output_id.GetFile().mLastChangeUSN });
 	}
 
 	// Update the last cook time.
@@ -1141,22 +2769,18 @@ void CookingSystem::CookCommand(CookingCommand& ioCommand, CookingThread& ioThre
 	// Make sure all inputs exist.
 	{
 		bool all_inputs_exist = true;
-		for (FileID input_id : ioCommand.GetAllInputs())
+		for (FileID input_id : ioCommand.GetCookInputs())
 		{
 			const FileInfo& input = gFileSystem.GetFile(input_id);
 			if (input.IsDeleted())
 			{
 				all_inputs_exist = false;
-				gAppendFormat(output_str, "[error] Input missing: %s\n", input.ToString().AsCStr());
+				gAppendFormat(ioOutput, "[error] Input missing: %s\n", input.ToString().AsCStr());
 			}
 		}
 
 		if (!all_inputs_exist)
-		{
-			log_entry.mOutput = output_str.AsStringView();
-			log_entry.mCookingState.Store(CookingState::Error);
-			return;
-		}
+			return false;
 	}
 
 	// Make sure the directories for all the outputs exist.
@@ -1169,101 +2793,260 @@ void CookingSystem::CookCommand(CookingCommand& ioCommand, CookingThread& ioThre
 			if (!success)
 			{
 				all_dirs_exist = false;
-				gAppendFormat(output_str, "[error] Failed to create directory for %s\n", output_file.GetFile().ToString().AsCStr());
+				gAppendFormat(ioOutput, "[error] Failed to create directory for %s\n", output_file.GetFile().ToString().AsCStr());
 			}
 		}
 
 		if (!all_dirs_exist)
-		{
-			log_entry.mOutput = output_str.AsStringView();
-			log_entry.mCookingState.Store(CookingState::Error);
-			return;
-		}
+			return false;
 	}
 
 	// Fake random failures for debugging.
 	if (gDebugFailCookingRandomly && (gRand32() % 5) == 0)
 	{
-		output_str.Append("Uh oh! This is a fake failure for debug purpose!\n");
-		log_entry.mOutput = output_str.AsStringView();
+		ioOutput.Append("Uh oh! This is a fake failure for debug purpose!\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+void CookingSystem::FinishCook(CookingCommand& ioCommand, StringView inOutput, bool inSuccess, int64 inDurationNs)
+{
+	CookingLogEntry& log_entry = *ioCommand.mLastCookingLog;
+
+	// Remember how long it took, to schedule the commands with the longest critical path first.
+	// Failed commands often fail early, so don't let them skew the estimates.
+	if (inSuccess)
+		ioCommand.SetLastCookDuration((uint32)gClamp(inDurationNs / 1'000'000, (int64)1, (int64)UINT32_MAX));
+
+	// Store the log output.
+	log_entry.mOutput = inOutput;
+	gParseANSIColors(log_entry.mOutput, log_entry.mOutputFormatSpans);
+
+	if (!inSuccess)
+	{
 		log_entry.mCookingState.Store(CookingState::Error);
-		return;
 	}
+	else
+	{
+
+		// Now we wait for confirmation that the outputs were written (and if yes, it's a success).
+		log_entry.mCookingState.Store(CookingState::Waiting);
+
+		// Any time an output is detected changed, we will try updating the cooking state.
+		// If all outputs were written, cooking is a success.
+		// If timeout happens first, we declare it's an error because of outputs not written.
+		AddTimeOut(&log_entry);
+	}
+}
+
+
+bool CookingSystem::CookCommand(CookingCommand& ioCommand, CookingThread& ioThread)
+{
+	CookingLogEntry& log_entry = *ioCommand.mLastCookingLog;
+
+	// Allocate a resizable string for the output.
+	StringPool::ResizableStringView output_str = ioThread.mStringPool.CreateResizableString();
 
+	const CookingRule& rule    = ioCommand.GetRule();
+
+	if (!PrepareCook(ioCommand, output_str))
+	{
+		log_entry.mOutput = output_str.AsStringView();
+		log_entry.mCookingState.Store(CookingState::Error);
+		return true;
+	}
 	
 	// If there is a dep file command line, build it.
 	TempString dep_command_line;
 	if (!rule.mDepFileCommandLine.Empty())
 	{
-		if (!gFormatCommandString(rule.mDepFileCommandLine, gFileSystem.GetFile(ioCommand.GetMainInput()), dep_command_line))
+		if (!rule.mDepFileCommandLineTemplate.Format(gFileSystem.GetFile(ioCommand.GetMainInput()), dep_command_line))
 		{
 			output_str.Append("[error] Failed to format dep file command line.\n");
 			log_entry.mOutput = output_str.AsStringView();
 			log_entry.mCookingState.Store(CookingState::Error);
-			return;
+			return true;
 		}
 	}
 
-	bool success = false;
+	bool success  = false;
+	bool restored = false;
+	ioCommand.mActionKey = {};
 	if (rule.mCommandType == CommandType::CommandLine)
 	{
 		// Build the command line.
 		TempString command_line;
-		if (!gFormatCommandString(rule.mCommandLine, gFileSystem.GetFile(ioCommand.GetMainInput()), command_line))
+		if (!rule.mCommandLineTemplate.Format(gFileSystem.GetFile(ioCommand.GetMainInput()), command_line))
 		{
 			output_str.Append("[error] Failed to format command line.\n");
 			log_entry.mOutput = output_str.AsStringView();
 			log_entry.mCookingState.Store(CookingState::Error);
-			return;
+			return true;
+		}
+
+		// If the outputs of the same inputs were cooked before, copy them from the action cache instead of cooking.
+		if (rule.mUseActionCache && mActionCache.IsEnabled())
+			sComputeActionKey(ioCommand, command_line, dep_command_line, ioCommand.mActionKey);
+
+		if (ioCommand.mActionKey != Hash128{} && mActionCache.Restore(ioCommand.mActionKey))
+		{
+			output_str.Append("Outputs restored from the action cache.\n");
+			success  = true;
+			restored = true;
 		}
+		else
+		{
+			// Send the command line to a worker, or let the process executor run it (and the dep file command line).
+			// In that case the executor finishes the cook once the processes exit, this thread can move on to the next command.
+			if (rule.UseWorkers())
+				success = RunOnWorker(ioThread, rule, gFileSystem.GetFile(ioCommand.GetMainInput()), command_line, output_str);
+			else
+			{
+				StringView command_lines[] = { command_line, dep_command_line };
+				int        count           = dep_command_line.Empty() ? 1 : 2;
+				if (mProcessExecutor.Run(ioCommand.mID, Span<const StringView>(command_lines, count), rule.mTimeout))
+					return false;
 
-		// Run the command line.
-		success = sRunCommandLine(command_line, output_str, mJobObject);
+				output_str.Append("[error] Cooking is stopping.\n");
+				success = false;
+			}
+		}
 	}
 	else
 	{
-		// Run the built-in command.
-		switch (rule.mCommandType)
+		// Run the built-in command.
+		switch (rule.mCommandType)
+		{
+		case CommandType::CopyFile:
+			success = sRunCopyFile(ioCommand, output_str);
+			break;
+		default:
+			gAssert(false);
+			success = false;
+			break;
+		}
+	}
+
+	// If there's a dep file command line, run it next (unless the dep file was restored with the other outputs).
+	if (success && !restored && !dep_command_line.Empty())
+	{
+		output_str.Append("\nDep File "); // No end line on purpose, we want to prepend the line added inside the sRunCommandLine.
+		success = sRunCommandLine(dep_command_line, output_str, mJobObject);
+	}
+
+	// Don't wait for the USN journal to know if outputs are missing.
+	if (success)
+		success = sCheckOutputsWritten(ioCommand, output_str);
+
+	if (success && !restored && ioCommand.mActionKey != Hash128{})
+		mActionCache.Store(ioCommand.mActionKey, ioCommand.mID, log_entry.mID, ioCommand.mCookDepFileInputs);
+
+	// Set the end time and add the duration at the end of the log.
+	log_entry.mTimeEnd = gGetSystemTimeAsFileTime();
+	gAppendFormat(output_str, "\nDuration: %.3f seconds\n", (double)(log_entry.mTimeEnd - log_entry.mTimeStart) / 1'000'000'000.0);
+
+	FinishCook(ioCommand, output_str.AsStringView(), success, log_entry.mTimeEnd - log_entry.mTimeStart);
+
+	// Make sure the file changes are processed as soon as possible (even if there was an error, there might be some files written).
+	gFileSystem.KickMonitorDirectoryThread();
+
+	return true;
+}
+
+
+void CookingSystem::CookCommandBatch(Span<CookingCommand* const> inCommands, CookingThread& ioThread)
+{
+	const CookingRule&          rule = inCommands[0]->GetRule();
+	TempVector<CookingCommand*> batch;
+	TempString                  response_file_content;
+
+	// Prepare each command and build its line of the response file.
+	// The commands that fail at this point end in error on their own, the others are cooked together.
+	for (CookingCommand* command : inCommands)
+	{
+		// Note: the pool is locked while a resizable string exists, make sure it's destroyed before creating the next one.
+		StringPool::ResizableStringView output_str = ioThread.mStringPool.CreateResizableString();
+		CookingLogEntry&                log_entry  = *command->mLastCookingLog;
+
+		bool       success = PrepareCook(*command, output_str);
+		TempString command_line;
+		if (success && !rule.mCommandLineTemplate.Format(gFileSystem.GetFile(command->GetMainInput()), command_line))
 		{
-		case CommandType::CopyFile:
-			success = sRunCopyFile(ioCommand, output_str);
-			break;
-		default:
-			gAssert(false);
+			output_str.Append("[error] Failed to format command line.\n");
 			success = false;
-			break;
 		}
-	}
 
-	// If there's a dep file command line, run it next.
-	if (success && !dep_command_line.Empty())
-	{
-		output_str.Append("\nDep File "); // No end line on purpose, we want to prepend the line added inside the sRunCommandLine.
-		success = sRunCommandLine(dep_command_line, output_str, mJobObject);
+		if (!success)
+		{
+			log_entry.mTimeEnd = gGetSystemTimeAsFileTime();
+			log_entry.mOutput  = output_str.AsStringView();
+			log_entry.mCookingState.Store(CookingState::Error);
+			continue;
+		}
+
+		response_file_content.Append(command_line);
+		response_file_content.Append("\n");
+		batch.PushBack(command);
 	}
 
-	// Set the end time and add the duration at the end of the log.
-	log_entry.mTimeEnd = gGetSystemTimeAsFileTime();
-	gAppendFormat(output_str, "\nDuration: %.3f seconds\n", (double)(log_entry.mTimeEnd - log_entry.mTimeStart) / 1'000'000'000.0);
+	if (batch.Empty())
+		return;
 
-	// Store the log output.
-	log_entry.mOutput = output_str.AsStringView();
-	gParseANSIColors(log_entry.mOutput, log_entry.mOutputFormatSpans);
+	// Write the response file in the cache directory. Named after the first command to be unique while it's cooking.
+	CreateDirectoryA(gApp.mCacheDirectory.AsCStr(), nullptr);
+	TempString response_file_path = gTempFormat(R"(%s\batch_%u.rsp)", gApp.mCacheDirectory.AsCStr(), batch[0]->mID.mIndex);
+
+	StringPool::ResizableStringView output_str = ioThread.mStringPool.CreateResizableString();
+	gAppendFormat(output_str, "Batch of %d commands.\n", batch.Size());
+	gAppendFormat(output_str, "Response File: %s\n%s\n", response_file_path.AsCStr(), response_file_content.AsCStr());
 
-	if (!success)
+	bool success = false;
+	if (FILE* response_file = fopen(response_file_path.AsCStr(), "wb"))
 	{
-		log_entry.mCookingState.Store(CookingState::Error);
+		bool written = fwrite(response_file_content.AsCStr(), 1, response_file_content.Size(), response_file) == (size_t)response_file_content.Size();
+		written      = (fclose(response_file) == 0) && written;
+
+		if (!written)
+		{
+			gAppendFormat(output_str, "[error] Failed to write response file - %s\n", strerror(errno));
+		}
+		else
+		{
+			// Build the command line.
+			TempString command_line;
+			const FileInfo& first_input = gFileSystem.GetFile(batch[0]->GetMainInput());
+			if (!rule.mBatchCommandLineTemplate.Format(first_input, command_line, response_file_path))
+				output_str.Append("[error] Failed to format batch command line.\n");
+			else
+				success = sRunCommandLine(command_line, output_str, mJobObject);
+		}
+
+		DeleteFileA(response_file_path.AsCStr());
 	}
 	else
 	{
+		gAppendFormat(output_str, "[error] Failed to create response file - %s\n", strerror(errno));
+	}
 
-		// Now we wait for confirmation that the outputs were written (and if yes, it's a success).
-		log_entry.mCookingState.Store(CookingState::Waiting);
+	// Don't wait for the USN journal to know if outputs are missing. Only the commands with missing outputs are errors.
+	TempVector<bool> commands_success;
+	for (CookingCommand* command : batch)
+		commands_success.PushBack(success && sCheckOutputsWritten(*command, output_str));
 
-		// Any time an output is detected changed, we will try updating the cooking state.
-		// If all outputs were written, cooking is a success.
-		// If timeout happens first, we declare it's an error because of outputs not written.
-		AddTimeOut(&log_entry);
+	// Set the end time and add the duration at the end of the log.
+	FileTime time_end = gGetSystemTimeAsFileTime();
+	int64    duration = time_end - batch[0]->mLastCookingLog->mTimeStart;
+	gAppendFormat(output_str, "\nDuration: %.3f seconds\n", (double)duration / 1'000'000'000.0);
+
+	// All the commands share the output. Each of them will only succeed if its own outputs are written.
+	// The duration is split evenly between them since we can't know better.
+	for (int i = 0; i < batch.Size(); ++i)
+	{
+		batch[i]->mLastCookingLog->mTimeEnd = time_end;
+		FinishCook(*batch[i], output_str.AsStringView(), commands_success[i], duration / batch.Size());
 	}
 
 	// Make sure the file changes are processed as soon as possible (even if there was an error, there might be some files written).
@@ -1277,6 +3060,9 @@ void CookingSystem::CleanupCommand(CookingCommand& ioCommand, CookingThread& ioT
 
 	log_entry.mIsCleanup       = true;
 
+	// The inputs aren't read, keep the hashes of the previous cook.
+	ioCommand.mHasCookInputHashes = false;
+
 	StringPool::ResizableStringView output_str = ioThread.mStringPool.CreateResizableString();
 
 	bool error = false;
@@ -1329,6 +3115,7 @@ void CookingSystem::TimeOutUpdateThread()
 {
 	// The logic in this loop is a bit weird, but the idea is to wait *at least* this amount of time before declaring a command is in error.
 	// Many commands will wait twice as much because they won't be in the first batch to be processed, but that's okay.
+	// Note: missing outputs are usually detected as soon as the process exits (see sCheckOutputsWritten), this is only a fallback.
 	constexpr auto cTimeout = 0.3_S;
 
 	while (true)
@@ -1371,15 +3158,7 @@ void CookingSystem::TimeOutUpdateThread()
 				if (log_entry->mCookingState.Load() == CookingState::Waiting)
 				{
 					log_entry->mCookingState.Store(CookingState::Error);
-
-					// Update the total count of errors.
-					mCookingErrors.Add(1);
-
-					// Notify the system that this command has officially finished cooking.
-					mCommandsToCook.FinishedCooking(*log_entry);
-
-					// Update the dirty state so that it's set to Error.
-					QueueUpdateDirtyState(log_entry->mCommandID);
+					FinishedCookingWithError(*log_entry);
 				}
 			}
 
@@ -1389,6 +3168,21 @@ void CookingSystem::TimeOutUpdateThread()
 }
 
 
+void CookingSystem::FinishedCookingWithError(CookingLogEntry& ioLogEntry)
+{
+	gAssert(ioLogEntry.mCookingState.Load() == CookingState::Error);
+
+	// Update the total count of errors.
+	mCookingErrors.Add(1);
+
+	// Note: the monitor thread notifies the cooking queue that this command has finished (see FinishedCooking), when it updates its dirty state.
+	// If the command ends in error, we need to make sure that its dirty state is updated.
+	// That normally happens when the outputs (and the dep file) are written, but that might not happen at all if there is an error.
+	// This is important to then properly detect when the inputs change again and the command can re-cook.
+	QueueUpdateDirtyState(ioLogEntry.mCommandID);
+}
+
+
 void CookingSystem::QueueUpdateDirtyStates(FileID inFileID)
 {
 	// We want to queue/defer the update for several reasons:
@@ -1401,6 +3195,15 @@ void CookingSystem::QueueUpdateDirtyStates(FileID inFileID)
 	if (file.mInputOf.Empty() && file.mOutputOf.Empty())
 		return; // Early out if we know there will be nothing to do.
 
+	// If an input changed after a command started cooking, the result will be obsolete. Cancel it, it will cook again.
+	// Note: mCookStartUSN is set by the cooking thread when the cook starts, if that didn't happen yet the command isn't running on the executor and Cancel does nothing.
+	for (CookingCommandID command_id : file.mInputOf)
+	{
+		const CookingCommand& command = GetCommand(command_id);
+		if (command.GetCookingState() == CookingState::Cooking && (file.IsDeleted() || file.mLastChangeUSN > command.mCookStartUSN.Load()))
+			mProcessExecutor.Cancel(command_id);
+	}
+
 	LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
 
 	for (CookingCommandID command_id : file.mInputOf)
@@ -1419,55 +3222,431 @@ void CookingSystem::QueueUpdateDirtyState(CookingCommandID inCommandID)
 
 bool CookingSystem::ProcessUpdateDirtyStates()
 {
-	LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
+	// Take the queued commands, so that the cooking threads adding more don't wait while they're updated.
+	TempVector<CookingCommandID> commands;
+	{
+		LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
+
+		commands.Reserve(mCommandsQueuedForUpdateDirtyState.Size());
+		for (CookingCommandID command_id : mCommandsQueuedForUpdateDirtyState)
+			commands.PushBack(command_id);
+
+		mCommandsQueuedForUpdateDirtyState.Clear();
+	}
+
+	TempVector<CookingCommandID> still_queued;
+	TempVector<CookingCommandID> updated;
+
+	// Take what the cooking thread computed for the last cook, once it's done with the command.
+	// This needs to happen before anything reads the state of the command.
+	auto take_cook_results = [this](CookingCommand& ioCommand)
+	{
+		// Read the log entry once, a new cook could start (and change it) if the last one is already finished.
+		const CookingLogEntry* log_entry = ioCommand.mLastCookingLog;
+		if (log_entry == nullptr || log_entry == ioCommand.mCacheState.mLastCookingLog)
+			return; // Already finished.
+
+		// Note: until it's finished, the cooking queue still considers the command cooking, so it can't cook again.
+		CookingState cooking_state = log_entry->mCookingState.Load();
+		if (cooking_state == CookingState::Waiting)
+			TakeCookInputHashes(ioCommand); // Successful cooks are finished once their outputs are written (see SetDirtyState).
+		else if (cooking_state == CookingState::Error || cooking_state == CookingState::Cancelled)
+			FinishedCooking(ioCommand);
+	};
+
+	auto set_dirty_state = [&updated](CookingCommand& ioCommand, CookingCommand::DirtyState inDepFileState)
+	{
+		bool                       all_outputs_written = false;
+		CookingCommand::DirtyState dirty_state         = inDepFileState;
+		dirty_state |= ioCommand.ComputeDirtyState(all_outputs_written);
+		ioCommand.SetDirtyState(dirty_state, all_outputs_written);
 
-	for (auto it = mCommandsQueuedForUpdateDirtyState.Begin(); it != mCommandsQueuedForUpdateDirtyState.End();)
+		// The update happens after cooking or reading the dep file, the state to save in the cache might have changed.
+		updated.PushBack(ioCommand.mID);
+	};
+
+	auto update_dirty_state = [&](CookingCommand& ioCommand, CookingCommand::DirtyState inDepFileState)
 	{
-		CookingCommand& command = GetCommand(*it);
+		// The dirty state of a command that just cooked depends on the hashes of its inputs before that cook.
+		take_cook_results(ioCommand);
 
-		if (command.mLastCookingLog && command.mLastCookingLog->mCookingState.Load() == CookingState::Cooking)
+		// If the outputs of a command that just cooked are hashed, update the commands using them first.
+		// This needs to happen before the command is marked finished, otherwise they could start cooking even though
+		// they aren't dirty anymore (if the content of the outputs didn't change).
+		if (ioCommand.GetRule().mHashOutputs && ioCommand.GetCookingState() == CookingState::Waiting)
 		{
-			++it; // Still cooking, check again later.
+			ApplyOutputHashes(ioCommand);
+
+			for (FileID output_id : ioCommand.mOutputs)
+			{
+				for (CookingCommandID dependent_id : output_id.GetFile().mInputOf)
+				{
+					CookingCommand& dependent     = GetCommand(dependent_id);
+					CookingState    cooking_state = dependent.GetCookingState();
+
+					// Commands in a more complicated state are handled like the other queued commands.
+					if (cooking_state == CookingState::Cooking || cooking_state == CookingState::Waiting || dependent.HasUnfinishedCook() || dependent.mIsReadingDepFile
+						|| dependent.NeedsDepFileRead() || dependent.mPendingInputHashCount > 0 || dependent.NeedsInputHashes())
+						commands.PushBack(dependent_id);
+					else
+						set_dirty_state(dependent, CookingCommand::NotDirty);
+				}
+			}
 		}
+
+		set_dirty_state(ioCommand, inDepFileState);
+	};
+
+	Vector<DepFileReader::Result>     dep_file_results;
+	Vector<DepFileReader::HashResult> hash_results;
+	mDepFileReader.TakeResults(dep_file_results, hash_results);
+
+	// Apply the input hashes computed by the DepFileReader, and update the commands that have all their hashes.
+	for (const DepFileReader::HashResult& result : hash_results)
+	{
+		if (result.mSuccess)
+			ApplyInputHash(result.mFileID, result.mUSN, result.mHash);
+
+		CookingCommand& command = GetCommand(result.mCommandID);
+		gAssert(command.mPendingInputHashCount > 0);
+		if (--command.mPendingInputHashCount > 0)
+			continue;
+
+		// Don't request the hashes again, the inputs that couldn't be hashed (or changed again since) are considered changed.
+		// If they changed again, the command will be queued again anyway.
+		if (command.GetCookingState() == CookingState::Cooking)
+			still_queued.PushBack(command.mID);
+		else if (command.NeedsDepFileRead())
+			commands.PushBack(command.mID);
 		else
+			update_dirty_state(command, CookingCommand::NotDirty);
+	}
+
+	// Apply the dep files read by the DepFileReader, and update these commands.
+	for (DepFileReader::Result& result : dep_file_results)
+	{
+		CookingCommand& command = GetCommand(result.mCommandID);
+		gAssert(command.mIsReadingDepFile);
+		command.mIsReadingDepFile = false;
+
+		// If the dep file changed again during the read, or the command started cooking again, the result is outdated.
+		// Handle the command like the others below (ie. read again or wait for the end of the cook).
+		if (result.mDepFileUSN != command.GetDepFile().GetFile().mLastChangeUSN || command.GetCookingState() == CookingState::Cooking)
+		{
+			commands.PushBack(command.mID);
+			continue;
+		}
+
+		CookingCommand::DirtyState dep_file_state = command.ApplyDepFile(result.mDepFileUSN, result.mSuccess, result.mInputs, result.mOutputs);
+
+		take_cook_results(command);
+
+		// If some inputs need to be hashed, the command is updated once the hashes are there.
+		if (dep_file_state == CookingCommand::NotDirty && RequestInputHashes(command))
+			continue;
+
+		update_dirty_state(command, dep_file_state);
+	}
+
+	// Note: more commands can be added while iterating (see update_dirty_state).
+	for (int command_index = 0; command_index < commands.Size(); ++command_index)
+	{
+		CookingCommandID command_id = commands[command_index];
+		CookingCommand&  command    = GetCommand(command_id);
+
+		// Still cooking, check again later.
+		if (command.GetCookingState() == CookingState::Cooking)
+		{
+			still_queued.PushBack(command_id);
+			continue;
+		}
+
+		// Finish the cooks that ended in error as soon as possible, the commands waiting for them can cook.
+		take_cook_results(command);
+
+		// Already being read or hashed, the command is updated once the results are there.
+		if (command.mIsReadingDepFile || command.mPendingInputHashCount > 0)
+			continue;
+
+		// If the dep file needs to be read (and exists), read it on the DepFileReader threads.
+		if (command.NeedsDepFileRead() && !command.GetDepFile().GetFile().IsDeleted())
 		{
-			// Update and remove from the list.
-			command.UpdateDirtyState();
-			it = mCommandsQueuedForUpdateDirtyState.Erase(it);
+			command.mIsReadingDepFile = true;
+			mDepFileReader.Read(command_id, command.GetDepFile().GetFile().mLastChangeUSN);
+			continue;
 		}
+
+		// If some inputs were written since the last cook, hash them on the DepFileReader threads to know if they actually changed.
+		if (RequestInputHashes(command))
+			continue;
+
+		// Otherwise update it now.
+		update_dirty_state(command, command.ReadDepFileIfNeeded());
 	}
 
+	// Now that the dirty states are up to date, push the commands requested by the UI.
+	ProcessUIRequests();
+
+	LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
+
+	for (CookingCommandID command_id : still_queued)
+		mCommandsQueuedForUpdateDirtyState.Insert(command_id);
+
+	for (CookingCommandID command_id : updated)
+		mCommandsToJournal.PushBack(command_id);
+
 	return !mCommandsQueuedForUpdateDirtyState.Empty();
 }
 
 
+void CookingSystem::ApplyOutputHashes(CookingCommand& ioCommand)
+{
+	// Note: the hashes were written by the cooking thread before setting the state to Waiting, and the command can't cook again until it's not Waiting anymore.
+	gAssert(ioCommand.GetCookingState() == CookingState::Waiting);
+
+	for (int i = 0; i < ioCommand.mOutputHashes.Size(); ++i)
+	{
+		const CookingCommand::OutputHash& output_hash = ioCommand.mOutputHashes[i];
+		if (output_hash.mUSN == 0)
+			continue; // Not hashed.
+
+		FileInfo& file = ioCommand.mOutputs[i].GetFile();
+
+		// The content only didn't change if the previous hash was still valid when the cook started (ie. the file wasn't modified by something else since).
+		bool same_content = file.mContentHashUSN != 0 && file.mContentHashUSN == output_hash.mPreviousUSN && file.mContentHash == output_hash.mHash;
+		if (!same_content)
+			file.mLastContentChangeUSN = output_hash.mUSN;
+
+		file.mContentHash    = output_hash.mHash;
+		file.mContentHashUSN = output_hash.mUSN;
+	}
+
+	ioCommand.mOutputHashes.Clear();
+}
+
+
+void CookingSystem::TakeCookInputHashes(CookingCommand& ioCommand)
+{
+	// Note: the hashes were written by the cooking thread before the cook ended (or became Waiting), and the command can't cook again until it's finished.
+	if (!ioCommand.mHasCookInputHashes)
+		return;
+
+	gSwap(ioCommand.mInputHashes, ioCommand.mCookInputHashes);
+	ioCommand.mCookInputHashes.Clear();
+	ioCommand.mHasCookInputHashes = false;
+}
+
+
+void CookingSystem::FinishedCooking(CookingCommand& ioCommand)
+{
+	CookingLogEntry& log_entry = *ioCommand.mLastCookingLog;
+
+	// The cooking thread is done with the command, and the cooking queue still considers it cooking so it can't be popped again.
+	// Nothing else writes the state of the cook while it's copied.
+	TakeCookInputHashes(ioCommand); // If the cook ended before being Waiting, they're not taken yet.
+	ioCommand.UpdateCacheState();
+
+	// Notify the queue that this command has officially finished cooking.
+	mCommandsToCook.FinishedCooking(log_entry);
+}
+
+
+bool CookingSystem::RequestInputHashes(CookingCommand& ioCommand)
+{
+	gAssert(ioCommand.mPendingInputHashCount == 0);
+
+	// Note: if several commands use the same input, it might get hashed more than once. Only the first result is applied.
+	for (const CookingCommand::InputHash& input_hash : ioCommand.mInputHashes)
+	{
+		if (!ioCommand.NeedsInputHash(input_hash.mFileID.GetFile()))
+			continue;
+
+		mDepFileReader.Hash(ioCommand.mID, input_hash.mFileID);
+		ioCommand.mPendingInputHashCount++;
+	}
+
+	return ioCommand.mPendingInputHashCount > 0;
+}
+
+
+void CookingSystem::ApplyInputHash(FileID inFileID, USN inUSN, uint64 inHash)
+{
+	FileInfo& file = inFileID.GetFile();
+
+	// Ignore the hash if the file changed again since, or if it already has one.
+	if (inUSN != file.mLastChangeUSN || file.IsContentHashValid())
+		return;
+
+	// We don't know what the content was before this change, so it counts as a change for the commands that don't have an InputHash.
+	file.mContentHash          = inHash;
+	file.mContentHashUSN       = inUSN;
+	file.mLastContentChangeUSN = inUSN;
+}
+
+
 void CookingSystem::UpdateAllDirtyStates()
 {
 	LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
 
-	for (CookingCommand& command : mCommands)
-		command.UpdateDirtyState();
+	const int command_count = mCommands.Size();
+
+	Vector<CookingCommand::DirtyState> dirty_states;
+	dirty_states.Resize(command_count);
+
+	// Read the dep files on worker threads, then apply them in order (this updates the InputOf/OutputOf lists, so it can't be done on several threads).
+	// Note: This is done by batches to limit the memory used by the content of the dep files.
+	{
+		Vector<CookingCommandID> dep_file_commands;
+		for (const CookingCommand& command : mCommands)
+			if (command.NeedsDepFileRead())
+				dep_file_commands.PushBack(command.mID);
+
+		constexpr int cDepFilesPerBatch = 16 * 1024;
+		constexpr int cDepFilesPerRange = 64;
+		Vector<DepFileReader::Result> results;
+
+		for (int batch_begin = 0; batch_begin < dep_file_commands.Size(); batch_begin += cDepFilesPerBatch)
+		{
+			int batch_size = gMin(cDepFilesPerBatch, dep_file_commands.Size() - batch_begin);
+			results.Clear();
+			results.Resize(batch_size);
+
+			sParallelFor("Read Dep Files Thread", (batch_size + cDepFilesPerRange - 1) / cDepFilesPerRange, [&](int inRangeIndex)
+			{
+				int begin = inRangeIndex * cDepFilesPerRange;
+				int end   = gMin(begin + cDepFilesPerRange, batch_size);
+
+				for (int i = begin; i < end; ++i)
+				{
+					const CookingCommand&  command  = GetCommand(dep_file_commands[batch_begin + i]);
+					const FileInfo&        dep_file = command.GetDepFile().GetFile();
+					DepFileReader::Result& result   = results[i];
+
+					// If the file is deleted, don't actually try to read it.
+					result.mDepFileUSN = dep_file.mLastChangeUSN;
+					result.mSuccess    = dep_file.IsDeleted() || gReadDepFile(command.GetRule().mDepFileFormat, command.GetDepFile(), result.mInputs, result.mOutputs);
+				}
+			});
+
+			for (int i = 0; i < batch_size; ++i)
+			{
+				CookingCommand&        command = GetCommand(dep_file_commands[batch_begin + i]);
+				DepFileReader::Result& result  = results[i];
+				dirty_states[command.mID.mIndex] = command.ApplyDepFile(result.mDepFileUSN, result.mSuccess, result.mInputs, result.mOutputs);
+			}
+		}
+	}
+
+	// Hash the inputs that were written since the last cook of the commands that need to know if their content changed (see CookingRule::mHashInputs).
+	{
+		Vector<FileID>  files_to_hash;
+		HashSet<FileID> files_seen;
+		for (const CookingCommand& command : mCommands)
+		{
+			for (const CookingCommand::InputHash& input_hash : command.mInputHashes)
+			{
+				if (!command.NeedsInputHash(input_hash.mFileID.GetFile()) || files_seen.Find(input_hash.mFileID) != files_seen.End())
+					continue;
+
+				files_seen.Insert(input_hash.mFileID);
+				files_to_hash.PushBack(input_hash.mFileID);
+			}
+		}
+
+		struct HashResult
+		{
+			USN    mUSN     = 0;
+			uint64 mHash    = 0;
+			bool   mSuccess = false;
+		};
+		Vector<HashResult> results;
+		results.Resize(files_to_hash.Size());
+
+		constexpr int cFilesPerRange = 64;
+		sParallelFor("Hash Inputs Thread", (files_to_hash.Size() + cFilesPerRange - 1) / cFilesPerRange, [&](int inRangeIndex)
+		{
+			int begin = inRangeIndex * cFilesPerRange;
+			int end   = gMin(begin + cFilesPerRange, files_to_hash.Size());
+
+			for (int i = begin; i < end; ++i)
+				results[i].mSuccess = gFileSystem.ReadCurrentUSNAndHash(files_to_hash[i], results[i].mUSN, results[i].mHash) == OpenFileError::NoError;
+		});
+
+		for (int i = 0; i < files_to_hash.Size(); ++i)
+		{
+			if (results[i].mSuccess)
+				ApplyInputHash(files_to_hash[i], results[i].mUSN, results[i].mHash);
+		}
+	}
+
+	// Check the inputs and outputs of the commands on worker threads. This only reads the FileInfos.
+	constexpr int cCommandsPerRange = 4096;
+	Vector<uint8> all_outputs_written;
+	all_outputs_written.Resize(command_count);
+
+	sParallelFor("Dirty State Thread", (command_count + cCommandsPerRange - 1) / cCommandsPerRange, [&](int inRangeIndex)
+	{
+		int begin = inRangeIndex * cCommandsPerRange;
+		int end   = gMin(begin + cCommandsPerRange, command_count);
+
+		for (int command_index = begin; command_index < end; ++command_index)
+		{
+			bool written = false;
+			dirty_states[command_index] |= mCommands[command_index].ComputeDirtyState(written);
+			all_outputs_written[command_index] = written;
+		}
+	});
+
+	// Store the results and fill the queues, in command order.
+	for (int command_index = 0; command_index < command_count; ++command_index)
+	{
+		CookingCommand& command = mCommands[command_index];
+		command.SetDirtyState(dirty_states[command_index], all_outputs_written[command_index]);
+
+		// Nothing is cooking yet, what was loaded from the cache is the last finished cook.
+		command.UpdateCacheState();
+
+		if (command.NeedsJournaling())
+			mCommandsToJournal.PushBack(command.mID);
+	}
 
 	mCommandsQueuedForUpdateDirtyState.Clear();
 }
 
 
-void CookingSystem::ForceCook(CookingCommandID inCommandID)
+void CookingSystem::TakeCommandsToJournal(Vector<CookingCommandID>& outCommands)
 {
-	auto& command       = GetCommand(inCommandID);
-	auto  cooking_state = command.GetCookingState();
+	LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
+
+	outCommands.Clear();
+	gSwap(outCommands, mCommandsToJournal);
+}
 
-	if (cooking_state == CookingState::Cooking || cooking_state == CookingState::Waiting)
-		return; // Already cooking, don't do anything.
 
-	// Remove it from the queue (if present) and add it at the front.
-	mCommandsToCook.Remove(inCommandID);
-	mCommandsToCook.Push(inCommandID, PushPosition::Front);
+void CookingSystem::ForceCook(CookingCommandID inCommandID)
+{
+	// Called from the UI thread, let the monitor thread push it (see ProcessUIRequests).
+	{
+		LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
+		mForceCookRequests.PushBack(inCommandID);
+	}
+	gFileSystem.KickMonitorDirectoryThread();
 }
 
 
 void CookingSystem::CookingThreadFunction(CookingThread& ioThread)
 {
+	Vector<CookingCommandID> batch;
+
+	// Stop the workers when the thread exits.
+	defer
+	{
+		for (CookingWorker* worker : ioThread.mWorkers)
+			sStopWorker(worker);
+
+		ioThread.mWorkers.Clear();
+	};
+
 	while (true)
 	{
 		CookingCommandID command_id = mCommandsToCook.Pop();
@@ -1477,32 +3656,52 @@ void CookingSystem::CookingThreadFunction(CookingThread& ioThread)
 
 		if (command_id.IsValid())
 		{
-			CookingCommand&	 command   = GetCommand(command_id);
-			CookingLogEntry& log_entry = AllocateCookingLogEntry(command_id);
+			CookingCommand&	   command   = GetCommand(command_id);
+			const CookingRule& rule      = command.GetRule();
+			bool               cleanup   = (command.mDirtyState & CookingCommand::AllStaticInputsMissing) != 0;
+
+			// If the rule is batched, grab more commands of the same rule to cook them together.
+			batch.Clear();
+			batch.PushBack(command_id);
+			if (rule.IsBatched() && !cleanup)
+				mCommandsToCook.PopBatch(rule.mID, rule.mBatchSize - 1, batch);
+
+			for (CookingCommandID batch_command_id : batch)
+			{
+				CookingLogEntry& log_entry = AllocateCookingLogEntry(batch_command_id);
 
-			// Set the log entry on the command.
-			command.mLastCookingLog = &log_entry;
+				// Set the log entry on the command.
+				GetCommand(batch_command_id).mLastCookingLog = &log_entry;
+				GetCommand(batch_command_id).mLastCookingLogID.Store(log_entry.mID);
+			}
 
 			// Set the current log entry for the cooking thread.
-			ioThread.mCurrentLogEntry.Store(log_entry.mID);
+			// For batches, only the first command is displayed.
+			ioThread.mCurrentLogEntry.Store(command.mLastCookingLog->mID);
 
-			if (command.mDirtyState & CookingCommand::AllStaticInputsMissing)
+			bool finished = true;
+			if (cleanup)
 				CleanupCommand(command, ioThread);
-			else
-				CookCommand(command, ioThread);
-
-			if (log_entry.mCookingState.Load() == CookingState::Error)
+			else if (rule.IsBatched())
 			{
-				// Update the total count of errors.
-				mCookingErrors.Add(1);
+				TempVector<CookingCommand*> batch_commands;
+				for (CookingCommandID batch_command_id : batch)
+					batch_commands.PushBack(&GetCommand(batch_command_id));
 
-				// Notify the system that this command has officially finished cooking.
-				mCommandsToCook.FinishedCooking(log_entry);
+				CookCommandBatch(batch_commands, ioThread);
+			}
+			else
+				finished = CookCommand(command, ioThread);
 
-				// If the command ends in error, we need to make sure that its dirty state is updated.
-				// That normally happens when the outputs (and the dep file) are written, but that might not happen at all if there is an error.
-				// This is important to then properly detect when the inputs change again and the command can re-cook.
-				QueueUpdateDirtyState(command_id);
+			// If the command was handed to the process executor, it takes care of the errors.
+			if (finished)
+			{
+				for (CookingCommandID batch_command_id : batch)
+				{
+					CookingLogEntry& log_entry = *GetCommand(batch_command_id).mLastCookingLog;
+					if (log_entry.mCookingState.Load() == CookingState::Error)
+						FinishedCookingWithError(log_entry);
+				}
 			}
 
 			// Remove the current log entry for the cooking thread.
@@ -1528,12 +3727,56 @@ CookingLogEntry& CookingSystem::AllocateCookingLogEntry(CookingCommandID inComma
 }
 
 
+void CookingSystem::FinishProcessCook(CookingCommandID inCommandID, String& ioOutput, ProcessResult inResult, StringPool& ioStringPool)
+{
+	CookingCommand&  command   = GetCommand(inCommandID);
+	CookingLogEntry& log_entry = *command.mLastCookingLog;
+
+	if (inResult == ProcessResult::Cancelled)
+		ioOutput.Append("\n[cancelled] An input changed while cooking, the command will cook again.\n");
+
+	// Don't wait for the USN journal to know if outputs are missing.
+	if (inResult == ProcessResult::Success && !sCheckOutputsWritten(command, ioOutput))
+		inResult = ProcessResult::Error;
+
+	if (inResult == ProcessResult::Success && command.mActionKey != Hash128{})
+		mActionCache.Store(command.mActionKey, inCommandID, log_entry.mID, command.mCookDepFileInputs);
+
+	// Set the end time and add the duration at the end of the log.
+	log_entry.mTimeEnd = gGetSystemTimeAsFileTime();
+	gAppendFormat(ioOutput, "\nDuration: %.3f seconds\n", (double)(log_entry.mTimeEnd - log_entry.mTimeStart) / 1'000'000'000.0);
+
+	if (inResult == ProcessResult::Cancelled)
+	{
+		log_entry.mOutput = ioStringPool.AllocateCopy(ioOutput);
+		gParseANSIColors(log_entry.mOutput, log_entry.mOutputFormatSpans);
+		log_entry.mCookingState.Store(CookingState::Cancelled);
+
+		// Updating the dirty state will finish the cook (see FinishedCooking) and queue the command again.
+		QueueUpdateDirtyState(inCommandID);
+		return;
+	}
+
+	FinishCook(command, ioStringPool.AllocateCopy(ioOutput), inResult == ProcessResult::Success, log_entry.mTimeEnd - log_entry.mTimeStart);
+
+	if (log_entry.mCookingState.Load() == CookingState::Error)
+		FinishedCookingWithError(log_entry);
+
+	// Make sure the file changes are processed as soon as possible (even if there was an error, there might be some files written).
+	gFileSystem.KickMonitorDirectoryThread();
+}
+
+
 bool CookingSystem::IsIdle() const
 {
 	// If there are things to cook, we're not idle.
 	if (!mCommandsToCook.IsEmpty())
 		return false;
 
+	// If processes are still running, we're not idle.
+	if (mProcessExecutor.GetInFlightCount() > 0)
+		return false;
+
 	// If any worker is busy, we're not idle.
 	for (auto& thread : mCookingThreads)
 		if (thread.mCurrentLogEntry.Load() != CookingLogEntryID::cInvalid())
@@ -1549,11 +3792,21 @@ bool CookingSystem::IsIdle() const
 				return false;
 	}
 
-	// If any command needs a dirty state update, we're not idle.
+	// If any dep file is being read, we're not idle.
+	if (mDepFileReader.GetPendingCount() > 0)
+		return false;
+
+	// If any output is being stored in the action cache, we're not idle.
+	if (mActionCache.GetPendingCount() > 0)
+		return false;
+
+	// If any command needs a dirty state update (or the UI asked to cook something), we're not idle.
 	{
 		LockGuard lock(mCommandsQueuedForUpdateDirtyStateMutex);
 		if (!mCommandsQueuedForUpdateDirtyState.Empty())
 			return false;
+		if (!mForceCookRequests.Empty() || mQueueDirtyCommandsRequested || mQueueErroredCommandsRequested)
+			return false;
 	}
 
 	// If we're still initializing, we're not idle.
@@ -9,6 +9,11 @@
 #include "Strings.h"
 #include "FileSystem.h"
 #include "CookingSystemIDs.h"
+#include "ProcessExecutor.h"
+#include "DepFileReader.h"
+#include "ActionCache.h"
+#include "PathPattern.h"
+#include "CommandVariables.h"
 
 #include <Bedrock/String.h>
 #include <Bedrock/Thread.h>
@@ -18,14 +23,17 @@
 #include <Bedrock/Atomic.h>
 #include <Bedrock/HashMap.h>
 
+struct CookingWorker;
+
 
 
 struct InputFilter
 {
-	uint32     mRepoIndex = FileID::cInvalid().mRepoIndex;
-	StringView mPathPattern;
+	uint32              mRepoIndex = FileID::cInvalid().mRepoIndex;
+	StringView          mPathPattern;
+	CompiledPathPattern mCompiledPathPattern;
 
-	bool       Pass(const FileInfo& inFile) const;
+	bool                Pass(const FileInfo& inFile) const;
 };
 
 
@@ -83,17 +91,62 @@ struct CookingRule : NoCopy
 	uint16                   mVersion             = 0;
 	CommandType              mCommandType         = CommandType::CommandLine;
 	bool                     mMatchMoreRules      = false; // If false, we'll stop matching rules once an input file is matched with this rule. If true, we'll keep looking.
+	bool                     mHashOutputs         = false; // If true, the outputs are hashed after cooking. Commands using them don't cook again if an output was written with the same content.
+	bool                     mHashInputs          = false; // If true, the inputs are hashed before cooking. The command doesn't cook again if an input is written with the same content.
+	bool                     mUseActionCache      = false; // If true, the outputs are stored in the action cache after cooking, and restored from it instead of cooking when the inputs are the same again. Implies HashInputs.
 	DepFileFormat            mDepFileFormat       = DepFileFormat::AssetCooker;
 	StringView               mDepFilePath;        // Optional file containing extra inputs/ouputs for the command.
 	StringView               mDepFileCommandLine; // Optional separate command line used to generate the dep file (in case the main command cannot generate it directly).
-	StringView               mCommandLine;
+	StringView               mCommandLine;        // When batched, this is the part of the command line specific to each command, written as one line of the response file.
+	int16                    mBatchSize           = 1;  // Maximum number of commands cooked by a single process. 1 means no batching.
+	StringView               mBatchCommandLine;   // Command line used to cook a batch of commands. Supports the ResponseFile CommandVariable.
+	StringView               mWorkerCommandLine;  // Optional command line of a long-lived worker process. If set, the CommandLine is sent to a worker instead of being run (see CookingWorker).
+	int                      mTimeout             = 0;  // In seconds. If cooking takes longer, the processes are killed and it's an error. Zero means no timeout.
 	Vector<InputFilter>      mInputFilters;
 	Vector<StringView>       mInputPaths;
 	Vector<StringView>       mOutputPaths;
 
+	// The strings above compiled by ValidateRules, to format them without parsing them every time.
+	CommandTemplate          mDepFilePathTemplate;
+	CommandTemplate          mDepFileCommandLineTemplate;
+	CommandTemplate          mCommandLineTemplate;
+	CommandTemplate          mBatchCommandLineTemplate;
+	CommandTemplate          mWorkerCommandLineTemplate;
+	Vector<CommandTemplate>  mInputPathTemplates;
+	Vector<CommandTemplate>  mOutputPathTemplates;
+
 	mutable AtomicInt32      mCommandCount = 0;
+	mutable AtomicInt64      mTotalCookDurationMs = 0; // Sum of the last cook duration of the commands that have one.
+	mutable AtomicInt32      mCookDurationCount   = 0; // Number of commands that have a last cook duration.
 
 	bool                     UseDepFile() const { return !mDepFilePath.Empty(); }
+	bool                     IsBatched() const { return mBatchSize > 1; }
+	bool                     UseWorkers() const { return !mWorkerCommandLine.Empty(); }
+	bool                     UseInputHashes() const { return mHashInputs || mUseActionCache; } // The action cache needs the input hashes for its keys.
+	uint32                   GetAverageCookDurationMs() const; // Used to estimate the duration of commands that never cooked.
+};
+
+
+// Index of the rules, to only test the rules that can match a file instead of all of them.
+// InputFilters with a fixed extension (eg. "*.png") are in a bucket per repo and extension, the other ones in a bucket per repo.
+struct RuleIndex
+{
+	void                     Build(Span<const CookingRule> inRules);
+
+	// Get the rules that might match this file, in declaration order. Their InputFilters still need to be tested.
+	void                     GetCandidateRules(const FileInfo& inFile, TempVector<CookingRuleID>& outRules) const;
+
+private:
+	struct Range
+	{
+		int                  mBegin = 0;
+		int                  mEnd   = 0;
+	};
+
+	Span<const CookingRuleID> GetBucket(uint64 inKey) const;
+
+	HashMap<uint64, Range>   mBuckets;	// Key is the hash of the repo index and extension (see sGetRuleBucketKey).
+	Vector<CookingRuleID>    mRuleIDs;	// Rules of all the buckets, sorted by declaration order in each bucket.
 };
 
 
@@ -104,6 +157,7 @@ enum class CookingState : uint8
 	Waiting,	// After cooking, we need to wait a little to get the USN events and see if all outputs were written (otherwise it's an Error instead of Success).
 	Error,		// TODO: maybe we need a second error value for the kind that will never go away (ie. generating command line fails)
 	Success,
+	Cancelled,	// An input changed while cooking, the processes were killed and the command will cook again.
 	_Count,
 };
 
@@ -117,6 +171,7 @@ constexpr StringView gToStringView(CookingState inVar)
 		"Waiting",
 		"Error",
 		"Success",
+		"Cancelled",
 	};
 	static_assert(gElemCount(cNames) == (int)CookingState::_Count);
 
@@ -146,6 +201,8 @@ struct CookingCommand : NoCopy
 	Vector<FileID>      mOutputs;        // Static outputs.
 	Vector<FileID>      mDepFileInputs;  // Dynamic inputs specified by the dep file.
 	Vector<FileID>      mDepFileOutputs; // Dynamic outputs specified by the dep file.
+	Vector<FileID>      mCookDepFileInputs;  // Copy of mDepFileInputs for the cooking threads, made by the monitor thread when the command is pushed to the cooking queue.
+	Vector<FileID>      mCookDepFileOutputs; // Same for mDepFileOutputs. The monitor thread can update the originals while the command cooks (see ApplyDepFile).
 
 	enum DirtyState : uint8
 	{
@@ -162,20 +219,70 @@ struct CookingCommand : NoCopy
 
 	DirtyState                      mDirtyState          = NotDirty;
 	bool                            mIsQueued            = false;
+	bool                            mIsReadingDepFile    = false;	// True while the DepFileReader is reading the dep file. Only accessed by the monitor thread.
+	int                             mPendingInputHashCount = 0;	// Number of inputs the DepFileReader is hashing. Only accessed by the monitor thread.
 	uint16                          mLastCookRuleVersion = CookingRule::cInvalidVersion;
 	USN                             mLastDepFileRead     = 0;
 	USN                             mLastCookUSN         = 0;		// Value that represents the last time this command was cooked. All outputs USN have to be greater than this for the command to be NotDirty.
+	Atomic<USN>                     mCookStartUSN        = 0;		// Copy of mLastCookUSN published when a cook starts, for the monitor thread to cancel cooks whose inputs changed since (see QueueUpdateDirtyStates).
 	FileTime                        mLastCookTime        = {};
+	uint32                          mLastCookDurationMs  = 0;		// Duration of the last cook, 0 if unknown.
+	uint32                          mCriticalPathMs      = 0;		// Estimated duration of this command plus the longest chain of commands using its outputs. See CookingSystem::UpdateCriticalPathEstimates.
 	CookingLogEntry*                mLastCookingLog      = nullptr;
+	Atomic<CookingLogEntryID>       mLastCookingLogID;              // Same as mLastCookingLog, for the threads that only need to know if the command cooked again (see ActionCache::StoreAction).
+	const CookingLogEntry*          mJournaledCookingLog  = nullptr; // Last cooking log written to the cache journal.
+	USN                             mJournaledDepFileRead = 0;       // Last dep file content written to the cache journal.
 
-	void                            UpdateDirtyState();
+	struct OutputHash
+	{
+		USN                         mPreviousUSN = 0; // USN of the output before cooking.
+		USN                         mUSN         = 0; // USN of the output when it was hashed, or 0 if it wasn't.
+		uint64                      mHash        = 0;
+	};
+	Vector<OutputHash>              mOutputHashes; // Hashes of mOutputs computed by the cooking thread when the rule has HashOutputs. Applied to the FileInfos by CookingSystem::ApplyOutputHashes.
+
+	struct InputHash
+	{
+		FileID                      mFileID;
+		uint64                      mHash = 0;
+	};
+	Vector<InputHash>               mInputHashes;  // Hashes of the inputs before the last cook, when the rule has HashInputs. Only accessed by the monitor thread.
+	Vector<InputHash>               mCookInputHashes; // Same, computed by the cooking thread before the current cook. Moved to mInputHashes by CookingSystem::TakeCookInputHashes.
+	bool                            mHasCookInputHashes = false; // True if mCookInputHashes was filled for the current cook and wasn't moved yet.
+	Hash128                         mActionKey = {}; // Key of the last cook in the action cache, or zero if it has none (see sComputeActionKey).
+
+	// State of the last finished cook, as written to the cache. The cooking threads write the fields above while cooking, the monitor thread
+	// copies them here once the cook is finished (see CookingSystem::FinishedCooking), and the cache snapshot and journal only read these.
+	struct CacheState
+	{
+		const CookingLogEntry*      mLastCookingLog      = nullptr;
+		uint16                      mLastCookRuleVersion = CookingRule::cInvalidVersion;
+		USN                         mLastCookUSN         = 0;
+		FileTime                    mLastCookTime        = {};
+		uint32                      mLastCookDurationMs  = 0;
+	};
+	CacheState                      mCacheState;
+
+	void                            UpdateDirtyState();    // Same as ReadDepFileIfNeeded, then ComputeDirtyState, then SetDirtyState.
+	DirtyState                      ReadDepFileIfNeeded(); // Return Error if the dep file was out of date and couldn't be read. Not thread safe (updates the InputOf/OutputOf lists).
+	DirtyState                      ComputeDirtyState(bool& outAllOutputsWritten) const; // Only reads the FileInfos, can be called from several threads at once.
+	void                            SetDirtyState(DirtyState inDirtyState, bool inAllOutputsWritten); // Store the dirty state and add or remove the command from the queues.
+	void                            SetLastCookDuration(uint32 inDurationMs); // Also updates the rule average.
+	uint32                          GetCookDurationEstimateMs() const;
+	bool                            NeedsJournaling() const; // Return true if the state that is saved in the cache changed since it was last written to the cache journal.
+	void                            UpdateCacheState();      // Copy the state of the last cook to mCacheState. Only on the monitor thread, while the command can't cook.
+	bool                            HasUnfinishedCook() const { return mLastCookingLog != mCacheState.mLastCookingLog; } // Cooking, or not finished by the monitor thread yet.
 	bool                            IsDirty() const { return mDirtyState != NotDirty && !IsCleanedUp(); }
 	bool                            NeedsCleanup() const { return (mDirtyState & AllStaticInputsMissing) && !IsCleanedUp(); }
 	bool                            IsCleanedUp() const { return (mDirtyState & (AllStaticInputsMissing | AllOutputsMissing)) == (AllStaticInputsMissing | AllOutputsMissing); }
 
 	CookingState                    GetCookingState() const { return mLastCookingLog ? mLastCookingLog->mCookingState.Load() : CookingState::Unknown; }
 
-	bool                            ReadDepFile();
+	bool                            NeedsDepFileRead() const; // Return true if the dep file changed since it was last read.
+	bool                            NeedsInputHash(const FileInfo& inInput) const; // Return true if the input was written since the last cook, and needs to be hashed to know if its content changed.
+	bool                            NeedsInputHashes() const; // Same as NeedsInputHash, for any of the inputs hashed before the last cook.
+	bool                            IsInputContentUnchanged(const FileInfo& inInput) const; // Return true if the input has the same hash as before the last cook.
+	DirtyState                      ApplyDepFile(USN inDepFileUSN, bool inReadSuccess, Span<FileID> inInputs, Span<FileID> inOutputs); // Return Error if the read failed. Not thread safe (updates the InputOf/OutputOf lists).
 
 	FileID                          GetMainInput() const { return mInputs[0]; }
 	FileID                          GetDepFile() const;
@@ -183,6 +290,8 @@ struct CookingCommand : NoCopy
 
 	MultiSpanRange<const FileID, 2> GetAllInputs() const { return { mInputs, mDepFileInputs }; }
 	MultiSpanRange<const FileID, 2> GetAllOutputs() const { return { mOutputs, mDepFileOutputs }; }
+	MultiSpanRange<const FileID, 2> GetCookInputs() const { return { mInputs, mCookDepFileInputs }; }    // Same as GetAllInputs, for the cooking threads.
+	MultiSpanRange<const FileID, 2> GetCookOutputs() const { return { mOutputs, mCookDepFileOutputs }; } // Same as GetAllOutputs, for the cooking threads.
 };
 
 constexpr CookingCommand::DirtyState& operator|=(CookingCommand::DirtyState& ioA, CookingCommand::DirtyState inB) { return ioA = (CookingCommand::DirtyState)(ioA | inB); }
@@ -196,17 +305,19 @@ enum class PushPosition
 enum class RemoveOption : uint8
 {
 	None        = 0b00,
-	KeepOrder   = 0b01,
-	ExpectFound = 0b10	// For validation only, will assert if not found.
+	ExpectFound = 0b01	// For validation only, will assert if not found.
 };
 
 constexpr RemoveOption operator|(RemoveOption inA, RemoveOption inB) { return (RemoveOption)((uint8)inA | (uint8)inB); }
 constexpr bool         operator&(RemoveOption inA, RemoveOption inB) { return ((uint8)inA & (uint8)inB) != 0; }
 
 
+// Queue of commands sorted by priority.
+// Each priority bucket is a doubly linked list, with the links stored per command index, so that commands can be
+// removed (or moved to the front) in constant time while keeping the order. A command can only be in the queue once.
 struct CookingQueue : NoCopy
 {
-	void             Push(CookingCommandID inCommandID, PushPosition inPosition = PushPosition::Back);
+	void             Push(CookingCommandID inCommandID, PushPosition inPosition = PushPosition::Back); // If the command is already in the queue, it only moves when pushing to the front.
 	CookingCommandID Pop();
 
 	bool             Remove(CookingCommandID inCommandID, RemoveOption inOption = RemoveOption::None);	// Return true if removed.
@@ -216,43 +327,135 @@ struct CookingQueue : NoCopy
 	bool             IsEmpty() const { return GetSize() == 0; }
 
 	void             PushInternal(MutexLockGuard& ioLock, int inPriority, CookingCommandID inCommandID, PushPosition inPosition);
+	bool             RemoveInternal(MutexLockGuard& ioLock, int inPriority, CookingCommandID inCommandID, RemoveOption inOption);
 
 	struct PrioBucket
 	{
 		int                           mPriority = 0;
-		Vector<CookingCommandID>      mCommands; // TODO replace by a ring buffer or some kind of deque
+		int                           mSize     = 0;
+		CookingCommandID              mFirst;
+		CookingCommandID              mLast;
+		int64                         mNextFrontOrder = -1;	// Order of the next command pushed to the front.
+		int64                         mNextBackOrder  = 0;	// Order of the next command pushed to the back.
+		CookingCommandID              mCursor;				// Last command found by Seek, kept valid (with its position) when commands are added or removed.
+		int                           mCursorIndex    = 0;
+
+		bool                          IsEmpty() const { return mSize == 0; }
 
 		auto                          operator<=>(int inOrder) const { return mPriority <=> inOrder; }
 		auto                          operator==(int inOrder) const { return mPriority == inOrder; }
 		auto                          operator<=>(const PrioBucket& inOther) const { return mPriority <=> inOther.mPriority; }
 	};
 
+	// Iterate over the commands of a bucket, in order. The mutex must be locked.
+	CookingCommandID GetNext(CookingCommandID inCommandID) const { return mLinks[inCommandID.mIndex].mNext; }
+
+	// Find the command at this position in a bucket. The mutex must be locked.
+	// Walks from the closest of the first/last command and the cursor left by the previous Seek, so that finding
+	// the visible commands of a list that is being scrolled only costs the scrolled distance.
+	CookingCommandID Seek(PrioBucket& ioBucket, int inIndex);
+
 	Vector<PrioBucket> mPrioBuckets;
 	int                mTotalSize = 0;
 	mutable Mutex      mMutex;
+
+protected:
+	CookingCommandID PopBack(PrioBucket& ioBucket);
+	void             Unlink(PrioBucket& ioBucket, CookingCommandID inCommandID);
+
+	struct Link
+	{
+		CookingCommandID mPrev;
+		CookingCommandID mNext;
+		int64            mOrder     = 0;	// Increases from the front to the back of the bucket, to compare positions without walking.
+		bool             mIsInQueue = false;
+	};
+	Vector<Link>       mLinks; // Indexed by command index.
 };
 
 
-struct CookingThreadsQueue : CookingQueue
+// Queue used by the cooking threads.
+// Commands wait for the commands producing their inputs to finish before they can be popped, instead of waiting for entire priority buckets to be done.
+// If the inputs/outputs form a cycle, the edge that would close it is skipped, otherwise these commands would never run.
+// The commands that are ready to run are kept in a heap sorted by their critical path estimate (see CookingCommand::mCriticalPathMs),
+// so that long chains of commands start as early as possible. The priority is only a tie-breaker.
+struct CookingThreadsQueue : NoCopy
 {
-	void                    Push(CookingCommandID inCommandID, PushPosition inPosition = PushPosition::Back);
+	void                    Push(CookingCommandID inCommandID, PushPosition inPosition = PushPosition::Back); // Only on the monitor thread, reads the InputOf/OutputOf lists.
 	CookingCommandID        Pop();
+	void                    PopBatch(CookingRuleID inRuleID, int inMaxCount, Vector<CookingCommandID>& ioCommands); // Pop up to inMaxCount ready commands of that rule (that don't need cleanup), in pop order, without waiting.
+	bool                    Remove(CookingCommandID inCommandID, RemoveOption inOption = RemoveOption::None);	// Return true if removed.
+	void                    Clear();
 	void                    FinishedCooking(const CookingLogEntry& inLogEntry);
 
+	int                     GetSize() const;
+	bool                    IsEmpty() const { return GetSize() == 0; }
+
 	void                    RequestStop();
 
-	struct PrioData
+	// Push a command that waits for inProducers and that inConsumers wait for (if they're in the queue). Return true if it's ready to run.
+	// The mutex must be locked. Push gathers the producers/consumers from the files, this can be used directly by tests and benchmarks.
+	bool                    PushInternal(MutexLockGuard& ioLock, CookingCommandID inCommandID, int inPriority, uint32 inCriticalPathMs, 
+	                                     Span<const CookingCommandID> inProducers, Span<const CookingCommandID> inConsumers, PushPosition inPosition);
+	bool                    FinishedCookingInternal(MutexLockGuard& ioLock, CookingCommandID inCommandID); // Return true if some commands became ready.
+
+	mutable Mutex           mMutex;
+	ConditionVariable       mBarrier;       // Signaled when commands become ready, or when stopping.
+
+	enum class CommandStatus : uint8
+	{
+		None,    // Not in the queue.
+		Blocked, // In the queue, waiting for some producers to finish.
+		Ready,   // In the queue, in the ready heap.
+		Cooking, // Popped but not finished yet.
+	};
+
+	struct Waiter
+	{
+		CookingCommandID mCommandID;
+		uint32           mGeneration = 0;
+	};
+
+	// Order of the ready commands. Compared field by field, higher goes first.
+	struct SortKey
 	{
-		int mPriority            = 0;
-		int mCommandsBeingCooked = 0; // Number of commands not in the list anymore but still cooking.
+		uint32           mFrontOrder     = 0; // Non-zero for commands pushed to the front, latest push first.
+		uint32           mCriticalPathMs = 0;
+		int              mPriority       = 0; // Negated rule priority, lower priority values go first.
+		uint32           mPushOrder      = 0; // Latest push first.
+
+		auto             operator<=>(const SortKey&) const = default;
+	};
 
-		auto operator<=>(int inOrder) const { return mPriority <=> inOrder; }
-		auto operator==(int inOrder) const { return mPriority == inOrder; }
-		auto operator<=>(const PrioBucket& inOther) const { return mPriority <=> inOther.mPriority; }
+	struct CommandData
+	{
+		CommandStatus    mStatus                = CommandStatus::None;
+		uint32           mGeneration            = 0; // Incremented every time the command leaves the queue, to ignore outdated Waiters.
+		int              mPendingProducerCount  = 0; // Number of commands that need to finish before this one can run.
+		int              mHeapIndex             = -1;
+		uint32           mVisitMark             = 0; // Used by IsWaitingFor to not visit a command twice.
+		SortKey          mSortKey;
+		Vector<Waiter>   mWaiters;                   // Commands waiting for this one to finish.
 	};
-	Vector<PrioData>        mPrioData;
-	ConditionVariable		mBarrier;
-	bool                    mStopRequested = false;
+
+private:
+	CommandData&            GetCommandData(CookingCommandID inCommandID);
+	void                    AddWaiter(CookingCommandID inProducerID, CookingCommandID inWaiterID);
+	bool                    ReleaseWaiters(CookingCommandID inProducerID); // Return true if some commands became ready.
+	bool                    IsWaitingFor(CookingCommandID inWaiterID, CookingCommandID inProducerID); // Return true if inWaiterID waits for inProducerID to finish, directly or not.
+
+	void                    HeapPush(CookingCommandID inCommandID);
+	void                    HeapRemove(CookingCommandID inCommandID);
+	void                    HeapUpdate(int inIndex); // Move the command at that index up or down to restore the heap order.
+	bool                    HeapIsBefore(int inIndexA, int inIndexB) const;
+	void                    HeapSwap(int inIndexA, int inIndexB);
+
+	Vector<CookingCommandID> mReadyHeap;
+	Vector<CommandData>     mCommandData;   // Indexed by command index.
+	int                     mTotalSize      = 0;
+	uint32                  mPushCounter    = 0;
+	uint32                  mVisitCounter   = 0;
+	bool                    mStopRequested  = false;
 };
 
 
@@ -267,7 +470,9 @@ struct CookingSystem : NoCopy
 
 	CookingRule&                          AddRule() { return mRules.Emplace({}, CookingRuleID{ (int16)mRules.Size() }); }
 	StringPool&                           GetStringPool() { return mStringPool; }
+	void                                  BuildRuleIndex() { mRuleIndex.Build(GetRules()); } // Needs to be called once all the rules are added.
 	void                                  CreateCommandsForFile(FileInfo& ioFile);
+	void                                  CreateCommandsForAllFiles(); // Same as CreateCommandsForFile on every file, but on several threads. Only needed during init.
 
 	const CookingRule*                    FindRule(StringView inRuleName) const;
 	CookingCommand*                       FindCommandByMainInput(CookingRuleID inRule, FileID inFileID);
@@ -281,6 +486,8 @@ struct CookingSystem : NoCopy
 	bool                                  IsCookingPaused() const { return mCookingPaused; }
 	void                                  SetCookingThreadCount(int inThreadCount) { mWantedCookingThreadCount = inThreadCount; }
 	int                                   GetCookingThreadCount() const { return mWantedCookingThreadCount; }
+	void                                  SetMaxCommandsInFlight(int inCount) { mWantedMaxCommandsInFlight = inCount; }
+	int                                   GetMaxCommandsInFlight() const { return mWantedMaxCommandsInFlight; }
 	int									  GetCookingErrorCount() const { return mCookingErrors.Load(); }
 
 	int                                   GetCommandCount() const { return mCommands.Size(); } // Total number of commands, for debug/display.
@@ -291,12 +498,14 @@ struct CookingSystem : NoCopy
 	void                                  QueueUpdateDirtyState(CookingCommandID inCommandID);
 	bool                                  ProcessUpdateDirtyStates(); // Return true if there are still commands to update.
 	void                                  UpdateAllDirtyStates(); // Update the dirty state of all commands. Only needed during init.
+	void                                  TakeCommandsToJournal(Vector<CookingCommandID>& outCommands); // Get the commands that might need to be written to the cache journal.
 	void                                  UpdateNotifications();
 
-	void                                  ForceCook(CookingCommandID inCommandID);
+	void                                  ForceCook(CookingCommandID inCommandID); // The command is pushed to the front of the cooking queue by the monitor thread (see ProcessUIRequests).
 	bool                                  IsIdle() const; // Return true if nothing is happening. Used by the UI to decide if it needs to draw.
 
 	CookingLogEntry&                      AllocateCookingLogEntry(CookingCommandID inCommandID);
+	void                                  FinishProcessCook(CookingCommandID inCommandID, String& ioOutput, ProcessResult inResult, StringPool& ioStringPool); // Called by the ProcessExecutor when the processes of a command are done.
 
 	bool                                  mSlowMode = false; // Slows down cooking, for debugging.
 private:
@@ -307,21 +516,64 @@ private:
 	friend void gDrawDebugWindow();
 	struct CookingThread;
 
+	// Input or output of a NewCommand that wasn't known yet when MatchRules found it.
+	// It's only added by AddCommand, so that the FileIDs don't depend on which thread matched the rules first.
+	struct MissingFile
+	{
+		FileRepo*                         mRepo     = nullptr;
+		String                            mPath;
+		PathHash                          mPathHash;
+		bool                              mIsOutput = false;
+		int                               mIndex    = 0;	// Index in mInputs or mOutputs, which contains an invalid FileID until the file is added.
+	};
+
+	// Command found by MatchRules, but not added yet.
+	struct NewCommand
+	{
+		CookingRuleID                     mRuleID;
+		Vector<FileID>                    mInputs;
+		Vector<FileID>                    mOutputs;
+		Vector<MissingFile>               mMissingFiles;
+	};
+
+	void                                  MatchRules(const FileInfo& inFile, Vector<NewCommand>& outCommands); // Thread safe, doesn't add any file (see MissingFile).
+	void                                  AddCommand(NewCommand& ioNewCommand); // Not thread safe, adds the missing files and updates the InputOf/OutputOf lists.
+	void                                  ApplyOutputHashes(CookingCommand& ioCommand); // Store the hashes computed after cooking in the FileInfos of the outputs. Only on the monitor thread.
+	bool                                  RequestInputHashes(CookingCommand& ioCommand); // Queue the inputs that need a hash on the DepFileReader. Return false if there's none. Only on the monitor thread.
+	void                                  ApplyInputHash(FileID inFileID, USN inUSN, uint64 inHash); // Store the hash of an input in its FileInfo, if it's still up to date. Only on the monitor thread.
+	void                                  TakeCookInputHashes(CookingCommand& ioCommand); // Move the input hashes computed for the last cook to mInputHashes. Only on the monitor thread, once the cook is Waiting or ended.
+	void                                  FinishedCooking(CookingCommand& ioCommand); // Update the cache state and let the commands waiting for this one cook. Only on the monitor thread.
+
 	void                                  CookingThreadFunction(CookingThread& ioThread);
-	void                                  CookCommand(CookingCommand& ioCommand, CookingThread& ioThread);
+	bool                                  RunOnWorker(CookingThread& ioThread, const CookingRule& inRule, const FileInfo& inMainInput, StringView inRequest, StringPool::ResizableStringView& ioOutput);
+	bool                                  PrepareCook(CookingCommand& ioCommand, StringPool::ResizableStringView& ioOutput); // Return false if the command can't cook (see output).
+	void                                  FinishCook(CookingCommand& ioCommand, StringView inOutput, bool inSuccess, int64 inDurationNs);
+	bool                                  CookCommand(CookingCommand& ioCommand, CookingThread& ioThread); // Return false if the command was handed to the ProcessExecutor and is still cooking.
+	void                                  CookCommandBatch(Span<CookingCommand* const> inCommands, CookingThread& ioThread); // Cook commands of a batched rule with a single process.
 	void                                  CleanupCommand(CookingCommand& ioCommand, CookingThread& ioThread); // Delete all outputs.
+	void                                  FinishedCookingWithError(CookingLogEntry& ioLogEntry);
 	void                                  AddTimeOut(CookingLogEntry* inLogEntry);
 	void                                  TimeOutUpdateThread();
-	void                                  QueueDirtyCommands();
-	void                                  QueueErroredCommands();
+	void                                  QueueDirtyCommands(); // Only on the monitor thread (see ProcessUIRequests).
+	void                                  UpdateCriticalPathEstimates(); // Only on the monitor thread, reads the InputOf lists.
+	void                                  QueueErroredCommands(); // Same as ForceCook, for all the commands in error.
+	void                                  ProcessUIRequests(); // Apply the ForceCook/SetCookingPaused/QueueErroredCommands requests. Only on the monitor thread.
 
 	VMemArray<CookingRule>                mRules      = { 1024ull * 1024, 4096 };
+	RuleIndex                             mRuleIndex;
 	StringPool                            mStringPool = { 64ull * 1024 };
 	VMemArray<CookingCommand>             mCommands;
 
 	VMemHashSet<CookingCommandID>		  mCommandsQueuedForUpdateDirtyState;
+	Vector<CookingCommandID>              mCommandsToJournal;		// Commands that had their dirty state updated since the last TakeCommandsToJournal.
 	mutable Mutex						  mCommandsQueuedForUpdateDirtyStateMutex;
 
+	// Requests from the UI thread, also protected by mCommandsQueuedForUpdateDirtyStateMutex.
+	// Pushing to the cooking queue reads the InputOf/OutputOf lists of the files, so only the monitor thread can do it.
+	Vector<CookingCommandID>              mForceCookRequests;
+	bool                                  mQueueDirtyCommandsRequested   = false;
+	bool                                  mQueueErroredCommandsRequested = false;
+
 	CookingQueue                          mCommandsDirty;	// All dirty commands.
 	CookingThreadsQueue                   mCommandsToCook;	// Commands that will get cooked by the cooking threads.
 
@@ -330,11 +582,16 @@ private:
 		Thread						      mThread;
 		StringPool					      mStringPool;
 		Atomic<CookingLogEntryID>	      mCurrentLogEntry;
+		Vector<CookingWorker*>		      mWorkers;		// Worker processes started by this thread, at most one per rule.
 	};
 	FixedVector<CookingThread, 128>       mCookingThreads;
 	bool                                  mCookingStartPaused     = false;
 	bool                                  mCookingPaused          = true;
 	int                                   mWantedCookingThreadCount = 0;	// Number of threads requested. Actual number of threads created might be lower. 
+	int                                   mWantedMaxCommandsInFlight = 0;	// Max number of command line processes running at once. Zero/negative means same as the number of cooking threads.
+	ProcessExecutor                       mProcessExecutor;
+	DepFileReader                         mDepFileReader;
+	ActionCache                           mActionCache;
 
 	friend void                           gDrawCookingLog();
 	friend void                           gDrawSelectedCookingLogEntry();
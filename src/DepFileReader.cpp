@@ -0,0 +1,258 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#include "DepFileReader.h"
+#include "App.h"
+#include "Benchmark.h"
+#include "CookingSystem.h"
+#include "DepFile.h"
+
+#include <Bedrock/StringFormat.h>
+#include <Bedrock/Ticks.h>
+
+#include "win32/threads.h"
+
+
+void DepFileReader::Start(int inThreadCount)
+{
+	mThreadCount   = gClamp(inThreadCount, 1, cMaxThreadCount);
+	mStopRequested = false;
+
+	for (int i = 0; i < mThreadCount; ++i)
+	{
+		mThreads[i].Create({
+			.mName        = "Dep File Reader Thread",
+			.mTempMemSize = 1_MiB, // Dep files are read in temp memory.
+		}, [this](Thread&) { ThreadFunction(); });
+	}
+}
+
+
+void DepFileReader::Stop()
+{
+	{
+		LockGuard lock(mMutex);
+		mStopRequested = true;
+	}
+	mRequestAdded.NotifyAll();
+
+	for (Thread& thread : Span(mThreads, mThreadCount))
+		thread.Join();
+	mThreadCount = 0;
+
+	// Forget about the reads that didn't happen.
+	LockGuard lock(mMutex);
+	mRequests.Clear();
+	mResults.Clear();
+	mHashResults.Clear();
+	mPendingCount = 0;
+}
+
+
+void DepFileReader::Read(CookingCommandID inCommandID, USN inDepFileUSN)
+{
+	{
+		LockGuard lock(mMutex);
+		mRequests.PushBack({ .mCommandID = inCommandID, .mDepFileUSN = inDepFileUSN });
+		mPendingCount++;
+	}
+	mRequestAdded.NotifyOne();
+}
+
+
+void DepFileReader::Hash(CookingCommandID inCommandID, FileID inFileID)
+{
+	{
+		LockGuard lock(mMutex);
+		mRequests.PushBack({ .mCommandID = inCommandID, .mFileID = inFileID });
+		mPendingCount++;
+	}
+	mRequestAdded.NotifyOne();
+}
+
+
+void DepFileReader::TakeResults(Vector<Result>& outResults, Vector<HashResult>& outHashResults)
+{
+	outResults.Clear();
+	outHashResults.Clear();
+
+	LockGuard lock(mMutex);
+	gSwap(outResults, mResults);
+	gSwap(outHashResults, mHashResults);
+	mPendingCount -= outResults.Size() + outHashResults.Size();
+}
+
+
+int DepFileReader::GetPendingCount() const
+{
+	LockGuard lock(mMutex);
+	return mPendingCount;
+}
+
+
+void DepFileReader::ThreadFunction()
+{
+	while (true)
+	{
+		Request request;
+		{
+			LockGuard lock(mMutex);
+			while (!mStopRequested && mRequests.IsEmpty())
+				mRequestAdded.Wait(lock);
+
+			if (mStopRequested)
+				return;
+
+			request = mRequests.Front();
+			mRequests.PopFront();
+		}
+
+		if (request.mFileID.IsValid())
+		{
+			HashResult result;
+			result.mCommandID = request.mCommandID;
+			result.mFileID    = request.mFileID;
+			result.mSuccess   = gFileSystem.ReadCurrentUSNAndHash(request.mFileID, result.mUSN, result.mHash) == OpenFileError::NoError;
+
+			LockGuard lock(mMutex);
+			mHashResults.PushBack(result);
+		}
+		else
+		{
+			Result result;
+			result.mCommandID  = request.mCommandID;
+			result.mDepFileUSN = request.mDepFileUSN;
+
+			const CookingCommand& command = gCookingSystem.GetCommand(request.mCommandID);
+			result.mSuccess = gReadDepFile(command.GetRule().mDepFileFormat, command.GetDepFile(), result.mInputs, result.mOutputs);
+
+			LockGuard lock(mMutex);
+			mResults.PushBack(gMove(result));
+		}
+
+		// Let the monitor thread apply the result.
+		gFileSystem.KickMonitorDirectoryThread();
+	}
+}
+
+
+REGISTER_BENCHMARK("DepFileReader_Latency")
+{
+	// A sync writes many dep files at once, and another change arrives right behind them.
+	// Before the DepFileReader, the monitor thread read the dep files itself: the other change waited for all of them to be read.
+	// Now the monitor thread only queues the reads, the other change waits for that, and the reads are done on the worker threads.
+	// Note: Only the dep file reads are measured. Applying them and updating the dirty states is still done on the monitor thread.
+	constexpr int cDepFileCount     = 2000;
+	constexpr int cInputsPerDepFile = 20;
+	const int     thread_count      = gClamp(gThreadHardwareConcurrency() / 2, 1, DepFileReader::cMaxThreadCount); // Same as CookingSystem::StartCooking.
+
+	TempString root_path = gCreateBenchmarkDirectory("DepFileReader");
+
+	for (int file_index = 0; file_index < cDepFileCount; ++file_index)
+	{
+		TempString content;
+		for (int input_index = 0; input_index < cInputsPerDepFile; ++input_index)
+			content.Append(gTempFormat("INPUT:%sinputs\\input_%04d_%02d.txt\n", root_path.AsCStr(), file_index, input_index));
+
+		TempString dep_file_path = gTempFormat("%sfile_%04d.dep", root_path.AsCStr(), file_index);
+		FILE*      dep_file      = fopen(dep_file_path.AsCStr(), "wb");
+		if (dep_file == nullptr)
+		{
+			gAppLogError("DepFileReader: failed to create %s.", dep_file_path.AsCStr());
+			return;
+		}
+
+		fwrite(content.Data(), 1, content.Size(), dep_file);
+		fclose(dep_file);
+	}
+
+	// One command per dep file. The main inputs only exist in memory, the dep files are real.
+	FileRepo& repo = gFileSystem.AddRepo("DepFileReader", root_path);
+	for (int file_index = 0; file_index < cDepFileCount; ++file_index)
+		repo.GetOrAddFile(gTempFormat("file_%04d.src", file_index), FileType::File, {});
+
+	CookingRule& rule = gCookingSystem.AddRule();
+	rule.mName         = "DepFileReader";
+	rule.mDepFilePath  = R"({Repo:DepFileReader}{File}.dep)";
+
+	InputFilter& filter = rule.mInputFilters.EmplaceBack();
+	filter.mRepoIndex   = repo.mIndex;
+	filter.mPathPattern = "*.src";
+	filter.mCompiledPathPattern.Compile(filter.mPathPattern);
+
+	if (!rule.mDepFilePathTemplate.Compile(rule.mDepFilePath))
+	{
+		gAppLogError("DepFileReader: failed to compile the dep file path.");
+		return;
+	}
+
+	gCookingSystem.BuildRuleIndex();
+	gCookingSystem.CreateCommandsForAllFiles();
+
+	Vector<CookingCommandID> command_ids;
+	for (const FileInfo& file : repo.mFiles)
+		for (CookingCommandID command_id : file.mInputOf)
+			if (gCookingSystem.GetCommand(command_id).GetMainInput() == file.mID)
+				command_ids.PushBack(command_id);
+
+	if (command_ids.Size() != cDepFileCount)
+	{
+		gAppLogError("DepFileReader: %d commands created instead of %d.", command_ids.Size(), cDepFileCount);
+		return;
+	}
+
+	// Read everything once first, so that both measurements find the inputs already added and the dep files in the OS cache.
+	auto read_inline = [&]()
+	{
+		int success_count = 0;
+		for (CookingCommandID command_id : command_ids)
+		{
+			const CookingCommand& command = gCookingSystem.GetCommand(command_id);
+			Vector<FileID>        inputs, outputs;
+			if (gReadDepFile(command.GetRule().mDepFileFormat, command.GetDepFile(), inputs, outputs) && inputs.Size() == cInputsPerDepFile)
+				success_count++;
+		}
+		return success_count;
+	};
+	read_inline();
+
+	Timer  inline_timer;
+	int    inline_success_count = read_inline();
+	double inline_ms            = gTicksToSeconds(inline_timer.GetTicks()) * 1000.0;
+
+	DepFileReader reader;
+	reader.Start(thread_count);
+
+	Timer queue_timer;
+	for (CookingCommandID command_id : command_ids)
+		reader.Read(command_id, 0);
+	double queue_ms = gTicksToSeconds(queue_timer.GetTicks()) * 1000.0;
+
+	Vector<DepFileReader::Result>     results;
+	Vector<DepFileReader::HashResult> hash_results;
+	int                               result_count  = 0;
+	int                               success_count = 0;
+	while (result_count < cDepFileCount)
+	{
+		reader.TakeResults(results, hash_results);
+		if (results.Empty())
+			Sleep(1);
+
+		for (const DepFileReader::Result& result : results)
+			if (result.mSuccess && result.mInputs.Size() == cInputsPerDepFile)
+				success_count++;
+
+		result_count += results.Size();
+	}
+	double read_ms = gTicksToSeconds(queue_timer.GetTicks()) * 1000.0;
+
+	reader.Stop();
+
+	if (inline_success_count != cDepFileCount || success_count != cDepFileCount)
+		gAppLogError("DepFileReader: %d and %d dep files read correctly out of %d.", inline_success_count, success_count, cDepFileCount);
+
+	gAppLog("DepFileReader: %d dep files. Read on the monitor thread: %.1f ms. Queued in %.2f ms, read by %d threads in %.1f ms.",
+		cDepFileCount, inline_ms, queue_ms, thread_count, read_ms);
+}
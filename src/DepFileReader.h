@@ -0,0 +1,73 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include "Core.h"
+#include "FileSystem.h"
+#include "CookingSystemIDs.h"
+#include "Queue.h"
+
+#include <Bedrock/Vector.h>
+#include <Bedrock/Thread.h>
+#include <Bedrock/Mutex.h>
+#include <Bedrock/ConditionVariable.h>
+
+
+// Reads dep files on worker threads, so that the thread updating the dirty states doesn't wait for the disk.
+// Reading and parsing a dep file only adds files (which is thread safe). Applying the result to the command
+// updates the InputOf/OutputOf lists, so it's done by the caller (see CookingSystem::ProcessUpdateDirtyStates).
+// Also hashes the inputs of the rules with HashInputs, for the same reason.
+struct DepFileReader : NoCopy
+{
+	static constexpr int cMaxThreadCount = 8;
+
+	struct Result
+	{
+		CookingCommandID mCommandID;
+		USN              mDepFileUSN = 0;     // USN of the dep file when the read started. If it changed since, the result is outdated.
+		bool             mSuccess    = false;
+		Vector<FileID>   mInputs;
+		Vector<FileID>   mOutputs;
+	};
+
+	void Start(int inThreadCount);
+	void Stop();
+
+	struct HashResult
+	{
+		CookingCommandID mCommandID;
+		FileID           mFileID;
+		USN              mUSN     = 0;       // USN of the file when it was hashed. If it's not the current one, the hash is outdated.
+		uint64           mHash    = 0;
+		bool             mSuccess = false;
+	};
+
+	void Read(CookingCommandID inCommandID, USN inDepFileUSN); // Queue a read. The monitor thread is kicked when the result is ready.
+	void Hash(CookingCommandID inCommandID, FileID inFileID);  // Queue a hash of an input of that command. Same as Read otherwise.
+	void TakeResults(Vector<Result>& outResults, Vector<HashResult>& outHashResults); // Get the results of the reads and hashes that are done.
+	int  GetPendingCount() const;                               // Number of reads and hashes queued or in progress, including the results not taken yet.
+
+private:
+	struct Request
+	{
+		CookingCommandID mCommandID;
+		USN              mDepFileUSN = 0;
+		FileID           mFileID;             // If valid, this is a hash request.
+	};
+
+	void                 ThreadFunction();
+
+	Thread               mThreads[cMaxThreadCount];
+	int                  mThreadCount   = 0;
+
+	mutable Mutex        mMutex;
+	ConditionVariable    mRequestAdded;
+	Queue<Request>       mRequests;
+	Vector<Result>       mResults;
+	Vector<HashResult>   mHashResults;
+	int                  mPendingCount  = 0;
+	bool                 mStopRequested = false;
+};
@@ -10,6 +10,7 @@
 #include "DepFile.h"
 #include "BinaryReadWriter.h"
 #include "Strings.h"
+#include "Benchmark.h"
 #include <Bedrock/Algorithm.h>
 #include <Bedrock/Ticks.h>
 #include <Bedrock/Random.h>
@@ -23,6 +24,7 @@
 #include "xxHash/xxh3.h"
 
 #include <algorithm> // for std::sort, sad!
+#include <emmintrin.h>
 
 // Debug toggle to fake files failing to open, to test error handling.
 bool             gDebugFailOpenFileRandomly = false;
@@ -37,41 +39,145 @@ using PathBufferUTF16 = wchar_t[cWin32MaxPathSizeUTF16];
 using PathBufferUTF8  = char[cWin32MaxPathSizeUTF8];
 
 
-// Hash the absolute path of a file in a case insensitive manner.
-// That's used to get a unique identifier for the file even if the file itself doesn't exist.
-// The hash is 128 bits, assume no collision.
-// Clearly not the most efficient implementation, but good enough for now.
-PathHash gHashPath(StringView inAbsolutePath)
+// Number of wchars taken by the parent hash at the start of the buffers hashed by sHashPathComponent.
+constexpr int cParentHashSizeInWChars = sizeof(PathHash) / sizeof(wchar_t);
+
+
+// Convert a hash from XXH3 to our hash wrapper.
+static PathHash sToPathHash(XXH128_hash_t inHash)
 {
-	// Make sure it's normalized, absolute, and doesn't contain any relative components.
-	gAssert(gIsNormalized(inAbsolutePath));
-	gAssert(gIsAbsolute(inAbsolutePath));
+	PathHash      path_hash;
+	static_assert(sizeof(path_hash.mData) == sizeof(inHash));
+	memcpy(path_hash.mData, &inHash, sizeof(path_hash.mData));
+	return path_hash;
+}
 
+
+// Convert the name to uppercase UTF-16 and hash it after the parent hash.
+// This handles any unicode character, but needs two conversions through large buffers.
+static PathHash sHashPathComponentUnicode(PathHash inParentHash, StringView inName)
+{
 	// Convert it to wide char.
-	PathBufferUTF16 wpath_buffer;
-	WStringView     wpath = gUtf8ToWideChar(inAbsolutePath, wpath_buffer);
-	if (wpath.empty())
-		gAppFatalError("Failed to convert path %s to WideChar", inAbsolutePath.AsCStr());
+	PathBufferUTF16 wname_buffer;
+	WStringView     wname = gUtf8ToWideChar(inName, wname_buffer);
+	if (wname.empty())
+		gAppFatalError("Failed to convert path %s to WideChar", inName.AsCStr());
 
 	// TODO use gToLowerCase instead?
-	// Convert it to uppercase.
+	// Convert it to uppercase, after the parent hash.
 	// Note: LCMapStringA does not seem to work with UTF8 (or at least not with LOCALE_INVARIANT) so we are forced to use wchars here.
-	PathBufferUTF16 uppercase_buffer;
-	int uppercase_size = LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, wpath.data(), (int)wpath.size(), uppercase_buffer, gElemCount(uppercase_buffer) / 2, nullptr, nullptr, 0);
+	PathBufferUTF16 buffer;
+	memcpy(buffer, inParentHash.mData, sizeof(inParentHash.mData));
+	int uppercase_size = LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, wname.data(), (int)wname.size(), buffer + cParentHashSizeInWChars, (gElemCount(buffer) - cParentHashSizeInWChars) / 2, nullptr, nullptr, 0);
 	if (uppercase_size == 0)
-		gAppFatalError("Failed to convert path %s to uppercase", inAbsolutePath.AsCStr());
+		gAppFatalError("Failed to convert path %s to uppercase", inName.AsCStr());
 
-	WStringView uppercase_wpath = { uppercase_buffer, (size_t)uppercase_size };
+	// Hash the parent hash and the uppercase name.
+	return sToPathHash(XXH3_128bits(buffer, (cParentHashSizeInWChars + uppercase_size) * sizeof(buffer[0])));
+}
 
-	// Hash the uppercase version.
-	XXH128_hash_t hash_xx = XXH3_128bits(uppercase_wpath.data(), uppercase_wpath.size() * sizeof(uppercase_wpath[0]));
 
-	// Convert to our hash wrapper.
-	PathHash      path_hash;
-	static_assert(sizeof(path_hash.mData) == sizeof(hash_xx));
-	memcpy(path_hash.mData, &hash_xx, sizeof(path_hash.mData));
+// Max length of the names handled by the ASCII version of sHashPathComponent. Longer names (very rare) go through the unicode version.
+constexpr int cMaxHashPathASCIISize = 1024;
 
-	return path_hash;
+// Uppercase ASCII characters and widen them to UTF-16, which gives exactly the same result as the unicode version for ASCII strings.
+// Return false if a non-ASCII character is found.
+static bool sToUppercaseUTF16ASCII(StringView inPath, wchar_t* outBuffer)
+{
+	const char* src  = inPath.Data();
+	int         size = inPath.Size();
+	int         i    = 0;
+
+	// Process 16 characters at a time.
+	const __m128i zero       = _mm_setzero_si128();
+	const __m128i before_a   = _mm_set1_epi8('a' - 1);
+	const __m128i after_z    = _mm_set1_epi8('z' + 1);
+	const __m128i case_bit   = _mm_set1_epi8(0x20);
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i chars = _mm_loadu_si128((const __m128i*)(src + i));
+
+		// Non-ASCII characters have their high bit set.
+		if (_mm_movemask_epi8(chars) != 0)
+			return false;
+
+		// Clear the case bit of lowercase letters. Signed comparisons are fine since all characters are ASCII.
+		__m128i is_lower = _mm_and_si128(_mm_cmpgt_epi8(chars, before_a), _mm_cmplt_epi8(chars, after_z));
+		chars            = _mm_sub_epi8(chars, _mm_and_si128(is_lower, case_bit));
+
+		// Widen to 16 bits.
+		_mm_storeu_si128((__m128i*)(outBuffer + i),     _mm_unpacklo_epi8(chars, zero));
+		_mm_storeu_si128((__m128i*)(outBuffer + i + 8), _mm_unpackhi_epi8(chars, zero));
+	}
+
+	// Process the remaining characters one by one.
+	for (; i < size; ++i)
+	{
+		uint8 c = (uint8)src[i];
+		if (c >= 0x80)
+			return false;
+
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+
+		outBuffer[i] = (wchar_t)c;
+	}
+
+	return true;
+}
+
+
+// Hash a single path component (file or directory name) on top of the hash of its parent directory.
+// ASCII names (almost all of them) are converted without any OS call or large buffer, other names go through the unicode version.
+static PathHash sHashPathComponent(PathHash inParentHash, StringView inName)
+{
+	gAssert(!inName.Empty());
+
+	if (inName.Size() > cMaxHashPathASCIISize)
+		return sHashPathComponentUnicode(inParentHash, inName);
+
+	wchar_t buffer[cParentHashSizeInWChars + cMaxHashPathASCIISize];
+	if (!sToUppercaseUTF16ASCII(inName, buffer + cParentHashSizeInWChars))
+		return sHashPathComponentUnicode(inParentHash, inName);
+
+	// Hash the parent hash and the uppercase name.
+	memcpy(buffer, inParentHash.mData, sizeof(inParentHash.mData));
+	return sToPathHash(XXH3_128bits(buffer, (cParentHashSizeInWChars + inName.Size()) * sizeof(buffer[0])));
+}
+
+
+// Hash a path relative to a directory, given the hash of that directory.
+// The hash is built one component at a time, so that hashing a file inside a known directory only needs to hash its name.
+// Empty components are ignored, so trailing slashes don't change the hash.
+PathHash gHashPath(PathHash inParentHash, StringView inRelativePath)
+{
+	PathHash hash            = inParentHash;
+	int      component_start = 0;
+	for (int i = 0; i <= inRelativePath.Size(); ++i)
+	{
+		if (i == inRelativePath.Size() || inRelativePath[i] == '\\')
+		{
+			if (i > component_start)
+				hash = sHashPathComponent(hash, inRelativePath.SubStr(component_start, i - component_start));
+
+			component_start = i + 1;
+		}
+	}
+
+	return hash;
+}
+
+
+// Hash the absolute path of a file in a case insensitive manner.
+// That's used to get a unique identifier for the file even if the file itself doesn't exist.
+// The hash is 128 bits, assume no collision.
+PathHash gHashPath(StringView inAbsolutePath)
+{
+	// Make sure it's normalized, absolute, and doesn't contain any relative components.
+	gAssert(gIsNormalized(inAbsolutePath));
+	gAssert(gIsAbsolute(inAbsolutePath));
+
+	return gHashPath(PathHash{}, inAbsolutePath);
 }
 
 
@@ -128,7 +234,7 @@ TempString FileInfo::ToString() const
 }
 
 
-FileInfo::FileInfo(FileID inID, StringView inPath, Hash128 inPathHash, FileType inType, FileRefNumber inRefNumber)
+FileInfo::FileInfo(FileID inID, StringView inPath, Hash128 inPathHash, FileType inType, FileRefNumber inRefNumber, FileID inParentDirID)
 	: mID(inID)
 	, mNamePos(sFindNamePos(inPath))
 	, mExtensionPos(sFindExtensionPos(mNamePos, inPath))
@@ -138,11 +244,118 @@ FileInfo::FileInfo(FileID inID, StringView inPath, Hash128 inPathHash, FileType
 	, mIsDepFile(false)
 	, mCommandsCreated(false)
 	, mRefNumber(inRefNumber)
+	, mParentDirID(inParentDirID)
 {
 	gAssert(gIsNormalized(inPath));
 }
 
 
+void ScanQueue::Push(int inWorkerIndex, FileID inDirID)
+{
+	// Count it before it becomes visible to other workers, otherwise they could see the count reach zero and exit too early.
+	mPendingDirCount.Add(1);
+
+	{
+		Worker& worker = mWorkers[inWorkerIndex];
+		LockGuard lock(worker.mMutex);
+		worker.mDirectories.PushBack(inDirID);
+	}
+
+	// Wake up a worker if some are waiting for something to do.
+	// Note: the push count is incremented before checking the idle count, and idle workers do the opposite (see Pop), so at least one side sees the other.
+	mPushCount.Add(1);
+	if (mIdleWorkerCount.Load() > 0)
+		WakeUpIdleWorkers(false);
+}
+
+
+void ScanQueue::WakeUpIdleWorkers(bool inAll)
+{
+	// Lock to make sure a worker that just checked for work is either waiting already or will see the change.
+	{
+		LockGuard lock(mIdleMutex);
+	}
+
+	if (inAll)
+		mIdleCondition.NotifyAll();
+	else
+		mIdleCondition.NotifyOne();
+}
+
+
+FileID ScanQueue::TryPopOrSteal(int inWorkerIndex)
+{
+	// Pop from the back of our own deque first (depth first, better locality).
+	{
+		Worker& worker = mWorkers[inWorkerIndex];
+		LockGuard lock(worker.mMutex);
+		if (!worker.mDirectories.IsEmpty())
+		{
+			FileID dir_id = worker.mDirectories.Back();
+			worker.mDirectories.PopBack();
+			return dir_id;
+		}
+	}
+
+	// Otherwise steal from the front of another worker's deque (the oldest directories, closer to the root, more likely to contain a lot of work).
+	for (int i = 1; i < mWorkerCount; ++i)
+	{
+		Worker& victim = mWorkers[(inWorkerIndex + i) % mWorkerCount];
+		LockGuard lock(victim.mMutex);
+		if (!victim.mDirectories.IsEmpty())
+		{
+			FileID dir_id = victim.mDirectories.Front();
+			victim.mDirectories.PopFront();
+			return dir_id;
+		}
+	}
+
+	return FileID::cInvalid();
+}
+
+
+FileID ScanQueue::Pop(int inWorkerIndex)
+{
+	Worker& worker = mWorkers[inWorkerIndex];
+
+	// The directory popped previously is finished (all its sub-directories were pushed).
+	if (worker.mHasCurrentDir)
+	{
+		worker.mHasCurrentDir = false;
+		mPendingDirCount.Add(-1);
+
+		// If that was the last one, wake up the idle workers so that they can exit.
+		if (mPendingDirCount.Load() == 0)
+			WakeUpIdleWorkers(true);
+	}
+
+	while (true)
+	{
+		// Read the push count before trying to pop, to notice anything pushed after that.
+		int    push_count = mPushCount.Load();
+		FileID dir_id     = TryPopOrSteal(inWorkerIndex);
+		if (dir_id.IsValid())
+		{
+			worker.mHasCurrentDir = true;
+			return dir_id;
+		}
+
+		// Nothing pushed and not finished anymore, no other worker can push anything, we're done.
+		if (mPendingDirCount.Load() == 0)
+			return FileID::cInvalid();
+
+		// Other workers are still scanning and might push more directories. Wait until something is pushed or everything is done.
+		LockGuard lock(mIdleMutex);
+		mIdleWorkerCount.Add(1);
+
+		while (mPushCount.Load() == push_count && mPendingDirCount.Load() != 0)
+			mIdleCondition.Wait(lock);
+
+		mIdleWorkerCount.Add(-1);
+	}
+}
+
+
 
 
 
@@ -162,6 +375,7 @@ FileRepo::FileRepo(uint32 inIndex, StringView inName, StringView inRootPath, Fil
 	mIndex    = inIndex;
 	mName     = mStringPool.AllocateCopy(inName);
 	mRootPath = mStringPool.AllocateCopy(inRootPath);
+	mRootPathHash = gHashPath(mRootPath);
 
 	// Add this repo to the repo list in the drive.
 	mDrive.mRepos.PushBack(this);
@@ -195,111 +409,170 @@ FileInfo& FileRepo::GetOrAddFile(StringView inPath, FileType inType, FileRefNumb
 	gNormalizePath(path);
 
 	// Calculate the case insensitive path hash that will be used to identify the file.
-	PathHash  path_hash = gHashPath(gConcat(mRootPath, path));
+	PathHash path_hash = gHashPath(mRootPathHash, path);
+
+	return GetOrAddFileInternal(path, path_hash, FileID::cInvalid(), inType, inRefNumber);
+}
 
-	FileInfo*     file                 = nullptr;
-	FileRefNumber ref_number_to_remove = {};
 
+FileInfo& FileRepo::GetOrAddFile(FileID inParentDirID, StringView inName, FileType inType, FileRefNumber inRefNumber)
+{
+	const FileInfo& parent_dir = GetFile(inParentDirID);
+	gAssert(parent_dir.IsDirectory());
+	gAssert(!inName.Empty() && inName.FindFirstOf("\\/") == -1);
+
+	// Build the path.
+	TempString path;
+	if (!parent_dir.mPath.Empty()) // Root dir has an empty path, in this case don't add the slash.
 	{
-		// Lock during the entire operation because we need to reserve a file ID.
-		auto files_lock = mFiles.Lock();
+		path += parent_dir.mPath;
+		path += "\\";
+	}
+	path += inName;
+
+	// Only the name needs to be hashed, on top of the parent dir hash.
+	PathHash path_hash = gHashPath(PathHash{ parent_dir.mPathHash }, inName);
+
+	return GetOrAddFileInternal(path, path_hash, inParentDirID, inType, inRefNumber);
+}
 
-		// Prepare a new FileID in case this file wasn't already added.
-		FileID           new_file_id = { mIndex, (uint32)mFiles.SizeRelaxed() };
-		FileID           actual_file_id;
 
-		// Try to insert it to the path hash map.
+FileInfo& FileRepo::GetOrAddFileInternal(StringView inNormalizedPath, PathHash inPathHash, FileID inParentDirID, FileType inType, FileRefNumber inRefNumber, PathStorage inPathStorage)
+{
+	StringView path      = inNormalizedPath;
+	PathHash   path_hash = inPathHash;
+
+	// Check if the file is already known. This only locks one shard of the map, so most of the time it doesn't contend with other threads.
+	FileID file_id  = gFileSystem.mFilesByPathHash.Find(path_hash);
+	bool   is_new   = false;
+
+	if (!file_id.IsValid())
+	{
+		// If the file is not known yet, make sure its parent directory is, so that the file can be linked to it.
+		// This is what allows finding all the files inside a directory without going through the entire repo.
+		// Note: The parent directory might not exist (eg. output files that are not cooked yet), in which case it's added as deleted.
+		FileID parent_dir_id = inParentDirID;
+		if (!parent_dir_id.IsValid() && !path.Empty())
 		{
-			// TODO: not great to access these internals, maybe find a better way?
-			LockGuard map_lock(gFileSystem.mFilesByPathHashMutex);
+			StringView parent_dir_path = gNoTrailingSlash(path.SubStr(0, sFindNamePos(path)));
+			parent_dir_id = GetOrAddFile(parent_dir_path, FileType::Directory, FileRefNumber::cInvalid()).mID;
+		}
 
-			auto [_, value, result] = gFileSystem.mFilesByPathHash.Insert(path_hash, new_file_id);
-			if (result == EInsertResult::Found)
-			{
-				actual_file_id = value;
+		// Lock the shard of the path hash map for this path. This is what prevents two threads from adding the same file,
+		// and unlike the mFiles lock it's only shared with the paths that fall in the same shard.
+		// TODO: not great to access these internals, maybe find a better way?
+		auto&     path_shard = gFileSystem.mFilesByPathHash.GetShard(path_hash);
+		LockGuard path_lock(path_shard.mMutex);
 
-				if (inRefNumber.IsValid())
-				{
-					FileInfo& file = GetFile(actual_file_id);
-
-					// If the file is already known, make sure we update the ref number.
-					// Three cases to consider here:
-					// - The ref number is the same: nothing to do (the function is GetOrAdd after all).
-					// - The file had an invalid ref number: it just means it was deleted and now it exists again.
-					// - The file had a different (but valid) ref number. This can happen when a file is created and immediately
-					// renamed to an existing file. Some apps do this when saving a file (eg. Visual Studio): they create a temp file,
-					// delete the target file, then rename the temp file to the target name. When we see the event for the temp file being
-					// created, it already has the target name, and the event for the deletion of the target file is after so we haven't seen it yet.
-					// It's a weird case, but it's actually not a problem: just make sure the ref number of the target file is immediately removed
-					// from the ref number hash map to avoid having two ref numbers pointing to the same FileInfo.
-					if (file.mRefNumber != inRefNumber)
-					{
-						// Case 3: if the file had a valid ref number, remember it to remove it from the hash map below.
-						if (file.mRefNumber.IsValid())
-							ref_number_to_remove = file.mRefNumber;
+		// Check again under the lock, another thread might have added it in the meantime.
+		if (auto it = path_shard.mMap.Find(path_hash); it != path_shard.mMap.End())
+			file_id = it->mValue;
 
-						// Update the ref number.
-						file.mRefNumber = inRefNumber;
-					}
-				}
-			}
-			else
+		if (!file_id.IsValid())
+		{
+			is_new = true;
+
+			// The file wasn't already known, add it to the list.
+			StringView stored_path = path;
+			if (inPathStorage == PathStorage::Copy)
+				stored_path = gNormalizePath(mStringPool.AllocateCopy(path));
+
+			// Reserving the index doesn't need the mFiles lock, so threads adding files to different directories don't wait for each other.
+			FileID    new_file_id = { mIndex, (uint32)mFiles.ReserveIndex() };
+			FileInfo& file        = mFiles.EmplaceReserved(new_file_id.mFileIndex, new_file_id, stored_path, path_hash, inType, inRefNumber, parent_dir_id);
+			mFiles.PublishReserved(new_file_id.mFileIndex);
+
+			// Link it to its parent directory (only the root dir doesn't have one).
+			// Note: The file is fully initialized before becoming the first child, so readers iterating on the children without the lock are fine.
+			gAssert(parent_dir_id.IsValid() == !path.Empty());
+			if (parent_dir_id.IsValid())
 			{
-				actual_file_id = new_file_id;
+				auto      files_lock = mFiles.Lock();
+				FileInfo& parent_dir = GetFile(parent_dir_id);
+				file.mNextSiblingID = parent_dir.mFirstChildID;
+				parent_dir.mFirstChildID = file.mID;
 			}
+
+			// Only publish the file ID once the FileInfo is built: threads that find it in the map use it right away.
+			path_shard.mMap.Insert(path_hash, new_file_id);
+			file_id = new_file_id;
 		}
+	}
+
+	FileInfo&     file                 = GetFile(file_id);
+	FileRefNumber ref_number_to_remove = {};
 
-		// Update the ref number hash map.
-		if (inRefNumber.IsValid() || ref_number_to_remove.IsValid())
+	if (!is_new)
+	{
+		if (file.GetType() != inType)
 		{
-			// TODO: not great to access these internals, maybe find a better way?
-			LockGuard map_lock(mDrive.mFilesByRefNumberMutex);
+			// TODO we could support changing the file type if we make sure to update any list of all directories
+			gAppFatalError("%s was a %s but is now a %s. This is not supported yet.",
+				file.ToString().AsCStr(),
+				file.GetType() == FileType::Directory ? "Directory" : "File",
+				inType == FileType::Directory ? "Directory" : "File");
+		}
 
-			// If there's a ref number to remove from the map, do it now that we have the lock.
-			if (ref_number_to_remove.IsValid())
-			{
-				bool erased = mDrive.mFilesByRefNumber.Erase(ref_number_to_remove);
-				gAssert(erased);
-			}
+		// If the file is already known, make sure we update the ref number.
+		// Three cases to consider here:
+		// - The ref number is the same: nothing to do (the function is GetOrAdd after all).
+		// - The file had an invalid ref number: it just means it was deleted and now it exists again.
+		// - The file had a different (but valid) ref number. This can happen when a file is created and immediately
+		// renamed to an existing file. Some apps do this when saving a file (eg. Visual Studio): they create a temp file,
+		// delete the target file, then rename the temp file to the target name. When we see the event for the temp file being
+		// created, it already has the target name, and the event for the deletion of the target file is after so we haven't seen it yet.
+		// It's a weird case, but it's actually not a problem: just make sure the ref number of the target file is immediately removed
+		// from the ref number hash map to avoid having two ref numbers pointing to the same FileInfo.
+		if (inRefNumber.IsValid())
+		{
+			// Note: Another thread might be updating it (eg. marking it deleted), so read it under the lock too.
+			LockGuard ref_number_lock(mDrive.GetRefNumberMutex(file_id));
 
-			auto [_, value, result] = mDrive.mFilesByRefNumber.Insert(inRefNumber, actual_file_id);
-			if (result == EInsertResult::Found)
+			if (file.mRefNumber != inRefNumber)
 			{
-				FileID previous_file_id = value;
+				// Case 3: if the file had a valid ref number, remember it to remove it from the hash map below.
+				if (file.mRefNumber.IsValid())
+					ref_number_to_remove = file.mRefNumber;
 
-				// Check if the existing file is the same (ie. same path).
-				// The file could have been renamed but kept the same ref number (and we've missed that rename event?),
-				// or it could be a junction/hardlink to the same file (TODO: detect that, at least to error properly?)
-				if (previous_file_id != actual_file_id || previous_file_id.GetFile().mPathHash != path_hash)
-				{
-					gAppLogError(R"(Found two files with the same RefNumber! %c:\%s and %s%s)", 
-						mDrive.mLetter, path.AsCStr(),
-						previous_file_id.GetRepo().mRootPath.AsCStr(), previous_file_id.GetFile().mPath.AsCStr());
-
-					// Mark the old file as deleted, and add the new one instead.
-					MarkFileDeleted(GetFile(previous_file_id), {}, map_lock);
-				}
+				// Update the ref number.
+				file.mRefNumber = inRefNumber;
 			}
 		}
+	}
 
+	// If there's a ref number to remove from the map, do it now.
+	if (ref_number_to_remove.IsValid())
+	{
+		bool erased = mDrive.mFilesByRefNumber.Erase(ref_number_to_remove);
+		gAssert(erased);
+	}
 
-		if (actual_file_id == new_file_id)
-		{
-			// The file wasn't already known, add it to the list.
-			file = &mFiles.Emplace(files_lock, new_file_id, gNormalizePath(mStringPool.AllocateCopy(path)), path_hash, inType, inRefNumber);
-		}
-		else
+	// Update the ref number hash map.
+	if (inRefNumber.IsValid())
+	{
+		// TODO: not great to access these internals, maybe find a better way?
+		auto&     shard = mDrive.mFilesByRefNumber.GetShard(inRefNumber);
+		LockGuard map_lock(shard.mMutex);
+
+		auto [_, value, result] = shard.mMap.Insert(inRefNumber, file_id);
+		if (result == EInsertResult::Found)
 		{
-			// The file was known, return it.
-			file = &GetFile(actual_file_id);
+			FileID previous_file_id = value;
 
-			if (file->GetType() != inType)
+			// Check if the existing file is the same (ie. same path).
+			// The file could have been renamed but kept the same ref number (and we've missed that rename event?),
+			// or it could be a junction/hardlink to the same file (TODO: detect that, at least to error properly?)
+			if (previous_file_id != file_id || previous_file_id.GetFile().mPathHash != path_hash)
 			{
-				// TODO we could support changing the file type if we make sure to update any list of all directories
-				gAppFatalError("%s was a %s but is now a %s. This is not supported yet.",
-					file->ToString().AsCStr(),
-					file->GetType() == FileType::Directory ? "Directory" : "File",
-					inType == FileType::Directory ? "Directory" : "File");
+				gAppLogError(R"(Found two files with the same RefNumber! %c:\%s and %s%s)", 
+					mDrive.mLetter, path.AsCStr(),
+					previous_file_id.GetRepo().mRootPath.AsCStr(), previous_file_id.GetFile().mPath.AsCStr());
+
+				// Mark the old file as deleted, and add the new one instead.
+				// Note: If the old file got a different ref number in the meantime, it's not using this one anymore, only the map needs updating.
+				if (!MarkFileDeleted(previous_file_id.GetFile(), {}, map_lock))
+					shard.mMap.Erase(inRefNumber);
+				shard.mMap.Insert(inRefNumber, file_id);
 			}
 		}
 	}
@@ -307,74 +580,92 @@ FileInfo& FileRepo::GetOrAddFile(StringView inPath, FileType inType, FileRefNumb
 	// Create all the commands that take this file as input (this may add more (non-existing) files).
 	// Note: Don't do it during initial scan, it's not necessary as we'll do it afterwards anyway.
 	if (gFileSystem.GetInitState() == FileSystem::InitState::Ready)
-		gCookingSystem.CreateCommandsForFile(*file);
+		gCookingSystem.CreateCommandsForFile(file);
 
-	return *file;
+	return file;
 }
 
 void FileRepo::MarkFileDeleted(FileInfo& ioFile, FileTime inTimeStamp)
 {
-	// TODO: not great to access these internals, maybe find a better way?
-	LockGuard lock(mDrive.mFilesByRefNumberMutex);
+	// The ref number tells which shard to lock, but the shard has to be locked before the ref number lock,
+	// so the ref number can change in between. Try again with the new one if it did.
+	while (true)
+	{
+		FileRefNumber ref_number = mDrive.GetRefNumber(ioFile);
 
-	MarkFileDeleted(ioFile, inTimeStamp, lock);
+		// TODO: not great to access these internals, maybe find a better way?
+		LockGuard lock(mDrive.mFilesByRefNumber.GetShard(ref_number).mMutex);
+
+		if (MarkFileDeleted(ioFile, inTimeStamp, lock))
+			return;
+	}
 }
 
-void FileRepo::MarkFileDeleted(FileInfo& ioFile, FileTime inTimeStamp, const LockGuard<Mutex>& inLock)
+bool FileRepo::MarkFileDeleted(FileInfo& ioFile, FileTime inTimeStamp, const LockGuard<Mutex>& inLock)
 {
-	gAssert(inLock.GetMutex() == &mDrive.mFilesByRefNumberMutex);
+	{
+		// Note: The file might be in another repo on the same drive (see GetOrAddFileInternal), the ref number locks are per drive so it doesn't matter.
+		LockGuard ref_number_lock(mDrive.GetRefNumberMutex(ioFile.mID));
+
+		auto& shard = mDrive.mFilesByRefNumber.GetShard(ioFile.mRefNumber);
+		if (inLock.GetMutex() != &shard.mMutex)
+			return false;
+
+		shard.mMap.Erase(ioFile.mRefNumber);
+		ioFile.mRefNumber = FileRefNumber::cInvalid();
+	}
 
-	mDrive.mFilesByRefNumber.Erase(ioFile.mRefNumber);
-	ioFile.mRefNumber      = FileRefNumber::cInvalid();
 	ioFile.mCreationTime   = inTimeStamp;	// Store the time of deletion in the creation time. 
 	ioFile.mLastChangeTime = {};
 	ioFile.mLastChangeUSN  = {};
 
 	gCookingSystem.QueueUpdateDirtyStates(ioFile.mID);
+	return true;
 }
 
 
-
-StringView FileRepo::RemoveRootPath(StringView inFullPath)
+void FileRepo::MarkDirectoryContentDeleted(const FileInfo& inDirectory, FileTime inTimeStamp)
 {
-	// inFullPath might be the root path without trailing slash, so ignore the trailing slash.
-	gAssert(gStartsWithNoCase(inFullPath, gNoTrailingSlash(mRootPath)));
-
-	// Use gMin also in case inFullPath is the root path without trailing slash.
-	return inFullPath.SubStr(gMin(mRootPath.Size(), inFullPath.Size()));
-}
+	gAssert(inDirectory.IsDirectory());
 
+	// Walk the sub-tree depth first.
+	TempVector<FileID> dirs_to_visit;
+	dirs_to_visit.PushBack(inDirectory.mID);
 
-
-static TempString sBuildFilePath(StringView inParentDirPath, WStringView inFileNameW)
-{
-	TempString file_name = gWideCharToUtf8(inFileNameW);
-	if (file_name.Empty())
+	while (!dirs_to_visit.Empty())
 	{
-		// Failed for some reason.
-		gAssert(false); // Investigate.
+		FileID dir_id = dirs_to_visit.Back();
+		dirs_to_visit.PopBack();
 
-		return {};
-	}
+		for (FileID file_id = GetFile(dir_id).mFirstChildID; file_id.IsValid(); file_id = GetFile(file_id).mNextSiblingID)
+		{
+			FileInfo& file = GetFile(file_id);
 
-	TempString path;
+			MarkFileDeleted(file, inTimeStamp);
 
-	// Add the parent dir if there's one (can be empty for the root dir).
-	if (!inParentDirPath.Empty())
-	{
-		path += inParentDirPath;
-		path += "\\";
+			if (gApp.mLogFSActivity >= LogLevel::Verbose)
+				gAppLog("Deleted %s", file.ToString().AsCStr());
+
+			if (file.IsDirectory())
+				dirs_to_visit.PushBack(file_id);
+		}
 	}
+}
 
-	// Add the file name.
-	path += file_name;
 
-	return path;
+StringView FileRepo::RemoveRootPath(StringView inFullPath)
+{
+	// inFullPath might be the root path without trailing slash, so ignore the trailing slash.
+	gAssert(gStartsWithNoCase(inFullPath, gNoTrailingSlash(mRootPath)));
+
+	// Use gMin also in case inFullPath is the root path without trailing slash.
+	return inFullPath.SubStr(gMin(mRootPath.Size(), inFullPath.Size()));
 }
 
 
+
 // TODO: do the while loop to drain the scan queue in here, maybe put the queue and the buffer in a context param? (since they're not meaningful to the caller)
-void FileRepo::ScanDirectory(FileID inDirectoryID, ScanQueue& ioScanQueue, Span<uint8> ioBuffer)
+void FileRepo::ScanDirectory(FileID inDirectoryID, ScanQueue& ioScanQueue, int inWorkerIndex, Span<uint8> ioBuffer)
 {
 	const FileInfo& dir = GetFile(inDirectoryID); 
 	gAssert(dir.IsDirectory());
@@ -428,11 +719,11 @@ void FileRepo::ScanDirectory(FileID inDirectoryID, ScanQueue& ioScanQueue, Span<
 			if (wfilename == L"." || wfilename == L"..")
 				continue;
 
-			// Build the file path.
-			TempString path = sBuildFilePath(dir.mPath, wfilename);
+			// Get the file name.
+			TempString file_name = gWideCharToUtf8(wfilename);
 
 			// If it fails, ignore the file.
-			if (path.Empty())
+			if (file_name.Empty())
 			{
 				gAppLogError("Failed to build the path of a file in %s", dir.ToString().AsCStr());
 				gAssert(false); // Investigate why that would happen.
@@ -443,7 +734,8 @@ void FileRepo::ScanDirectory(FileID inDirectoryID, ScanQueue& ioScanQueue, Span<
 			const bool is_directory = (entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
 
 			// Add (or get) the file info.
-			FileInfo& file = GetOrAddFile(path, is_directory ? FileType::Directory : FileType::File, entry->FileId);
+			// Note: The parent dir is known, so only the file name needs to be hashed.
+			FileInfo& file = GetOrAddFile(inDirectoryID, file_name, is_directory ? FileType::Directory : FileType::File, entry->FileId);
 
 			if (gApp.mLogFSActivity >= LogLevel::Verbose)
 				gAppLog("Added %s", file.ToString().AsCStr());
@@ -451,7 +743,7 @@ void FileRepo::ScanDirectory(FileID inDirectoryID, ScanQueue& ioScanQueue, Span<
 			if (file.IsDirectory())
 			{
 				// Add directories to the scan queue.
-				ioScanQueue.Push(file.mID);
+				ioScanQueue.Push(inWorkerIndex, file.mID);
 			}
 			else
 			{
@@ -541,6 +833,14 @@ FileDrive::FileDrive(char inDriveLetter)
 
 	gAppLog(R"(Queried USN journal for %c:\. ID: 0x%08llX. Max size: %s)", 
 		mLetter, mUSNJournalID, gFormatSizeInBytes(journal_data.MaximumSize).AsCStr());
+
+	mChangeSource = new USNJournalChangeSource(*this);
+}
+
+
+FileDrive::~FileDrive()
+{
+	delete mChangeSource;
 }
 
 
@@ -742,7 +1042,7 @@ TempString gToString(USNReasons inReasons)
 
 
 template <typename taFunctionType>
-USN FileDrive::ReadUSNJournal(USN inStartUSN, Span<uint8> ioBuffer, taFunctionType inRecordCallback) const
+USN USNJournalChangeSource::ReadUSNJournal(USN inStartUSN, Span<uint8> ioBuffer, taFunctionType inRecordCallback) const
 {
 	USN start_usn = inStartUSN;
 
@@ -761,17 +1061,17 @@ USN FileDrive::ReadUSNJournal(USN inStartUSN, Span<uint8> ioBuffer, taFunctionTy
 		journal_data.ReturnOnlyOnClose = true;          // Only get events when the file is closed (ie. USN_REASON_CLOSE is present). We don't care about earlier events.
 		journal_data.Timeout           = 0;				// Never wait.
 		journal_data.BytesToWaitFor    = 0;				// Never wait.
-		journal_data.UsnJournalID      = mUSNJournalID;	// The journal we're querying.
+		journal_data.UsnJournalID      = mDrive.mUSNJournalID; // The journal we're querying.
 		journal_data.MinMajorVersion   = 3;				// Doc says it needs to be 3 to use 128-bit file identifiers (ie. FileRefNumbers).
 		journal_data.MaxMajorVersion   = 3;				// Don't want to support anything else.
 		
 		// Note: Use FSCTL_READ_UNPRIVILEGED_USN_JOURNAL to make that work without admin rights.
 		uint32 available_bytes;
-		if (!DeviceIoControl(mHandle, FSCTL_READ_UNPRIVILEGED_USN_JOURNAL, &journal_data, sizeof(journal_data), ioBuffer.Data(), (uint32)ioBuffer.Size(), &available_bytes, nullptr))
+		if (!DeviceIoControl(mDrive.mHandle, FSCTL_READ_UNPRIVILEGED_USN_JOURNAL, &journal_data, sizeof(journal_data), ioBuffer.Data(), (uint32)ioBuffer.Size(), &available_bytes, nullptr))
 		{
 			// TODO: test this but probably the only thing to do is to restart and re-scan everything (maybe the journal was deleted?)
 			gAppFatalError("Failed to read USN journal for %c:\\ - Trying to read USN %llx.\nError: %s", 
-				mLetter,
+				mDrive.mLetter,
 				start_usn,
 				GetLastErrorString().AsCStr());
 		}
@@ -815,58 +1115,89 @@ USN FileDrive::ReadUSNJournal(USN inStartUSN, Span<uint8> ioBuffer, taFunctionTy
 }
 
 
+USN USNJournalChangeSource::ReadChanges(USN inStartUSN, Span<uint8> ioBuffer, FileChangeCallback inChangeCallback)
+{
+	return ReadUSNJournal(inStartUSN, ioBuffer, [&inChangeCallback](const USN_RECORD_V3& inRecord)
+	{
+		USNReasons reason = (USNReasons)inRecord.Reason;
+
+		FileChange change;
+		change.mRefNumber       = inRecord.FileReferenceNumber;
+		change.mParentRefNumber = inRecord.ParentFileReferenceNumber;
+		change.mUSN         = inRecord.Usn;
+		change.mTimeStamp   = FileTime(inRecord.TimeStamp.QuadPart);
+		change.mIsDirectory = (inRecord.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		change.mIsDeleted   = (reason & (USNReasons::FILE_DELETE | USNReasons::RENAME_NEW_NAME)) != 0;
+		change.mIsCreated   = (reason & (USNReasons::FILE_CREATE | USNReasons::RENAME_NEW_NAME)) != 0;
+
+		// Only creations need the file name. Don't convert it for the other records, they're most of the journal (and most are outside the repos).
+		WStringView wname = { (const wchar_t*)((const uint8*)&inRecord + inRecord.FileNameOffset), inRecord.FileNameLength / sizeof(wchar_t) };
+		TempString  name  = change.mIsCreated ? gWideCharToUtf8(wname) : TempString();
+		change.mName      = name;
+
+		inChangeCallback(change);
+	});
+}
+
+
 bool FileDrive::ProcessMonitorDirectory(Span<uint8> ioBufferUSN, ScanQueue &ioScanQueue, Span<uint8> ioBufferScan)
 {
-	USN next_usn = ReadUSNJournal(mNextUSN, ioBufferUSN, [this, ioBufferScan, &ioScanQueue](const USN_RECORD_V3& inRecord)
+	USN next_usn = ReadChanges(mNextUSN, ioBufferUSN, [this, ioBufferScan, &ioScanQueue](const FileChange& inChange)
 	{
-		bool is_directory = (inRecord.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		ApplyChange(inChange, ioScanQueue, ioBufferScan);
+	});
+
+	if (next_usn == mNextUSN)
+		return false;
+
+	mNextUSN = next_usn;
+	return true;
+}
 
-		USNReasons reason = (USNReasons)inRecord.Reason;
 
-		if (reason & (USNReasons::FILE_DELETE | USNReasons::RENAME_NEW_NAME))
+void FileDrive::ApplyChange(const FileChange& inChange, ScanQueue& ioScanQueue, Span<uint8> ioBufferScan)
+{
+	if (inChange.mIsDeleted)
+	{
+		// If the file is in a repo, mark it as deleted.
+		FileID deleted_file_id = FindFileID(inChange.mRefNumber);
+		if (deleted_file_id.IsValid())
 		{
-			// If the file is in a repo, mark it as deleted.
-			FileID deleted_file_id = FindFileID(inRecord.FileReferenceNumber);
-			if (deleted_file_id.IsValid())
-			{
-				FileInfo& deleted_file = deleted_file_id.GetFile();
-				FileTime  timestamp    = FileTime(inRecord.TimeStamp.QuadPart);
+			FileInfo& deleted_file = deleted_file_id.GetFile();
+			FileTime  timestamp    = inChange.mTimeStamp;
 
-				FileRepo& repo = gFileSystem.GetRepo(deleted_file.mID);
+			FileRepo& repo = gFileSystem.GetRepo(deleted_file.mID);
 
-				repo.MarkFileDeleted(deleted_file, timestamp);
+			repo.MarkFileDeleted(deleted_file, timestamp);
 
-				if (gApp.mLogFSActivity >= LogLevel::Verbose)
-					gAppLog("Deleted %s", deleted_file.ToString().AsCStr());
+			if (gApp.mLogFSActivity >= LogLevel::Verbose)
+				gAppLog("Deleted %s", deleted_file.ToString().AsCStr());
 
-				// If it's a directory, also mark all the file inside as deleted.
-				if (deleted_file.IsDirectory())
-				{
-					TempString dir_path = deleted_file.mPath;
+			// If it's a directory, also mark all the file inside as deleted.
+			if (deleted_file.IsDirectory())
+				repo.MarkDirectoryContentDeleted(deleted_file, timestamp);
+		}
 
-					// Root dir has an empty path, in this case don't add the slash.
-					if (!dir_path.Empty())
-						dir_path += "\\";
+	}
 
-					for (FileInfo& file : repo.mFiles)
-					{
-						if (file.mID != deleted_file.mID && gStartsWithNoCase(file.mPath, dir_path))
-						{
-							repo.MarkFileDeleted(file, timestamp);
+	if (inChange.mIsCreated)
+	{
+		const FileType type = inChange.mIsDirectory ? FileType::Directory : FileType::File;
 
-							if (gApp.mLogFSActivity >= LogLevel::Verbose)
-								gAppLog("Deleted %s", file.ToString().AsCStr());
-						}
-					}
-				}
-			}
+		FileRepo* repo = nullptr;
+		FileInfo* file = nullptr;
 
+		FileID parent_dir_id = FindFileID(inChange.mParentRefNumber);
+		if (parent_dir_id.IsValid() && parent_dir_id.GetFile().IsDirectory() && !inChange.mName.Empty())
+		{
+			// If the parent directory is known, the file is in the same repo and we can build its path directly (and only hash its name).
+			repo = &parent_dir_id.GetRepo();
+			file = &repo->GetOrAddFile(parent_dir_id, inChange.mName, type, inChange.mRefNumber);
 		}
-
-		if (reason & (USNReasons::FILE_CREATE | USNReasons::RENAME_NEW_NAME))
+		else
 		{
 			// Get a handle to the file.
-			HandleOrError file_handle = OpenFileByRefNumber(inRecord.FileReferenceNumber, OpenFileAccess::AttributesOnly, FileID::cInvalid());
+			HandleOrError file_handle = OpenFileByRefNumber(inChange.mRefNumber, OpenFileAccess::AttributesOnly, FileID::cInvalid());
 			if (!file_handle.IsValid())
 			{
 				// This can fail for many reasons when monitoring a drive that also contains eg. Windows.
@@ -881,67 +1212,65 @@ bool FileDrive::ProcessMonitorDirectory(Span<uint8> ioBufferUSN, ScanQueue &ioSc
 			{
 				// TODO: same remark as failing to open
 				gAppLogError("Failed to get path for newly created file %s - %s", 
-					FileRefNumber(inRecord.FileReferenceNumber).ToString().AsCStr(), 
+					inChange.mRefNumber.ToString().AsCStr(), 
 					GetLastErrorString().AsCStr());
 				return;
 			}
 
 			// Check if it's in a repo, otherwise ignore.
-			FileRepo* repo = FindRepoForPath(full_path);
+			repo = FindRepoForPath(full_path);
 			if (repo)
 			{
 				// Get the file path relative to the repo root.
 				StringView file_path = repo->RemoveRootPath(full_path);
 
 				// Add the file.
-				FileInfo& file = repo->GetOrAddFile(file_path, is_directory ? FileType::Directory : FileType::File, inRecord.FileReferenceNumber);
-
-				if (is_directory)
-				{
-					// If it's a directory, scan it to add all the files inside.
-					ioScanQueue.Push(file.mID);
-
-					FileID dir_id;
-					while ((dir_id = ioScanQueue.Pop()) != FileID::cInvalid())
-						repo->ScanDirectory(dir_id, ioScanQueue, ioBufferScan);
-				}
-				else
-				{
-					// If it's a file, treat it as if it was modified.
-					if (gApp.mLogFSActivity >= LogLevel::Verbose)
-						gAppLog("Added %s", file.ToString().AsCStr());
-
-					file.mLastChangeUSN  = inRecord.Usn;
-					file.mLastChangeTime = inRecord.TimeStamp.QuadPart;
-
-					gCookingSystem.QueueUpdateDirtyStates(file.mID);
-				}
+				file = &repo->GetOrAddFile(file_path, type, inChange.mRefNumber);
 			}
 		}
-		else
+
+		if (file)
 		{
-			// The file was just modified, update its USN.
-			FileID file_id = FindFileID(inRecord.FileReferenceNumber);
-			if (file_id.IsValid())
+			if (inChange.mIsDirectory)
 			{
-				FileInfo& file = file_id.GetFile();
+				// If it's a directory, scan it to add all the files inside.
+				// Note: This is only called from the monitor thread, which is the only worker of its scan queue.
+				ioScanQueue.Push(0, file->mID);
 
+				FileID dir_id;
+				while ((dir_id = ioScanQueue.Pop(0)) != FileID::cInvalid())
+					repo->ScanDirectory(dir_id, ioScanQueue, 0, ioBufferScan);
+			}
+			else
+			{
+				// If it's a file, treat it as if it was modified.
 				if (gApp.mLogFSActivity >= LogLevel::Verbose)
-					gAppLog("Modified %s", file.ToString().AsCStr());
+					gAppLog("Added %s", file->ToString().AsCStr());
 
-				file.mLastChangeUSN  = inRecord.Usn;
-				file.mLastChangeTime = inRecord.TimeStamp.QuadPart;
+				file->mLastChangeUSN  = inChange.mUSN;
+				file->mLastChangeTime = inChange.mTimeStamp;
 
-				gCookingSystem.QueueUpdateDirtyStates(file.mID);
+				gCookingSystem.QueueUpdateDirtyStates(file->mID);
 			}
 		}
-	});
+	}
+	else
+	{
+		// The file was just modified, update its USN.
+		FileID file_id = FindFileID(inChange.mRefNumber);
+		if (file_id.IsValid())
+		{
+			FileInfo& file = file_id.GetFile();
 
-	if (next_usn == mNextUSN)
-		return false;
+			if (gApp.mLogFSActivity >= LogLevel::Verbose)
+				gAppLog("Modified %s", file.ToString().AsCStr());
 
-	mNextUSN = next_usn;
-	return true;
+			file.mLastChangeUSN  = inChange.mUSN;
+			file.mLastChangeTime = inChange.mTimeStamp;
+
+			gCookingSystem.QueueUpdateDirtyStates(file.mID);
+		}
+	}
 }
 
 
@@ -962,13 +1291,7 @@ FileRepo* FileDrive::FindRepoForPath(StringView inFullPath)
 
 FileID FileDrive::FindFileID(FileRefNumber inRefNumber) const
 {
-	LockGuard lock(mFilesByRefNumberMutex);
-
-	auto it = mFilesByRefNumber.Find(inRefNumber);
-	if (it != mFilesByRefNumber.End())
-		return it->mValue;
-
-	return {};
+	return mFilesByRefNumber.Find(inRefNumber);
 }
 
 
@@ -1034,13 +1357,7 @@ FileID FileSystem::FindFileIDByPath(StringView inAbsolutePath) const
 
 FileID FileSystem::FindFileIDByPathHash(PathHash inPathHash) const
 {
-	LockGuard lock(mFilesByPathHashMutex);
-
-	auto it = mFilesByPathHash.Find(inPathHash);
-	if (it != mFilesByPathHash.End())
-		return it->mValue;
-
-	return {};
+	return mFilesByPathHash.Find(inPathHash);
 }
 
 
@@ -1132,6 +1449,78 @@ bool FileSystem::DeleteFile(FileID inFileID)
 }
 
 
+static HandleOrError sOpenFileForRead(const FileRepo& inRepo, const FileInfo& inFile)
+{
+	TempString abs_path = inRepo.mRootPath;
+	abs_path += inFile.mPath;
+
+	OwnedHandle handle = CreateFileA(abs_path.AsCStr(), FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	if (!handle.IsValid())
+	{
+		uint32 error = GetLastError();
+		if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND)
+			return OpenFileError::FileNotFound;
+		else if (error == ERROR_SHARING_VIOLATION)
+			return OpenFileError::SharingViolation;
+		else
+			return OpenFileError::AccessDenied;
+	}
+
+	return gMove(handle);
+}
+
+
+OpenFileError FileSystem::ReadCurrentUSN(FileID inFileID, USN& outUSN)
+{
+	const FileRepo& repo = GetRepo(inFileID);
+
+	HandleOrError handle = sOpenFileForRead(repo, GetFile(inFileID));
+	if (!handle.IsValid())
+		return handle.mError;
+
+	outUSN = repo.mDrive.GetUSN(*handle);
+	return OpenFileError::NoError;
+}
+
+
+OpenFileError FileSystem::ReadCurrentUSNAndHash(FileID inFileID, USN& outUSN, uint64& outHash)
+{
+	const FileRepo& repo = GetRepo(inFileID);
+
+	HandleOrError handle = sOpenFileForRead(repo, GetFile(inFileID));
+	if (!handle.IsValid())
+		return handle.mError;
+
+	// Read the USN first. If the file is modified while it's being hashed, the USN journal will report a more recent USN
+	// and the hash will be considered outdated.
+	outUSN = repo.mDrive.GetUSN(*handle);
+
+	LARGE_INTEGER file_size = {};
+	if (GetFileSizeEx(*handle, &file_size) == FALSE)
+		return OpenFileError::AccessDenied;
+
+	// Use the size as seed, so that the hash is a fingerprint of both.
+	XXH3_state_t state;
+	XXH3_64bits_reset_withSeed(&state, (uint64)file_size.QuadPart);
+
+	uint8 buffer[16 * 1024];
+	while (true)
+	{
+		DWORD bytes_read = 0;
+		if (ReadFile(*handle, buffer, sizeof(buffer), &bytes_read, nullptr) == FALSE)
+			return OpenFileError::AccessDenied;
+
+		if (bytes_read == 0)
+			break;
+
+		XXH3_64bits_update(&state, buffer, bytes_read);
+	}
+
+	outHash = XXH3_64bits_digest(&state);
+	return OpenFileError::NoError;
+}
+
+
 int FileSystem::GetFileCount() const
 {
 	int file_count = 0;
@@ -1152,15 +1541,12 @@ void FileSystem::InitialScan(const Thread& inInitialScanThread, Span<uint8> ioBu
 	Timer timer;
 	mInitState.Store(InitState::Scanning);
 
-	// Don't use too many threads otherwise they'll just spend their time on the hashmap mutex.
-	// TODO this could be improved
-	constexpr int cMaxScanThreadCount = 4;
+	// The file maps are sharded, so scanning scales with the number of cores (until the disk becomes the bottleneck).
+	constexpr int cMaxScanThreadCount = 64;
 	const int scan_thread_count = gMin(gThreadHardwareConcurrency(), cMaxScanThreadCount);
 
 	// Prepare a scan queue that can be used by multiple threads.
-	ScanQueue scan_queue;
-	scan_queue.mDirectories.Reserve(1024);
-	scan_queue.mThreadsBusy = scan_thread_count; // All threads start busy.
+	ScanQueue scan_queue(scan_thread_count);
 
 	// Put the root dir of each repo in the queue.
 	for (FileRepo& repo : mRepos)
@@ -1169,21 +1555,21 @@ void FileSystem::InitialScan(const Thread& inInitialScanThread, Span<uint8> ioBu
 		if (repo.mLoadedFromCache)
 			continue;
 
-		scan_queue.Push(repo.mRootDirID);
+		scan_queue.Push(0, repo.mRootDirID);
 	}
 
 	// Create temporary worker threads to scan directories.
 	{
 		Thread scan_threads[cMaxScanThreadCount];
-		for (auto& thread : Span(scan_threads, scan_thread_count))
+		for (int thread_index = 0; thread_index < scan_thread_count; ++thread_index)
 		{
-			thread.Create({ .mName = "Scan Directory Thread" }, [&](Thread&) 
+			scan_threads[thread_index].Create({ .mName = "Scan Directory Thread" }, [&, thread_index](Thread&) 
 			{
 				uint8 buffer_scan[32 * 1024];
 
 				// Process the queue until it's empty.
 				FileID dir_id;
-				while ((dir_id = scan_queue.Pop()) != FileID::cInvalid())
+				while ((dir_id = scan_queue.Pop(thread_index)) != FileID::cInvalid())
 				{
 					FileRepo& repo = gFileSystem.GetRepo(dir_id);
 
@@ -1191,21 +1577,20 @@ void FileSystem::InitialScan(const Thread& inInitialScanThread, Span<uint8> ioBu
 					if (inInitialScanThread.IsStopRequested())
 						continue;
 
-					repo.ScanDirectory(dir_id, scan_queue, buffer_scan);
+					repo.ScanDirectory(dir_id, scan_queue, thread_index, buffer_scan);
 				}
 			});
 		}
 
 		// Wait for the threads to finish their work.
-		for (auto& thread : scan_threads)
+		for (auto& thread : Span(scan_threads, scan_thread_count))
 			thread.Join();
 
 		if (inInitialScanThread.IsStopRequested())
 			return;
 	}
 
-	gAssert(scan_queue.mDirectories.Empty());
-	gAssert(scan_queue.mThreadsBusy == 0);
+	gAssert(scan_queue.IsEmpty());
 
 	int total_files = 0;
 	for (auto& repo : mRepos)
@@ -1232,14 +1617,14 @@ void FileSystem::InitialScan(const Thread& inInitialScanThread, Span<uint8> ioBu
 
 		// Read the entire USN journal.
 		USN start_usn = 0;
-		drive.ReadUSNJournal(start_usn, ioBufferUSN, [this, &drive, &file_count](const USN_RECORD_V3& inRecord) 
+		drive.ReadChanges(start_usn, ioBufferUSN, [this, &drive, &file_count](const FileChange& inChange) 
 		{
 			// If the file is in one of the repos, update its USN.
-			FileID file_id = drive.FindFileID(inRecord.FileReferenceNumber);
+			FileID file_id = drive.FindFileID(inChange.mRefNumber);
 			if (file_id.IsValid())
 			{
 				file_count++;
-				file_id.GetFile().mLastChangeUSN = inRecord.Usn;
+				file_id.GetFile().mLastChangeUSN = inChange.mUSN;
 			}
 		});
 
@@ -1372,9 +1757,7 @@ void FileSystem::MonitorDirectoryThread(const Thread& inThread)
 	mInitState.Store(InitState::PreparingCommands);
 
 	// Create the commands for all the files.
-	for (auto& repo : mRepos)
-		for (auto& file : repo.mFiles)
-			gCookingSystem.CreateCommandsForFile(file);
+	gCookingSystem.CreateCommandsForAllFiles();
 
 	// Check which commmands need to cook.
 	gCookingSystem.UpdateAllDirtyStates();
@@ -1416,8 +1799,8 @@ void FileSystem::MonitorDirectoryThread(const Thread& inThread)
 				FileID dir_id = file_to_rescan;
 				do
 				{
-					repo.ScanDirectory(dir_id, scan_queue, buffer_scan);
-				} while ((dir_id = scan_queue.Pop()) != FileID::cInvalid());
+					repo.ScanDirectory(dir_id, scan_queue, 0, buffer_scan);
+				} while ((dir_id = scan_queue.Pop(0)) != FileID::cInvalid());
 			}
 			else
 			{
@@ -1447,6 +1830,9 @@ void FileSystem::MonitorDirectoryThread(const Thread& inThread)
 		// Instead the cooking threads will wake this thread up any time a command finishes (which usually also means there are file changes to process).
 		gCookingSystem.ProcessUpdateDirtyStates();
 
+		// Save the commands that changed in the cached state.
+		UpdateCacheJournal();
+
 		// Launch notifications if there are errors or cooking is finished.
 		gCookingSystem.UpdateNotifications();
 
@@ -1472,9 +1858,19 @@ void FileSystem::MonitorDirectoryThread(const Thread& inThread)
 		}
 	}
 
+	// Let a snapshot being saved in the background finish.
+	FinishCacheSnapshot(true);
+
 	// Only save the state if we've finished scanning when we exit (don't save an incomplete state).
+	// Note: This isn't necessary (the journal is up to date), but it makes the next start faster.
 	if (GetInitState() == InitState::Ready)
 		SaveCache();
+
+	if (mCacheJournalFile)
+	{
+		fclose(mCacheJournalFile);
+		mCacheJournalFile = nullptr;
+	}
 }
 
 
@@ -1497,20 +1893,47 @@ struct SerializedFileInfo
 	FileTime      mCreationTime     = {};
 	USN           mLastChangeUSN    = 0;
 	FileTime      mLastChangeTime   = {};
+	PathHash      mPathHash         = {};           // Stored to avoid hashing all the paths again when loading.
+	uint32        mParentDirIndex   = cNoParentDir; // Index of the parent dir in the serialized files.
+	uint32        mPadding          = 0;
+	uint64        mContentHash          = 0;
+	USN           mContentHashUSN       = 0;
+	USN           mLastContentChangeUSN = 0;
+
+	static constexpr uint32 cNoParentDir = (uint32)-1;
 
 	FileType GetType() const { return mIsDirectory ? FileType::Directory : FileType::File; }
 };
-static_assert(sizeof(SerializedFileInfo) == 48);
+static_assert(sizeof(SerializedFileInfo) == 96);
+
+// Reference to a file by its index in the serialized files, so that loading doesn't need any hash map lookup.
+struct SerializedFileID
+{
+	uint32   mRepoIndex = cInvalidIndex; // Index of the repo in the cache (not necessarily the same as FileRepo::mIndex).
+	uint32   mFileIndex = cInvalidIndex; // Index of the file in the serialized files of that repo.
+
+	static constexpr uint32 cInvalidIndex = (uint32)-1;
+};
+static_assert(sizeof(SerializedFileID) == 8);
 
 struct SerializedCommand
 {
-	PathHash mMainInputPathHash    = {};
-	uint64   mLastCookUSN     : 63 = 0;
-	uint64   mLastCookIsError : 1  = 0;
-	FileTime mLastCookTime         = {};
+	SerializedFileID mMainInput            = {};
+	uint64           mLastCookUSN     : 63 = 0;
+	uint64           mLastCookIsError : 1  = 0;
+	FileTime         mLastCookTime         = {};
+	uint32           mLastCookDurationMs   = 0;
+	uint32           mInputHashCount       = 0; // Number of SerializedInputHash that follow (after the dep file data).
 };
 static_assert(sizeof(SerializedCommand) == 32);
 
+struct SerializedInputHash
+{
+	SerializedFileID mFileID = {};
+	uint64           mHash   = 0;
+};
+static_assert(sizeof(SerializedInputHash) == 16);
+
 struct SerializedDepFileHeader
 {
 	USN      mLastDepFileRead    = 0;
@@ -1519,9 +1942,111 @@ struct SerializedDepFileHeader
 };
 static_assert(sizeof(SerializedDepFileHeader) == 16);
 
+struct SerializedJournalBatchHeader
+{
+	uint32   mSize               = 0; // Size of the batch content in bytes (not including this header).
+	uint32   mRecordCount        = 0;
+	uint64   mChecksum           = 0; // Hash of the batch content, to detect batches that were only partially written.
+};
+static_assert(sizeof(SerializedJournalBatchHeader) == 16);
+
+struct SerializedJournalCommand
+{
+	uint16   mRuleVersion          = 0;
+	uint16   mUseDepFile           = 0; // Non-zero if the dep file content follows.
+	uint32   mLastCookDurationMs   = 0;
+	uint64   mLastCookUSN     : 63 = 0;
+	uint64   mLastCookIsError : 1  = 0;
+	FileTime mLastCookTime         = {};
+	uint32   mInputHashCount       = 0; // Number of input hashes that follow (after the dep file data), each as a path and a hash.
+	uint32   mPadding              = 0;
+};
+static_assert(sizeof(SerializedJournalCommand) == 32);
+
+
+constexpr int        cCacheFormatVersion  = 11;
+constexpr StringView cCacheFileName       = "cache.bin";
+constexpr StringView cCacheJournalNames[] = { "cache.journal", "cache.journal2" }; // Used in turn, see FileSystem::StartCacheSnapshot.
+
+
+static TempString sGetCacheJournalPath(int inJournalIndex)
+{
+	return gTempFormat(R"(%s\%s)", gApp.mCacheDirectory.AsCStr(), cCacheJournalNames[inJournalIndex].AsCStr());
+}
+
+
+// Compress the serialized state and write it to the cache file. Return the size of the file.
+// Note: This doesn't read anything from the FileSystem, it can be done on any thread.
+static size_t sWriteCacheSnapshot(BinaryWriter& inBin)
+{
+	// Make sure the cache dir exists.
+	CreateDirectoryA(gApp.mCacheDirectory.AsCStr(), nullptr);
+
+	// Write to a temp file first and rename it after, so that the previous snapshot stays valid if the process is killed while saving.
+	TempString cache_file_path      = gTempFormat(R"(%s\%s)", gApp.mCacheDirectory.AsCStr(), cCacheFileName.AsCStr());
+	TempString temp_cache_file_path = gConcat(cache_file_path, ".tmp");
+	FILE*      cache_file           = fopen(temp_cache_file_path.AsCStr(), "wb");
+
+	if (cache_file == nullptr)
+		gAppFatalError(R"(Failed to save cached state ("%s") - %s (0x%X))", temp_cache_file_path.AsCStr(), strerror(errno), errno);
+
+	if (!inBin.WriteFile(cache_file))
+		gAppFatalError(R"(Failed to save cached state ("%s") - %s (0x%X))", temp_cache_file_path.AsCStr(), strerror(errno), errno);
+
+	size_t file_size = ftell(cache_file);
+	fclose(cache_file);
+
+	if (!MoveFileExA(temp_cache_file_path.AsCStr(), cache_file_path.AsCStr(), MOVEFILE_REPLACE_EXISTING))
+		gAppFatalError(R"(Failed to save cached state ("%s") - %s)", cache_file_path.AsCStr(), GetLastErrorString().AsCStr());
+
+	return file_size;
+}
+
+
+// Create a new (empty) journal file for this snapshot.
+static FILE* sCreateCacheJournal(int inJournalIndex, uint64 inSnapshotID)
+{
+	TempString journal_file_path = sGetCacheJournalPath(inJournalIndex);
+	FILE*      journal_file      = fopen(journal_file_path.AsCStr(), "wb");
+
+	if (journal_file == nullptr)
+		gAppFatalError(R"(Failed to create cache journal ("%s") - %s (0x%X))", journal_file_path.AsCStr(), strerror(errno), errno);
+
+	BinaryWriter bin;
+	bin.WriteLabel("JOURNAL");
+	bin.Write(cCacheFormatVersion);
+	bin.Write(inSnapshotID);
+
+	if (fwrite(bin.mBuffer.Begin(), 1, bin.mBuffer.Size(), journal_file) != (size_t)bin.mBuffer.Size() || fflush(journal_file) != 0)
+		gAppFatalError(R"(Failed to write cache journal ("%s") - %s (0x%X))", journal_file_path.AsCStr(), strerror(errno), errno);
+
+	return journal_file;
+}
+
+
+// Read the ID of the snapshot a journal file belongs to. Return false if it can't be read or if it's from another format version.
+static bool sReadCacheJournalSnapshotID(StringView inJournalPath, uint64& outSnapshotID)
+{
+	FILE* journal_file = fopen(inJournalPath.AsCStr(), "rb");
+	if (journal_file == nullptr)
+		return false;
+
+	// Same layout as written by sCreateCacheJournal.
+	char   label[7]       = {};
+	int    format_version = -1;
+	uint64 snapshot_id    = 0;
+	bool   success        = fread(label, sizeof(label), 1, journal_file) == 1 &&
+							fread(&format_version, sizeof(format_version), 1, journal_file) == 1 &&
+							fread(&snapshot_id, sizeof(snapshot_id), 1, journal_file) == 1;
+	fclose(journal_file);
+
+	if (!success || memcmp(label, "JOURNAL", sizeof(label)) != 0 || format_version != cCacheFormatVersion)
+		return false;
+
+	outSnapshotID = snapshot_id;
+	return true;
+}
 
-constexpr int        cCacheFormatVersion = 5;
-constexpr StringView cCacheFileName      = "cache.bin";
 
 void FileSystem::LoadCache()
 {
@@ -1542,7 +2067,10 @@ void FileSystem::LoadCache()
 
 	BinaryReader bin;
 	if (!bin.ReadFile(cache_file))
+	{
+		gAppLogError(R"(Failed to read cached state, ignoring cache. ("%s"))", cache_file_path.AsCStr());
 		return;
+	}
 
 	if (!bin.ExpectLabel("VERSION"))
 	{
@@ -1559,6 +2087,9 @@ void FileSystem::LoadCache()
 		return;
 	}
 
+	uint64 snapshot_id = 0;
+	bin.Read(snapshot_id);
+
 	Vector<StringView> valid_repos;
 	int total_repo_count = 0;
 
@@ -1662,6 +2193,23 @@ void FileSystem::LoadCache()
 		}
 	}
 
+	// FileIDs of the files loaded for each repo in the cache, indexed by their serialized index.
+	// Stays empty for invalid repos, so that references to their files are ignored.
+	Vector<Vector<FileID>> loaded_file_ids;
+	loaded_file_ids.Resize(total_repo_count);
+
+	auto find_loaded_file_id = [&loaded_file_ids](SerializedFileID inSerializedID)
+	{
+		if (inSerializedID.mRepoIndex >= (uint32)loaded_file_ids.Size())
+			return FileID::cInvalid();
+
+		const Vector<FileID>& file_ids = loaded_file_ids[inSerializedID.mRepoIndex];
+		if (inSerializedID.mFileIndex >= (uint32)file_ids.Size())
+			return FileID::cInvalid();
+
+		return file_ids[inSerializedID.mFileIndex];
+	};
+
 	for (int repo_index = 0; repo_index < total_repo_count; ++repo_index)
 	{
 		if (!bin.ExpectLabel("REPO_CONTENT"))
@@ -1703,20 +2251,31 @@ void FileSystem::LoadCache()
 
 		if (repo_valid)
 		{
+			Vector<FileID>& file_ids = loaded_file_ids[repo_index];
+			file_ids.Reserve(file_count);
+
 			// Read the files.
 			for (int file_index = 0; file_index < (int)file_count; ++file_index)
 			{
 				SerializedFileInfo serialized_file_info;
 				bin.Read(serialized_file_info);
 
-				FileInfo& file_info = repo->GetOrAddFile(
-					MutStringView(all_strings.SubSpan(serialized_file_info.mPathOffset, serialized_file_info.mPathSize)), 
-					serialized_file_info.GetType(), 
-					serialized_file_info.mRefNumber);
+				// The path is already in the string pool and the hash is stored in the cache, use both as is.
+				// Parent dirs are always serialized before their content, so the parent dir is known as well.
+				StringView path          = MutStringView(all_strings.SubSpan(serialized_file_info.mPathOffset, serialized_file_info.mPathSize));
+				FileID     parent_dir_id = serialized_file_info.mParentDirIndex < (uint32)file_ids.Size() ? file_ids[serialized_file_info.mParentDirIndex] : FileID::cInvalid();
+
+				FileInfo& file_info = repo->GetOrAddFileInternal(path, serialized_file_info.mPathHash, parent_dir_id, 
+					serialized_file_info.GetType(), serialized_file_info.mRefNumber, FileRepo::PathStorage::InPool);
+
+				file_ids.PushBack(file_info.mID);
 
 				file_info.mCreationTime   = serialized_file_info.mCreationTime;
 				file_info.mLastChangeUSN  = serialized_file_info.mLastChangeUSN;
 				file_info.mLastChangeTime = serialized_file_info.mLastChangeTime;
+				file_info.mContentHash          = serialized_file_info.mContentHash;
+				file_info.mContentHashUSN       = serialized_file_info.mContentHashUSN;
+				file_info.mLastContentChangeUSN = serialized_file_info.mLastContentChangeUSN;
 
 				// Mark all the files as deleted, the scan will tell if they actually still exist.
 				// Note: Don't mark the root dir as deleted otherwise we won't be able to scan it (because it clears the ref number).
@@ -1731,12 +2290,8 @@ void FileSystem::LoadCache()
 		}
 	}
 
-	struct ErroredCommand
-	{
-		CookingCommandID mCommandID;
-		StringView       mLastCookOutput;
-	};
-	Vector<ErroredCommand> errored_commands;
+	// Results of the last cooks, used to add cooking log entries for the errored commands.
+	Vector<CachedLastCook> last_cooks;
 
 	// Read the commands.
 	int	   total_commands = 0;
@@ -1775,7 +2330,7 @@ void FileSystem::LoadCache()
 			SerializedCommand serialized_command;
 			bin.Read(serialized_command);
 
-			FileID          main_input = FindFileIDByPathHash(serialized_command.mMainInputPathHash);
+			FileID          main_input = find_loaded_file_id(serialized_command.mMainInput);
 			CookingCommand* command    = nullptr;
 			if (rule_valid && main_input.IsValid())
 			{
@@ -1790,6 +2345,7 @@ void FileSystem::LoadCache()
 					command->mLastCookUSN         = (USN)serialized_command.mLastCookUSN;
 					command->mLastCookTime        = serialized_command.mLastCookTime;
 					command->mLastCookRuleVersion = rule_version;
+					command->SetLastCookDuration(serialized_command.mLastCookDurationMs);
 				}
 			}
 
@@ -1798,7 +2354,7 @@ void FileSystem::LoadCache()
 			{
 				// If the rule/command are valid, also read the last cooking log output, otherwise skip it.
 				if (command)
-					errored_commands.PushBack({ command->mID, bin.Read(gCookingSystem.GetStringPool()) });
+					last_cooks.PushBack({ command->mID, true, bin.Read(gCookingSystem.GetStringPool()) });
 				else
 					bin.SkipString();
 			}
@@ -1814,42 +2370,76 @@ void FileSystem::LoadCache()
 
 				for (int input_index = 0; input_index < (int)serialized_dep_file.mDepFileInputCount; ++input_index)
 				{
-					PathHash path_hash;
-					bin.Read(path_hash);
+					SerializedFileID serialized_file_id;
+					bin.Read(serialized_file_id);
 
-					FileID input_file = FindFileIDByPathHash(path_hash);
+					FileID input_file = find_loaded_file_id(serialized_file_id);
 					if (input_file.IsValid())
 						inputs.PushBack(input_file);
 				}
 
 				for (int output_index = 0; output_index < (int)serialized_dep_file.mDepFileOutputCount; ++output_index)
 				{
-					PathHash path_hash;
-					bin.Read(path_hash);
+					SerializedFileID serialized_file_id;
+					bin.Read(serialized_file_id);
 
-					FileID output_file = FindFileIDByPathHash(path_hash);
+					FileID output_file = find_loaded_file_id(serialized_file_id);
 					if (output_file.IsValid())
 						outputs.PushBack(output_file);
 				}
 
 				if (rule_valid && rule->UseDepFile() && command != nullptr)
 				{
-					command->mLastDepFileRead = serialized_dep_file.mLastDepFileRead;
+					command->mLastDepFileRead      = serialized_dep_file.mLastDepFileRead;
+					command->mJournaledDepFileRead = serialized_dep_file.mLastDepFileRead;
 					gApplyDepFileContent(*command, inputs, outputs);
 				}
 			}
+
+			for (int hash_index = 0; hash_index < (int)serialized_command.mInputHashCount; ++hash_index)
+			{
+				SerializedInputHash serialized_input_hash;
+				bin.Read(serialized_input_hash);
+
+				FileID input_file = find_loaded_file_id(serialized_input_hash.mFileID);
+				if (command != nullptr && rule->UseInputHashes() && input_file.IsValid())
+					command->mInputHashes.PushBack({ input_file, serialized_input_hash.mHash });
+			}
 		}
 	}
 
+	bin.ExpectLabel("FIN");
+
+	if (bin.mError)
+		gAppFatalError(R"(Corrupted cached state. Delete the file and try again ("%s")).)", cache_file_path.AsCStr());
+
+	// Apply the changes saved in the journal since that snapshot.
+	ReplayCacheJournal(snapshot_id, valid_repos, last_cooks);
+
 	// Now we need to add a cooking log entry for the errored commands.
 	{
+		// The journal can contain several cooks of the same command, only the last one matters.
+		Vector<CachedLastCook>        errored_commands;
+		VMemHashSet<CookingCommandID> commands_seen;
+		for (int index = last_cooks.Size() - 1; index >= 0; --index)
+		{
+			const CachedLastCook& last_cook = last_cooks[index];
+			if (commands_seen.Find(last_cook.mCommandID) != commands_seen.End())
+				continue;
+
+			commands_seen.Insert(last_cook.mCommandID);
+
+			if (last_cook.mIsError)
+				errored_commands.PushBack(last_cook);
+		}
+
 		// Sort the commands in error by cooking time, so that the log entries are in a sensible order.
-		std::sort(errored_commands.begin(), errored_commands.end(), [](const ErroredCommand& inA, const ErroredCommand& inB) {
+		std::sort(errored_commands.begin(), errored_commands.end(), [](const CachedLastCook& inA, const CachedLastCook& inB) {
 			return gCookingSystem.GetCommand(inA.mCommandID).mLastCookTime.mDateTime < gCookingSystem.GetCommand(inB.mCommandID).mLastCookTime.mDateTime;
 		});
 
 		// Add a cooking log for each.
-		for (auto [command_id, output_log] : errored_commands)
+		for (auto [command_id, is_error, output_log] : errored_commands)
 		{
 			CookingCommand&  command   = gCookingSystem.GetCommand(command_id);
 
@@ -1858,7 +2448,9 @@ void FileSystem::LoadCache()
 			log_entry.mOutput          = output_log;
 			log_entry.mCookingState.Store(CookingState::Error);
 
-			command.mLastCookingLog    = &log_entry;
+			command.mLastCookingLog      = &log_entry;
+			command.mLastCookingLogID.Store(log_entry.mID);
+			command.mJournaledCookingLog = &log_entry; // Already in the cache, no need to write it again.
 
 			// If running without UI, force all errored commands to recook.
 			// They should error again and that error will be reported on exit.
@@ -1867,12 +2459,6 @@ void FileSystem::LoadCache()
 				command.mLastCookRuleVersion = CookingRule::cInvalidVersion;
 		}
 	}
-	
-
-	bin.ExpectLabel("FIN");
-
-	if (bin.mError)
-		gAppFatalError(R"(Corrupted cached state. Delete the file and try again ("%s")).)", cache_file_path.AsCStr());
 
 	int total_files = 0;
 	for (auto& repo : mRepos)
@@ -1886,22 +2472,37 @@ void FileSystem::LoadCache()
 
 void FileSystem::SaveCache()
 {
+	// Let a snapshot being saved in the background finish first, this one is more recent.
+	FinishCacheSnapshot(true);
+
 	gAppLog("Saving cached state.");
 	Timer timer;
 
-	// Make sure the cache dir exists.
-	CreateDirectoryA(gApp.mCacheDirectory.AsCStr(), nullptr);
+	// Identifies this snapshot, the journal is only valid for the snapshot with the same ID.
+	const uint64 snapshot_id = gGetSystemTimeAsFileTime().mDateTime;
 
-	TempString cache_file_path = gTempFormat(R"(%s\%s)", gApp.mCacheDirectory.AsCStr(), cCacheFileName.AsCStr());
-	FILE*      cache_file      = fopen(cache_file_path.AsCStr(), "wb");
+	BinaryWriter bin;
+	SerializeCache(snapshot_id, bin);
 
-	if (cache_file == nullptr)
-		gAppFatalError(R"(Failed to save cached state ("%s") - %s (0x%X))", cache_file_path.AsCStr(), strerror(errno), errno);
+	size_t file_size = sWriteCacheSnapshot(bin);
+
+	// The snapshot now contains everything, start a new journal.
+	ResetCacheJournal(snapshot_id);
+
+	gAppLog("Done. Saved %s (%s compressed) in %.2f seconds.", 
+		gFormatSizeInBytes(bin.mBuffer.Size()).AsCStr(), 
+		gFormatSizeInBytes(file_size).AsCStr(), 
+		gTicksToSeconds(timer.GetTicks()));
+}
 
-	BinaryWriter bin;
+
+void FileSystem::SerializeCache(uint64 inSnapshotID, BinaryWriter& ioBin)
+{
+	BinaryWriter& bin = ioBin;
 
 	bin.WriteLabel("VERSION");
 	bin.Write(cCacheFormatVersion);
+	bin.Write(inSnapshotID);
 
 	// Write all drives and repos.
 	bin.Write((uint16)mDrives.Size());
@@ -1922,6 +2523,20 @@ void FileSystem::SaveCache()
 		}
 	}
 
+	// Index of each file in the serialized files of its repo, to reference files without storing their path hash.
+	Vector<Vector<uint32>> serialized_indices_per_repo;
+	serialized_indices_per_repo.Resize(mRepos.Size());
+
+	auto get_serialized_file_id = [&serialized_indices_per_repo](FileID inFileID)
+	{
+		// Note: Repos are serialized in order, so the serialized repo index is the same as the repo index.
+		uint32 file_index = serialized_indices_per_repo[inFileID.mRepoIndex][inFileID.mFileIndex];
+		if (file_index == SerializedFileID::cInvalidIndex)
+			return SerializedFileID{}; // Deleted files aren't serialized.
+
+		return SerializedFileID{ inFileID.mRepoIndex, file_index };
+	};
+
 	for (const FileRepo& repo : mRepos)
 	{
 		bin.WriteLabel("REPO_CONTENT");
@@ -1958,13 +2573,22 @@ void FileSystem::SaveCache()
 
 		bin.WriteLabel("FILES");
 
+		Vector<uint32>& serialized_indices = serialized_indices_per_repo[repo.mIndex];
+		serialized_indices.Resize(repo.mFiles.SizeRelaxed(), EResizeInit::NoZeroInit);
+		uint32 serialized_count = 0;
+
 		// Write the files.
 		uint32 current_offset = 0;
 		for (const FileInfo& file : repo.mFiles)
 		{
 			// Skip deleted files.
 			if (file.IsDeleted())
+			{
+				serialized_indices[file.mID.mFileIndex] = SerializedFileID::cInvalidIndex;
 				continue;
+			}
+
+			serialized_indices[file.mID.mFileIndex] = serialized_count++;
 
 			SerializedFileInfo serialized_file_info;
 			serialized_file_info.mPathOffset     = current_offset;
@@ -1974,6 +2598,11 @@ void FileSystem::SaveCache()
 			serialized_file_info.mCreationTime   = file.mCreationTime;
 			serialized_file_info.mLastChangeUSN  = file.mLastChangeUSN;
 			serialized_file_info.mLastChangeTime = file.mLastChangeTime;
+			serialized_file_info.mPathHash       = PathHash{ file.mPathHash };
+			serialized_file_info.mParentDirIndex = file.mParentDirID.IsValid() ? serialized_indices[file.mParentDirID.mFileIndex] : SerializedFileInfo::cNoParentDir;
+			serialized_file_info.mContentHash          = file.mContentHash;
+			serialized_file_info.mContentHashUSN       = file.mContentHashUSN;
+			serialized_file_info.mLastContentChangeUSN = file.mLastContentChangeUSN;
 
 			bin.Write(serialized_file_info);
 
@@ -1994,7 +2623,13 @@ void FileSystem::SaveCache()
 
 		// Skip commands that didn't cook since the rule version changed.
 		// They are dirty and not saving them will make them appear dirty when we restart.
-		if (command.mLastCookRuleVersion != command.GetRule().mVersion)
+		if (command.mCacheState.mLastCookRuleVersion != command.GetRule().mVersion)
+			continue;
+
+		// Skip commands that are still cooking, we don't know the result yet (the snapshot can be saved while cooking).
+		// They'll be written to the journal once finished.
+		// Note: only the cache state is read below, the cooking threads can be writing the other fields.
+		if (command.HasUnfinishedCook())
 			continue;
 
 		commands_per_rule[command.mRuleID.mIndex].PushBack(command.mID);
@@ -2020,19 +2655,20 @@ void FileSystem::SaveCache()
 			const CookingCommand& command = gCookingSystem.GetCommand(command_id);
 
 			// Write the base command data.
-			SerializedCommand     serialized_command;
-			const FileInfo&       main_input      = command.GetMainInput().GetFile();
-			serialized_command.mMainInputPathHash = gHashPath(gConcat(main_input.GetRepo().mRootPath, main_input.mPath));
-			serialized_command.mLastCookUSN       = command.mLastCookUSN;
-			serialized_command.mLastCookIsError   = (command.mDirtyState & CookingCommand::Error) != 0;
-			serialized_command.mLastCookTime      = command.mLastCookTime;
+			SerializedCommand serialized_command;
+			serialized_command.mMainInput          = get_serialized_file_id(command.GetMainInput());
+			serialized_command.mLastCookUSN        = command.mCacheState.mLastCookUSN;
+			serialized_command.mLastCookIsError    = (command.mDirtyState & CookingCommand::Error) != 0;
+			serialized_command.mLastCookTime       = command.mCacheState.mLastCookTime;
+			serialized_command.mLastCookDurationMs = command.mCacheState.mLastCookDurationMs;
+			serialized_command.mInputHashCount     = (uint32)command.mInputHashes.Size();
 			bin.Write(serialized_command);
 
 			// If the command had an error, also write the last cooking log output.
 			if (serialized_command.mLastCookIsError)
 			{
-				if (command.mLastCookingLog)
-					bin.Write(command.mLastCookingLog->mOutput);
+				if (command.mCacheState.mLastCookingLog)
+					bin.Write(command.mCacheState.mLastCookingLog->mOutput);
 				else
 					bin.Write("No output recorded."); // Can this case happen? Probably not, but better be safe.
 			}
@@ -2047,43 +2683,852 @@ void FileSystem::SaveCache()
 				bin.Write(serialized_dep_file);
 
 				for (FileID file_id : command.mDepFileInputs)
-				{
-					const FileInfo& file = file_id.GetFile();
-					PathHash path_hash = gHashPath(gConcat(file.GetRepo().mRootPath, file.mPath));
-					bin.Write(path_hash);
-				}
+					bin.Write(get_serialized_file_id(file_id));
 
 				for (FileID file_id : command.mDepFileOutputs)
-				{
-					const FileInfo& file = file_id.GetFile();
-					PathHash path_hash = gHashPath(gConcat(file.GetRepo().mRootPath, file.mPath));
-					bin.Write(path_hash);
-				}
+					bin.Write(get_serialized_file_id(file_id));
 			}
+
+			for (const CookingCommand::InputHash& input_hash : command.mInputHashes)
+				bin.Write(SerializedInputHash{ get_serialized_file_id(input_hash.mFileID), input_hash.mHash });
 		}
 	}
 
 	bin.WriteLabel("FIN");
+}
 
-	if (!bin.WriteFile(cache_file))
-		gAppFatalError(R"(Failed to save cached state ("%s") - %s (0x%X))", cache_file_path.AsCStr(), strerror(errno), errno);
-
-	size_t file_size = ftell(cache_file);
-	fclose(cache_file);
 
-	gAppLog("Done. Saved %s (%s compressed) in %.2f seconds.", 
-		gFormatSizeInBytes(bin.mBuffer.Size()).AsCStr(), 
-		gFormatSizeInBytes(file_size).AsCStr(), 
+void FileSystem::StartCacheSnapshot()
+{
+	gAssert(mNextCacheJournalFile == nullptr);
+
+	Timer        timer;
+	const uint64 snapshot_id = gGetSystemTimeAsFileTime().mDateTime;
+
+	// Serialize the state here, this thread is the only one allowed to read it. The copy is compressed and written on a background thread,
+	// which is the slow part.
+	BinaryWriter* bin = new BinaryWriter;
+	SerializeCache(snapshot_id, *bin);
+
+	// The changes from now on are not in the snapshot. Write them to a new journal that belongs to it, but also keep writing them
+	// to the current journal until the snapshot is on disk, in case the process is killed before that.
+	// Note: The other journal file belongs to an older snapshot, it's not needed anymore.
+	mNextCacheJournalFile   = sCreateCacheJournal(1 - mCacheJournalIndex, snapshot_id);
+	mNextCacheJournalSize   = 0;
+	mLastCacheSnapshotTicks = gGetTickCount();
+	mCacheSnapshotDone.Store(false);
+
+	gAppLog("Saving cached state in the background (serialized %s in %.2f seconds).", 
+		gFormatSizeInBytes(bin->mBuffer.Size()).AsCStr(), 
 		gTicksToSeconds(timer.GetTicks()));
+
+	mCacheSnapshotThread.Create({
+		.mName = "Save Cache Thread",
+		.mTempMemSize = 128_KiB, // For the paths.
+	}, [this, bin](Thread&)
+	{
+		Timer  timer;
+		size_t file_size = sWriteCacheSnapshot(*bin);
+
+		gAppLog("Done. Saved %s (%s compressed) in %.2f seconds.", 
+			gFormatSizeInBytes(bin->mBuffer.Size()).AsCStr(), 
+			gFormatSizeInBytes(file_size).AsCStr(), 
+			gTicksToSeconds(timer.GetTicks()));
+
+		delete bin;
+
+		// Let the monitor thread switch to the new journal.
+		mCacheSnapshotDone.Store(true);
+		KickMonitorDirectoryThread();
+	});
 }
 
 
-REGISTER_TEST("USNToString")
+void FileSystem::FinishCacheSnapshot(bool inWait)
 {
-	TEST_TRUE(gUSNToString(0) == "0");
-	TEST_TRUE(gUSNToString(123) == "123");
-	TEST_TRUE(gUSNToString(1'234) == "1'234");
-	TEST_TRUE(gUSNToString(12'345) == "12'345");
-	TEST_TRUE(gUSNToString(123'456) == "123'456");
-	TEST_TRUE(gUSNToString(1'234'567) == "1'234'567");
-};
\ No newline at end of file
+	// No snapshot being saved.
+	if (mNextCacheJournalFile == nullptr)
+		return;
+
+	if (!inWait && !mCacheSnapshotDone.Load())
+		return;
+
+	mCacheSnapshotThread.Join();
+
+	// The new snapshot is on disk, its journal replaces the current one.
+	fclose(mCacheJournalFile);
+	mCacheJournalFile     = mNextCacheJournalFile;
+	mCacheJournalSize     = mNextCacheJournalSize;
+	mCacheJournalIndex    = 1 - mCacheJournalIndex;
+	mNextCacheJournalFile = nullptr;
+	mNextCacheJournalSize = 0;
+}
+
+
+// Start a new (empty) journal for this snapshot.
+void FileSystem::ResetCacheJournal(uint64 inSnapshotID)
+{
+	if (mCacheJournalFile)
+		fclose(mCacheJournalFile);
+
+	mCacheJournalFile       = sCreateCacheJournal(mCacheJournalIndex, inSnapshotID);
+	mCacheJournalSize       = 0;
+	mLastCacheSnapshotTicks = gGetTickCount();
+}
+
+
+void FileSystem::UpdateCacheJournal()
+{
+	// Save a new snapshot when the journal gets too big (to keep loading fast), or when it gets old (to keep the snapshot USNs recent,
+	// otherwise the USN journal might not contain all the changes since then anymore and we'd need to scan everything again on start).
+	constexpr int64  cMaxJournalSize        = 64_MiB;
+	constexpr double cMaxSnapshotAgeSeconds = 30.0 * 60.0;
+
+	// No journal yet (eg. the cache didn't exist or was invalid), save a snapshot to start one.
+	if (mCacheJournalFile == nullptr)
+	{
+		SaveCache();
+		return;
+	}
+
+	// If a snapshot finished saving in the background, switch to its journal.
+	FinishCacheSnapshot(false);
+
+	Vector<CookingCommandID> commands;
+	gCookingSystem.TakeCommandsToJournal(commands);
+
+	// Write the state of all the commands that changed since last time in a single batch.
+	BinaryWriter bin;
+	uint32       record_count = 0;
+	for (CookingCommandID command_id : commands)
+	{
+		CookingCommand& command = gCookingSystem.GetCommand(command_id);
+		if (!command.NeedsJournaling())
+			continue;
+
+		const CookingRule& rule = command.GetRule();
+
+		bin.Write(rule.mName);
+
+		// Note: only the cache state is read, the cooking threads can be writing the other fields (see CookingCommand::mCacheState).
+		SerializedJournalCommand serialized_command;
+		serialized_command.mRuleVersion        = command.mCacheState.mLastCookRuleVersion;
+		serialized_command.mUseDepFile         = rule.UseDepFile();
+		serialized_command.mLastCookUSN        = command.mCacheState.mLastCookUSN;
+		serialized_command.mLastCookIsError    = (command.mDirtyState & CookingCommand::Error) != 0;
+		serialized_command.mLastCookTime       = command.mCacheState.mLastCookTime;
+		serialized_command.mLastCookDurationMs = command.mCacheState.mLastCookDurationMs;
+		serialized_command.mInputHashCount     = (uint32)command.mInputHashes.Size();
+		bin.Write(serialized_command);
+
+		// Files are referenced by their full path since they might not be in the snapshot.
+		const FileInfo& main_input = command.GetMainInput().GetFile();
+		bin.Write(StringView(gConcat(main_input.GetRepo().mRootPath, main_input.mPath)));
+
+		// If the command had an error, also write the last cooking log output.
+		if (serialized_command.mLastCookIsError)
+		{
+			if (command.mCacheState.mLastCookingLog)
+				bin.Write(command.mCacheState.mLastCookingLog->mOutput);
+			else
+				bin.Write("No output recorded.");
+		}
+
+		if (rule.UseDepFile())
+		{
+			SerializedDepFileHeader serialized_dep_file;
+			serialized_dep_file.mLastDepFileRead    = command.mLastDepFileRead;
+			serialized_dep_file.mDepFileInputCount  = (uint32)command.mDepFileInputs.Size();
+			serialized_dep_file.mDepFileOutputCount = (uint32)command.mDepFileOutputs.Size();
+			bin.Write(serialized_dep_file);
+
+			for (FileID file_id : command.mDepFileInputs)
+				bin.Write(StringView(gConcat(file_id.GetRepo().mRootPath, file_id.GetFile().mPath)));
+
+			for (FileID file_id : command.mDepFileOutputs)
+				bin.Write(StringView(gConcat(file_id.GetRepo().mRootPath, file_id.GetFile().mPath)));
+		}
+
+		for (const CookingCommand::InputHash& input_hash : command.mInputHashes)
+		{
+			bin.Write(StringView(gConcat(input_hash.mFileID.GetRepo().mRootPath, input_hash.mFileID.GetFile().mPath)));
+			bin.Write(input_hash.mHash);
+		}
+
+		command.mJournaledCookingLog  = command.mCacheState.mLastCookingLog;
+		command.mJournaledDepFileRead = command.mLastDepFileRead;
+		record_count++;
+	}
+
+	if (record_count > 0)
+	{
+		SerializedJournalBatchHeader header;
+		header.mSize        = (uint32)bin.mBuffer.Size();
+		header.mRecordCount = record_count;
+		header.mChecksum    = XXH3_64bits(bin.mBuffer.Begin(), bin.mBuffer.Size());
+
+		// Flush after each batch. If the process is killed, the data is still written by the OS.
+		auto write_batch = [&](FILE* ioJournalFile)
+		{
+			return fwrite(&header, sizeof(header), 1, ioJournalFile) == 1 &&
+				fwrite(bin.mBuffer.Begin(), 1, bin.mBuffer.Size(), ioJournalFile) == (size_t)bin.mBuffer.Size() &&
+				fflush(ioJournalFile) == 0;
+		};
+
+		// While a snapshot is being saved, the batch also goes to its journal (see StartCacheSnapshot).
+		if (!write_batch(mCacheJournalFile) || (mNextCacheJournalFile && !write_batch(mNextCacheJournalFile)))
+			gAppFatalError(R"(Failed to write cache journal - %s (0x%X))", strerror(errno), errno);
+
+		mCacheJournalSize += sizeof(header) + bin.mBuffer.Size();
+		if (mNextCacheJournalFile)
+			mNextCacheJournalSize += sizeof(header) + bin.mBuffer.Size();
+	}
+
+	// Only one snapshot is saved at a time.
+	if (mNextCacheJournalFile)
+		return;
+
+	if (mCacheJournalSize >= cMaxJournalSize || 
+		(mCacheJournalSize > 0 && gTicksToSeconds(gGetTickCount() - mLastCacheSnapshotTicks) >= cMaxSnapshotAgeSeconds))
+	{
+		StartCacheSnapshot();
+	}
+}
+
+
+void FileSystem::ReplayCacheJournal(uint64 inSnapshotID, Span<const StringView> inValidRepos, Vector<CachedLastCook>& ioLastCooks)
+{
+	Timer timer;
+
+	// The two journal files are used in turn (see StartCacheSnapshot), find the one that belongs to that snapshot.
+	// If there's none (eg. the process was killed between saving the snapshot and resetting the journal), the changes are all in the snapshot.
+	// A new journal is started after saving the next snapshot.
+	int journal_index = -1;
+	for (int i = 0; i < (int)gElemCount(cCacheJournalNames) && journal_index == -1; ++i)
+	{
+		uint64 snapshot_id = 0;
+		if (sReadCacheJournalSnapshotID(sGetCacheJournalPath(i), snapshot_id) && snapshot_id == inSnapshotID)
+			journal_index = i;
+	}
+
+	if (journal_index == -1)
+	{
+		gAppLog("No cache journal matches the cached state, ignoring them.");
+		return;
+	}
+
+	TempString journal_file_path = sGetCacheJournalPath(journal_index);
+	FILE*      journal_file      = fopen(journal_file_path.AsCStr(), "rb");
+
+	if (journal_file == nullptr)
+		return;
+
+	BinaryReader bin;
+	bool         read_success = bin.ReadFileUncompressed(journal_file);
+	fclose(journal_file);
+
+	if (!read_success || !bin.ExpectLabel("JOURNAL"))
+		return;
+
+	// Skip the rest of the header, it was checked above.
+	bin.Skip(sizeof(int) + sizeof(uint64));
+
+	// Find a file by its full path. Files created after the snapshot might not exist yet, add them (they'll be updated when reading the USN journal).
+	auto get_file = [this, inValidRepos](StringView inPath)
+	{
+		FileRepo* repo = FindRepoByPath(inPath);
+		if (repo == nullptr || !gContains(inValidRepos, repo->mName))
+			return FileID::cInvalid();
+
+		return repo->GetOrAddFile(repo->RemoveRootPath(inPath), FileType::File, FileRefNumber::cInvalid()).mID;
+	};
+
+	const int header_size  = bin.mCurrentOffset;
+	int       valid_size   = header_size;
+	int       record_count = 0;
+	while (bin.mCurrentOffset < bin.mBuffer.Size())
+	{
+		SerializedJournalBatchHeader header;
+		bin.Read(header);
+
+		// Stop at the first batch that wasn't entirely written.
+		if (bin.mError || header.mSize > (uint32)(bin.mBuffer.Size() - bin.mCurrentOffset) || 
+			header.mChecksum != XXH3_64bits(bin.mBuffer.Begin() + bin.mCurrentOffset, header.mSize))
+		{
+			gAppLog("Cache journal ends with an incomplete batch, ignoring it.");
+			break;
+		}
+
+		for (uint32 record_index = 0; record_index < header.mRecordCount; ++record_index)
+		{
+			TempString rule_name;
+			bin.Read(rule_name);
+
+			SerializedJournalCommand serialized_command;
+			bin.Read(serialized_command);
+
+			TempString main_input_path;
+			bin.Read(main_input_path);
+
+			if (bin.mError)
+				break;
+
+			const CookingRule* rule       = gCookingSystem.FindRule(rule_name);
+			FileID             main_input = rule ? get_file(main_input_path) : FileID::cInvalid();
+			CookingCommand*    command    = nullptr;
+			if (main_input.IsValid())
+			{
+				// Make sure the commands are created for this file.
+				gCookingSystem.CreateCommandsForFile(main_input.GetFile());
+
+				// Find the command. Should be found, unless the rule changed.
+				command = gCookingSystem.FindCommandByMainInput(rule->mID, main_input);
+
+				if (command)
+				{
+					command->mLastCookUSN         = (USN)serialized_command.mLastCookUSN;
+					command->mLastCookTime        = serialized_command.mLastCookTime;
+					command->mLastCookRuleVersion = serialized_command.mRuleVersion;
+					command->SetLastCookDuration(serialized_command.mLastCookDurationMs);
+				}
+			}
+
+			if (serialized_command.mLastCookIsError)
+			{
+				if (command)
+					ioLastCooks.PushBack({ command->mID, true, bin.Read(gCookingSystem.GetStringPool()) });
+				else
+					bin.SkipString();
+			}
+			else if (command)
+			{
+				// Not an error (anymore), the command shouldn't have an error log entry.
+				ioLastCooks.PushBack({ command->mID, false, {} });
+			}
+
+			if (serialized_command.mUseDepFile)
+			{
+				SerializedDepFileHeader serialized_dep_file;
+				bin.Read(serialized_dep_file);
+
+				Vector<FileID> inputs, outputs;
+				inputs.Reserve(serialized_dep_file.mDepFileInputCount);
+				outputs.Reserve(serialized_dep_file.mDepFileOutputCount);
+
+				TempString path;
+				for (int input_index = 0; input_index < (int)serialized_dep_file.mDepFileInputCount; ++input_index)
+				{
+					bin.Read(path);
+
+					FileID input_file = command ? get_file(path) : FileID::cInvalid();
+					if (input_file.IsValid())
+						inputs.PushBack(input_file);
+				}
+
+				for (int output_index = 0; output_index < (int)serialized_dep_file.mDepFileOutputCount; ++output_index)
+				{
+					bin.Read(path);
+
+					FileID output_file = command ? get_file(path) : FileID::cInvalid();
+					if (output_file.IsValid())
+						outputs.PushBack(output_file);
+				}
+
+				if (command != nullptr && rule->UseDepFile())
+				{
+					command->mLastDepFileRead      = serialized_dep_file.mLastDepFileRead;
+					command->mJournaledDepFileRead = serialized_dep_file.mLastDepFileRead;
+					gApplyDepFileContent(*command, inputs, outputs);
+				}
+			}
+
+			// The journal has the hashes of the last cook, replace the ones from the snapshot.
+			if (command != nullptr)
+				command->mInputHashes.Clear();
+
+			TempString input_path;
+			for (int hash_index = 0; hash_index < (int)serialized_command.mInputHashCount; ++hash_index)
+			{
+				uint64 hash = 0;
+				bin.Read(input_path);
+				bin.Read(hash);
+
+				FileID input_file = command ? get_file(input_path) : FileID::cInvalid();
+				if (input_file.IsValid() && rule->UseInputHashes())
+					command->mInputHashes.PushBack({ input_file, hash });
+			}
+
+			record_count++;
+		}
+
+		// The batch checksum was correct, so this should never happen.
+		if (bin.mError)
+		{
+			gAppLogError(R"(Corrupted cache journal, ignoring the rest of it ("%s").)", journal_file_path.AsCStr());
+			break;
+		}
+
+		valid_size = bin.mCurrentOffset;
+	}
+
+	// Keep appending to this journal.
+	// Note: An incomplete batch at the end gets overwritten. If it's longer than what's written next, the leftover is ignored since the checksum won't match.
+	mCacheJournalFile = fopen(journal_file_path.AsCStr(), "r+b");
+	if (mCacheJournalFile == nullptr || fseek(mCacheJournalFile, valid_size, SEEK_SET) != 0)
+		gAppFatalError(R"(Failed to open cache journal ("%s") - %s (0x%X))", journal_file_path.AsCStr(), strerror(errno), errno);
+
+	mCacheJournalIndex      = journal_index;
+	mCacheJournalSize       = valid_size - header_size;
+	mLastCacheSnapshotTicks = gGetTickCount();
+
+	gAppLog("Replayed %d changes from the cache journal in %.2f seconds.", record_count, gTicksToSeconds(timer.GetTicks()));
+}
+
+
+REGISTER_TEST("USNToString")
+{
+	TEST_TRUE(gUSNToString(0) == "0");
+	TEST_TRUE(gUSNToString(123) == "123");
+	TEST_TRUE(gUSNToString(1'234) == "1'234");
+	TEST_TRUE(gUSNToString(12'345) == "12'345");
+	TEST_TRUE(gUSNToString(123'456) == "123'456");
+	TEST_TRUE(gUSNToString(1'234'567) == "1'234'567");
+};
+
+
+REGISTER_TEST("HashPath")
+{
+	// The ASCII version must give the same hashes as the unicode version.
+	const char* names[] = {
+		"C:",
+		"a",
+		"brick_albedo.png",
+		"BRICK_albedo.PNG",
+		"[with]{symbols}_and_@_~_`_0123456789_file.name.with.dots.txt",
+	};
+
+	PathHash parent_hash = gHashPath("D:\\Data\\Source");
+	for (const char* name : names)
+		TEST_TRUE(sHashPathComponent(parent_hash, name) == sHashPathComponentUnicode(parent_hash, name));
+
+	// Case insensitive.
+	TEST_TRUE(gHashPath("D:\\Data\\Source\\textures\\brick_albedo.png") == gHashPath("D:\\data\\source\\TEXTURES\\Brick_Albedo.PNG"));
+
+	// Can be built one component at a time.
+	TEST_TRUE(gHashPath("D:\\Data\\Source\\textures\\brick_albedo.png") == gHashPath(parent_hash, "textures\\brick_albedo.png"));
+	TEST_TRUE(gHashPath("D:\\Data\\Source\\textures\\brick_albedo.png") == gHashPath(gHashPath(parent_hash, "textures"), "brick_albedo.png"));
+
+	// Trailing slashes are ignored.
+	TEST_TRUE(gHashPath("D:\\Data\\Source\\") == parent_hash);
+
+	// Different paths give different hashes, even with the same characters.
+	TEST_FALSE(gHashPath("D:\\ab\\c") == gHashPath("D:\\a\\bc"));
+
+	// Non-ASCII names go through the unicode version.
+	TEST_TRUE(gHashPath("C:\\\xC3\xA9t\xC3\xA9.txt") == gHashPath("C:\\\xC3\x89T\xC3\x89.TXT"));
+};
+
+
+REGISTER_BENCHMARK("ShardedHashMap")
+{
+	// Insert the same keys from 1 to 64 threads, in a ShardedHashMap and in a single map behind one mutex (what the file maps used to be).
+	constexpr int cKeyCount = 256 * 1024;
+
+	auto make_key = [](int inIndex)
+	{
+		XXH128_hash_t hash = XXH3_128bits(&inIndex, sizeof(inIndex));
+		PathHash      key;
+		key.mData[0] = hash.low64;
+		key.mData[1] = hash.high64;
+		return key;
+	};
+
+	auto run_threads = [](int inThreadCount, auto&& inInsertFunction)
+	{
+		Timer  timer;
+		Thread threads[64];
+		for (int thread_index = 0; thread_index < inThreadCount; ++thread_index)
+		{
+			threads[thread_index].Create({ .mName = "Test Thread" }, [&, thread_index](Thread&)
+			{
+				for (int i = thread_index; i < cKeyCount; i += inThreadCount)
+					inInsertFunction(i);
+			});
+		}
+
+		for (Thread& thread : Span(threads, inThreadCount))
+			thread.Join();
+
+		return gTicksToSeconds(timer.GetTicks());
+	};
+
+	for (int thread_count = 1; thread_count <= 64; thread_count *= 2)
+	{
+		ShardedHashMap<PathHash, FileID> sharded_map;
+		double sharded_seconds = run_threads(thread_count, [&](int inIndex)
+		{
+			sharded_map.InsertOrGet(make_key(inIndex), FileID{ 0, (uint32)inIndex });
+		});
+		if (sharded_map.Size() != cKeyCount)
+			gAppLogError("ShardedHashMap: %d keys inserted but the map contains %d.", cKeyCount, sharded_map.Size());
+
+		Mutex                         single_mutex;
+		VMemHashMap<PathHash, FileID> single_map;
+		double single_seconds = run_threads(thread_count, [&](int inIndex)
+		{
+			LockGuard lock(single_mutex);
+			single_map.Insert(make_key(inIndex), FileID{ 0, (uint32)inIndex });
+		});
+		if (single_map.Size() != cKeyCount)
+			gAppLogError("Single mutex map: %d keys inserted but the map contains %d.", cKeyCount, single_map.Size());
+
+		gAppLog("ShardedHashMap: %2d threads, %d inserts. Sharded: %.1f ms. Single mutex: %.1f ms.",
+			thread_count, cKeyCount, sharded_seconds * 1000.0, single_seconds * 1000.0);
+	}
+}
+
+
+REGISTER_BENCHMARK("FileRepo_Scan")
+{
+	// Scan the same tree with more and more threads. Each run needs its own copy of the tree since its files must all be new,
+	// otherwise it would only measure finding them (and two repos can't share a root directory anyway).
+	constexpr int cDirCount         = 64;
+	constexpr int cFilesPerDirCount = 128;
+	const int     max_thread_count  = gMin(gThreadHardwareConcurrency(), 64);
+
+	for (int thread_count = 1; ; thread_count = gMin(thread_count * 2, max_thread_count))
+	{
+		TempString root_path = gCreateBenchmarkDirectory(gTempFormat("Scan_%d", thread_count));
+
+		for (int dir_index = 0; dir_index < cDirCount; ++dir_index)
+		{
+			TempString dir_path = gTempFormat(R"(%sdir_%03d\)", root_path.AsCStr(), dir_index);
+			gCreateDirectoryRecursive(dir_path);
+
+			for (int file_index = 0; file_index < cFilesPerDirCount; ++file_index)
+			{
+				OwnedHandle file = CreateFileA(gTempFormat("%sfile_%04d.txt", dir_path.AsCStr(), file_index).AsCStr(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+				if (!file.IsValid())
+				{
+					gAppLogError("Failed to create a file in %s - %s", dir_path.AsCStr(), GetLastErrorString().AsCStr());
+					return;
+				}
+			}
+		}
+
+		FileRepo& repo = gFileSystem.AddRepo(gTempFormat("Scan_%d", thread_count), root_path);
+
+		// Same loop as the initial scan.
+		Timer     timer;
+		ScanQueue scan_queue(thread_count);
+		scan_queue.Push(0, repo.mRootDirID);
+
+		Thread threads[64];
+		for (int thread_index = 0; thread_index < thread_count; ++thread_index)
+		{
+			threads[thread_index].Create({ .mName = "Scan Directory Thread" }, [&, thread_index](Thread&)
+			{
+				uint8 buffer_scan[32 * 1024];
+
+				FileID dir_id;
+				while ((dir_id = scan_queue.Pop(thread_index)) != FileID::cInvalid())
+					repo.ScanDirectory(dir_id, scan_queue, thread_index, buffer_scan);
+			});
+		}
+
+		for (Thread& thread : Span(threads, thread_count))
+			thread.Join();
+
+		double seconds = gTicksToSeconds(timer.GetTicks());
+
+		// The root dir, the sub-directories and their files.
+		constexpr int cExpectedFileCount = 1 + cDirCount + cDirCount * cFilesPerDirCount;
+		if (repo.mFiles.Size() != cExpectedFileCount)
+			gAppLogError("FileRepo scan: found %d files instead of %d.", repo.mFiles.Size(), cExpectedFileCount);
+
+		gAppLog("FileRepo scan: %2d threads, %d files in %.1f ms.", thread_count, repo.mFiles.Size(), seconds * 1000.0);
+
+		if (thread_count == max_thread_count)
+			break;
+	}
+}
+
+
+REGISTER_BENCHMARK("FileRepo_DeleteDirectory")
+{
+	// Delete a directory containing 10k nested directories, next to another directory of the same size that stays.
+	// The directories only exist in memory, with made up ref numbers: deleting their content doesn't touch the disk.
+	constexpr int cDirCount    = 100;
+	constexpr int cSubDirCount = 100;
+
+	TempString root_path = gCreateBenchmarkDirectory("DeleteDirectory");
+	FileRepo&  repo      = gFileSystem.AddRepo("DeleteDirectory", root_path);
+
+	uint64 next_ref_number = 0;
+	auto   add_dir         = [&](FileID inParentDirID, StringView inName)
+	{
+		FileRefNumber ref_number;
+		ref_number.mData[0] = next_ref_number++;
+		ref_number.mData[1] = 0xBE7C4; // Real NTFS ref numbers have zeroes there, don't collide with the root dir.
+		return repo.GetOrAddFile(inParentDirID, inName, FileType::Directory, ref_number).mID;
+	};
+
+	FileID deleted_dir_id = add_dir(repo.mRootDirID, "deleted");
+	FileID kept_dir_id    = add_dir(repo.mRootDirID, "kept");
+	for (FileID top_dir_id : { deleted_dir_id, kept_dir_id })
+	{
+		for (int dir_index = 0; dir_index < cDirCount; ++dir_index)
+		{
+			FileID dir_id = add_dir(top_dir_id, gTempFormat("dir_%03d", dir_index));
+			for (int sub_dir_index = 0; sub_dir_index < cSubDirCount; ++sub_dir_index)
+				add_dir(dir_id, gTempFormat("sub_dir_%03d", sub_dir_index));
+		}
+	}
+
+	// What deleting a directory used to cost: testing the path of every file of the repo.
+	Timer baseline_timer;
+	int   baseline_count = 0;
+	{
+		TempString dir_path = gConcat(repo.GetFile(deleted_dir_id).mPath, "\\");
+		for (const FileInfo& file : repo.mFiles)
+			if (gStartsWithNoCase(file.mPath, dir_path))
+				baseline_count++;
+	}
+	double baseline_ms = gTicksToSeconds(baseline_timer.GetTicks()) * 1000.0;
+
+	Timer timer;
+	repo.MarkDirectoryContentDeleted(repo.GetFile(deleted_dir_id), gGetSystemTimeAsFileTime());
+	double delete_ms = gTicksToSeconds(timer.GetTicks()) * 1000.0;
+
+	int deleted_count = 0;
+	int kept_count    = 0;
+	for (const FileInfo& file : repo.mFiles)
+	{
+		if (file.mID == repo.mRootDirID || file.mID == deleted_dir_id || file.mID == kept_dir_id)
+			continue;
+
+		if (file.IsDeleted())
+			deleted_count++;
+		else
+			kept_count++;
+	}
+
+	constexpr int cExpectedCount = cDirCount + cDirCount * cSubDirCount;
+	if (deleted_count != cExpectedCount || kept_count != cExpectedCount || baseline_count != cExpectedCount)
+		gAppLogError("FileRepo delete: %d directories deleted and %d kept (%d found by path), expected %d of each.",
+			deleted_count, kept_count, baseline_count, cExpectedCount);
+
+	gAppLog("FileRepo delete: %d nested directories in %.2f ms. Testing the paths of the %d files of the repo: %.2f ms.",
+		deleted_count, delete_ms, repo.mFiles.Size(), baseline_ms);
+}
+
+
+// Compare adding the files of the cache the way the v5 format did (paths only, hashed again and copied) with the current format
+// (path hash and parent dir stored, paths used directly from the string pool).
+// Note: Only the files are measured, reading and decompressing the cache file is the same for both.
+struct LoadCacheBenchmark
+{
+	static void Run()
+	{
+		constexpr int cDirCount         = 200;
+		constexpr int cFilesPerDirCount = 500;
+
+		struct SerializedFile
+		{
+			String     mPath;
+			int        mParentIndex = -1; // -1 for the root dir.
+			FileType   mType        = FileType::File;
+		};
+
+		Vector<SerializedFile> files;
+		for (int dir_index = 0; dir_index < cDirCount; ++dir_index)
+		{
+			int dir_file_index = files.Size();
+			files.PushBack({ String(gTempFormat("dir_%03d", dir_index)), -1, FileType::Directory });
+
+			for (int file_index = 0; file_index < cFilesPerDirCount; ++file_index)
+				files.PushBack({ String(gTempFormat(R"(dir_%03d\file_%04d.txt)", dir_index, file_index)), dir_file_index, FileType::File });
+		}
+
+		// Each repo is on the same drive, give them different made up ref numbers.
+		auto make_ref_number = [](int inRepoIndex, int inFileIndex)
+		{
+			FileRefNumber ref_number;
+			ref_number.mData[0] = (uint64)inFileIndex;
+			ref_number.mData[1] = 0x10AD0 + inRepoIndex; // Real NTFS ref numbers have zeroes there, don't collide with the root dirs.
+			return ref_number;
+		};
+
+		// Format v5.
+		FileRepo& v5_repo = gFileSystem.AddRepo("LoadCache_v5", gCreateBenchmarkDirectory("LoadCache_v5"));
+
+		Timer v5_timer;
+		for (int file_index = 0; file_index < files.Size(); ++file_index)
+			v5_repo.GetOrAddFile(files[file_index].mPath, files[file_index].mType, make_ref_number(0, file_index));
+		double v5_ms = gTicksToSeconds(v5_timer.GetTicks()) * 1000.0;
+
+		// Current format. The paths and their hashes are prepared first, they are read from the cache.
+		FileRepo& repo = gFileSystem.AddRepo("LoadCache", gCreateBenchmarkDirectory("LoadCache"));
+
+		Vector<StringView> pooled_paths;
+		Vector<PathHash>   path_hashes;
+		for (const SerializedFile& file : files)
+		{
+			pooled_paths.PushBack(repo.mStringPool.AllocateCopy(file.mPath));
+			path_hashes.PushBack(gHashPath(repo.mRootPathHash, file.mPath));
+		}
+
+		Timer          timer;
+		Vector<FileID> file_ids;
+		file_ids.Reserve(files.Size());
+		for (int file_index = 0; file_index < files.Size(); ++file_index)
+		{
+			const SerializedFile& file          = files[file_index];
+			FileID                parent_dir_id = file.mParentIndex == -1 ? repo.mRootDirID : file_ids[file.mParentIndex];
+
+			FileInfo& file_info = repo.GetOrAddFileInternal(pooled_paths[file_index], path_hashes[file_index], parent_dir_id, 
+				file.mType, make_ref_number(1, file_index), FileRepo::PathStorage::InPool);
+
+			file_ids.PushBack(file_info.mID);
+		}
+		double current_ms = gTicksToSeconds(timer.GetTicks()) * 1000.0;
+
+		// Both repos should have all the files plus their root dir, added in the same order and linked to the same parent dirs.
+		const FileID last_file_id = file_ids.Back();
+		if (v5_repo.mFiles.Size() != files.Size() + 1 || repo.mFiles.Size() != files.Size() + 1)
+			gAppLogError("LoadCache: %d and %d files added instead of %d.", v5_repo.mFiles.Size(), repo.mFiles.Size(), files.Size() + 1);
+		else if (v5_repo.mFiles[last_file_id.mFileIndex].mParentDirID.mFileIndex != repo.GetFile(last_file_id).mParentDirID.mFileIndex)
+			gAppLogError("LoadCache: the files were not linked to the same parent dirs.");
+
+		gAppLog("LoadCache: %d files. Format v5: %.1f ms. Current format: %.1f ms.", files.Size(), v5_ms, current_ms);
+	}
+};
+
+
+REGISTER_BENCHMARK("LoadCache")
+{
+	LoadCacheBenchmark::Run();
+}
+
+
+REGISTER_BENCHMARK("ScanQueue")
+{
+	// Scan synthetic trees without touching the disk: "scanning" a directory only pushes its sub-directories.
+	// Wide trees stress the queue of a single worker (others have to steal), deep ones leave all but one worker idle.
+	struct SyntheticTree
+	{
+		const char* mName;
+		int         mDirCount;
+		int         mChildCount; // Number of sub-directories of each directory (until mDirCount is reached).
+	};
+
+	const SyntheticTree trees[] = {
+		{ "wide (100k sibling dirs)", 100'001, 100'000 },
+		{ "balanced (8 sub-dirs)",    100'000, 8 },
+		{ "deep (1 sub-dir)",         10'000,  1 },
+	};
+
+	for (const SyntheticTree& tree : trees)
+	{
+		for (int thread_count = 1; thread_count <= 64; thread_count *= 4)
+		{
+			ScanQueue   scan_queue(thread_count);
+			AtomicInt32 visited_count = 0;
+
+			Timer timer;
+			scan_queue.Push(0, FileID{ 0, 0 });
+
+			Thread threads[64];
+			for (int thread_index = 0; thread_index < thread_count; ++thread_index)
+			{
+				threads[thread_index].Create({ .mName = "Test Thread" }, [&, thread_index](Thread&)
+				{
+					FileID dir_id;
+					while ((dir_id = scan_queue.Pop(thread_index)) != FileID::cInvalid())
+					{
+						visited_count.Add(1);
+
+						// Children of dir N are N * mChildCount + 1 to N * mChildCount + mChildCount.
+						int64 first_child = (int64)dir_id.mFileIndex * tree.mChildCount + 1;
+						int64 end_child   = gMin(first_child + tree.mChildCount, (int64)tree.mDirCount);
+						for (int64 child = first_child; child < end_child; ++child)
+							scan_queue.Push(thread_index, FileID{ 0, (uint32)child });
+					}
+				});
+			}
+
+			for (Thread& thread : Span(threads, thread_count))
+				thread.Join();
+
+			if (visited_count.Load() != tree.mDirCount || !scan_queue.IsEmpty())
+				gAppLogError("ScanQueue: %s, %d threads. Visited %d directories instead of %d.", tree.mName, thread_count, visited_count.Load(), tree.mDirCount);
+
+			gAppLog("ScanQueue: %s, %2d threads. %.1f ms.", tree.mName, thread_count, gTicksToSeconds(timer.GetTicks()) * 1000.0);
+		}
+	}
+}
+
+
+REGISTER_BENCHMARK("HashPath_Component")
+{
+	// Compare the ASCII and unicode versions of the path component hash on typical asset names.
+	const char* names[] = {
+		"rock.png",                                                                       // Short name.
+		"medium_house_brick_wall_albedo.png",                                             // Typical name.
+		"character_knight_armor_chest_plate_damaged_variant_02_normal_map_4k_bc5.dds",     // Long name.
+		"lod_group_0000_very_long_generated_name_from_a_dcc_tool_export_with_many_tags_such_as_version_author_date_and_"
+		"platform_0123456789_abcdefghijklmnopqrstuvwxyz_ABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789.fbx", // Very long name.
+	};
+
+	constexpr int cIterationCount = 20'000;
+	PathHash      parent_hash     = gHashPath("D:\\Data\\Source");
+
+	for (const char* name : names)
+	{
+		PathHash ascii_hash;
+		Timer    ascii_timer;
+		for (int i = 0; i < cIterationCount; ++i)
+			ascii_hash = sHashPathComponent(parent_hash, name);
+		double ascii_ns = gTicksToSeconds(ascii_timer.GetTicks()) * 1'000'000'000.0 / cIterationCount;
+
+		PathHash unicode_hash;
+		Timer    unicode_timer;
+		for (int i = 0; i < cIterationCount; ++i)
+			unicode_hash = sHashPathComponentUnicode(parent_hash, name);
+		double unicode_ns = gTicksToSeconds(unicode_timer.GetTicks()) * 1'000'000'000.0 / cIterationCount;
+
+		if (ascii_hash != unicode_hash)
+			gAppLogError("HashPath: the ASCII and unicode hashes of %s are different.", name);
+
+		gAppLog("HashPath: %3d chars name. ASCII: %.0f ns. Unicode: %.0f ns.", StringView(name).Size(), ascii_ns, unicode_ns);
+	}
+}
+
+
+REGISTER_BENCHMARK("HashPath_Incremental")
+{
+	// Compare hashing a file in a deep directory from scratch and from the hash of its directory (what the scanner and the USN create handler do).
+	constexpr StringView cDirPath        = "D:\\Data\\Source\\characters\\knight\\armor\\chest\\variants\\damaged\\textures\\4k";
+	constexpr StringView cFileName       = "knight_armor_chest_damaged_albedo.png";
+	constexpr int        cIterationCount = 20'000;
+
+	TempString file_path = gConcat(cDirPath, "\\", cFileName);
+	PathHash   dir_hash  = gHashPath(cDirPath);
+
+	PathHash full_hash;
+	Timer    full_timer;
+	for (int i = 0; i < cIterationCount; ++i)
+		full_hash = gHashPath(file_path);
+	double full_ns = gTicksToSeconds(full_timer.GetTicks()) * 1'000'000'000.0 / cIterationCount;
+
+	PathHash incremental_hash;
+	Timer    incremental_timer;
+	for (int i = 0; i < cIterationCount; ++i)
+		incremental_hash = gHashPath(dir_hash, cFileName);
+	double incremental_ns = gTicksToSeconds(incremental_timer.GetTicks()) * 1'000'000'000.0 / cIterationCount;
+
+	if (full_hash != incremental_hash)
+		gAppLogError("HashPath: hashing %s from its directory hash gives a different result.", file_path.AsCStr());
+
+	gAppLog("HashPath: %d chars path. Full: %.0f ns. From parent hash: %.0f ns.", file_path.Size(), full_ns, incremental_ns);
+}
@@ -11,6 +11,7 @@
 #include "SyncSignal.h"
 #include "FileUtils.h"
 #include "FileTime.h"
+#include "ShardedHashMap.h"
 
 #include <Bedrock/Vector.h>
 #include <Bedrock/Thread.h>
@@ -18,6 +19,7 @@
 #include <Bedrock/ConditionVariable.h>
 #include <Bedrock/StringFormat.h>
 #include <Bedrock/HashMap.h>
+#include <Bedrock/FunctionRef.h>
 
 // Forward declarations.
 struct FileID;
@@ -25,6 +27,7 @@ struct FileInfo;
 struct FileRepo;
 struct FileDrive;
 struct FileSystem;
+struct BinaryWriter;
 
 // Forward declarations of Win32 types.
 struct _FILE_ID_128;
@@ -124,6 +127,9 @@ template <> struct Hash<PathHash> : Hash<Hash128> {};
 
 // Hash the absolute path of a file in a case insensitive manner.
 PathHash gHashPath(StringView inAbsolutePath);
+// Hash a path relative to a directory in a case insensitive manner, given the hash of that directory.
+// gHashPath(gHashPath(dir), path) gives the same result as gHashPath(dir\path).
+PathHash gHashPath(PathHash inParentHash, StringView inRelativePath);
 
 
 // Identifier for a file. 4 bytes.
@@ -172,15 +178,24 @@ struct FileInfo : NoCopy
 	bool                          mIsDirectory     : 1; // Is this a directory or a file. Note: could change if a file is deleted then a directory of the same name is created.
 	bool                          mIsDepFile       : 1; // Is this a dep file.
 	bool                          mCommandsCreated : 1; // Are cooking commands already created for this file.
-	FileRefNumber                 mRefNumber      = {}; // File ID used by Windows. Can change when the file is deleted and re-created.
+	FileRefNumber                 mRefNumber      = {}; // File ID used by Windows. Can change when the file is deleted and re-created. Written under the drive's ref number lock (see FileDrive::GetRefNumberMutex).
 	FileTime                      mCreationTime   = {}; // Time of the creation of this file (or its deletion if the file is deleted).
 	USN                           mLastChangeUSN  = 0;  // Identifier of the last change to this file.
 	FileTime                      mLastChangeTime = {}; // Time of the last change to this file.
+	uint64                        mContentHash          = 0; // Hash of the size and content. Only computed when needed (see CookingRule::mHashOutputs and mHashInputs), and only valid if mContentHashUSN == mLastChangeUSN.
+	USN                           mContentHashUSN       = 0; // USN of the file when mContentHash was computed.
+	USN                           mLastContentChangeUSN = 0; // USN of the last change that actually modified the content (according to the hash).
+
+	const FileID                  mParentDirID;         // The directory containing this file. Invalid for the root dir.
+	FileID                        mFirstChildID;        // First file inside this directory (if it is one). Protected by the repo's mFiles lock.
+	FileID                        mNextSiblingID;       // Next file in the same parent directory. Protected by the repo's mFiles lock.
 
 	Vector<CookingCommandID>      mInputOf;             // List of commands that use this file as input.
 	Vector<CookingCommandID>      mOutputOf;            // List of commands that use this file as output. There should be only one, otherwise it's an error. // TODO tiny vector optimization // TODO actually detect that error
 
 	bool                          IsDeleted() const { return !mRefNumber.IsValid(); }
+	bool                          IsContentHashValid() const { return mContentHashUSN != 0 && mContentHashUSN == mLastChangeUSN; }
+	USN                           GetLastContentChangeUSN() const { return IsContentHashValid() ? mLastContentChangeUSN : mLastChangeUSN; } // Same as mLastChangeUSN, unless the hash shows the last writes didn't change the content.
 	bool                          IsDirectory() const { return mIsDirectory; }
 	FileType                      GetType() const { return mIsDirectory ? FileType::Directory : FileType::File; }
 	StringView                    GetName() const { return mPath.SubStr(mNamePos); }
@@ -191,61 +206,49 @@ struct FileInfo : NoCopy
 
 	TempString                    ToString() const; // For convenience when we need to log things about this file.
 
-	FileInfo(FileID inID, StringView inPath, Hash128 inPathHash, FileType inType, FileRefNumber inRefNumber);
+	FileInfo(FileID inID, StringView inPath, Hash128 inPathHash, FileType inType, FileRefNumber inRefNumber, FileID inParentDirID);
 };
 
 
-struct ScanQueue
+// Queue of directories to scan, shared by several scan threads (workers).
+// Each worker pushes to and pops from its own deque, and steals from the other workers when it runs out of directories,
+// so that threads don't all contend on the same lock (eg. when scanning a directory with many sub-directories).
+// Termination is detected with an atomic count of the directories pushed but not fully scanned yet: when it reaches zero
+// no worker can push anything anymore, and all workers can exit without waiting on each other.
+struct ScanQueue : NoCopy
 {
-	void Push(FileID inDirID)
-	{
-		{
-			LockGuard lock(mMutex);
-			mDirectories.PushBack(inDirID);
-		}
+	static constexpr int cMaxWorkerCount = 64;
 
-		// Wake up any waiting thread.
-		mConditionVariable.NotifyOne();
+	ScanQueue(int inWorkerCount = 1)
+	{
+		gAssert(inWorkerCount > 0 && inWorkerCount <= cMaxWorkerCount);
+		mWorkerCount = inWorkerCount;
 	}
 
-	FileID Pop()
+	void   Push(int inWorkerIndex, FileID inDirID);
+	FileID Pop(int inWorkerIndex); // Also marks the directory previously popped by this worker as done. Return an invalid FileID once all directories are done.
+	bool   IsEmpty() const { return mPendingDirCount.Load() == 0; }
+
+private:
+	FileID TryPopOrSteal(int inWorkerIndex);
+
+	// Aligned to avoid false sharing between workers.
+	struct alignas(64) Worker
 	{
-		LockGuard lock(mMutex);
-
-		// When the queue appears empty, we need to wait until all the other workers are also idle, because they may add more work to the queue.
-		if (mDirectories.Empty())
-		{
-			if (mThreadsBusy-- == 1)
-			{
-				// This is the last thread, all the others are already idle/waiting.
-				// Wake them up and exit.
-				mConditionVariable.NotifyAll();
-				return FileID::cInvalid();
-			}
-			else
-			{
-				// Wait until more work is pushed into the queue, or all other threads are also idle.
-				// Note: while loop needed because there can be spurious wake ups.
-				while (mDirectories.Empty() && mThreadsBusy > 0)
-					mConditionVariable.Wait(lock);
-
-				// If the queue is indeed empty, exit.
-				if (mDirectories.Empty())
-					return FileID::cInvalid();
-				else
-					mThreadsBusy++; // Otherwise this thread is busy again.
-			}
-		}
-
-		FileID dir = mDirectories.Back();
-		mDirectories.PopBack();
-		return dir;
-	}
+		Mutex          mMutex;                 // Only contended when another worker steals from this one.
+		Queue<FileID>  mDirectories;           // The worker pops from the back, other workers steal from the front.
+		bool           mHasCurrentDir = false; // True if the worker popped a directory and didn't finish it yet.
+	};
+
+	void   WakeUpIdleWorkers(bool inAll);
 
-	Vector<FileID>    mDirectories;
-	Mutex             mMutex;
-	ConditionVariable mConditionVariable;
-	int               mThreadsBusy = 1;
+	Worker            mWorkers[cMaxWorkerCount];
+	int               mWorkerCount     = 1;
+	AtomicInt32       mPendingDirCount = 0; // Number of directories pushed and not finished yet.
+	AtomicInt32       mPushCount       = 0; // Incremented by every push, lets idle workers know if something was pushed since they last looked.
+	AtomicInt32       mIdleWorkerCount = 0; // Number of workers waiting on mIdleCondition. Pushes only lock mIdleMutex when it's not zero.
+	Mutex             mIdleMutex;
+	ConditionVariable mIdleCondition;       // Signaled when a directory is pushed while workers are idle, and when all directories are done.
 };
 
 
@@ -258,12 +261,14 @@ struct FileRepo : NoCopy
 	FileInfo&			GetFile(FileID inFileID)		{ gAssert(inFileID.mRepoIndex == mIndex); return mFiles[inFileID.mFileIndex]; }
 	const FileInfo&		GetFile(FileID inFileID) const	{ gAssert(inFileID.mRepoIndex == mIndex); return mFiles[inFileID.mFileIndex]; }
 	FileInfo&           GetOrAddFile(StringView inPath, FileType inType, FileRefNumber inRefNumber);
+	FileInfo&           GetOrAddFile(FileID inParentDirID, StringView inName, FileType inType, FileRefNumber inRefNumber); // Faster version for when the parent directory is known, only the name needs to be hashed.
 	void                MarkFileDeleted(FileInfo& ioFile, FileTime inTimeStamp);
-	void                MarkFileDeleted(FileInfo& ioFile, FileTime inTimeStamp, const LockGuard<Mutex>& inLock);
+	bool                MarkFileDeleted(FileInfo& ioFile, FileTime inTimeStamp, const LockGuard<Mutex>& inLock); // Return false if the ref number of the file doesn't match the locked shard anymore.
+	void                MarkDirectoryContentDeleted(const FileInfo& inDirectory, FileTime inTimeStamp); // Mark all the files inside this directory (recursively) as deleted.
 
 	StringView          RemoveRootPath(StringView inFullPath);
 
-	void                ScanDirectory(FileID inDirectoryID, ScanQueue& ioScanQueue, Span<uint8> ioBuffer);
+	void                ScanDirectory(FileID inDirectoryID, ScanQueue& ioScanQueue, int inWorkerIndex, Span<uint8> ioBuffer);
 
 	enum class RequestedAttributes
 	{
@@ -275,6 +280,7 @@ struct FileRepo : NoCopy
 	uint32				mIndex = 0;				  // The index of this repo.
 	StringView			mName;					  // A named used to identify the repo.
 	StringView			mRootPath;				  // Absolute path to the repo. Starts with the drive letter, ends with a slash.
+	PathHash			mRootPathHash;			  // Hash of the root path. Also the path hash of the root dir.
 	FileDrive&			mDrive;					  // The drive this repo is on.
 	FileID				mRootDirID;				  // The FileID of the root dir.
 	bool				mNoOrphanFiles	 = false; // True when the repo is not supposed to contain orphan files (files that are neither inputs or outputs of any command).
@@ -283,16 +289,73 @@ struct FileRepo : NoCopy
 	VMemArray<FileInfo> mFiles;					  // All the files in this repo.
 
 	StringPool			mStringPool;			  // Pool for storing all the paths.
+
+private:
+	friend struct FileSystem;          // For LoadCache.
+	friend struct LoadCacheBenchmark;  // To add files the same way LoadCache does.
+
+	enum class PathStorage
+	{
+		Copy,   // The path needs to be copied to the string pool.
+		InPool, // The path is already in the string pool (eg. loaded from the cache), use it as is.
+	};
+	FileInfo&           GetOrAddFileInternal(StringView inNormalizedPath, PathHash inPathHash, FileID inParentDirID, FileType inType, FileRefNumber inRefNumber, PathStorage inPathStorage = PathStorage::Copy);
+};
+
+
+// A single change reported by a drive's change source.
+// On NTFS the change source is the USN journal, and the USN is the change counter.
+// Another change source only needs to provide a counter that increases monotonically for each change on the drive.
+struct FileChange
+{
+	FileRefNumber mRefNumber;           // The file that changed.
+	FileRefNumber mParentRefNumber;     // The directory containing the file.
+	StringView    mName;                // Name of the file (only valid during the callback, and only provided when mIsCreated is set).
+	USN           mUSN         = 0;     // Position of this change in the drive's change counter.
+	FileTime      mTimeStamp   = {};    // Time of the change.
+	bool          mIsDirectory = false; // True if the file is a directory.
+	bool          mIsCreated   = false; // The file was created (or is the new name of a renamed file).
+	bool          mIsDeleted   = false; // The file was deleted (or renamed, since the old path does not exist anymore).
+};
+
+
+using FileChangeCallback = FunctionRef<void(const FileChange&)>;
+
+
+// Where the changes of a drive come from. FileDrive only applies the FileChanges, it doesn't know how they're detected.
+struct FileChangeSource : NoCopy
+{
+	virtual                ~FileChangeSource() = default;
+
+	// Call inChangeCallback for each change since inStartUSN. Return the USN to start from next time.
+	// ioBuffer is scratch memory the source can use to read the changes.
+	virtual USN            ReadChanges(USN inStartUSN, Span<uint8> ioBuffer, FileChangeCallback inChangeCallback) = 0;
+};
+
+
+// Change source reading the USN journal of an NTFS drive.
+struct USNJournalChangeSource final : FileChangeSource
+{
+	USNJournalChangeSource(const FileDrive& inDrive) : mDrive(inDrive) {}
+
+	USN                    ReadChanges(USN inStartUSN, Span<uint8> ioBuffer, FileChangeCallback inChangeCallback) override;
+
+private:
+	template <typename taFunctionType>
+	USN                    ReadUSNJournal(USN inStartUSN, Span<uint8> ioBuffer, taFunctionType inRecordCallback) const;
+
+	const FileDrive&       mDrive;
 };
 
 
 struct FileDrive : NoCopy
 {
 	FileDrive(char inDriveLetter);
+	~FileDrive();
 
-	template <typename taFunctionType>
-	USN                    ReadUSNJournal(USN inStartUSN, Span<uint8> ioBuffer, taFunctionType inRecordCallback) const; // TODO replace template by a typed std::function_ref equivalent
+	USN                    ReadChanges(USN inStartUSN, Span<uint8> ioBuffer, FileChangeCallback inChangeCallback) const { return mChangeSource->ReadChanges(inStartUSN, ioBuffer, inChangeCallback); }
 	bool                   ProcessMonitorDirectory(Span<uint8> ioBufferUSN, ScanQueue &ioScanQueue, Span<uint8> ioBufferScan); // Check if files changed. Return false if there were no changes.
+	void                   ApplyChange(const FileChange& inChange, ScanQueue& ioScanQueue, Span<uint8> ioBufferScan);          // Update the files and commands affected by a change.
 	FileRepo*              FindRepoForPath(StringView inFullPath);                                        // Return nullptr if not in any repo.
 
 	HandleOrError          OpenFileByRefNumber(FileRefNumber inRefNumber, OpenFileAccess inDesiredAccess, FileID inFileID) const;
@@ -307,11 +370,23 @@ struct FileDrive : NoCopy
 	USN                    mFirstUSN     = 0;
 	USN                    mNextUSN      = 0;
 	Vector<FileRepo*>      mRepos;
+	FileChangeSource*      mChangeSource = nullptr; // Owned by the drive. The USN journal for now, but anything providing FileChanges can replace it.
 
-	using FilesByRefNumberMap = VMemHashMap<FileRefNumber, FileID>;
+	using FilesByRefNumberMap = ShardedHashMap<FileRefNumber, FileID>;
 
 	FilesByRefNumberMap    mFilesByRefNumber;      // Map to find files by ref number.
-	mutable Mutex          mFilesByRefNumberMutex; // Mutex to protect access to the map.
+
+	// The mRefNumber of the files on this drive is only written while holding one of these locks (picked by file index).
+	// Split in stripes since the scan threads all read it. Lock order: the mFilesByRefNumber shard first, then the stripe.
+	struct alignas(64) RefNumberLock
+	{
+		Mutex              mMutex;
+	};
+	static constexpr int   cRefNumberLockCount = 64;
+	RefNumberLock          mRefNumberLocks[cRefNumberLockCount];
+
+	Mutex&                 GetRefNumberMutex(FileID inFileID)       { return mRefNumberLocks[inFileID.mFileIndex % cRefNumberLockCount].mMutex; }
+	FileRefNumber          GetRefNumber(const FileInfo& inFile)     { LockGuard lock(GetRefNumberMutex(inFile.mID)); return inFile.mRefNumber; } // For threads that might race with a writer.
 };
 
 
@@ -338,6 +413,8 @@ struct FileSystem : NoCopy
 
 	bool            CreateDirectory(FileID inFileID);                  // Make sure all the parent directories for this file exist.
 	bool            DeleteFile(FileID inFileID);                       // Delete this file on disk.
+	OpenFileError   ReadCurrentUSN(FileID inFileID, USN& outUSN);      // Read the USN of this file on disk, without waiting for the USN journal to be processed.
+	OpenFileError   ReadCurrentUSNAndHash(FileID inFileID, USN& outUSN, uint64& outHash); // Same as ReadCurrentUSN, and also hash the size and content of the file.
 
 	int             GetDriveCount() const { return mDrives.Size(); }   // Number of drives, for debug/display.
 	int             GetRepoCount() const { return mRepos.Size(); }     // Number of repos, for debug/display.
@@ -359,8 +436,23 @@ struct FileSystem : NoCopy
 
 	void            SaveCache();
 	void            LoadCache();
+	void            UpdateCacheJournal(); // Write the commands state changes to the cache journal, and save a new cache snapshot when the journal gets too big/old.
 
 private:
+	// Result of the last cook of a command, read from the cache.
+	struct CachedLastCook
+	{
+		CookingCommandID mCommandID;
+		bool             mIsError = false;
+		StringView       mOutput;        // Only set for errors.
+	};
+
+	void            SerializeCache(uint64 inSnapshotID, BinaryWriter& ioBin); // Only on the monitor thread, reads the state of the files and commands.
+	void            StartCacheSnapshot();             // Serialize a snapshot and save it on a background thread.
+	void            FinishCacheSnapshot(bool inWait); // Switch to the journal of the snapshot saved in the background, once it's on disk. If inWait is false, only if it's already done.
+	void            ResetCacheJournal(uint64 inSnapshotID);
+	void            ReplayCacheJournal(uint64 inSnapshotID, Span<const StringView> inValidRepos, Vector<CachedLastCook>& ioLastCooks);
+
 	void            InitialScan(const Thread& inThread, Span<uint8> ioBufferUSN);
 	void			MonitorDirectoryThread(const Thread& ioThread);
 
@@ -398,9 +490,21 @@ private:
 	Queue<FileToRescan> mFilesToRescan;
 	Mutex               mFilesToRescanMutex;
 
-	using FilesByPathHash = VMemHashMap<PathHash, FileID>;
+	using FilesByPathHash = ShardedHashMap<PathHash, FileID>;
 	FilesByPathHash mFilesByPathHash;      // Map to find files by path hash.
-	mutable Mutex   mFilesByPathHashMutex; // Mutex to protect access to the map.
+
+	// The cached state is a snapshot (see SaveCache) plus a journal of the commands state changes since that snapshot.
+	// Only accessed by the monitor thread.
+	FILE*           mCacheJournalFile       = nullptr;
+	int64           mCacheJournalSize       = 0;       // In bytes.
+	int             mCacheJournalIndex      = 0;       // The two journal files are used in turn, see StartCacheSnapshot.
+	int64           mLastCacheSnapshotTicks = 0;       // Tick count when the last snapshot was saved (or started saving).
+
+	// Snapshot being saved in the background. Until it's on disk, the changes are written to both the current journal and its journal.
+	FILE*           mNextCacheJournalFile   = nullptr; // Only accessed by the monitor thread. Not null while a snapshot is being saved.
+	int64           mNextCacheJournalSize   = 0;       // Only accessed by the monitor thread.
+	Thread          mCacheSnapshotThread;
+	AtomicBool      mCacheSnapshotDone      = false;
 };
 
 
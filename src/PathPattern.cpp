@@ -0,0 +1,461 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#include "PathPattern.h"
+#include "FileUtils.h"
+#include "Debug.h"
+#include "App.h"
+#include "Benchmark.h"
+
+#include <Bedrock/Test.h>
+#include <Bedrock/Ticks.h>
+
+#include <bit>
+#include <emmintrin.h>
+
+
+static constexpr char sToLowercaseASCII(char inChar)
+{
+	if (inChar >= 'A' && inChar <= 'Z')
+		return (char)(inChar + ('a' - 'A'));
+	return inChar;
+}
+
+
+bool gMatchPath(StringView inPath, StringView inPattern)
+{
+	gAssert(!inPattern.Empty());
+	gAssert(gIsNormalized(inPath) && gIsNormalized(inPattern));
+
+	int path_index         = 0;
+	int pattern_index      = 0;
+	int star_pattern_index = -1; // Position of the last '*' encountered in the pattern.
+	int star_path_index    = 0;  // Position in the path where that '*' started matching.
+
+	while (path_index < inPath.Size())
+	{
+		if (pattern_index < inPattern.Size() && inPattern[pattern_index] == '*')
+		{
+			// Start by matching nothing with the '*'.
+			star_pattern_index = pattern_index++;
+			star_path_index    = path_index;
+		}
+		else if (pattern_index < inPattern.Size()
+			&& (inPattern[pattern_index] == '?' || sToLowercaseASCII(inPattern[pattern_index]) == sToLowercaseASCII(inPath[path_index])))
+		{
+			path_index++;
+			pattern_index++;
+		}
+		else if (star_pattern_index != -1)
+		{
+			// Mismatch, make the last '*' match one more character and try again from there.
+			pattern_index = star_pattern_index + 1;
+			path_index    = ++star_path_index;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	// The path is consumed, the rest of the pattern must be only '*'.
+	while (pattern_index < inPattern.Size() && inPattern[pattern_index] == '*')
+		pattern_index++;
+
+	return pattern_index == inPattern.Size();
+}
+
+
+REGISTER_TEST("MatchPath")
+{
+	TEST_TRUE(gMatchPath ("YOYO.txt", "yoyo.txt"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "*.txt"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "y?yo.txt"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "????????"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "*"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "?*"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "**"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "*?"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "*?oyo.txt"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "*????.txt"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "y*?*?*?.txt"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "y*y*.txt"));
+	TEST_TRUE(gMatchPath ("YOYO.txt", "y*?.*"));
+	TEST_FALSE(gMatchPath("Y.txt", "y*?.*"));
+	TEST_FALSE(gMatchPath("YOYO.txt", "yoyo.txt*?"));
+	TEST_TRUE(gMatchPath("medium_house\\texture_albedo.png", "*_albedo.*"));
+	TEST_TRUE(gMatchPath("YOYO.txt.txt", "*.txt"));
+	TEST_TRUE(gMatchPath("aabc", "*a?c"));
+};
+
+
+void CompiledPathPattern::Compile(StringView inPattern)
+{
+	gAssert(!inPattern.Empty());
+	gAssert(gIsNormalized(inPattern));
+
+	mPattern.Clear();
+	mBlocks.Clear();
+	mHasStar = false;
+
+	Block block;
+	for (char c : inPattern)
+	{
+		if (c == '*')
+		{
+			// End the current block (possibly empty) and start a new one.
+			mHasStar = true;
+			mBlocks.PushBack(block);
+
+			block        = {};
+			block.mBegin = mPattern.Size();
+			continue;
+		}
+
+		if (c != '?' && block.mAnchor == -1)
+			block.mAnchor = block.mSize;
+
+		char lowercase = sToLowercaseASCII(c);
+		mPattern.Append(StringView(&lowercase, 1));
+		block.mSize++;
+	}
+
+	mBlocks.PushBack(block);
+}
+
+
+bool CompiledPathPattern::MatchBlockAt(const Block& inBlock, const char* inPath) const
+{
+	const char* pattern = mPattern.Data() + inBlock.mBegin;
+	for (int i = 0; i < inBlock.mSize; ++i)
+	{
+		if (pattern[i] != '?' && pattern[i] != sToLowercaseASCII(inPath[i]))
+			return false;
+	}
+
+	return true;
+}
+
+
+int CompiledPathPattern::FindBlock(const Block& inBlock, StringView inPath, int inBegin, int inEnd) const
+{
+	int last_begin = inEnd - inBlock.mSize;
+	if (last_begin < inBegin)
+		return -1;
+
+	// If the block is only '?', it matches anywhere.
+	if (inBlock.mAnchor == -1)
+		return inBegin;
+
+	// Look for the anchor character (in both cases), then check the rest of the block.
+	const char* path         = inPath.Data();
+	char        lowercase    = mPattern[inBlock.mBegin + inBlock.mAnchor];
+	char        uppercase    = (lowercase >= 'a' && lowercase <= 'z') ? (char)(lowercase - ('a' - 'A')) : lowercase;
+	int         search_begin = inBegin + inBlock.mAnchor;
+	int         search_end   = last_begin + inBlock.mAnchor + 1;
+	int         i            = search_begin;
+
+	// Process 16 characters at a time.
+	const __m128i lowercase_chars = _mm_set1_epi8(lowercase);
+	const __m128i uppercase_chars = _mm_set1_epi8(uppercase);
+	for (; i + 16 <= search_end; i += 16)
+	{
+		__m128i chars = _mm_loadu_si128((const __m128i*)(path + i));
+		uint32  mask  = (uint32)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chars, lowercase_chars), _mm_cmpeq_epi8(chars, uppercase_chars)));
+
+		while (mask != 0)
+		{
+			int block_begin = i + std::countr_zero(mask) - inBlock.mAnchor;
+			if (MatchBlockAt(inBlock, path + block_begin))
+				return block_begin;
+
+			mask &= mask - 1; // Clear the lowest bit.
+		}
+	}
+
+	// Process the remaining characters one by one.
+	for (; i < search_end; ++i)
+	{
+		if (path[i] != lowercase && path[i] != uppercase)
+			continue;
+
+		int block_begin = i - inBlock.mAnchor;
+		if (MatchBlockAt(inBlock, path + block_begin))
+			return block_begin;
+	}
+
+	return -1;
+}
+
+
+bool CompiledPathPattern::Match(StringView inPath) const
+{
+	// Not compiled (empty pattern), nothing matches.
+	if (mBlocks.Empty())
+		return false;
+
+	const char* path = inPath.Data();
+	int         size = inPath.Size();
+
+	// Without '*', the path must have the same size as the pattern.
+	if (!mHasStar)
+		return size == mBlocks[0].mSize && MatchBlockAt(mBlocks[0], path);
+
+	// The first and last blocks are anchored to the start and end of the path.
+	const Block& first_block = mBlocks[0];
+	const Block& last_block  = mBlocks[mBlocks.Size() - 1];
+	if (first_block.mSize + last_block.mSize > size)
+		return false;
+
+	if (!MatchBlockAt(first_block, path) || !MatchBlockAt(last_block, path + size - last_block.mSize))
+		return false;
+
+	// The blocks in between are matched as early as possible. Since each '*' can absorb anything, this never prevents a match.
+	int begin = first_block.mSize;
+	int end   = size - last_block.mSize;
+	for (int i = 1; i < mBlocks.Size() - 1; ++i)
+	{
+		int found = FindBlock(mBlocks[i], inPath, begin, end);
+		if (found == -1)
+			return false;
+
+		begin = found + mBlocks[i].mSize;
+	}
+
+	return true;
+}
+
+
+REGISTER_TEST("CompiledPathPattern")
+{
+	auto match = [](StringView inPath, StringView inPattern)
+	{
+		CompiledPathPattern pattern;
+		pattern.Compile(inPattern);
+		return pattern.Match(inPath);
+	};
+
+	TEST_TRUE(match ("YOYO.txt", "yoyo.txt"));
+	TEST_TRUE(match ("YOYO.txt", "*.txt"));
+	TEST_TRUE(match ("YOYO.txt", "y?yo.txt"));
+	TEST_TRUE(match ("YOYO.txt", "????????"));
+	TEST_TRUE(match ("YOYO.txt", "*"));
+	TEST_TRUE(match ("YOYO.txt", "?*"));
+	TEST_TRUE(match ("YOYO.txt", "**"));
+	TEST_TRUE(match ("YOYO.txt", "*?"));
+	TEST_TRUE(match ("YOYO.txt", "*?oyo.txt"));
+	TEST_TRUE(match ("YOYO.txt", "*????.txt"));
+	TEST_TRUE(match ("YOYO.txt", "y*?*?*?.txt"));
+	TEST_TRUE(match ("YOYO.txt", "y*y*.txt"));
+	TEST_TRUE(match ("YOYO.txt", "y*?.*"));
+	TEST_FALSE(match("Y.txt", "y*?.*"));
+	TEST_FALSE(match("YOYO.txt", "yoyo.txt*?"));
+	TEST_TRUE(match("medium_house\\texture_albedo.png", "*_albedo.*"));
+	TEST_TRUE(match("YOYO.txt.txt", "*.txt"));
+	TEST_TRUE(match("aabc", "*a?c"));
+	TEST_TRUE(match("textures\\very_long_directory_name\\another_one\\rock_ALBEDO.png", "textures\\*\\*_albedo.png"));
+	TEST_FALSE(match("textures\\very_long_directory_name\\another_one\\rock_normal.png", "textures\\*\\*_albedo.png"));
+};
+
+
+REGISTER_TEST("CompiledPathPattern_Random")
+{
+	// Compare with gMatchPath on random paths and patterns.
+	// Small alphabets to get a good mix of matches and mismatches, and long enough paths to use the 16 characters loop.
+	uint32 state = 0x12345678;
+	auto   rand  = [&state]()
+	{
+		// Xorshift32, to get the same sequence every time.
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	};
+
+	constexpr StringView cPathChars    = "aAb.\\";
+	constexpr StringView cPatternChars = "aAb.\\*?";
+
+	for (int i = 0; i < 100000; ++i)
+	{
+		TempString path;
+		int path_size = rand() % 40;
+		for (int c = 0; c < path_size; ++c)
+			path.Append(cPathChars.SubStr(rand() % cPathChars.Size(), 1));
+
+		TempString pattern_str;
+		int pattern_size = 1 + rand() % 10;
+		for (int c = 0; c < pattern_size; ++c)
+			pattern_str.Append(cPatternChars.SubStr(rand() % cPatternChars.Size(), 1));
+
+		CompiledPathPattern pattern;
+		pattern.Compile(pattern_str);
+
+		TEST_TRUE(pattern.Match(path) == gMatchPath(path, pattern_str));
+	}
+};
+
+
+// Copy of gMatchPath as it was before CompiledPathPattern, kept as the baseline for the benchmark below.
+// It lowercases copies of the path and the pattern on every call.
+static bool sMatchPathBaseline(StringView inPath, StringView inPattern)
+{
+	gAssert(!inPattern.Empty());
+	gAssert(gIsNormalized(inPath) && gIsNormalized(inPattern));
+
+	// Convert the path and pattern to lowercase to make sure the search is case-insensitive.
+	TempString path_lowercase = inPath;
+	gToLowercase(path_lowercase);
+	TempString pattern_lowercase = inPattern;
+	gToLowercase(pattern_lowercase);
+
+	StringView str          = path_lowercase;
+	StringView pattern      = pattern_lowercase;
+	bool       pending_star = false;
+
+	while (true)
+	{
+		// Find the next wild card in the pattern.
+		int next_wildcard_index = pattern.FindFirstOf("?*");
+
+		// If the next char isn't a wild card and we have a pending '*', process it now.
+		// This case happens when we encounter '*?'. More explanations where pending_star is set to true below.
+		if (next_wildcard_index != 0 && pending_star)
+		{
+			pending_star = false;
+
+			// If the pattern ends with '*', it's an automatic match.
+			if (pattern.Empty())
+				return true;
+
+			// Find where the string starts matching the pattern again.
+			StringView pattern_until_next_wildcard = pattern.SubStr(0, pattern.FindFirstOf("?*"));
+			int next_match = str.Find(pattern_until_next_wildcard);
+
+			// Never? Then it's a fail.
+			if (next_match == -1)
+				return false;
+
+			// Skip to where it matches again.
+			str.RemovePrefix(next_match);
+		}
+
+		// Strings should be equal until there (or until end of the string).
+		if (str.SubStr(0, next_wildcard_index) != pattern.SubStr(0, next_wildcard_index))
+			return false;
+
+		// If there was no wild card, we're done! Strings match.
+		if (next_wildcard_index == -1)
+			return true;
+
+		// Skip the parts that match.
+		str.RemovePrefix(next_wildcard_index);
+		pattern.RemovePrefix(next_wildcard_index);
+
+		// Also skip the wild card, but keep a copy.
+		char wild_card = pattern[0];
+		pattern.RemovePrefix(1);
+
+		if (wild_card == '?')
+		{
+			// If there is no character left, it's a fail.
+			if (str.Size() < 1)
+				return false;
+
+			// Skip one character.
+			str.RemovePrefix(1);
+		}
+		else
+		{
+			gAssert(wild_card == '*');
+
+			// If the pattern ends with '*', it's an automatic match.
+			if (pattern.Empty())
+				return true;
+
+			// If the * is followed by another '*', continue to process the next wild card directly, '**' is equivalent to '*'.
+			if (pattern[0] == '*')
+				continue;
+
+			// If the '*' is followed by '?', it is THE annoying case.
+			// '*?' is equivalent to '?*', so continue to process the '?', but remember we have a pending '*'.
+			// This way both '*???' and '*?*?*?' will just be interpreted as '???*'.
+			if (pattern[0] == '?')
+			{
+				pending_star = true;
+				continue;
+			}
+
+			// Clear the pending '*' if we encounter another one.
+			pending_star = false;
+
+			// Find where the string starts matching the pattern again.
+			StringView pattern_until_next_wildcard = pattern.SubStr(0, pattern.FindFirstOf("?*"));
+			int next_match = str.Find(pattern_until_next_wildcard);
+
+			// Never? Then it's a fail.
+			if (next_match == -1)
+				return false;
+
+			// Skip to where it matches again.
+			str.RemovePrefix(next_match);
+		}
+	}
+}
+
+
+REGISTER_BENCHMARK("PathPattern")
+{
+	// Compare CompiledPathPattern, the current gMatchPath and the original gMatchPath on typical rule patterns and asset paths.
+	constexpr StringView cPatterns[] =
+	{
+		"*.png",
+		"*_albedo.*",
+		"textures\\*\\*_albedo.png",
+		"*.fbx.meta",
+	};
+
+	constexpr StringView cPaths[] =
+	{
+		"rock.png",
+		"textures\\environment\\medium_house_brick_wall_albedo.png",
+		"textures\\characters\\knight\\character_knight_armor_chest_plate_damaged_variant_02_normal.dds",
+		"meshes\\props\\lod_group_0000_very_long_generated_name_from_a_dcc_tool_export_with_many_tags.fbx",
+	};
+
+	constexpr int cIterationCount = 20'000;
+
+	for (StringView pattern_str : cPatterns)
+	{
+		CompiledPathPattern pattern;
+		pattern.Compile(pattern_str);
+
+		int   compiled_matches = 0;
+		Timer compiled_timer;
+		for (int i = 0; i < cIterationCount; ++i)
+			for (StringView path : cPaths)
+				compiled_matches += pattern.Match(path);
+		double compiled_ns = gTicksToSeconds(compiled_timer.GetTicks()) * 1'000'000'000.0 / (cIterationCount * gElemCount(cPaths));
+
+		int   match_path_matches = 0;
+		Timer match_path_timer;
+		for (int i = 0; i < cIterationCount; ++i)
+			for (StringView path : cPaths)
+				match_path_matches += gMatchPath(path, pattern_str);
+		double match_path_ns = gTicksToSeconds(match_path_timer.GetTicks()) * 1'000'000'000.0 / (cIterationCount * gElemCount(cPaths));
+
+		int   baseline_matches = 0;
+		Timer baseline_timer;
+		for (int i = 0; i < cIterationCount; ++i)
+			for (StringView path : cPaths)
+				baseline_matches += sMatchPathBaseline(path, pattern_str);
+		double baseline_ns = gTicksToSeconds(baseline_timer.GetTicks()) * 1'000'000'000.0 / (cIterationCount * gElemCount(cPaths));
+
+		if (compiled_matches != match_path_matches || compiled_matches != baseline_matches)
+			gAppLogError("PathPattern: \"%s\" matched %d times compiled, %d times with gMatchPath and %d times with the original gMatchPath.",
+				pattern_str.AsCStr(), compiled_matches / cIterationCount, match_path_matches / cIterationCount, baseline_matches / cIterationCount);
+
+		gAppLog("PathPattern: \"%s\". Compiled: %.0f ns. gMatchPath: %.0f ns. Original gMatchPath: %.0f ns.", pattern_str.AsCStr(), compiled_ns, match_path_ns, baseline_ns);
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include "Core.h"
+
+#include <Bedrock/String.h>
+#include <Bedrock/Vector.h>
+
+
+// Test a path against a pattern. Return true if the path matches the pattern (case-insensitive, ASCII only).
+// Pattern supports wild cards '*' (any number of characters) and '?' (single character).
+// Note: This is the simple version, use CompiledPathPattern to test many paths against the same pattern.
+bool gMatchPath(StringView inPath, StringView inPattern);
+
+
+// Path pattern prepared once to test many paths quickly and without allocating. Same rules as gMatchPath.
+// The pattern is split into blocks at each '*'. Blocks only contain literal characters and '?', so they have a fixed size.
+// The first block must match the start of the path, the last block the end, and the others are searched from left to right.
+struct CompiledPathPattern
+{
+	void Compile(StringView inPattern);
+	bool Match(StringView inPath) const;
+
+private:
+	struct Block
+	{
+		int mBegin  = 0;  // Position in mPattern.
+		int mSize   = 0;
+		int mAnchor = -1; // Position in the block of the first literal character (used to search for the block), or -1 if it's all '?'.
+	};
+
+	bool MatchBlockAt(const Block& inBlock, const char* inPath) const;
+	int  FindBlock(const Block& inBlock, StringView inPath, int inBegin, int inEnd) const; // Return the first position where the block matches in [inBegin, inEnd), or -1.
+
+	String        mPattern;         // Lowercase pattern, without the '*'.
+	Vector<Block> mBlocks;
+	bool          mHasStar = false; // If false, there's a single block and it must match the whole path.
+};
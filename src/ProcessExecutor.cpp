@@ -0,0 +1,439 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#include "ProcessExecutor.h"
+#include "CookingSystem.h"
+#include "App.h"
+#include "Debug.h"
+
+#include <Bedrock/Algorithm.h>
+#include <Bedrock/StringFormat.h>
+#include <Bedrock/Ticks.h>
+
+#include "win32/file.h"
+#include "win32/io.h"
+#include "win32/misc.h"
+#include "win32/process.h"
+#include "win32/threads.h"
+
+
+// Thread pool waits and process attribute lists, not in the win32 headers.
+extern "C" __declspec(dllimport) BOOL WINAPI RegisterWaitForSingleObject(HANDLE* phNewWaitObject, HANDLE hObject, void (WINAPI* Callback)(void*, unsigned char), void* Context, ULONG dwMilliseconds, ULONG dwFlags);
+extern "C" __declspec(dllimport) BOOL WINAPI UnregisterWaitEx(HANDLE WaitHandle, HANDLE CompletionEvent);
+
+struct _PROC_THREAD_ATTRIBUTE_LIST;
+extern "C" __declspec(dllimport) BOOL WINAPI InitializeProcThreadAttributeList(_PROC_THREAD_ATTRIBUTE_LIST* lpAttributeList, DWORD dwAttributeCount, DWORD dwFlags, SIZE_T* lpSize);
+extern "C" __declspec(dllimport) BOOL WINAPI UpdateProcThreadAttribute(_PROC_THREAD_ATTRIBUTE_LIST* lpAttributeList, DWORD dwFlags, DWORD_PTR Attribute, void* lpValue, SIZE_T cbSize, void* lpPreviousValue, SIZE_T* lpReturnSize);
+extern "C" __declspec(dllimport) void WINAPI DeleteProcThreadAttributeList(_PROC_THREAD_ATTRIBUTE_LIST* lpAttributeList);
+
+// Same layout as STARTUPINFOEXA.
+struct StartupInfoEx
+{
+	STARTUPINFOA                 StartupInfo;
+	_PROC_THREAD_ATTRIBUTE_LIST* lpAttributeList;
+};
+
+constexpr DWORD     cExtendedStartupInfoPresent    = 0x00080000; // EXTENDED_STARTUPINFO_PRESENT
+constexpr DWORD_PTR cProcThreadAttributeHandleList = 0x00020002; // PROC_THREAD_ATTRIBUTE_HANDLE_LIST
+constexpr ULONG     cWaitExecuteOnlyOnce           = 0x00000008; // WT_EXECUTEONLYONCE
+
+// Completion key of the packets that only wake up the executor thread. The other packets use the Request pointer as key.
+constexpr ULONG_PTR cWakeUpCompletionKey = 0;
+
+
+void ProcessExecutor::Start(int inMaxInFlight, void* inJobObject)
+{
+	mMaxInFlight   = gMax(inMaxInFlight, 1);
+	mJobObject     = inJobObject;
+	mStopRequested = false;
+
+	// Completion port used to wake up the thread when a process exits, when requests are added, or when stopping.
+	mCompletionPort = CreateIoCompletionPort(OwnedHandle::cInvalid, nullptr, 0, 1);
+	if (mCompletionPort == nullptr)
+		gAppFatalError("CreateIoCompletionPort failed - %s", GetLastErrorString().AsCStr());
+
+	// The output files of the processes are created in the cache directory.
+	CreateDirectoryA(gApp.mCacheDirectory.AsCStr(), nullptr);
+
+	mThread.Create({
+		.mName = "Process Executor Thread",
+	}, [this](Thread&) { ThreadFunction(); });
+}
+
+
+void ProcessExecutor::Stop()
+{
+	{
+		LockGuard lock(mMutex);
+		mStopRequested = true;
+	}
+
+	// Wake up the threads waiting for a slot, and the executor thread.
+	mSlotAvailable.NotifyAll();
+	WakeUp();
+
+	mThread.Join();
+	mCompletionPort = {};
+}
+
+
+void ProcessExecutor::WakeUp()
+{
+	if (PostQueuedCompletionStatus(mCompletionPort, 0, cWakeUpCompletionKey, nullptr) == FALSE)
+		gAppFatalError("PostQueuedCompletionStatus failed - %s", GetLastErrorString().AsCStr());
+}
+
+
+bool ProcessExecutor::Run(CookingCommandID inCommandID, Span<const StringView> inCommandLines, int inTimeoutSeconds)
+{
+	Request* request         = new Request;
+	request->mCommandID      = inCommandID;
+	request->mTimeoutSeconds = inTimeoutSeconds;
+	for (StringView command_line : inCommandLines)
+		request->mCommandLines.EmplaceBack(command_line);
+
+	{
+		LockGuard lock(mMutex);
+
+		// Wait until there's room for one more command.
+		while (!mStopRequested && mInFlightCount >= mMaxInFlight)
+			mSlotAvailable.Wait(lock);
+
+		if (mStopRequested)
+		{
+			delete request;
+			return false;
+		}
+
+		mInFlightCount++;
+		request->mRequestIndex = mNextRequestIndex++;
+		mPendingRequests.PushBack(request);
+	}
+
+	WakeUp();
+	return true;
+}
+
+
+void ProcessExecutor::Cancel(CookingCommandID inCommandID)
+{
+	{
+		LockGuard lock(mMutex);
+		mCancelRequests.PushBack({ inCommandID, mNextRequestIndex });
+	}
+
+	WakeUp();
+}
+
+
+int ProcessExecutor::GetInFlightCount() const
+{
+	LockGuard lock(mMutex);
+	return mInFlightCount;
+}
+
+
+bool ProcessExecutor::StartProcess(Request& ioRequest)
+{
+	const String& command_line = ioRequest.mCommandLines[ioRequest.mCurrentCommandLine];
+
+	if (ioRequest.mCurrentCommandLine > 0)
+		ioRequest.mOutput.Append("\n");
+
+	gAppendFormat(ioRequest.mOutput, "Command Line: %s\n\n", command_line.AsCStr());
+
+	// Create the file receiving the output. It's deleted when the handle is closed.
+	// Note: it needs to be inheritable to be used as the process stdout/stderr, but the attribute list below makes sure only this process inherits it.
+	TempString output_path = gTempFormat(R"(%s\output_%u_%d.txt)", gApp.mCacheDirectory.AsCStr(), ioRequest.mCommandID.mIndex, ioRequest.mCurrentCommandLine);
+
+	SECURITY_ATTRIBUTES security_attributes = {};
+	security_attributes.nLength              = sizeof(security_attributes);
+	security_attributes.bInheritHandle       = TRUE;
+
+	ioRequest.mOutputFile = CreateFileA(output_path.AsCStr(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		&security_attributes, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+
+	if (!ioRequest.mOutputFile.IsValid())
+	{
+		gAppendFormat(ioRequest.mOutput, "[error] Failed to create output file %s - %s\n", output_path.AsCStr(), GetLastErrorString().AsCStr());
+		return false;
+	}
+
+	// Only let the process inherit its own output file. With bInheritHandles alone, it would inherit every inheritable handle,
+	// including the output files of the processes started at the same time by the other requests.
+	HANDLE inherited_handles[] = { ioRequest.mOutputFile };
+
+	// A list with a single attribute is small, a buffer on the stack is enough.
+	alignas(8) uint8             attribute_list_buffer[128];
+	SIZE_T                       attribute_list_size = sizeof(attribute_list_buffer);
+	_PROC_THREAD_ATTRIBUTE_LIST* attribute_list      = (_PROC_THREAD_ATTRIBUTE_LIST*)attribute_list_buffer;
+	if (InitializeProcThreadAttributeList(attribute_list, 1, 0, &attribute_list_size) == FALSE)
+		gAppFatalError("InitializeProcThreadAttributeList failed - %s", GetLastErrorString().AsCStr());
+	defer { DeleteProcThreadAttributeList(attribute_list); };
+
+	if (UpdateProcThreadAttribute(attribute_list, 0, cProcThreadAttributeHandleList, inherited_handles, sizeof(inherited_handles), nullptr, nullptr) == FALSE)
+		gAppFatalError("UpdateProcThreadAttribute failed - %s", GetLastErrorString().AsCStr());
+
+	StartupInfoEx startup_info          = {};
+	startup_info.StartupInfo.cb         = sizeof(startup_info);
+	startup_info.StartupInfo.dwFlags    = STARTF_USESTDHANDLES;
+	startup_info.StartupInfo.hStdInput  = nullptr;
+	startup_info.StartupInfo.hStdOutput = ioRequest.mOutputFile;
+	startup_info.StartupInfo.hStdError  = ioRequest.mOutputFile;
+	startup_info.lpAttributeList        = attribute_list;
+
+	// Create the job object of this request, it's used to kill the process and all its children if the cook is cancelled.
+	if (!ioRequest.mJobObject.IsValid())
+	{
+		HANDLE job_object = CreateJobObjectA(nullptr, nullptr);
+		if (job_object == nullptr)
+			gAppFatalError("CreateJobObjectA failed - %s", GetLastErrorString().AsCStr());
+
+		ioRequest.mJobObject  = job_object;
+		ioRequest.mStartTicks = gGetTickCount();
+	}
+
+	// CreateProcessA needs a mutable command line.
+	TempString mutable_command_line = command_line;
+
+	// Create the process suspended, so that it can't start child processes before being assigned to the job objects.
+	PROCESS_INFORMATION process_info = {};
+	if (CreateProcessA(nullptr, mutable_command_line.Data(), nullptr, nullptr, TRUE, CREATE_NO_WINDOW | CREATE_SUSPENDED | cExtendedStartupInfoPresent, nullptr, nullptr, &startup_info.StartupInfo, &process_info) == FALSE)
+	{
+		gAppendFormat(ioRequest.mOutput, "[error] Failed to create process - %s\n", GetLastErrorString().AsCStr());
+		ioRequest.mOutputFile = {};
+		return false;
+	}
+
+	ioRequest.mProcess = process_info.hProcess;
+	OwnedHandle thread = process_info.hThread;
+
+	// Assign the job object to the process, to make sure it is killed if the Asset Cooker process ends.
+	if (AssignProcessToJobObject(mJobObject, ioRequest.mProcess) == FALSE)
+		gAppFatalError("AssignProcessToJobObject failed - %s", GetLastErrorString().AsCStr());
+
+	// Then the job object of the request, which becomes nested in the previous one.
+	if (AssignProcessToJobObject(ioRequest.mJobObject, ioRequest.mProcess) == FALSE)
+		gAppFatalError("AssignProcessToJobObject failed - %s", GetLastErrorString().AsCStr());
+
+	ResumeThread(thread);
+
+	// Have a thread pool thread post this request to the completion port when the process exits.
+	// Note: There's exactly one packet per process, and the executor thread unregisters the wait when it gets it.
+	ioRequest.mCompletionPort = mCompletionPort;
+	auto on_process_exit = [](void* inRequest, unsigned char)
+	{
+		Request* request = (Request*)inRequest;
+		if (PostQueuedCompletionStatus(request->mCompletionPort, 0, (ULONG_PTR)request, nullptr) == FALSE)
+			gAppFatalError("PostQueuedCompletionStatus failed - %s", GetLastErrorString().AsCStr());
+	};
+
+	if (RegisterWaitForSingleObject(&ioRequest.mProcessExitWait, ioRequest.mProcess, on_process_exit, &ioRequest, INFINITE, cWaitExecuteOnlyOnce) == FALSE)
+		gAppFatalError("RegisterWaitForSingleObject failed - %s", GetLastErrorString().AsCStr());
+
+	return true;
+}
+
+
+// Remove the thread pool wait of the current process. Waits for the callback if it's running.
+static void sUnregisterProcessExitWait(void*& ioWait)
+{
+	if (ioWait == nullptr)
+		return;
+
+	UnregisterWaitEx(ioWait, OwnedHandle::cInvalid);
+	ioWait = nullptr;
+}
+
+
+void ProcessExecutor::KillProcesses(Request& ioRequest)
+{
+	// Terminate the job object rather than the process, to also kill the processes it started.
+	// The process handle gets signaled and the request finishes as usual.
+	if (ioRequest.mProcess.IsValid())
+		TerminateJobObject(ioRequest.mJobObject, 1);
+}
+
+
+void ProcessExecutor::ReadProcessOutput(Request& ioRequest)
+{
+	// The process wrote from the start of the file, go back there.
+	SetFilePointer(ioRequest.mOutputFile, 0, nullptr, FILE_BEGIN);
+
+	char buffer[4096];
+	while (true)
+	{
+		DWORD bytes_read = 0;
+		if (ReadFile(ioRequest.mOutputFile, buffer, sizeof(buffer), &bytes_read, nullptr) == FALSE || bytes_read == 0)
+			break;
+
+		ioRequest.mOutput.Append({ buffer, (int)bytes_read });
+	}
+
+	// Closing the file also deletes it.
+	ioRequest.mOutputFile = {};
+}
+
+
+bool ProcessExecutor::StartNextProcess(Request& ioRequest)
+{
+	if (ioRequest.mCurrentCommandLine >= ioRequest.mCommandLines.Size())
+		return false;
+
+	return StartProcess(ioRequest);
+}
+
+
+void ProcessExecutor::ThreadFunction()
+{
+	while (true)
+	{
+		// Take the new requests and the cancel requests.
+		Vector<Request*>      new_requests;
+		Vector<CancelRequest> cancel_requests;
+		{
+			LockGuard lock(mMutex);
+
+			if (mStopRequested)
+				break;
+
+			gSwap(new_requests, mPendingRequests);
+			gSwap(cancel_requests, mCancelRequests);
+		}
+
+		auto finish_request = [this](Request* inRequest, ProcessResult inResult)
+		{
+			gCookingSystem.FinishProcessCook(inRequest->mCommandID, inRequest->mOutput, inResult, mStringPool);
+			delete inRequest;
+
+			{
+				LockGuard lock(mMutex);
+				mInFlightCount--;
+			}
+			mSlotAvailable.NotifyOne();
+		};
+
+		// Start their first process.
+		for (Request* request : new_requests)
+		{
+			if (StartNextProcess(*request))
+				mRunningRequests.PushBack(request);
+			else
+				finish_request(request, ProcessResult::Error);
+		}
+
+		// Kill the processes of the cancelled commands.
+		// Note: The requests started above may be for a command that was cancelled, check the index to only cancel the ones that came before.
+		for (const CancelRequest& cancel_request : cancel_requests)
+		{
+			for (Request* request : mRunningRequests)
+			{
+				if (request->mCommandID == cancel_request.mCommandID && request->mRequestIndex < cancel_request.mBeforeRequestIndex && !request->mCancelled)
+				{
+					request->mCancelled = true;
+					KillProcesses(*request);
+				}
+			}
+		}
+
+		// Kill the processes that took too long, and find when the next time out happens.
+		DWORD  wait_ms       = INFINITE;
+		int64  current_ticks = gGetTickCount();
+		for (Request* request : mRunningRequests)
+		{
+			if (request->mTimeoutSeconds <= 0 || request->mCancelled || request->mTimedOut)
+				continue;
+
+			double remaining_seconds = (double)request->mTimeoutSeconds - gTicksToSeconds(current_ticks - request->mStartTicks);
+			if (remaining_seconds <= 0.0)
+			{
+				request->mTimedOut = true;
+				KillProcesses(*request);
+			}
+			else
+			{
+				wait_ms = gMin(wait_ms, (DWORD)(remaining_seconds * 1000.0) + 1);
+			}
+		}
+
+		// Wait for a process to exit, for new requests, or for the next time out.
+		DWORD       byte_count     = 0;
+		ULONG_PTR   completion_key = cWakeUpCompletionKey;
+		OVERLAPPED* overlapped     = nullptr;
+		if (GetQueuedCompletionStatus(mCompletionPort, &byte_count, &completion_key, &overlapped, wait_ms) == FALSE)
+		{
+			if (GetLastError() == WAIT_TIMEOUT)
+				continue;
+
+			gAppFatalError("GetQueuedCompletionStatus failed - %s", GetLastErrorString().AsCStr());
+		}
+
+		if (completion_key == cWakeUpCompletionKey)
+			continue;
+
+		Request* request = (Request*)completion_key;
+		sUnregisterProcessExitWait(request->mProcessExitWait);
+
+		// Get the output and exit code.
+		ReadProcessOutput(*request);
+
+		DWORD exit_code = 0;
+		bool  success   = true;
+		if (GetExitCodeProcess(request->mProcess, &exit_code) == FALSE)
+		{
+			gAppendFormat(request->mOutput, "[error] Failed to get exit code - %s\n", GetLastErrorString().AsCStr());
+			success = false;
+		}
+		else
+		{
+			gAppendFormat(request->mOutput, "\nExit code: %d (0x%X)\n", (int)exit_code, (uint32)exit_code);
+
+			// Non-zero exit code is considered an error.
+			if (exit_code != 0)
+				success = false;
+		}
+
+		request->mProcess = {};
+		request->mCurrentCommandLine++;
+
+		if (request->mTimedOut)
+		{
+			gAppendFormat(request->mOutput, "[error] Timed out after %d seconds.\n", request->mTimeoutSeconds);
+			success = false;
+		}
+
+		// Run the next command line if there is one, otherwise the request is done.
+		if (success && !request->mCancelled && request->mCurrentCommandLine < request->mCommandLines.Size())
+		{
+			if (StartNextProcess(*request))
+				continue;
+
+			success = false;
+		}
+
+		gSwapEraseFirstIf(mRunningRequests, [request](Request* inRequest) { return inRequest == request; });
+
+		ProcessResult process_result = success ? ProcessResult::Success : ProcessResult::Error;
+		if (request->mCancelled)
+			process_result = ProcessResult::Cancelled;
+
+		finish_request(request, process_result);
+	}
+
+	// The processes still running are killed when the job object is closed, just clean up the requests.
+	for (Request* request : mRunningRequests)
+	{
+		sUnregisterProcessExitWait(request->mProcessExitWait);
+		delete request;
+	}
+	mRunningRequests.Clear();
+
+	LockGuard lock(mMutex);
+	for (Request* request : mPendingRequests)
+		delete request;
+	mPendingRequests.Clear();
+	mCancelRequests.Clear();
+	mInFlightCount = 0;
+}
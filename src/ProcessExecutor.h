@@ -0,0 +1,96 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include "Core.h"
+#include "FileUtils.h"
+#include "StringPool.h"
+#include "CookingSystemIDs.h"
+
+#include <Bedrock/String.h>
+#include <Bedrock/Vector.h>
+#include <Bedrock/Thread.h>
+#include <Bedrock/Mutex.h>
+#include <Bedrock/ConditionVariable.h>
+
+
+enum class ProcessResult : uint8
+{
+	Success,
+	Error,
+	Cancelled,
+};
+
+
+// Runs the processes of the cooking commands without blocking the cooking threads.
+// A single thread waits on an IO completion port, which gets a packet when a process exits (posted by a thread pool wait),
+// so there is no limit to the number of processes running at once. The output of each process goes to a temporary file
+// (instead of a pipe that would need to be read continuously), which is read once the process exits.
+// This allows more commands in flight than there are cooking threads, which helps with tools that are not CPU bound.
+struct ProcessExecutor : NoCopy
+{
+	void Start(int inMaxInFlight, void* inJobObject);
+	void Stop();
+
+	// Run the command lines one after the other, stopping at the first failure, then call CookingSystem::FinishProcessCook.
+	// If the processes take longer than inTimeoutSeconds in total (zero means no timeout), they are killed and it's an error.
+	// Block while the maximum number of commands in flight is reached. Return false if the executor is stopping.
+	bool Run(CookingCommandID inCommandID, Span<const StringView> inCommandLines, int inTimeoutSeconds);
+
+	// Kill the processes of this command (including their child processes). The result will be ProcessResult::Cancelled.
+	// Does nothing if the command isn't running on the executor. Only affects the requests made before the call,
+	// a request made afterwards for the same command (eg. to cook it again) is not cancelled.
+	void Cancel(CookingCommandID inCommandID);
+
+	int  GetInFlightCount() const;
+
+private:
+	struct Request
+	{
+		CookingCommandID mCommandID;
+		uint64           mRequestIndex = 0;  // Incremented for every request, to know which requests a Cancel applies to.
+		Vector<String>   mCommandLines;
+		int              mCurrentCommandLine = 0;
+		String           mOutput;
+		OwnedHandle      mProcess;
+		OwnedHandle      mOutputFile;
+		OwnedHandle      mJobObject;		// Nested in the executor job object, used to kill the whole process tree.
+		void*            mProcessExitWait = nullptr; // Thread pool wait that posts this request to the completion port when mProcess exits.
+		void*            mCompletionPort  = nullptr; // The executor's completion port (not owned), for the thread pool wait callback.
+		int64            mStartTicks     = 0;
+		int              mTimeoutSeconds = 0;
+		bool             mCancelled      = false;
+		bool             mTimedOut       = false;
+	};
+
+	void                 ThreadFunction();
+	bool                 StartProcess(Request& ioRequest);   // Return false (with an error in the output) if the process could not be started.
+	void                 ReadProcessOutput(Request& ioRequest);
+	bool                 StartNextProcess(Request& ioRequest); // Return false if there is nothing left to start (or starting failed).
+	void                 KillProcesses(Request& ioRequest);
+	void                 WakeUp();
+
+	Thread               mThread;
+	OwnedHandle          mCompletionPort;
+	void*                mJobObject   = nullptr;
+	int                  mMaxInFlight = 1;
+	StringPool           mStringPool;
+
+	mutable Mutex        mMutex;
+	ConditionVariable    mSlotAvailable;
+	Vector<Request*>     mPendingRequests; // Added by Run, moved to mRunningRequests by the executor thread.
+	struct CancelRequest
+	{
+		CookingCommandID mCommandID;
+		uint64           mBeforeRequestIndex; // Only the requests with a lower index are cancelled.
+	};
+	Vector<CancelRequest> mCancelRequests;
+	uint64               mNextRequestIndex = 0;
+	int                  mInFlightCount = 0;
+	bool                 mStopRequested = false;
+
+	Vector<Request*>     mRunningRequests; // Only accessed by the executor thread.
+};
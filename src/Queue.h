@@ -95,6 +95,36 @@ struct Queue : NoCopy // Copy not implemented yet
 		}
 	}
 
+	void PopBack()
+	{
+		// Destroy the element.
+		Back().~taType();
+
+		// Decrement the end offset.
+		mLastSegmentEndOffset--;
+
+		// Special case when there is a single segment, we don't want to free it even it it's empty.
+		if (mSegments.Size() == 1)
+		{
+			// If that was the last element, just reset the offsets.
+			if (mFirstSegmentBeginOffset == mLastSegmentEndOffset)
+			{
+				mLastSegmentEndOffset    = 0;
+				mFirstSegmentBeginOffset = 0;
+			}
+		}
+		else
+		{
+			// If that was the last element, but not the last segment, remove the segment.
+			if (mLastSegmentEndOffset == 0)
+			{
+				gMemFree({ (uint8*)mSegments.Back(), taSegmentSizeInElements * sizeof(taType) });
+				mSegments.PopBack();
+				mLastSegmentEndOffset = taSegmentSizeInElements;
+			}
+		}
+	}
+
 	taType& Front()
 	{
 		gAssert(GetSize() > 0);
@@ -81,6 +81,10 @@ static void sReadRuleFile(StringView inPath)
 					gNormalizePath(path_pattern);
 
 					input_filter.mPathPattern = reader.mStringPool->AllocateCopy(path_pattern);
+
+					// Compile it once to make testing files faster.
+					if (!path_pattern.Empty())
+						input_filter.mCompiledPathPattern.Compile(path_pattern);
 				}
 			}
 		}
@@ -95,16 +99,50 @@ static void sReadRuleFile(StringView inPath)
 		if (rule.mCommandType == CommandType::CommandLine)
 		{
 			reader.Read    ("CommandLine",		rule.mCommandLine);
+			reader.TryRead ("BatchSize",		rule.mBatchSize);
+
+			// Only read the batch command line if batching is enabled.
+			// Workers cook one command at a time, they can't be used for batches.
+			if (rule.IsBatched())
+			{
+				reader.Read("BatchCommandLine",	rule.mBatchCommandLine);
+				reader.NotAllowed("WorkerCommandLine", "because BatchSize is greater than 1");
+			}
+			else
+			{
+				reader.NotAllowed("BatchCommandLine", "because BatchSize isn't greater than 1");
+				reader.TryRead("WorkerCommandLine", rule.mWorkerCommandLine);
+			}
+
+			// Only the processes started for a single command can be killed, batches can't time out.
+			// Workers time out per request (the worker is killed and restarted).
+			if (rule.IsBatched())
+				reader.NotAllowed("Timeout", "because BatchSize is greater than 1");
+			else
+				reader.TryRead("Timeout", rule.mTimeout);
+
+			// Batches don't have a separate output per command to store in the action cache.
+			if (rule.IsBatched())
+				reader.NotAllowed("UseActionCache", "because BatchSize is greater than 1");
+			else
+				reader.TryRead("UseActionCache", rule.mUseActionCache);
 		}
 		else
 		{
 			reader.NotAllowed("CommandLine", "because CommandType isn't CommandLine");
 			reader.NotAllowed("DepFile",	 "because CommandType isn't CommandLine");
+			reader.NotAllowed("BatchSize",	 "because CommandType isn't CommandLine");
+			reader.NotAllowed("BatchCommandLine", "because CommandType isn't CommandLine");
+			reader.NotAllowed("WorkerCommandLine", "because CommandType isn't CommandLine");
+			reader.NotAllowed("Timeout",	 "because CommandType isn't CommandLine");
+			reader.NotAllowed("UseActionCache", "because CommandType isn't CommandLine");
 		}
 
 		reader.TryRead     ("Priority",			rule.mPriority);
 		reader.TryRead     ("Version",			rule.mVersion);
 		reader.TryRead     ("MatchMoreRules",	rule.mMatchMoreRules);
+		reader.TryRead     ("HashOutputs",		rule.mHashOutputs);
+		reader.TryRead     ("HashInputs",		rule.mHashInputs);
 		reader.TryReadArray("InputPaths",		rule.mInputPaths);
 		reader.TryReadArray("OutputPaths",		rule.mOutputPaths);
 
@@ -119,7 +157,11 @@ static void sReadRuleFile(StringView inPath)
 			reader.CloseTable();
 
 			// Only read the dep file command line if there is a dep file.
-			reader.TryRead("DepFileCommandLine", rule.mDepFileCommandLine);
+			// Batched commands are cooked by a single process, they can't have a dep file command line each.
+			if (rule.IsBatched())
+				reader.NotAllowed("DepFileCommandLine", "because BatchSize is greater than 1");
+			else
+				reader.TryRead("DepFileCommandLine", rule.mDepFileCommandLine);
 		}
 		else
 		{
@@ -130,6 +172,9 @@ static void sReadRuleFile(StringView inPath)
 	// Validate the rules.
 	if (!gCookingSystem.ValidateRules())
 		gApp.SetInitError("Rules validation failed. See log for details.");
+
+	// Index them to speed up creating commands.
+	gCookingSystem.BuildRuleIndex();
 }
 
 
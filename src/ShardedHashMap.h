@@ -0,0 +1,83 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include "Core.h"
+
+#include <Bedrock/Mutex.h>
+#include <Bedrock/HashMap.h>
+
+
+// Hash map split into independent shards, each protected by its own mutex.
+// The shard is selected with the upper bits of the key hash (the lower bits are used by the shard's own hash map),
+// so threads accessing different keys very rarely contend on the same mutex.
+template <typename taKey, typename taValue, int taShardCountLog2 = 6>
+struct ShardedHashMap : NoCopy
+{
+	static constexpr int cShardCount = 1 << taShardCountLog2;
+
+	// Aligned to avoid false sharing between the mutexes of neighbouring shards.
+	struct alignas(64) Shard
+	{
+		mutable Mutex               mMutex;
+		VMemHashMap<taKey, taValue> mMap;
+	};
+
+	Shard&       GetShard(const taKey& inKey)       { return mShards[sGetShardIndex(inKey)]; }
+	const Shard& GetShard(const taKey& inKey) const { return mShards[sGetShardIndex(inKey)]; }
+
+	// Return the value for this key, or a default constructed value if the key is not in the map.
+	taValue Find(const taKey& inKey) const
+	{
+		const Shard& shard = GetShard(inKey);
+		LockGuard    lock(shard.mMutex);
+
+		auto it = shard.mMap.Find(inKey);
+		if (it != shard.mMap.End())
+			return it->mValue;
+		else
+			return {};
+	}
+
+	// Insert the value if the key is not already in the map.
+	// Return the value that is in the map after the operation (ie. the existing one if the key was already there).
+	taValue InsertOrGet(const taKey& inKey, const taValue& inValue)
+	{
+		Shard&    shard = GetShard(inKey);
+		LockGuard lock(shard.mMutex);
+
+		auto [_, value, result] = shard.mMap.Insert(inKey, inValue);
+		return value;
+	}
+
+	// Return true if the key was found and erased.
+	bool Erase(const taKey& inKey)
+	{
+		Shard&    shard = GetShard(inKey);
+		LockGuard lock(shard.mMutex);
+
+		return shard.mMap.Erase(inKey);
+	}
+
+	int Size() const
+	{
+		int size = 0;
+		for (const Shard& shard : mShards)
+		{
+			LockGuard lock(shard.mMutex);
+			size += shard.mMap.Size();
+		}
+		return size;
+	}
+
+private:
+	static int sGetShardIndex(const taKey& inKey)
+	{
+		return (int)(Hash<taKey>{}(inKey) >> (64 - taShardCountLog2));
+	}
+
+	Shard mShards[cShardCount];
+};
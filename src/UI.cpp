@@ -517,7 +517,7 @@ void gDrawFileInfo(const FileInfo& inFile, FileContext inContext = {})
 			break;
 
 		case DependencyType::Input:
-			if (inFile.mLastChangeUSN > inContext.mLastCook)
+			if (inFile.GetLastContentChangeUSN() > inContext.mLastCook)
 				file_state = Modified;
 			break;
 
@@ -616,6 +616,15 @@ void gDrawFileInfo(const FileInfo& inFile, FileContext inContext = {})
 				
 				ImGui::TableNextColumn(); ImGui::TextUnformatted("Last Change USN");
 				ImGui::TableNextColumn(); ImGui::TextUnformatted(gUSNToString(inFile.mLastChangeUSN));
+
+				if (inFile.IsContentHashValid())
+				{
+					ImGui::TableNextColumn(); ImGui::TextUnformatted("Content Hash");
+					ImGui::TableNextColumn(); ImGui::TextUnformatted(gTempFormat("%016llX", (unsigned long long)inFile.mContentHash));
+
+					ImGui::TableNextColumn(); ImGui::TextUnformatted("Last Content Change USN");
+					ImGui::TableNextColumn(); ImGui::TextUnformatted(gUSNToString(inFile.mLastContentChangeUSN));
+				}
 			}
 
 			ImGui::EndTable();
@@ -809,6 +818,15 @@ void gDrawCookingRulePopup(const CookingRule& inRule)
 		ImGui::TableNextColumn(); ImGui::TextUnformatted("MatchMoreRules");
 		ImGui::TableNextColumn(); ImGui::TextUnformatted(inRule.mMatchMoreRules ? "true" : "false");
 
+		ImGui::TableNextColumn(); ImGui::TextUnformatted("HashOutputs");
+		ImGui::TableNextColumn(); ImGui::TextUnformatted(inRule.mHashOutputs ? "true" : "false");
+
+		ImGui::TableNextColumn(); ImGui::TextUnformatted("HashInputs");
+		ImGui::TableNextColumn(); ImGui::TextUnformatted(inRule.mHashInputs ? "true" : "false");
+
+		ImGui::TableNextColumn(); ImGui::TextUnformatted("UseActionCache");
+		ImGui::TableNextColumn(); ImGui::TextUnformatted(inRule.mUseActionCache ? "true" : "false");
+
 		ImGui::TableNextColumn(); ImGui::TextUnformatted("CommandLine");
 		ImGui::TableNextColumn(); ImGui::TextUnformatted(inRule.mCommandLine);
 
@@ -927,22 +945,27 @@ void gDrawCookingQueue()
 		bool all_empty = true;
 		for (auto& bucket : gCookingSystem.mCommandsDirty.mPrioBuckets)
 		{
-			if (bucket.mCommands.Empty())
+			if (bucket.IsEmpty())
 				continue;
 
 			all_empty = false;
 
-			ImGui::SeparatorText(gTempFormat("Priority %d (%d items)", bucket.mPriority, bucket.mCommands.Size()));
+			ImGui::SeparatorText(gTempFormat("Priority %d (%d items)", bucket.mPriority, bucket.mSize));
 
 			ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0, 1));
 
+			// The bucket is a linked list, Seek only walks from where the previous frame stopped.
+			CookingQueue& queue = gCookingSystem.mCommandsDirty;
+
 			ImGuiListClipper clipper;
-			clipper.Begin(bucket.mCommands.Size());
+			clipper.Begin(bucket.mSize);
 			while (clipper.Step())
 			{
-				for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
+				CookingCommandID command_id = queue.Seek(bucket, clipper.DisplayStart);
+				for (int index = clipper.DisplayStart; index < clipper.DisplayEnd && command_id.IsValid(); index++)
 				{
-					gDrawCookingCommand(gCookingSystem.GetCommand(bucket.mCommands[i]));
+					gDrawCookingCommand(gCookingSystem.GetCommand(command_id));
+					command_id = queue.GetNext(command_id);
 				}
 			}
 			clipper.End();
@@ -1049,6 +1072,7 @@ void gDrawCookingLog()
 					ICON_FK_HOURGLASS,
 					ICON_FK_TIMES,
 					ICON_FK_CHECK,
+					ICON_FK_BAN,
 				};
 				static_assert(gElemCount(cIcons) == (size_t)CookingState::_Count);
 
@@ -1109,7 +1133,7 @@ void gDrawSelectedCookingLogEntry()
 		const CookingCommand& command      = gCookingSystem.GetCommand(log_entry.mCommandID);
 		const CookingRule&    rule         = command.GetRule();
 		TempString            command_line;
-		if (gFormatCommandString(rule.mCommandLine, gFileSystem.GetFile(command.GetMainInput()), command_line))
+		if (rule.mCommandLineTemplate.Format(gFileSystem.GetFile(command.GetMainInput()), command_line))
 		{
 			ImGui::LogToClipboard();
 			ImGui::LogText("%s", command_line.AsCStr());
@@ -1529,6 +1553,21 @@ void gDrawDebugWindow()
 	ImGui::Checkbox("Cause random Cooking errors", &gDebugFailCookingRandomly);
 	ImGui::Checkbox("Cause random FileSystem errors", &gDebugFailOpenFileRandomly);
 
+	if (ImGui::CollapsingHeader("Action Cache"))
+	{
+		if (gCookingSystem.mActionCache.IsEnabled())
+		{
+			ActionCache::Stats stats = gCookingSystem.mActionCache.GetStats();
+			ImGui::Text("Hits: %d", stats.mHitCount);
+			ImGui::Text("Misses: %d", stats.mMissCount);
+			ImGui::Text("Stored: %d (%d pending)", stats.mStoreCount, gCookingSystem.mActionCache.GetPendingCount());
+			ImGui::Text("Blobs: %d (%s / %s)", stats.mBlobCount, gFormatSizeInBytes(stats.mTotalSize).AsCStr(), gFormatSizeInBytes(gApp.mActionCacheMaxSize).AsCStr());
+			ImGui::Text("Evicted: %d", stats.mEvictedCount);
+		}
+		else
+			ImGui::TextUnformatted("Disabled (see ActionCacheMaxSizeMB in the config file).");
+	}
+
 	Span rules = gCookingSystem.GetRules();
 	if (ImGui::CollapsingHeader(gTempFormat("Rules (%d)##Rules", rules.Size())))
 	{
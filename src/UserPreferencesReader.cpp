@@ -53,6 +53,13 @@ void gReadUserPreferencesFile(StringView inPath)
 			gCookingSystem.SetCookingThreadCount(num_cooking_threads);
 	}
 
+	// Max number of command line processes running at once.
+	{
+		int max_commands_in_flight = 0;
+		if (reader.TryRead("MaxCommandsInFlight", max_commands_in_flight))
+			gCookingSystem.SetMaxCommandsInFlight(max_commands_in_flight);
+	}
+
 	// Filesystem log verbosity.
 	{
 		TempString log_level_str;
@@ -120,6 +127,7 @@ void gWriteUserPreferencesFile(StringView inPath)
 	prefs_toml.insert("StartPaused", gCookingSystem.IsCookingPaused());
 	prefs_toml.insert("StartMinimized", gApp.mStartMinimized);
 	prefs_toml.insert("NumCookingThreads", gCookingSystem.GetCookingThreadCount());
+	prefs_toml.insert("MaxCommandsInFlight", gCookingSystem.GetMaxCommandsInFlight());
 	prefs_toml.insert("LogFSActivity", std::string_view(gToStringView(gApp.mLogFSActivity).AsCStr()));
 	prefs_toml.insert("UIScale", gUIGetUserScale());
 
@@ -10,7 +10,9 @@
 #include <optional>
 
 #include <Bedrock/Mutex.h>
+#include <Bedrock/ConditionVariable.h>
 #include <Bedrock/Atomic.h>
+#include <Bedrock/Algorithm.h>
 #include <Bedrock/PlacementNew.h>
 #include <Bedrock/Vector.h>
 
@@ -68,6 +70,62 @@ struct VMemArray : NoCopy
 		return new_element;
 	}
 
+	// Alternative to Emplace for arrays that many threads add to at the same time, the element is constructed outside the lock:
+	// - ReserveIndex returns a unique index (it only locks when more memory needs to be committed).
+	// - EmplaceReserved constructs the element at that index.
+	// - PublishReserved makes it visible to readers. Since readers assume every index below Size() is valid, it waits
+	//   until the elements before it are published too (they're being constructed by other threads, so it's never long).
+	// Note: Don't mix with Add/Emplace on the same array, they don't know about reserved indices.
+	[[nodiscard]] int ReserveIndex()
+	{
+		int index = mReservedSize.Add(1);
+
+		// VMem commits large blocks at a time, so this lock is rarely needed.
+		if (index >= mCommittedSize.Load())
+		{
+			VMemArrayLock lock = Lock();
+			if (index >= mCommittedSize.Load(MemoryOrder::Relaxed))
+			{
+				mVector.Reserve(index + 1);
+				mCommittedSize.Store(mVector.Capacity());
+			}
+		}
+
+		return index;
+	}
+
+	template <typename... taArgs>
+	taType& EmplaceReserved(int inIndex, taArgs&&... inArgs)
+	{
+		gAssert(inIndex < mCommittedSize.Load());
+
+		taType* element = mVector.Begin() + inIndex;
+		gPlacementNew(*element, gForward<taArgs>(inArgs)...);
+		return *element;
+	}
+
+	void PublishReserved(int inIndex)
+	{
+		VMemArrayLock lock = Lock();
+
+		mPendingPublish.PushBack(inIndex);
+
+		// Publish all the elements that are now contiguous.
+		int size = mAtomicSize.Load(MemoryOrder::Relaxed);
+		while (gSwapEraseFirstIf(mPendingPublish, [size](int inPending) { return inPending == size; }))
+			size++;
+
+		if (size != mAtomicSize.Load(MemoryOrder::Relaxed))
+		{
+			mAtomicSize.Store(size);
+			mPublished.NotifyAll();
+		}
+
+		// Don't return until this element is visible, the caller is likely to use its index right away.
+		while (mAtomicSize.Load(MemoryOrder::Relaxed) <= inIndex)
+			mPublished.Wait(lock);
+	}
+
 	// Increase the current size. This is not like resize, elements are not constructed.
 	// Meant to be used with a manual lock: first lock, then reserve, then construct elements manually, then set size.
 	void IncreaseSize(int inSizeIncreaseInElements, const VMemArrayLock& inLock)
@@ -95,6 +153,10 @@ struct VMemArray : NoCopy
 		const VMemArrayLock& lock = inLock.value_or((const VMemArrayLock&)Lock());
 		(void)lock;
 
+		// Elements added with ReserveIndex are constructed in place without mVector knowing about them, destroy them here.
+		for (int i = mVector.Size(); i < mAtomicSize.Load(); i++)
+			mVector.Begin()[i].~taType();
+
 		mAtomicSize.Store(mVector.Size());
 
 		mVector.Clear();
@@ -122,6 +184,10 @@ private:
 
 	VMemVector<taType>   mVector;
 	Atomic<int>          mAtomicSize = 0;
+	Atomic<int>          mReservedSize  = 0; // Number of indices returned by ReserveIndex.
+	Atomic<int>          mCommittedSize = 0; // Number of elements that fit in the committed memory (only used by ReserveIndex).
+	Vector<int>          mPendingPublish;    // Reserved indices that are constructed but can't be published yet.
+	ConditionVariable    mPublished;         // Signaled when Size() increases in PublishReserved.
 	Mutex                mMutex;
 };
 
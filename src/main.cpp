@@ -17,6 +17,7 @@
 #include "CookingSystem.h"
 #include "Notifications.h"
 #include "Version.h"
+#include "Benchmark.h"
 #include <Bedrock/Test.h>
 #include <Bedrock/Ticks.h>
 #include <Bedrock/Trace.h>
@@ -219,7 +220,8 @@ int WinMain(
 	}
 
 	// Check if we only want to run without UI.
-	gApp.mNoUI = args.Contains("-no_ui");
+	// Benchmarks also run without UI, to print their results to the console.
+	gApp.mNoUI = args.Contains("-no_ui") || args.Contains("-benchmark");
 	if (gApp.mNoUI)
 	{
 		// Make sure there's a console so we can printf to it.
@@ -236,6 +238,13 @@ int WinMain(
 		SetConsoleCtrlHandler(sCtrlHandler, TRUE);
 	}
 
+	// Check if we only want to run the benchmarks.
+	if (auto benchmark = args.Find("-benchmark"); benchmark != args.End())
+	{
+		gRunBenchmarks(benchmark->mValue);
+		return 0;
+	}
+
 	// Check if we want to change the working directory.
 	// Note: This has to be done before gApp.Init() since that changes where the config.toml file is read from.
 	if (auto working_dir = args.Find("-working_dir"); working_dir != args.End())